@@ -0,0 +1,721 @@
+// serialized IR cache
+// Copyright (C) 2014-2015 Serguei Makarov
+//
+// This file is part of EBT, and is free software. You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+extern "C" {
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <openssl/md5.h>
+}
+
+using namespace std;
+
+#include "util.h"
+#include "ir.h"
+#include "cache.h"
+
+// A cache entry consists of a header, the token table of the file, and
+// the toplevel declarations with their syntax trees. Integers are stored
+// in host byte order, since the cache is never shared between machines.
+// Strings are stored as a length followed by the NUL-terminated text, so
+// that string_refs of the loaded file can point directly into the entry.
+// Tokens are stored as indices into the token table (NO_TOKEN for NULL).
+
+#define IR_CACHE_MAGIC "EBTIR"
+#define NO_TOKEN ((uint32_t) -1)
+
+enum ir_tag {
+  n_null,
+
+  n_empty_stmt, n_expr_stmt, n_compound_stmt, n_ifthen_stmt,
+  n_loop_stmt, n_foreach_stmt, n_jump_stmt,
+
+  n_basic_expr, n_unary_expr, n_binary_expr, n_conditional_expr,
+  n_call_expr,
+
+  n_named_event, n_conditional_event, n_compound_event,
+};
+
+// ---------------------------------
+// --- writing serialized files ---
+// ---------------------------------
+
+class ir_writer : public visitor {
+  ebt_file *f;
+
+public:
+  std::string out;
+
+  ir_writer(ebt_file *f) : f(f) {}
+
+  void u8(unsigned v) { out.push_back((char) v); }
+  void u32(uint32_t v) { out.append((const char *) &v, sizeof(v)); }
+  void u64(uint64_t v) { out.append((const char *) &v, sizeof(v)); }
+  void str(const char *data, unsigned len)
+    { u32(len); out.append(data, len); out.push_back('\0'); }
+  void str(const string_ref &s) { str(s.data, s.len); }
+  void str(const std::string &s) { str(s.data(), s.size()); }
+  void tok(const token *t)
+    { u32(t == NULL ? NO_TOKEN : (uint32_t) (t - &f->tokens[0])); }
+
+  void write_stmt(stmt *s) { if (s) s->visit(this); else u8(n_null); }
+  void write_expr(expr *e) { if (e) e->visit(this); else u8(n_null); }
+  void write_event(event_expr *e) { if (e) e->visit(this); else u8(n_null); }
+  void write_handler(handler *h);
+  void write_file(const std::string &hash);
+
+  void visit_empty_stmt (empty_stmt *s);
+  void visit_expr_stmt (expr_stmt *s);
+  void visit_compound_stmt (compound_stmt *s);
+  void visit_ifthen_stmt (ifthen_stmt *s);
+  void visit_loop_stmt (loop_stmt *s);
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_jump_stmt (jump_stmt *s);
+
+  void visit_basic_expr (basic_expr *e);
+  void visit_unary_expr (unary_expr *e);
+  void visit_binary_expr (binary_expr *e);
+  void visit_conditional_expr (conditional_expr *e);
+  void visit_call_expr (call_expr *e);
+
+  void visit_named_event (named_event *e);
+  void visit_conditional_event (conditional_event *e);
+  void visit_compound_event (compound_event *e);
+};
+
+void
+ir_writer::visit_empty_stmt (empty_stmt *s)
+{
+  u8(n_empty_stmt); tok(s->tok);
+}
+
+void
+ir_writer::visit_expr_stmt (expr_stmt *s)
+{
+  u8(n_expr_stmt); tok(s->tok);
+  write_expr(s->e);
+}
+
+void
+ir_writer::visit_compound_stmt (compound_stmt *s)
+{
+  u8(n_compound_stmt); tok(s->tok);
+  u32(s->stmts.size());
+  for (unsigned i = 0; i < s->stmts.size(); i++)
+    write_stmt(s->stmts[i]);
+}
+
+void
+ir_writer::visit_ifthen_stmt (ifthen_stmt *s)
+{
+  u8(n_ifthen_stmt); tok(s->tok);
+  write_expr(s->condition);
+  write_stmt(s->then_stmt);
+  write_stmt(s->else_stmt);
+}
+
+void
+ir_writer::visit_loop_stmt (loop_stmt *s)
+{
+  u8(n_loop_stmt); tok(s->tok);
+  write_expr(s->initial);
+  write_expr(s->condition);
+  write_expr(s->update);
+  write_stmt(s->body);
+}
+
+void
+ir_writer::visit_foreach_stmt (foreach_stmt *s)
+{
+  u8(n_foreach_stmt); tok(s->tok);
+  str(s->identifier);
+  write_expr(s->array);
+  write_stmt(s->body);
+}
+
+void
+ir_writer::visit_jump_stmt (jump_stmt *s)
+{
+  u8(n_jump_stmt); tok(s->tok);
+  u8(s->kind);
+  write_expr(s->value);
+}
+
+void
+ir_writer::visit_basic_expr (basic_expr *e)
+{
+  u8(n_basic_expr); tok(e->tok);
+  tok(e->sigil);
+  u32(e->chain.size());
+  for (unsigned i = 0; i < e->chain.size(); i++)
+    {
+      u8(e->chain[i].first);
+      write_expr(e->chain[i].second);
+    }
+}
+
+void
+ir_writer::visit_unary_expr (unary_expr *e)
+{
+  u8(n_unary_expr); tok(e->tok);
+  u8(e->op);
+  write_expr(e->operand);
+}
+
+void
+ir_writer::visit_binary_expr (binary_expr *e)
+{
+  u8(n_binary_expr); tok(e->tok);
+  u8(e->op);
+  write_expr(e->left);
+  write_expr(e->right);
+}
+
+void
+ir_writer::visit_conditional_expr (conditional_expr *e)
+{
+  u8(n_conditional_expr); tok(e->tok);
+  write_expr(e->cond);
+  write_expr(e->truevalue);
+  write_expr(e->falsevalue);
+}
+
+void
+ir_writer::visit_call_expr (call_expr *e)
+{
+  u8(n_call_expr); tok(e->tok);
+  str(e->func);
+  u32(e->args.size());
+  for (unsigned i = 0; i < e->args.size(); i++)
+    write_expr(e->args[i]);
+}
+
+void
+ir_writer::visit_named_event (named_event *e)
+{
+  u8(n_named_event); tok(e->tok);
+  str(e->ident);
+  write_event(e->subevent);
+}
+
+void
+ir_writer::visit_conditional_event (conditional_event *e)
+{
+  u8(n_conditional_event); tok(e->tok);
+  write_event(e->subevent);
+  write_expr(e->condition);
+}
+
+void
+ir_writer::visit_compound_event (compound_event *e)
+{
+  u8(n_compound_event); tok(e->tok);
+  u8(e->op);
+  u32(e->subevents.size());
+  for (unsigned i = 0; i < e->subevents.size(); i++)
+    write_event(e->subevents[i]);
+}
+
+void
+ir_writer::write_handler (handler *h)
+{
+  u32(h->id);
+  write_stmt(h->action);
+  str(h->orig_source);
+}
+
+void
+ir_writer::write_file (const std::string &hash)
+{
+  out.append(IR_CACHE_MAGIC);
+  u32(IR_CACHE_VERSION);
+  str(hash);
+  u32(f->handler_ticket);
+  u32(f->global_ticket);
+
+  u32(f->tokens.size());
+  for (unsigned i = 0; i < f->tokens.size(); i++)
+    {
+      const token &t = f->tokens[i];
+      u8(t.type);
+      u32(t.location.line);
+      u32(t.location.col);
+      str(t.content);
+    }
+
+  u32(f->probes.size());
+  for (unsigned i = 0; i < f->probes.size(); i++)
+    {
+      probe *p = f->probes[i];
+      tok(p->tok);
+      write_event(p->probe_point);
+      write_handler(p->body);
+    }
+
+  u32(f->functions.size());
+  for (map<string, ebt_function *>::iterator it = f->functions.begin();
+       it != f->functions.end(); it++)
+    {
+      ebt_function *fn = it->second;
+      u32(fn->id);
+      tok(fn->tok);
+      str(fn->name);
+      u32(fn->argument_names.size());
+      for (unsigned j = 0; j < fn->argument_names.size(); j++)
+        str(fn->argument_names[j]);
+      write_stmt(fn->body);
+    }
+
+  u32(f->globals.size());
+  for (map<string, ebt_global *>::iterator it = f->globals.begin();
+       it != f->globals.end(); it++)
+    {
+      ebt_global *g = it->second;
+      u32(g->id);
+      tok(g->tok);
+      str(g->name);
+      u8(g->value_type);
+      u8(g->array_type);
+      u8(g->key_type);
+      u8(g->is_thread_local);
+      u8(g->is_dense);
+      u64(g->key_min);
+      u64(g->key_max);
+      u64(g->capacity);
+      write_expr(g->initializer);
+    }
+}
+
+// ---------------------------------
+// --- reading serialized files ---
+// ---------------------------------
+
+// Thrown when an entry is truncated or otherwise malformed; the caller
+// falls back to parsing the source:
+struct ir_format_error {};
+
+class ir_reader {
+  ebt_module *m;
+  ebt_file *f;
+  const char *pos;
+  const char *end;
+
+public:
+  ir_reader(ebt_module *m, ebt_file *f, const char *data, unsigned size)
+    : m(m), f(f), pos(data), end(data + size) {}
+
+  void need(size_t n) { if ((size_t) (end - pos) < n) throw ir_format_error(); }
+  unsigned u8() { need(1); return (unsigned char) *pos++; }
+  uint32_t u32() { uint32_t v; need(sizeof(v)); memcpy(&v, pos, sizeof(v));
+                   pos += sizeof(v); return v; }
+  uint64_t u64() { uint64_t v; need(sizeof(v)); memcpy(&v, pos, sizeof(v));
+                   pos += sizeof(v); return v; }
+  unsigned count() { uint32_t n = u32(); need(n); return n; }
+    // -- every element takes at least one byte, so this catches bogus counts
+  string_ref str();
+  token *tok();
+
+  stmt *read_stmt();
+  expr *read_expr();
+  event_expr *read_event();
+  handler *read_handler();
+  void read_file(const std::string &hash);
+};
+
+string_ref
+ir_reader::str()
+{
+  uint32_t len = u32();
+  need((size_t) len + 1);
+  if (pos[len] != '\0') throw ir_format_error();
+  string_ref s(pos, len); pos += len + 1;
+  return s;
+}
+
+token *
+ir_reader::tok()
+{
+  uint32_t i = u32();
+  if (i == NO_TOKEN) return NULL;
+  if (i >= f->tokens.size()) throw ir_format_error();
+  return &f->tokens[i];
+}
+
+stmt *
+ir_reader::read_stmt()
+{
+  unsigned tag = u8();
+  if (tag == n_null) return NULL;
+
+  token *t = tok();
+  stmt *result;
+  switch (tag)
+    {
+    case n_empty_stmt:
+      {
+        result = new (f->mem) empty_stmt();
+        break;
+      }
+    case n_expr_stmt:
+      {
+        expr_stmt *s = new (f->mem) expr_stmt();
+        s->e = read_expr();
+        result = s; break;
+      }
+    case n_compound_stmt:
+      {
+        compound_stmt *s = new (f->mem) compound_stmt();
+        vector<stmt *> stmts(count());
+        for (unsigned i = 0; i < stmts.size(); i++)
+          stmts[i] = read_stmt();
+        s->stmts = arena_list<stmt *>(f->mem, stmts);
+        result = s; break;
+      }
+    case n_ifthen_stmt:
+      {
+        ifthen_stmt *s = new (f->mem) ifthen_stmt();
+        s->condition = read_expr();
+        s->then_stmt = read_stmt();
+        s->else_stmt = read_stmt();
+        result = s; break;
+      }
+    case n_loop_stmt:
+      {
+        loop_stmt *s = new (f->mem) loop_stmt();
+        s->initial = read_expr();
+        s->condition = read_expr();
+        s->update = read_expr();
+        s->body = read_stmt();
+        result = s; break;
+      }
+    case n_foreach_stmt:
+      {
+        foreach_stmt *s = new (f->mem) foreach_stmt();
+        s->identifier = str();
+        s->array = read_expr();
+        s->body = read_stmt();
+        result = s; break;
+      }
+    case n_jump_stmt:
+      {
+        jump_stmt *s = new (f->mem) jump_stmt();
+        s->kind = (jump_type) u8();
+        s->value = read_expr();
+        result = s; break;
+      }
+    default:
+      throw ir_format_error();
+    }
+
+  result->tok = t;
+  return result;
+}
+
+expr *
+ir_reader::read_expr()
+{
+  unsigned tag = u8();
+  if (tag == n_null) return NULL;
+
+  token *t = tok();
+  expr *result;
+  switch (tag)
+    {
+    case n_basic_expr:
+      {
+        basic_expr *e = new (f->mem) basic_expr();
+        e->sigil = tok();
+        vector<chain_item> chain(count());
+        for (unsigned i = 0; i < chain.size(); i++)
+          {
+            chain[i].first = (chain_type) u8();
+            chain[i].second = read_expr();
+          }
+        e->chain = arena_list<chain_item>(f->mem, chain);
+        result = e; break;
+      }
+    case n_unary_expr:
+      {
+        unary_expr *e = new (f->mem) unary_expr();
+        e->op = (expr_op) u8();
+        e->operand = read_expr();
+        result = e; break;
+      }
+    case n_binary_expr:
+      {
+        binary_expr *e = new (f->mem) binary_expr();
+        e->op = (expr_op) u8();
+        e->left = read_expr();
+        e->right = read_expr();
+        result = e; break;
+      }
+    case n_conditional_expr:
+      {
+        conditional_expr *e = new (f->mem) conditional_expr();
+        e->cond = read_expr();
+        e->truevalue = read_expr();
+        e->falsevalue = read_expr();
+        result = e; break;
+      }
+    case n_call_expr:
+      {
+        call_expr *e = new (f->mem) call_expr();
+        e->func = str();
+        vector<expr *> args(count());
+        for (unsigned i = 0; i < args.size(); i++)
+          args[i] = read_expr();
+        e->args = arena_list<expr *>(f->mem, args);
+        result = e; break;
+      }
+    default:
+      throw ir_format_error();
+    }
+
+  result->tok = t;
+  return result;
+}
+
+event_expr *
+ir_reader::read_event()
+{
+  unsigned tag = u8();
+  if (tag == n_null) return NULL;
+
+  token *t = tok();
+  event_expr *result;
+  switch (tag)
+    {
+    case n_named_event:
+      {
+        named_event *e = new (f->mem) named_event();
+        e->ident = str();
+        e->subevent = read_event();
+        result = e; break;
+      }
+    case n_conditional_event:
+      {
+        conditional_event *e = new (f->mem) conditional_event();
+        e->subevent = read_event();
+        e->condition = read_expr();
+        result = e; break;
+      }
+    case n_compound_event:
+      {
+        compound_event *e = new (f->mem) compound_event();
+        e->op = (event_op) u8();
+        vector<event_expr *> subevents(count());
+        for (unsigned i = 0; i < subevents.size(); i++)
+          subevents[i] = read_event();
+        e->subevents = arena_list<event_expr *>(f->mem, subevents);
+        result = e; break;
+      }
+    default:
+      throw ir_format_error();
+    }
+
+  result->tok = t;
+  return result;
+}
+
+handler *
+ir_reader::read_handler()
+{
+  handler *h = f->keep(new handler());
+  h->id = u32();
+  h->action = read_stmt();
+  h->orig_source = str();
+  return h;
+}
+
+void
+ir_reader::read_file(const std::string &hash)
+{
+  need(strlen(IR_CACHE_MAGIC));
+  if (strncmp(pos, IR_CACHE_MAGIC, strlen(IR_CACHE_MAGIC)) != 0)
+    throw ir_format_error();
+  pos += strlen(IR_CACHE_MAGIC);
+  if (u32() != IR_CACHE_VERSION || str() != hash)
+    throw ir_format_error();
+  f->handler_ticket = u32();
+  f->global_ticket = u32();
+
+  // The token table is never resized after this point:
+  f->tokens.resize(count());
+  for (unsigned i = 0; i < f->tokens.size(); i++)
+    {
+      token &t = f->tokens[i];
+      t.type = (tok_type) u8();
+      t.location.file = f;
+      t.location.line = u32();
+      t.location.col = u32();
+      t.content = str();
+    }
+
+  unsigned n = u32();
+  for (unsigned i = 0; i < n; i++)
+    {
+      probe *p = new (f->mem) probe();
+      p->tok = tok();
+      p->probe_point = read_event();
+      p->body = read_handler();
+      f->probes.push_back(p);
+    }
+
+  n = u32();
+  for (unsigned i = 0; i < n; i++)
+    {
+      ebt_function *fn = f->keep(new ebt_function());
+      fn->id = u32();
+      fn->tok = tok();
+      fn->name = str();
+      unsigned n_args = u32();
+      for (unsigned j = 0; j < n_args; j++)
+        fn->argument_names.push_back(str());
+      fn->body = read_stmt();
+      f->functions[fn->name] = fn;
+    }
+
+  n = u32();
+  for (unsigned i = 0; i < n; i++)
+    {
+      ebt_global *g = f->keep(new ebt_global());
+      g->id = u32();
+      g->tok = tok();
+      g->name = str();
+      g->value_type = (ebt_type) u8();
+      g->array_type = (ebt_dimension) u8();
+      g->key_type = (ebt_type) u8();
+      g->is_thread_local = u8() != 0;
+      g->is_dense = u8() != 0;
+      g->key_min = (long long) u64();
+      g->key_max = (long long) u64();
+      g->capacity = (long long) u64();
+      g->initializer = read_expr();
+      f->globals[g->name] = g;
+    }
+
+  if (pos != end) throw ir_format_error();
+}
+
+// ------------------------------
+// --- methods for ir_cache ---
+// ------------------------------
+
+ir_cache::ir_cache()
+{
+  const char *xdg_cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg_cache && *xdg_cache)
+    dir = string(xdg_cache);
+  else if (home && *home)
+    dir = string(home) + "/.cache";
+  else
+    return;
+
+  dir += "/ebt";
+}
+
+string
+ir_cache::content_hash(const char *buf, unsigned size)
+{
+  unsigned char hash_result[MD5_DIGEST_LENGTH];
+  MD5((const unsigned char *) buf, size, hash_result);
+
+  string result("");
+  for (unsigned i = 0; i < MD5_DIGEST_LENGTH; i++)
+    {
+      char hex[3]; sprintf(hex, "%02x", hash_result[i]);
+      result.push_back(hex[0]); result.push_back(hex[1]);
+    }
+  return result;
+}
+
+string
+ir_cache::entry_path(const string &hash) const
+{
+  return dir + "/" + hash + ".ir";
+}
+
+ebt_file *
+ir_cache::load(ebt_module *m, const string &name, const string &hash)
+{
+  if (dir.empty()) return NULL;
+
+  mapped_file *entry = new mapped_file;
+  if (!entry->open(entry_path(hash)))
+    {
+      delete entry;
+      return NULL;
+    }
+
+  ebt_file *f = new ebt_file(name, m);
+  try
+    {
+      ir_reader r(m, f, entry->data, entry->size);
+      r.read_file(hash);
+    }
+  catch (const ir_format_error& e)
+    {
+      delete f;
+      delete entry;
+      return NULL;
+    }
+
+  // Strings of the loaded file point into the entry, thus it is kept
+  // mapped for the module lifetime:
+  m->keep_source(entry);
+  return f;
+}
+
+void
+ir_cache::store(ebt_file *f, const string &hash)
+{
+  if (dir.empty()) return;
+
+  // -- an existing directory is fine; if mkdir() fails otherwise,
+  //    so will opening the entry below
+  mkdir(dir.substr(0, dir.rfind('/')).c_str(), S_IRWXU);
+  mkdir(dir.c_str(), S_IRWXU);
+
+  ir_writer w(f);
+  w.write_file(hash);
+
+  // Write to a temporary file first, so that a concurrent ebt never
+  // observes a partially written entry. The name is unique, since files
+  // with the same contents (thus the same entry) may be stored at once:
+  string tmp = entry_path(hash) + ".XXXXXX";
+  vector<char> tmp_path(tmp.begin(), tmp.end());
+  tmp_path.push_back('\0');
+  int fd = mkstemp(&tmp_path[0]);
+  if (fd < 0) return;
+
+  const char *data = w.out.data();
+  size_t left = w.out.size();
+  while (left > 0)
+    {
+      ssize_t n = write(fd, data, left);
+      if (n <= 0) break;
+      data += n;
+      left -= n;
+    }
+
+  if (close(fd) < 0 || left > 0
+      || rename(&tmp_path[0], entry_path(hash).c_str()) < 0)
+    unlink(&tmp_path[0]);
+}
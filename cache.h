@@ -0,0 +1,47 @@
+// serialized IR cache
+// Copyright (C) 2014-2015 Serguei Makarov
+//
+// This file is part of EBT, and is free software. You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#ifndef EBT_CACHE_H
+#define EBT_CACHE_H
+
+#include <string>
+
+/* from ir.h */
+struct ebt_module;
+struct ebt_file;
+
+// Parsed library files are cached in a compact binary form, so that
+// shared libraries are not lexed and parsed again on every invocation.
+// Cache entries are named by (and validated against) the MD5 hash of the
+// source they were produced from, so a stale entry is never used.
+//
+// The cache lives in $XDG_CACHE_HOME/ebt (by default ~/.cache/ebt) rather
+// than next to the library, since writing into a library directory would
+// make its ebt.index look out of date.
+//
+// XXX Bump IR_CACHE_VERSION whenever the representation of ebt_file or
+// of the AST changes, to invalidate existing cache entries.
+#define IR_CACHE_VERSION 6
+
+class ir_cache {
+  std::string dir; // -- empty if the cache is unavailable
+
+  std::string entry_path(const std::string &hash) const;
+
+public:
+  ir_cache();
+
+  static std::string content_hash(const char *buf, unsigned size);
+
+  // Returns NULL unless a valid entry for the given hash exists:
+  ebt_file *load(ebt_module *m, const std::string &name,
+                 const std::string &hash);
+  void store(ebt_file *f, const std::string &hash);
+};
+
+#endif // EBT_CACHE_H
@@ -12,6 +12,10 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
 
 using namespace std;
 
@@ -81,45 +85,1873 @@ client_template::register_global(ebt_global *g)
   globals.push_back(g);
 }
 
+// ------------------------------
+// --- methods for c_unparser ---
+// ------------------------------
+
+// TODOXXX need c++0x to_string or such
+static string
+tostring(long long n)
+{
+  ostringstream result; result << n; return result.str();
+}
+
+// The lexer keeps C escapes in string literals as-is, dropping only the
+// backslash of an escaped quote:
+static string
+c_literal(const string& content)
+{
+  string result;
+  for (unsigned i = 0; i < content.size(); i++)
+    {
+      if (content[i] == '\"') result.push_back('\\');
+      result.push_back(content[i]);
+    }
+  return result;
+}
+
+// -- thread-local globals and private copies are fields of the thread
+// data (see dr_client_template::emit_thread_globals())
+string
+c_unparser::global(ebt_global *g) const
+{
+  if (use_private && privatized.count(g))
+    return "thread_data->private_" + tostring(g->id);
+  return (g->is_thread_local ? "thread_data->" : "") + string("global_")
+    + tostring(g->id);
+}
+
+string
+c_unparser::function(ebt_function *fn) const
+{
+  return "function_" + tostring(fn->id);
+}
+
+string
+c_unparser::local(const string& name) const
+{
+  return "l_" + name;
+}
+
+string
+c_unparser::context(basic_expr *e) const
+{
+  string name = "ctx_" + e->tok->content.str();
+  // -- indexed context values only allow a constant index
+  if (!e->chain.empty())
+    name += "_" + e->chain[0].second->tok->content.str();
+  return name;
+}
+
+// -- the element of array g for a static context value
+string
+c_unparser::slot(ebt_global *g, basic_expr *key) const
+{
+  return "slot_" + tostring(g->id) + "_"
+    + context(key).substr(strlen("ctx_"));
+}
+
+string
+c_unparser::c_type(ebt_type t)
+{
+  return t == t_str ? "const char *" : "int64 ";
+}
+
+string
+c_unparser::default_value(ebt_type t)
+{
+  return t == t_str ? "\"\"" : "0";
+}
+
+// -- the runtime type of an array, which prefixes its accessors: a dense
+// array (see runtime/dense.h) or a map for its key and element types
+// (see runtime/map.h)
+string
+c_unparser::array_prefix(ebt_global *g)
+{
+  if (g->is_dense)
+    return "ebt_dense";
+  return string("ebt_map_") + (g->key_type == t_str ? "s" : "i")
+    + (g->value_type == t_str ? "s" : "i");
+}
+
+/* a traversing visitor to emit an expression */
+class unparsing_visitor : public traversing_visitor {
+  ostream &o;
+  c_unparser *u;
+  ebt_module *module;
+  expr *discarded; // -- an expression whose value is unused
+
+  void emit_truth(expr *e);
+  void emit_key(ebt_global *g, expr *index);
+  void emit_lvalue(basic_expr *e);
+  void emit_update(expr *lhs, expr_op op, expr *rhs);
+  void emit_shift_count(expr *e);
+  void emit_printf(call_expr *e);
+
+public:
+  unparsing_visitor(ostream &o, c_unparser *u, ebt_module *module,
+                    expr *discarded = NULL)
+    : o(o), u(u), module(module), discarded(discarded) {}
+
+  void visit_basic_expr (basic_expr *e);
+  void visit_unary_expr (unary_expr *e);
+  void visit_binary_expr (binary_expr *e);
+  void visit_conditional_expr (conditional_expr *e);
+  void visit_call_expr (call_expr *e);
+};
+
+// Any value can be tested for truth; a string is true unless empty:
+void
+unparsing_visitor::emit_truth (expr *e)
+{
+  if (e->type == t_str)
+    {
+      o << "ebt_str_truth(";
+      e->visit(this);
+      o << ")";
+    }
+  else
+    e->visit(this);
+}
+
+// -- string keys are interned (see runtime/intern.h), which static
+// context values already are
+void
+unparsing_visitor::emit_key (ebt_global *g, expr *index)
+{
+  basic_expr *e = dynamic_cast<basic_expr *>(index);
+  bool interned = e && e->sigil && e->sigil->content.str() == "$";
+  if (g->key_type == t_str && !interned)
+    {
+      o << "ebt_intern(";
+      index->visit(this);
+      o << ")";
+    }
+  else
+    index->visit(this);
+}
+
+// Emits a C lvalue for a variable or element of a dense array (the
+// elements of a map are updated through its accessors, see emit_update()):
+void
+unparsing_visitor::emit_lvalue (basic_expr *e)
+{
+  ebt_global *g = module->find_global(e->tok->content);
+  if (g && g->is_dense)
+    {
+      o << "(*ebt_dense_ref(&" << u->global(g) << ", ";
+      emit_key(g, e->chain[0].second);
+      o << "))";
+    }
+  else
+    o << (g ? u->global(g) : u->local(e->tok->content));
+}
+
+// -- the character naming an update for ebt_map_apply()
+static char
+map_update_op(expr_op op)
+{
+  switch (op) {
+  case op_assign: return '=';
+  case op_add_assign: case op_preinc: case op_postinc: return '+';
+  case op_sub_assign: case op_predec: case op_postdec: return '-';
+  case op_mul_assign: return '*';
+  case op_div_assign: return '/';
+  case op_mod_assign: return '%';
+  case op_shl_assign: return '<';
+  case op_shr_assign: return '>';
+  case op_band_assign: return '&';
+  case op_bxor_assign: return '^';
+  case op_bor_assign: return '|';
+  default: return '?';
+  }
+}
+
+// Emits lhs = rhs, lhs OP= rhs, or ++lhs and --lhs (when rhs is NULL):
+void
+unparsing_visitor::emit_update (expr *lhs, expr_op op, expr *rhs)
+{
+  basic_expr *be = (basic_expr *) lhs; // -- checked by checking_visitor
+  ebt_global *g = module->find_global(be->tok->content);
+
+  // -- an element of a map may move as the map grows, so the update is a
+  // single call, after the key and rhs are evaluated
+  if (g && g->array_type == d_array && !g->is_dense)
+    {
+      string prefix = c_unparser::array_prefix(g);
+      o << prefix << (op == op_assign ? "_set(&" : "_update(&")
+        << u->global(g) << ", ";
+      emit_key(g, be->chain[0].second);
+      if (op != op_assign)
+        o << ", '" << map_update_op(op) << "'";
+      o << ", ";
+      if (rhs)
+        rhs->visit(this);
+      else
+        o << "1LL";
+      o << ")";
+      return;
+    }
+
+  // -- division by zero yields 0 rather than crashing the target
+  if (op == op_div_assign || op == op_mod_assign)
+    {
+      o << (op == op_div_assign ? "ebt_div_assign(&" : "ebt_mod_assign(&");
+      emit_lvalue(be);
+      o << ", ";
+      rhs->visit(this);
+      o << ")";
+      return;
+    }
+
+  o << "(";
+  if (op == op_preinc || op == op_predec)
+    o << op_name(op);
+  emit_lvalue(be);
+  if (rhs && (op == op_shl_assign || op == op_shr_assign))
+    {
+      o << " " << op << " ";
+      emit_shift_count(rhs);
+    }
+  else if (rhs)
+    {
+      o << " " << op << " ";
+      rhs->visit(this);
+    }
+  o << ")";
+}
+
+// Shift counts are taken modulo 64, like the target's shifts, rather
+// than being undefined in C:
+void
+unparsing_visitor::emit_shift_count (expr *e)
+{
+  basic_expr *be = dynamic_cast<basic_expr *>(e);
+  if (be && !be->sigil && be->tok->type == tok_num)
+    {
+      string s = be->tok->content;
+      char *end;
+      long long n = strtoll(s.c_str(), &end, 0);
+      if (*end == '\0' && n >= 0 && n < 64)
+        {
+          e->visit(this);
+          return;
+        }
+    }
+  o << "(";
+  e->visit(this);
+  o << " & 63)";
+}
+
+void
+unparsing_visitor::visit_basic_expr (basic_expr *e)
+{
+  if (e->tok->type == tok_num)
+    o << e->tok->content << "LL";
+  else if (e->tok->type == tok_str)
+    o << "\"" << c_literal(e->tok->content) << "\"";
+  else if (e->sigil)
+    o << u->context(e);
+  else
+    {
+      ebt_global *g = module->find_global(e->tok->content);
+      if (g && g->array_type == d_array)
+        {
+          o << c_unparser::array_prefix(g) << "_get(&" << u->global(g)
+            << ", ";
+          emit_key(g, e->chain[0].second);
+          o << ")";
+        }
+      else
+        emit_lvalue(e);
+    }
+}
+
+void
+unparsing_visitor::visit_unary_expr (unary_expr *e)
+{
+  switch (e->op) {
+  case op_plus: case op_neg: case op_bnot:
+    o << "(" << (e->op == op_plus ? "" : op_name(e->op));
+    e->operand->visit(this);
+    o << ")";
+    break;
+  case op_lnot:
+    o << "(!";
+    emit_truth(e->operand);
+    o << ")";
+    break;
+  case op_preinc: case op_predec:
+    emit_update(e->operand, e->op, NULL);
+    break;
+  case op_postinc: case op_postdec:
+    {
+      basic_expr *be = (basic_expr *) e->operand;
+      ebt_global *g = module->find_global(be->tok->content);
+      if (g && g->array_type == d_array && !g->is_dense)
+        {
+          // -- the value before the update, unless it is unused
+          if (e != discarded) o << "(";
+          emit_update(be, e->op, NULL);
+          if (e != discarded) o << (e->op == op_postinc ? " - 1)" : " + 1)");
+          break;
+        }
+      o << "(";
+      emit_lvalue(be);
+      o << (e->op == op_postinc ? "++" : "--") << ")";
+    }
+    break;
+  default:
+    o << "(BUG: unknown unary operator)";
+  }
+}
+
+void
+unparsing_visitor::visit_binary_expr (binary_expr *e)
+{
+  if (e->op == op_div || e->op == op_mod)
+    {
+      // -- division by zero yields 0 rather than crashing the target
+      o << (e->op == op_div ? "ebt_div(" : "ebt_mod(");
+      e->left->visit(this);
+      o << ", ";
+      e->right->visit(this);
+      o << ")";
+    }
+  else if (e->op >= op_lt && e->op <= op_ne && e->left->type == t_str)
+    {
+      o << "(strcmp(";
+      e->left->visit(this);
+      o << ", ";
+      e->right->visit(this);
+      o << ") " << e->op << " 0)";
+    }
+  else if (e->op == op_shl || e->op == op_shr)
+    {
+      o << "(";
+      e->left->visit(this);
+      o << " " << e->op << " ";
+      emit_shift_count(e->right);
+      o << ")";
+    }
+  else if (e->op <= op_bor)
+    {
+      o << "(";
+      e->left->visit(this);
+      o << " " << e->op << " ";
+      e->right->visit(this);
+      o << ")";
+    }
+  else if (e->op == op_in)
+    {
+      basic_expr *array = (basic_expr *) e->right;
+      ebt_global *g = module->find_global(array->tok->content);
+      o << c_unparser::array_prefix(g) << "_contains(&" << u->global(g)
+        << ", ";
+      emit_key(g, e->left);
+      o << ")";
+    }
+  else if (e->op == op_land || e->op == op_lor)
+    {
+      o << "(";
+      emit_truth(e->left);
+      o << " " << e->op << " ";
+      emit_truth(e->right);
+      o << ")";
+    }
+  else if (e->op == op_comma)
+    {
+      o << "(";
+      e->left->visit(this);
+      o << ", ";
+      e->right->visit(this);
+      o << ")";
+    }
+  else
+    emit_update(e->left, e->op, e->right);
+}
+
+void
+unparsing_visitor::visit_conditional_expr (conditional_expr *e)
+{
+  o << "(";
+  emit_truth(e->cond);
+  o << " ? ";
+  e->truevalue->visit(this);
+  o << " : ";
+  e->falsevalue->visit(this);
+  o << ")";
+}
+
+// A literal format is translated into a format for dr_fprintf(), picking
+// the conversion of each argument according to its type (as ebt_printf()
+// does at runtime for any other format):
+void
+unparsing_visitor::emit_printf (call_expr *e)
+{
+  basic_expr *fmt = dynamic_cast<basic_expr *>(e->args[0]);
+  if (!fmt || fmt->tok->type != tok_str)
+    {
+      o << "ebt_printf(";
+      e->args[0]->visit(this);
+      o << ", " << e->args.size() - 1 << ", ";
+      if (e->args.size() == 1)
+        o << "NULL";
+      else
+        {
+          o << "(ebt_value []) { ";
+          for (unsigned i = 1; i < e->args.size(); i++)
+            {
+              o << (i > 1 ? ", " : "")
+                << (e->args[i]->type == t_str ? "ebt_str(" : "ebt_int(");
+              e->args[i]->visit(this);
+              o << ")";
+            }
+          o << " }";
+        }
+      o << ")";
+      return;
+    }
+
+  string format = fmt->tok->content;
+  string result;
+  vector<string> casts;
+  unsigned arg = 1;
+  for (unsigned i = 0; i < format.size(); i++)
+    {
+      char c = format[i];
+      if (c == '\\' && i + 1 < format.size())
+        {
+          // -- escapes are kept as-is
+          result.push_back(c); result.push_back(format[++i]);
+          continue;
+        }
+      if (c == '\"')
+        {
+          result += "\\\"";
+          continue;
+        }
+      if (c != '%')
+        {
+          result.push_back(c);
+          continue;
+        }
+      if (i + 1 < format.size() && format[i+1] == '%')
+        {
+          result += "%%"; i++;
+          continue;
+        }
+
+      // Copy flags, width and precision; skip length modifiers:
+      unsigned j = i + 1;
+      while (j < format.size() && strchr("-+ #0123456789.", format[j])) j++;
+      string spec = format.substr(i, j - i);
+      while (j < format.size() && strchr("hlLqjzt", format[j])) j++;
+      if (j == format.size())
+        break;
+
+      char conv = format[j];
+      if (arg >= e->args.size())
+        // XXX missing arguments are printed as the conversion itself
+        result += "%" + format.substr(i, j + 1 - i);
+      else if (e->args[arg]->type == t_str)
+        {
+          result += spec + "s";
+          casts.push_back("");
+        }
+      else if (conv == 'c')
+        {
+          result += spec + "c";
+          casts.push_back("(int) ");
+        }
+      else
+        {
+          // -- %u, %x, %X and %o keep their conversion, others print as %d
+          result += spec + "\" INT64_FORMAT \""
+            + (strchr("uxXo", conv) ? conv : 'd');
+          casts.push_back("");
+        }
+      arg++;
+      i = j;
+    }
+
+  // -- like ebt_printf(), the call evaluates to 0
+  if (e != discarded) o << "(";
+  o << "dr_fprintf(STDERR, \"" << result << "\"";
+  for (unsigned i = 1; i < e->args.size(); i++)
+    {
+      o << ", " << (i - 1 < casts.size() ? casts[i - 1] : "");
+      e->args[i]->visit(this);
+    }
+  o << ")";
+  if (e != discarded) o << ", 0LL)";
+}
+
+void
+unparsing_visitor::visit_call_expr (call_expr *e)
+{
+  if (ebt_module::find_builtin(e->func))
+    {
+      // TODOXXX printf is the only builtin function so far
+      emit_printf(e);
+      return;
+    }
+
+  o << u->function(module->find_function(e->func)) << "(";
+  for (unsigned i = 0; i < e->args.size(); i++)
+    {
+      if (i > 0) o << ", ";
+      e->args[i]->visit(this);
+    }
+  o << ")";
+}
+
+// Returns the variable which an additive update such as 'g++', 'x -= e'
+// or 'a[k] += e' modifies, or NULL for any other expression:
+static basic_expr *
+additive_target(expr *e)
+{
+  unary_expr *ue = dynamic_cast<unary_expr *>(e);
+  binary_expr *be = dynamic_cast<binary_expr *>(e);
+  basic_expr *target = NULL;
+  if (ue && ue->op >= op_preinc)
+    target = dynamic_cast<basic_expr *>(ue->operand);
+  else if (be && (be->op == op_add_assign || be->op == op_sub_assign))
+    target = dynamic_cast<basic_expr *>(be->left);
+
+  if (!target || target->sigil || target->tok->type != tok_ident)
+    return NULL;
+  if (!target->chain.empty() && (target->chain.size() > 1
+                                 || target->chain[0].first != chain_index))
+    return NULL;
+  return target;
+}
+
+// Returns the scalar variable which a plain store 'x = e' sets, or NULL
+// for any other expression:
+static basic_expr *
+store_target(expr *e)
+{
+  binary_expr *be = dynamic_cast<binary_expr *>(e);
+  basic_expr *target =
+    be && be->op == op_assign ? dynamic_cast<basic_expr *>(be->left) : NULL;
+  if (!target || target->sigil || target->tok->type != tok_ident
+      || !target->chain.empty())
+    return NULL;
+  return target;
+}
+
+void
+c_unparser::emit_expr(translator_output& o, expr *e, bool discard)
+{
+  // -- a single-word store into an atomic global is atomic, too
+  basic_expr *stored = discard ? store_target(e) : NULL;
+  ebt_global *sg = stored ? module->find_global(stored->tok->content) : NULL;
+  if (sg && sg->array_type == d_scalar && atomic.count(sg))
+    {
+      o.line() << "__atomic_store_n(&" << global(sg) << ", ";
+      emit_expr(o, ((binary_expr *) e)->right);
+      o.line() << ", __ATOMIC_RELAXED)";
+      return;
+    }
+
+  // An additive update of an atomic global (or of the slot of an
+  // element) whose value is discarded becomes an atomic operation:
+  basic_expr *target = discard ? additive_target(e) : NULL;
+  ebt_global *g = target ? module->find_global(target->tok->content) : NULL;
+  string location;
+  if (g && target->chain.empty() && atomic.count(g))
+    location = "&" + global(g);
+  else if (g && !target->chain.empty() && use_slots && slotted.count(g))
+    location = slot(g, (basic_expr *) target->chain[0].second);
+  else if (g && !target->chain.empty() && g->is_dense && atomic.count(g))
+    location = "ebt_dense_ref(&" + global(g) + ", "; // -- and the key
+  if (!location.empty())
+    {
+      unary_expr *ue = dynamic_cast<unary_expr *>(e);
+      binary_expr *be = dynamic_cast<binary_expr *>(e);
+      bool add = ue ? ue->op == op_preinc || ue->op == op_postinc
+        : be->op == op_add_assign;
+      o.line() << (add ? "__sync_fetch_and_add(" : "__sync_fetch_and_sub(")
+               << location;
+      if (g->is_dense)
+        {
+          emit_expr(o, target->chain[0].second);
+          o.line() << ")";
+        }
+      o.line() << ", ";
+      if (be)
+        emit_expr(o, be->right);
+      else
+        o.line() << "1";
+      o.line() << ")";
+      return;
+    }
+
+  unparsing_visitor v(o.line(), this, module, discard ? e : NULL);
+  e->visit(&v);
+}
+
+void
+c_unparser::emit_truth(translator_output& o, expr *e)
+{
+  if (e->type == t_str)
+    {
+      o.line() << "ebt_str_truth(";
+      emit_expr(o, e);
+      o.line() << ")";
+    }
+  else
+    emit_expr(o, e);
+}
+
+/* a visitor to emit a statement, one line at a time */
+class stmt_unparsing_visitor : public traversing_visitor {
+  translator_output &o;
+  c_unparser *u;
+  ebt_module *module;
+  unsigned &iter_ticket;
+
+  // -- the iterators of the enclosing foreach loops, innermost last, as
+  // (prefix, name); a jump out of the loops must release them
+  vector<pair<string, string> > iters;
+
+  void emit_block(stmt *s);
+  void emit_iters_done();
+
+public:
+  stmt_unparsing_visitor(translator_output &o, c_unparser *u,
+                         ebt_module *module, unsigned &iter_ticket)
+    : o(o), u(u), module(module), iter_ticket(iter_ticket) {}
+
+  void visit_empty_stmt (empty_stmt *s);
+  void visit_expr_stmt (expr_stmt *s);
+  void visit_compound_stmt (compound_stmt *s);
+  void visit_ifthen_stmt (ifthen_stmt *s);
+  void visit_loop_stmt (loop_stmt *s);
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_jump_stmt (jump_stmt *s);
+};
+
+// Substatements are always emitted with braces:
+void
+stmt_unparsing_visitor::emit_block (stmt *s)
+{
+  if (dynamic_cast<compound_stmt *>(s))
+    {
+      s->visit(this);
+      return;
+    }
+
+  o.newline() << "{";
+  o.indent(1);
+  s->visit(this);
+  o.newline(-1) << "}";
+}
+
+void
+stmt_unparsing_visitor::visit_empty_stmt (empty_stmt *)
+{
+  o.newline() << ";";
+}
+
+void
+stmt_unparsing_visitor::visit_expr_stmt (expr_stmt *s)
+{
+  o.newline();
+  u->emit_expr(o, s->e, true);
+  o.line() << ";";
+}
+
+void
+stmt_unparsing_visitor::visit_compound_stmt (compound_stmt *s)
+{
+  o.newline() << "{";
+  o.indent(1);
+  traversing_visitor::visit_compound_stmt(s);
+  o.newline(-1) << "}";
+}
+
+void
+stmt_unparsing_visitor::visit_ifthen_stmt (ifthen_stmt *s)
+{
+  o.newline() << "if (";
+  u->emit_truth(o, s->condition);
+  o.line() << ")";
+  emit_block(s->then_stmt);
+  if (s->else_stmt)
+    {
+      o.newline() << "else";
+      emit_block(s->else_stmt);
+    }
+}
+
+void
+stmt_unparsing_visitor::visit_loop_stmt (loop_stmt *s)
+{
+  o.newline() << "for (";
+  if (s->initial) u->emit_expr(o, s->initial);
+  o.line() << "; ";
+  if (s->condition) u->emit_truth(o, s->condition);
+  o.line() << "; ";
+  if (s->update) u->emit_expr(o, s->update);
+  o.line() << ")";
+  emit_block(s->body);
+}
+
+void
+stmt_unparsing_visitor::visit_foreach_stmt (foreach_stmt *s)
+{
+  string iter = "iter_" + tostring(iter_ticket++);
+  basic_expr *array = (basic_expr *) s->array;
+  ebt_global *g = module->find_global(array->tok->content);
+  ebt_global *var = module->find_global(s->identifier);
+
+  string prefix = c_unparser::array_prefix(g) + "_iter";
+  o.newline() << "{";
+  o.newline(1) << prefix << " " << iter << ";";
+  o.newline() << prefix << "_init(&" << iter << ", &" << u->global(g) << ");";
+  o.newline() << "while (" << prefix << "_next(&" << iter << "))";
+  o.newline() << "{";
+  o.newline(1) << (var ? u->global(var) : u->local(s->identifier)) << " = "
+              << iter << ".key;";
+  iters.push_back(make_pair(prefix, iter));
+  s->body->visit(this);
+  iters.pop_back();
+  o.newline(-1) << "}";
+  o.newline() << prefix << "_done(&" << iter << ");";
+  o.newline(-1) << "}";
+}
+
+// 'next' and 'return' leave every enclosing foreach loop, whose copies of
+// the keys are released first ('break' reaches the end of the loop):
+void
+stmt_unparsing_visitor::emit_iters_done ()
+{
+  for (unsigned i = iters.size(); i-- > 0; )
+    o.newline() << iters[i].first << "_done(&" << iters[i].second << ");";
+}
+
+void
+stmt_unparsing_visitor::visit_jump_stmt (jump_stmt *s)
+{
+  switch (s->kind) {
+  case j_break: o.newline() << "break;"; break;
+  case j_continue: o.newline() << "continue;"; break;
+  case j_next:
+    emit_iters_done();
+    o.newline() << "goto " << u->exit_label << ";";
+    u->exit_label_used = true;
+    break;
+  case j_return:
+    if (u->in_handler)
+      {
+        // -- the value returned by a probe handler is ignored
+        if (s->value)
+          {
+            o.newline() << "(void) ";
+            u->emit_expr(o, s->value);
+            o.line() << ";";
+          }
+        emit_iters_done();
+        o.newline() << "goto " << u->exit_label << ";";
+        u->exit_label_used = true;
+      }
+    else
+      {
+        emit_iters_done();
+        o.newline() << "return ";
+        if (s->value)
+          u->emit_expr(o, s->value);
+        else
+          o.line() << c_unparser::default_value(u->return_type);
+        o.line() << ";";
+      }
+    break;
+  }
+}
+
+void
+c_unparser::emit_stmt(translator_output& o, stmt *s)
+{
+  stmt_unparsing_visitor v(o, this, module, iter_ticket);
+  s->visit(&v);
+}
+
+void
+c_unparser::emit_locals(translator_output& o,
+                        const map<string, ebt_type>& locals)
+{
+  for (map<string, ebt_type>::const_iterator it = locals.begin();
+       it != locals.end(); it++)
+    {
+      // -- a name may refer to a global in one file and a local in another
+      if (module->find_global(it->first)) continue;
+      o.newline() << c_type(it->second) << local(it->first)
+                  << " = " << default_value(it->second) << ";";
+    }
+}
+
+/* finds the context values used in an expression or statement */
+class context_collector : public traversing_visitor {
+  context_map &ctx;
+  const set<basic_expr *> *skip; // -- e.g. the keys of slots
+
+public:
+  context_collector(context_map &ctx, const set<basic_expr *> *skip = NULL)
+    : ctx(ctx), skip(skip) {}
+  void visit_basic_expr (basic_expr *e);
+};
+
+void
+context_collector::visit_basic_expr (basic_expr *e)
+{
+  if (skip && skip->count(e)) return;
+  if (e->sigil)
+    {
+      string name = "ctx_" + e->tok->content.str();
+      if (!e->chain.empty())
+        name += "_" + e->chain[0].second->tok->content.str();
+      if (!ctx.count(name)) ctx[name] = e;
+      return; // -- the index is a constant
+    }
+  traversing_visitor::visit_basic_expr(e);
+}
+
+void
+c_unparser::collect_context(expr *e, context_map& ctx)
+{
+  context_collector v(ctx);
+  e->visit(&v);
+}
+
+void
+c_unparser::collect_context(stmt *s, context_map& ctx,
+                            const set<basic_expr *> *skip)
+{
+  context_collector v(ctx, skip);
+  s->visit(&v);
+}
+
+/* finds the shared globals which code reads and writes, following calls
+   into script functions. Thread-local globals (and privatized ones, if
+   given) are not shared; only their direct uses count, since each
+   function fetches the thread data by itself */
+class global_use_collector : public traversing_visitor {
+  ebt_module *module;
+  const set<ebt_global *> *privatized; // -- count as thread-local
+  set<ebt_function *> seen;
+  unsigned depth; // -- of the calls being followed
+
+  bool is_shared(ebt_global *g);
+  void note_write(expr *e);
+  void merge(const global_use_collector &other);
+
+public:
+  bool uses_thread;
+  set<ebt_global *> reads, writes;
+  // -- written other than by an additive update ('g++', 'g -= e', or
+  // 'g[k]++' of a dense array):
+  set<ebt_global *> other_writes;
+  // -- for a global set by a plain store 'g = e', the globals which e
+  // reads (a store whose e reads g itself counts as another write):
+  map<ebt_global *, set<ebt_global *> > store_reads;
+
+  global_use_collector(ebt_module *module,
+                       const set<ebt_global *> *privatized = NULL)
+    : module(module), privatized(privatized), depth(0),
+      uses_thread(false) {}
+
+  void visit_expr_stmt (expr_stmt *s);
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_basic_expr (basic_expr *e);
+  void visit_unary_expr (unary_expr *e);
+  void visit_binary_expr (binary_expr *e);
+  void visit_call_expr (call_expr *e);
+};
+
+bool
+global_use_collector::is_shared(ebt_global *g)
+{
+  if (!g) return false;
+  if (!g->is_thread_local && !(privatized && privatized->count(g)))
+    return true;
+  if (depth == 0)
+    uses_thread = true;
+  return false;
+}
+
+void
+global_use_collector::note_write(expr *e)
+{
+  basic_expr *target = dynamic_cast<basic_expr *>(e);
+  if (!target || target->sigil || target->tok->type != tok_ident) return;
+  ebt_global *g = module->find_global(target->tok->content);
+  if (is_shared(g))
+    {
+      writes.insert(g);
+      other_writes.insert(g);
+    }
+}
+
+void
+global_use_collector::merge(const global_use_collector &other)
+{
+  uses_thread = uses_thread || other.uses_thread;
+  reads.insert(other.reads.begin(), other.reads.end());
+  writes.insert(other.writes.begin(), other.writes.end());
+  other_writes.insert(other.other_writes.begin(), other.other_writes.end());
+  for (map<ebt_global *, set<ebt_global *> >::const_iterator it =
+         other.store_reads.begin(); it != other.store_reads.end(); it++)
+    store_reads[it->first].insert(it->second.begin(), it->second.end());
+}
+
+void
+global_use_collector::visit_expr_stmt (expr_stmt *s)
+{
+  basic_expr *stored = store_target(s->e);
+  ebt_global *sg = stored ? module->find_global(stored->tok->content) : NULL;
+  if (sg && sg->array_type == d_scalar && is_shared(sg))
+    {
+      // -- the store itself can be atomic (see c_unparser::emit_expr())
+      global_use_collector rhs(module, privatized);
+      rhs.depth = depth;
+      ((binary_expr *) s->e)->right->visit(&rhs);
+      merge(rhs);
+      writes.insert(sg);
+      if (rhs.reads.count(sg) || rhs.writes.count(sg))
+        other_writes.insert(sg);
+      else
+        store_reads[sg].insert(rhs.reads.begin(), rhs.reads.end());
+      return;
+    }
+
+  basic_expr *target = additive_target(s->e);
+  ebt_global *g = target ? module->find_global(target->tok->content) : NULL;
+  if (g && !target->chain.empty() && !g->is_dense)
+    g = NULL;
+  if (!is_shared(g))
+    {
+      traversing_visitor::visit_expr_stmt(s);
+      return;
+    }
+
+  // -- the update itself can be atomic (see c_unparser::emit_expr())
+  writes.insert(g);
+  if (!target->chain.empty())
+    target->chain[0].second->visit(this);
+  binary_expr *be = dynamic_cast<binary_expr *>(s->e);
+  if (be)
+    be->right->visit(this);
+}
+
+void
+global_use_collector::visit_foreach_stmt (foreach_stmt *s)
+{
+  ebt_global *g = module->find_global(s->identifier);
+  if (is_shared(g))
+    {
+      writes.insert(g);
+      other_writes.insert(g);
+    }
+  traversing_visitor::visit_foreach_stmt(s);
+}
+
+void
+global_use_collector::visit_basic_expr (basic_expr *e)
+{
+  if (!e->sigil && e->tok->type == tok_ident)
+    {
+      ebt_global *g = module->find_global(e->tok->content);
+      if (is_shared(g))
+        reads.insert(g);
+    }
+  traversing_visitor::visit_basic_expr(e);
+}
+
+void
+global_use_collector::visit_unary_expr (unary_expr *e)
+{
+  if (e->op >= op_preinc)
+    note_write(e->operand);
+  traversing_visitor::visit_unary_expr(e);
+}
+
+void
+global_use_collector::visit_binary_expr (binary_expr *e)
+{
+  if (e->op >= op_assign && e->op <= op_bor_assign)
+    note_write(e->left);
+  traversing_visitor::visit_binary_expr(e);
+}
+
+void
+global_use_collector::visit_call_expr (call_expr *e)
+{
+  ebt_function *fn = module->find_function(e->func);
+  if (fn && !fn->is_builtin && !seen.count(fn))
+    {
+      seen.insert(fn);
+      depth++;
+      fn->body->visit(this);
+      depth--;
+    }
+  traversing_visitor::visit_call_expr(e);
+}
+
+/* finds the globals which code only updates by additive reductions whose
+   value is discarded ('g++', 'g[k] += e', ...), which commute with each
+   other; any other use of a global disqualifies it */
+class reduction_checker : public traversing_visitor {
+  ebt_module *module;
+
+public:
+  bool allow_reductions; // -- false for code outside of hot handlers
+  set<ebt_global *> reduced, disqualified;
+
+  reduction_checker(ebt_module *module)
+    : module(module), allow_reductions(true) {}
+
+  void visit_expr_stmt (expr_stmt *s);
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_basic_expr (basic_expr *e);
+};
+
+void
+reduction_checker::visit_expr_stmt (expr_stmt *s)
+{
+  basic_expr *target = additive_target(s->e);
+  ebt_global *g = target ? module->find_global(target->tok->content) : NULL;
+  if (!g || !allow_reductions)
+    {
+      traversing_visitor::visit_expr_stmt(s);
+      return;
+    }
+
+  // -- the index and the operand may still refer to other globals
+  reduced.insert(g);
+  if (!target->chain.empty())
+    target->chain[0].second->visit(this);
+  binary_expr *be = dynamic_cast<binary_expr *>(s->e);
+  if (be)
+    be->right->visit(this);
+}
+
+void
+reduction_checker::visit_foreach_stmt (foreach_stmt *s)
+{
+  ebt_global *g = module->find_global(s->identifier);
+  if (g) disqualified.insert(g);
+  traversing_visitor::visit_foreach_stmt(s);
+}
+
+void
+reduction_checker::visit_basic_expr (basic_expr *e)
+{
+  if (!e->sigil && e->tok->type == tok_ident)
+    {
+      ebt_global *g = module->find_global(e->tok->content);
+      if (g) disqualified.insert(g);
+    }
+  traversing_visitor::visit_basic_expr(e);
+}
+
+/* finds the arrays which code only updates by additive reductions of
+   the element for a static context value ('g[$name]++'), in statements
+   which the handler always reaches; any other use of an array
+   disqualifies it ($tid is not known at instrumentation time) */
+class slot_checker : public traversing_visitor {
+  ebt_module *module;
+
+public:
+  bool allow_slots; // -- false unless the statement is always reached
+  set<ebt_global *> slotted, disqualified;
+  vector<basic_expr *> targets; // -- of the updates through slots
+
+  slot_checker(ebt_module *module)
+    : module(module), allow_slots(false) {}
+
+  void visit_expr_stmt (expr_stmt *s);
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_basic_expr (basic_expr *e);
+};
+
+void
+slot_checker::visit_expr_stmt (expr_stmt *s)
+{
+  basic_expr *target = additive_target(s->e);
+  ebt_global *g = target ? module->find_global(target->tok->content) : NULL;
+  basic_expr *key = target && !target->chain.empty()
+    ? dynamic_cast<basic_expr *>(target->chain[0].second) : NULL;
+  if (!g || !allow_slots || !key || !key->sigil
+      || key->sigil->content != "$" || key->tok->content == "tid")
+    {
+      traversing_visitor::visit_expr_stmt(s);
+      return;
+    }
+
+  slotted.insert(g);
+  targets.push_back(target);
+  binary_expr *be = dynamic_cast<binary_expr *>(s->e);
+  if (be)
+    be->right->visit(this);
+}
+
+void
+slot_checker::visit_foreach_stmt (foreach_stmt *s)
+{
+  ebt_global *g = module->find_global(s->identifier);
+  if (g) disqualified.insert(g);
+  traversing_visitor::visit_foreach_stmt(s);
+}
+
+void
+slot_checker::visit_basic_expr (basic_expr *e)
+{
+  if (!e->sigil && e->tok->type == tok_ident)
+    {
+      ebt_global *g = module->find_global(e->tok->content);
+      if (g) disqualified.insert(g);
+    }
+  traversing_visitor::visit_basic_expr(e);
+}
+
 // --------------------------------------
 // --- methods for dr_client_template ---
 // --------------------------------------
 
-dr_client_template::dr_client_template(ebt_module *_module)
-  : client_template(_module)
+static bool
+compare_global_ids(ebt_global *a, ebt_global *b)
+{
+  return a->id < b->id;
+}
+
+static bool
+compare_function_ids(ebt_function *a, ebt_function *b)
+{
+  return a->id < b->id;
+}
+
+dr_client_template::dr_client_template(ebt_module *_module)
+  : client_template(_module), unparser(_module)
+{
+  // XXX Some options are easiest to hardcode in at the moment:
+  wants_opcode = true;         // -- XXX hardcoded in every script
+  wants_symbols = false;       // -- computed at the start of emit()
+  wants_map = false;           // -- computed at the start of emit()
+  wants_dense = false;         // -- computed at the start of emit()
+  wants_sequence = false;      // -- computed at the start of emit()
+  wants_inline = false;        // -- computed at the start of emit()
+  wants_batch = false;         // -- computed at the start of emit()
+  wants_thread_arena = false;  // -- computed at the start of emit()
+  wants_intern = false;        // -- computed at the start of emit()
+  wants_thread_data = false;   // -- computed at the start of emit()
+  wants_thread_events = false; // -- computed at the start of emit()
+  wants_forward = true;        // -- exit_event is always emitted
+  wants_bb_callback = false;   // -- computed at the start of emit()
+
+  // Globals are initialized (and functions emitted) in declaration order:
+  sort(globals.begin(), globals.end(), compare_global_ids);
+  sort(functions.begin(), functions.end(), compare_function_ids);
+
+  batch_handlers = false;
+}
+
+// Determine if initialization boilerplate corresponding to a given
+// probe mechanism should be generated:
+bool
+dr_client_template::wants_mechanism(basic_probe_type bt)
+{
+  // XXX Since implementations of mechanisms may depend on each other
+  // (e.g. EV_FCALL is based on EV_INSN) this may require more complex testing.
+  return basic_probes[bt].size() != 0;
+}
+
+// A condition of an EV_INSN probe is checked at instrumentation time if it
+// only depends on static ('$') context values, other than $tid (a basic
+// block is instrumented once for all threads):
+class static_checker : public traversing_visitor {
+public:
+  bool is_static;
+  static_checker() : is_static(true) {}
+
+  void visit_basic_expr (basic_expr *e)
+  {
+    if (e->tok->type == tok_ident
+        && (!e->sigil || e->sigil->content.str() != "$"
+            || e->tok->content.str() == "tid"))
+      is_static = false;
+    traversing_visitor::visit_basic_expr(e);
+  }
+
+  void visit_unary_expr (unary_expr *e)
+  {
+    if (e->op >= op_preinc) is_static = false; // -- modifies a variable
+    traversing_visitor::visit_unary_expr(e);
+  }
+
+  void visit_binary_expr (binary_expr *e)
+  {
+    if (e->op >= op_assign && e->op <= op_bor_assign) is_static = false;
+    traversing_visitor::visit_binary_expr(e);
+  }
+
+  void visit_call_expr (call_expr *) { is_static = false; }
+};
+
+bool
+dr_client_template::is_static(basic_probe *bp, expr *e)
+{
+  // TODOXXX $name of EV_FEXIT could also be computed statically
+  if (bp->mechanism != EV_INSN) return false;
+
+  static_checker v;
+  e->visit(&v);
+  return v.is_static;
+}
+
+// Sort the context values of a probe into those passed from instrumentation
+// time and those computed by the handler itself:
+void
+dr_client_template::collect_context(basic_probe *bp)
+{
+  context_map used;
+  for (unsigned i = 0; i < bp->conditions.size(); i++)
+    if (!is_static(bp, bp->conditions[i]->e))
+      c_unparser::collect_context(bp->conditions[i]->e, used);
+  // -- the key of a slot is only needed to resolve it in bb_event
+  if (bp->is_final())
+    c_unparser::collect_context(bp->body->action, used,
+                                slot_keys.count(bp) ? &slot_keys[bp] : NULL);
+
+  for (context_map::iterator it = used.begin(); it != used.end(); it++)
+    {
+      if (it->second->tok->content.str() == "name")
+        wants_symbols = true;
+
+      if (bp->mechanism == EV_INSN && it->second->tok->content.str() == "tid")
+        thread_context[bp][it->first] = it->second;
+      else if (bp->mechanism == EV_INSN
+               && it->second->sigil->content.str() == "$")
+        static_context[bp][it->first] = it->second;
+      else
+        dynamic_context[bp][it->first] = it->second;
+    }
+
+  // Static conditions use context values in the bb callback:
+  for (unsigned i = 0; i < bp->conditions.size(); i++)
+    if (is_static(bp, bp->conditions[i]->e))
+      {
+        context_map cond_ctx;
+        c_unparser::collect_context(bp->conditions[i]->e, cond_ctx);
+        if (cond_ctx.count("ctx_name")) wants_symbols = true;
+      }
+}
+
+// A dynamic condition of an EV_INSN probe is also checked before the
+// clean call if it only does integer arithmetic and comparisons on '@op'
+// values and literals which fit in 32 bits. The operand values are loaded
+// into the first registers; the others hold intermediate results.
+static const unsigned max_inline_regs = 4; // -- EBT_INLINE_REGS
+
+class condition_lowering {
+  c_unparser &unparser;
+  map<string, unsigned> loaded; // -- register of each operand value
+
+public:
+  vector<basic_expr *> loads;
+  vector<string> code;
+  unsigned num_regs;
+
+  condition_lowering(c_unparser &unparser)
+    : unparser(unparser), num_regs(0) {}
+
+  static bool literal(expr *e, long long &value);
+  static bool is_lowerable_value(expr *e);
+  static bool is_lowerable_test(expr *e, bool sense = true);
+
+  void load(expr *e);
+  void emit_value(expr *e, unsigned r);
+  unsigned emit_operand(expr *e, unsigned r);
+  void emit_test(expr *e, unsigned r, bool sense = true);
+
+private:
+  void add(const string &call) { code.push_back(call); }
+  void use(unsigned r) { num_regs = max(num_regs, r + 1); }
+};
+
+bool
+condition_lowering::literal(expr *e, long long &value)
+{
+  basic_expr *be = dynamic_cast<basic_expr *>(e);
+  if (!be || be->sigil || be->tok->type != tok_num)
+    return false;
+
+  string s = be->tok->content;
+  char *end;
+  value = strtoll(s.c_str(), &end, 0);
+  return *end == '\0' && value >= INT_MIN && value <= INT_MAX;
+}
+
+bool
+condition_lowering::is_lowerable_value(expr *e)
+{
+  long long value;
+  if (e->type != t_int)
+    return false;
+
+  if (basic_expr *be = dynamic_cast<basic_expr *>(e))
+    return literal(be, value)
+      || (be->sigil && be->sigil->content.str() == "@"
+          && be->tok->content.str() == "op");
+  if (unary_expr *ue = dynamic_cast<unary_expr *>(e))
+    return (ue->op == op_plus || ue->op == op_neg || ue->op == op_bnot)
+      && is_lowerable_value(ue->operand);
+
+  binary_expr *be = dynamic_cast<binary_expr *>(e);
+  if (!be)
+    return false;
+  switch (be->op) {
+  case op_add: case op_sub: case op_mul:
+  case op_band: case op_bxor: case op_bor:
+    return is_lowerable_value(be->left) && is_lowerable_value(be->right);
+  case op_shl: case op_shr: // -- only by a constant amount
+    return is_lowerable_value(be->left) && literal(be->right, value)
+      && value >= 0 && value < 64;
+  default:
+    return false;
+  }
+}
+
+// With sense, the clean call is skipped unless e holds; otherwise, it is
+// skipped if e holds:
+bool
+condition_lowering::is_lowerable_test(expr *e, bool sense)
+{
+  unary_expr *ue = dynamic_cast<unary_expr *>(e);
+  binary_expr *be = dynamic_cast<binary_expr *>(e);
+  if (ue && ue->op == op_lnot)
+    return is_lowerable_test(ue->operand, !sense);
+  if (be && be->op == op_land) // XXX 'not (a and b)' needs another label
+    return sense && is_lowerable_test(be->left)
+      && is_lowerable_test(be->right);
+  if (be && be->op >= op_lt && be->op <= op_ne)
+    return is_lowerable_value(be->left) && is_lowerable_value(be->right);
+  return is_lowerable_value(e);
+}
+
+// Assigns a register to each operand value which e uses:
+void
+condition_lowering::load(expr *e)
+{
+  context_map used;
+  c_unparser::collect_context(e, used);
+  for (context_map::iterator it = used.begin(); it != used.end(); it++)
+    if (!loaded.count(it->first))
+      {
+        loaded[it->first] = loads.size();
+        use(loads.size());
+        loads.push_back(it->second);
+      }
+}
+
+// Computes the value of e into register r, using the registers above r
+// for intermediate results:
+void
+condition_lowering::emit_value(expr *e, unsigned r)
+{
+  long long value;
+  use(r);
+  if (literal(e, value))
+    {
+      add("ebt_inline_mov_imm(&il, " + tostring(r) + ", " + tostring(value) + ");");
+      return;
+    }
+  if (basic_expr *be = dynamic_cast<basic_expr *>(e))
+    {
+      add("ebt_inline_mov(&il, " + tostring(r) + ", "
+          + tostring(loaded[unparser.context(be)]) + ");");
+      return;
+    }
+  if (unary_expr *ue = dynamic_cast<unary_expr *>(e))
+    {
+      emit_value(ue->operand, r);
+      if (ue->op != op_plus)
+        add(string("ebt_inline_unary(&il, ")
+            + (ue->op == op_neg ? "OP_neg" : "OP_not") + ", "
+            + tostring(r) + ");");
+      return;
+    }
+
+  binary_expr *be = dynamic_cast<binary_expr *>(e);
+  string opcode;
+  switch (be->op) {
+  case op_add: opcode = "OP_add"; break;
+  case op_sub: opcode = "OP_sub"; break;
+  case op_mul: opcode = "OP_imul"; break;
+  case op_band: opcode = "OP_and"; break;
+  case op_bxor: opcode = "OP_xor"; break;
+  case op_bor: opcode = "OP_or"; break;
+  case op_shl: opcode = "OP_shl"; break;
+  case op_shr: opcode = "OP_sar"; break; // -- int64 shifts are signed
+  default: opcode = "(BUG: unexpected operator)";
+  }
+
+  emit_value(be->left, r);
+  if (be->op != op_mul && literal(be->right, value))
+    // -- XXX there is no two-operand form of imul with an immediate
+    add("ebt_inline_op_imm(&il, " + opcode + ", " + tostring(r) + ", "
+        + tostring(value) + ");");
+  else
+    add("ebt_inline_op(&il, " + opcode + ", " + tostring(r) + ", "
+        + tostring(emit_operand(be->right, r + 1)) + ");");
+}
+
+// Returns a register holding the value of e, computing it into r unless
+// it is an operand value which is already loaded:
+unsigned
+condition_lowering::emit_operand(expr *e, unsigned r)
 {
-  // XXX Some options are easiest to hardcode in at the moment:
-  wants_opcode = true;         // -- XXX hardcoded in every script
-  wants_forward = false;       // -- computed at the start of emit()
-  wants_bb_callback = false;   // -- computed at the start of emit()
-  wants_exit_callback = false; // -- computed at the start of emit()
+  basic_expr *be = dynamic_cast<basic_expr *>(e);
+  if (be && be->sigil)
+    return loaded[unparser.context(be)];
+  emit_value(e, r);
+  return r;
 }
 
-// TODOXXX override register_basic_probe to collect wants_drsyms or similar
+void
+condition_lowering::emit_test(expr *e, unsigned r, bool sense)
+{
+  unary_expr *ue = dynamic_cast<unary_expr *>(e);
+  binary_expr *be = dynamic_cast<binary_expr *>(e);
+  if (ue && ue->op == op_lnot)
+    {
+      emit_test(ue->operand, r, !sense);
+      return;
+    }
+  if (be && be->op == op_land)
+    {
+      emit_test(be->left, r, sense);
+      emit_test(be->right, r, sense);
+      return;
+    }
+  if (!be || be->op < op_lt || be->op > op_ne)
+    {
+      unsigned a = emit_operand(e, r);
+      add("ebt_inline_test(&il, " + tostring(a) + ");");
+      add(string("ebt_inline_skip(&il, ") + (sense ? "OP_jz" : "OP_jnz") + ");");
+      return;
+    }
+
+  // -- a literal goes on the right, as the immediate operand of cmp
+  expr *left = be->left, *right = be->right;
+  expr_op op = be->op;
+  long long value;
+  if (literal(left, value) && !literal(right, value))
+    {
+      swap(left, right);
+      switch (op) {
+      case op_lt: op = op_gt; break;
+      case op_le: op = op_ge; break;
+      case op_gt: op = op_lt; break;
+      case op_ge: op = op_le; break;
+      default: break;
+      }
+    }
 
-// Determine if initialization boilerplate corresponding to a given
-// probe mechanism should be generated:
-bool
-dr_client_template::wants_mechanism(basic_probe_type bt)
+  unsigned a = emit_operand(left, r);
+  if (literal(right, value))
+    add("ebt_inline_cmp_imm(&il, " + tostring(a) + ", " + tostring(value) + ");");
+  else
+    add("ebt_inline_cmp(&il, " + tostring(a) + ", "
+        + tostring(emit_operand(right, r + 1)) + ");");
+
+  // -- the jump skips the clean call, i.e. is taken if the test fails
+  const char *holds, *fails;
+  switch (op) {
+  case op_lt: holds = "OP_jl"; fails = "OP_jnl"; break;
+  case op_le: holds = "OP_jle"; fails = "OP_jnle"; break;
+  case op_gt: holds = "OP_jnle"; fails = "OP_jle"; break;
+  case op_ge: holds = "OP_jnl"; fails = "OP_jl"; break;
+  case op_eq: holds = "OP_jz"; fails = "OP_jnz"; break;
+  default: holds = "OP_jnz"; fails = "OP_jz"; break; // -- op_ne
+  }
+  add(string("ebt_inline_skip(&il, ") + (sense ? fails : holds) + ");");
+}
+
+void
+dr_client_template::lower_conditions(basic_probe *bp)
 {
-  // XXX Since implementations of mechanisms may depend on each other
-  // (e.g. EV_FCALL is based on EV_INSN) this may require more complex testing.
-  return basic_probes[bt].size() != 0;
+  if (bp->mechanism != EV_INSN) return;
+  // -- a batched handler is not called from the instrumented code
+  if (batch_handlers && bp->num_stages == 1) return;
+  // -- the sequence check holds the flags (see runtime/sequence.h)
+  if (bp->num_stages > 1) return;
+
+  vector<expr *> lowered;
+  for (unsigned i = 0; i < bp->conditions.size(); i++)
+    {
+      expr *e = bp->conditions[i]->e;
+      if (!is_static(bp, e) && condition_lowering::is_lowerable_test(e))
+        lowered.push_back(e);
+    }
+  if (lowered.empty()) return;
+
+  condition_lowering l(unparser);
+  for (unsigned i = 0; i < lowered.size(); i++)
+    l.load(lowered[i]);
+  for (unsigned i = 0; i < lowered.size(); i++)
+    l.emit_test(lowered[i], l.loads.size());
+
+  // XXX conditions needing more registers are left to the handler
+  if (l.num_regs > max_inline_regs) return;
+
+  inline_check &check = inline_checks[bp];
+  check.loads = l.loads;
+  check.code = l.code;
+  check.num_regs = l.num_regs;
+  wants_inline = true;
+}
+
+// A shared array of integers which hot handlers only update through the
+// element for a static context value of an EV_INSN probe ('g[$name]++')
+// has the element resolved in bb_event, which passes its address to the
+// handler along with the static context values (see runtime/map.h). The
+// handler updates the element atomically, without hashing the key or
+// holding a mutex. Since an element is added to the array when it is
+// resolved, only updates which the handler always reaches get a slot:
+// those at the start of the body of a probe with no dynamic conditions.
+// XXX An element is still added for an instruction which is instrumented
+// but never runs (e.g. after a faulting instruction in the same block).
+void
+dr_client_template::find_slots()
+{
+  slot_checker hot(module), cold(module);
+  map<basic_probe *, vector<basic_expr *> > targets;
+  for (probe_map::iterator it = basic_probes.begin();
+       it != basic_probes.end(); it++)
+    {
+      if (it->first == EV_BEGIN || it->first == EV_END) continue;
+      for (unsigned i = 0; i < it->second.size(); i++)
+        {
+          basic_probe *bp = it->second[i];
+          bool unconditional = bp->mechanism == EV_INSN
+            && bp->num_stages == 1;
+          for (unsigned j = 0; j < bp->conditions.size(); j++)
+            {
+              if (!is_static(bp, bp->conditions[j]->e))
+                unconditional = false;
+              bp->conditions[j]->e->visit(&hot);
+            }
+
+          // -- a statement after anything but an expression may be skipped
+          compound_stmt *cs = dynamic_cast<compound_stmt *>(bp->body->action);
+          if (!cs)
+            {
+              hot.allow_slots = unconditional;
+              bp->body->action->visit(&hot);
+            }
+          else
+            for (unsigned j = 0; j < cs->stmts.size(); j++)
+              {
+                if (!dynamic_cast<expr_stmt *>(cs->stmts[j]))
+                  unconditional = false;
+                hot.allow_slots = unconditional;
+                cs->stmts[j]->visit(&hot);
+              }
+          hot.allow_slots = false;
+          targets[bp].swap(hot.targets);
+        }
+    }
+  for (unsigned i = 0; i < functions.size(); i++)
+    functions[i]->body->visit(&cold);
+  for (unsigned i = 0; i < globals.size(); i++)
+    if (globals[i]->initializer)
+      globals[i]->initializer->visit(&cold);
+
+  for (unsigned i = 0; i < globals.size(); i++)
+    {
+      ebt_global *g = globals[i];
+      if (g->is_thread_local || g->array_type != d_array
+          || g->is_dense || g->value_type != t_int) continue;
+      if (hot.slotted.count(g) && !hot.disqualified.count(g)
+          && !cold.disqualified.count(g))
+        unparser.slotted.insert(g);
+    }
+
+  for (map<basic_probe *, vector<basic_expr *> >::iterator it =
+         targets.begin(); it != targets.end(); it++)
+    for (unsigned i = 0; i < it->second.size(); i++)
+      {
+        basic_expr *target = it->second[i];
+        ebt_global *g = module->find_global(target->tok->content);
+        if (!unparser.slotted.count(g)) continue;
+        basic_expr *key = (basic_expr *) target->chain[0].second;
+        string name = unparser.slot(g, key);
+        static_context[it->first][name] = key;
+        slot_globals[name] = g;
+        slot_keys[it->first].insert(key);
+        if (key->tok->content.str() == "name")
+          wants_symbols = true;
+      }
+}
+
+// A shared integer global (or array of integers) which the handlers of
+// hot probes only update by additive reductions is privatized: each
+// thread updates its own copy without holding the script mutex, and the
+// copies are added into the global when their thread exits and before
+// the end probes run (see emit_thread_merge()). Only begin and end probes
+// may otherwise use it. XXX Functions are not analyzed, so a global used
+// by any function is never privatized.
+void
+dr_client_template::find_privatized()
+{
+  reduction_checker hot(module), cold(module);
+  cold.allow_reductions = false;
+  for (probe_map::iterator it = basic_probes.begin();
+       it != basic_probes.end(); it++)
+    {
+      if (it->first == EV_BEGIN || it->first == EV_END) continue;
+      for (unsigned i = 0; i < it->second.size(); i++)
+        {
+          basic_probe *bp = it->second[i];
+          bp->body->action->visit(&hot);
+          for (unsigned j = 0; j < bp->conditions.size(); j++)
+            bp->conditions[j]->e->visit(&hot);
+        }
+    }
+  for (unsigned i = 0; i < functions.size(); i++)
+    functions[i]->body->visit(&cold);
+  for (unsigned i = 0; i < globals.size(); i++)
+    if (globals[i]->initializer)
+      globals[i]->initializer->visit(&cold);
+
+  for (unsigned i = 0; i < globals.size(); i++)
+    {
+      ebt_global *g = globals[i];
+      if (g->is_thread_local || g->value_type != t_int
+          || unparser.slotted.count(g)) continue;
+      if (hot.reduced.count(g) && !hot.disqualified.count(g)
+          && !cold.disqualified.count(g))
+        unparser.privatized.insert(g);
+    }
+}
+
+// Begin and end probes run while no application thread does, so they
+// take no locks, and a shared global which no hot handler writes needs
+// none either. An integer global (or dense array) which is only ever
+// written by additive updates, or by plain stores of values which read
+// no locked global, is updated atomically instead (see
+// c_unparser::emit_expr()). Any other global written by a hot handler
+// has its own mutex, which every hot handler using the global holds
+// while it runs; a handler takes its mutexes in the order of the
+// globals' ids.
+void
+dr_client_template::find_locks()
+{
+  global_use_collector hot(module, &unparser.privatized), all(module);
+  for (probe_map::iterator it = basic_probes.begin();
+       it != basic_probes.end(); it++)
+    for (unsigned i = 0; i < it->second.size(); i++)
+      {
+        basic_probe *bp = it->second[i];
+        global_use_collector &uses =
+          it->first == EV_BEGIN || it->first == EV_END ? all : hot;
+        bp->body->action->visit(&uses);
+        for (unsigned j = 0; j < bp->conditions.size(); j++)
+          bp->conditions[j]->e->visit(&uses);
+      }
+  for (unsigned i = 0; i < functions.size(); i++)
+    functions[i]->body->visit(&all);
+  for (unsigned i = 0; i < globals.size(); i++)
+    if (globals[i]->initializer)
+      globals[i]->initializer->visit(&all);
+
+  for (unsigned i = 0; i < globals.size(); i++)
+    {
+      ebt_global *g = globals[i];
+      // -- handlers only update an array with slots through its slots
+      if (!hot.writes.count(g) || unparser.slotted.count(g)) continue;
+      if ((g->array_type == d_scalar || g->is_dense) && g->value_type == t_int
+          && !hot.other_writes.count(g) && !all.other_writes.count(g))
+        unparser.atomic.insert(g);
+      else
+        locked_globals.insert(g);
+    }
+  // -- a store which reads a locked global is made under its mutex
+  for (bool changed = true; changed; )
+    {
+      changed = false;
+      for (unsigned i = 0; i < globals.size(); i++)
+        {
+          ebt_global *g = globals[i];
+          if (!unparser.atomic.count(g)) continue;
+          set<ebt_global *> read = hot.store_reads[g];
+          read.insert(all.store_reads[g].begin(), all.store_reads[g].end());
+          for (set<ebt_global *>::iterator it = read.begin();
+               it != read.end(); it++)
+            if (locked_globals.count(*it))
+              {
+                unparser.atomic.erase(g);
+                locked_globals.insert(g);
+                changed = true;
+                break;
+              }
+        }
+    }
+}
+
+// --- naming conventions ---
+
+string
+dr_client_template::handlerfn(basic_probe *bp) const
+{
+  string mechanism;
+  switch (bp->mechanism) {
+  case EV_BEGIN: mechanism = "begin"; break;
+  case EV_END: mechanism = "end"; break;
+  case EV_TBEGIN: mechanism = "tbegin"; break;
+  case EV_TEND: mechanism = "tend"; break;
+  case EV_INSN: mechanism = "insn"; break;
+  case EV_FENTRY: mechanism = "fentry"; break;
+  case EV_FEXIT: mechanism = "fexit"; break;
+  default: mechanism = "unknown";
+  }
+  // -- a probe has at most one basic probe per mechanism (and stage)
+  string stage = bp->num_stages > 1 ? "s" + tostring(bp->stage) + "_" : "";
+  return "ebt_handler_" + tostring(bp->body->id) + "_" + stage + mechanism;
+}
+
+string
+dr_client_template::global_mutex(ebt_global *g) const
+{
+  return "global_mutex_" + tostring(g->id);
+}
+
+string
+dr_client_template::chain_label(basic_probe *bp) const
+{
+  return "chain_label_" + handlerfn(bp).substr(strlen("ebt_handler_"));
+}
+
+// -- the bits of probe_mask must fit in a ptr_uint_t
+static const unsigned max_fused = 32;
+
+string
+dr_client_template::fused_bit(basic_probe *bp)
+{
+  ostringstream bit;
+  bit << "0x" << hex << (1UL << fused_index[bp]);
+  return bit.str();
+}
+
+string
+dr_client_template::sequence_state(basic_probe *bp)
+{
+  return "*ebt_seq_state(" + tostring(sequence_slots[bp->body->id]) + ")";
+}
+
+#ifdef PROBE_COUNTERS
+string
+dr_client_template::probecounter(handler *h) const
+{
+  return "probecounter_" + tostring(h->id);
 }
+#endif
+
+// --- client template ---
 
 void
 dr_client_template::emit(translator_output& o)
 {
   // Determine which elements of the client template should be used:
-  wants_forward = functions.size() > 0 || basic_probes.size() > 0
-    || wants_mechanism(EV_INSN) || wants_mechanism(EV_END);
-  wants_bb_callback = wants_mechanism(EV_INSN);
-  wants_exit_callback = wants_mechanism(EV_END);
+  find_slots();
+  for (probe_map::iterator it = basic_probes.begin();
+       it != basic_probes.end(); it++)
+    for (unsigned i = 0; i < it->second.size(); i++)
+      {
+        basic_probe *bp = it->second[i];
+        collect_context(bp);
+        lower_conditions(bp);
+        if (bp->num_stages > 1 && !sequence_slots.count(bp->body->id))
+          {
+            unsigned slot = sequence_slots.size();
+            sequence_slots[bp->body->id] = slot;
+          }
+      }
+  wants_sequence = !sequence_slots.empty();
+
+  // The EV_INSN probes which are not part of a sequence are fused:
+  const vector<basic_probe *> &insn_probes = basic_probes[EV_INSN];
+  for (unsigned i = 0; i < insn_probes.size(); i++)
+    if (insn_probes[i]->num_stages == 1 && fused_probes.size() < max_fused)
+      fused_probes.push_back(insn_probes[i]);
+  // -- when batching, a single probe is fused as well
+  if (fused_probes.size() < 2 && !batch_handlers)
+    fused_probes.clear();
+  for (unsigned i = 0; i < fused_probes.size(); i++)
+    fused_index[fused_probes[i]] = i;
+  wants_batch = batch_handlers && !fused_probes.empty();
+  find_privatized();
+  find_locks();
+  wants_thread_data = !unparser.privatized.empty();
+  for (unsigned i = 0; i < globals.size(); i++)
+    {
+      if (globals[i]->is_dense)
+        wants_dense = true;
+      else if (globals[i]->array_type == d_array)
+        wants_map = true;
+      if (globals[i]->array_type == d_array && globals[i]->key_type == t_str)
+        wants_intern = true;
+      if (globals[i]->is_thread_local)
+        wants_thread_data = true;
+    }
+  // -- function names are interned as well
+  wants_intern = wants_intern || wants_symbols;
+  wants_bb_callback = wants_mechanism(EV_INSN)
+    || wants_mechanism(EV_FENTRY) || wants_mechanism(EV_FEXIT);
+  // -- handlers which run in application threads allocate from an arena
+  // of their thread (see runtime/alloc.h)
+  wants_thread_arena = wants_map && (wants_bb_callback
+                                     || wants_mechanism(EV_TBEGIN)
+                                     || wants_mechanism(EV_TEND));
+  wants_thread_events = wants_thread_data || wants_batch || wants_thread_arena
+    || wants_mechanism(EV_TBEGIN) || wants_mechanism(EV_TEND);
+  // -- every instrumentation goes through drmgr and drreg, which also
+  // provide the thread events
+  if (wants_bb_callback || wants_thread_events)
+    wants_inline = true;
 
-  // Emit library includes:
+  // Emit the definitions given on the command line (e.g. MAXMAPENTRIES
+  // for runtime/map.h), then library includes:
+  for (unsigned i = 0; i < defines.size(); i++)
+    {
+      size_t eq = defines[i].find('=');
+      o.newline() << "#define " << defines[i].substr(0, eq) << " "
+                  << (eq == string::npos ? "1" : defines[i].substr(eq + 1));
+    }
   o.newline() << "#include \"dr_api.h\"";
   if (wants_opcode)
     o.newline() << "#include \"runtime/opcode.h\"";
+  o.newline() << "#include \"runtime/value.h\"";
+  // -- thread_data_alloc() takes the arena of its thread
+  if (wants_map || wants_intern || wants_thread_data)
+    o.newline() << "#include \"runtime/alloc.h\"";
+  if (wants_intern)
+    o.newline() << "#include \"runtime/intern.h\"";
+  if (wants_map)
+    o.newline() << "#include \"runtime/map.h\"";
+  if (wants_dense)
+    o.newline() << "#include \"runtime/dense.h\"";
+  if (wants_symbols)
+    o.newline() << "#include \"runtime/symbols.h\"";
+  if (wants_inline)
+    o.newline() << "#include \"runtime/inline.h\"";
+  if (wants_sequence)
+    o.newline() << "#include \"runtime/sequence.h\"";
+  if (wants_batch)
+    o.newline() << "#include \"runtime/batch.h\"";
   o.newline();
 
   // Emit forward declarations:
@@ -136,6 +1968,7 @@ dr_client_template::emit(translator_output& o)
   // Emit global value and function declarations:
   emit_globals(o);
   emit_functions(o);
+  emit_thread_callbacks(o);
 
   // Emit initialization and invocations of EV_BEGIN handlers:
   o.newline() << "DR_EXPORT void";
@@ -144,18 +1977,44 @@ dr_client_template::emit(translator_output& o)
 
   o.indent(1);
 
-  // TODOXXX may also want to initialize drsyms and similar
-  // TODOXXX may also want to initialize probe context structs?
+  o.newline() << "script_mutex = dr_mutex_create();";
+  if (wants_inline)
+    o.newline() << "ebt_inline_init();";
+  if (wants_intern)
+    o.newline() << "ebt_intern_init();";
+  if (wants_symbols)
+    o.newline() << "ebt_symbols_init();";
+  if (wants_sequence)
+    o.newline() << "ebt_seq_init(" << sequence_slots.size() << ");";
+  if (wants_batch)
+    o.newline() << "ebt_batch_init();";
+  if (wants_thread_arena)
+    o.newline() << "ebt_alloc_init();";
+  if (wants_thread_data)
+    {
+      o.newline() << "thread_data_idx = drmgr_register_tls_field();";
+      o.newline() << "thread_data_default = thread_data_alloc(NULL);";
+    }
 
   /* Register callbacks: */
+  if (wants_thread_events)
+    {
+      o.newline() << "drmgr_register_thread_init_event(thread_init_event);";
+      o.newline() << "drmgr_register_thread_exit_event(thread_exit_event);";
+    }
   if (wants_bb_callback)
-    o.newline() << "dr_register_bb_event(bb_event);";
-  if (wants_exit_callback)
-    o.newline() << "dr_register_exit_event(exit_event);";
+    o.newline() << "drmgr_register_bb_instrumentation_event("
+                << (wants_batch ? "bb_analysis" : "NULL") << ", bb_event, NULL);";
+  o.newline() << "dr_register_exit_event(exit_event);";
 
-  /* Initialize globals: */
+  /* Initialize globals (thread-local ones in thread_data_alloc()): */
   for (unsigned i = 0; i < globals.size(); i++)
-    emit_global_initialization(o, globals[i]);
+    {
+      if (globals[i]->is_thread_local) continue;
+      if (locked_globals.count(globals[i]))
+        o.newline() << global_mutex(globals[i]) << " = dr_mutex_create();";
+      emit_global_initialization(o, globals[i]);
+    }
 
   /* Fire EV_BEGIN probes: */
   emit_event_invocations(o, EV_BEGIN);
@@ -176,29 +2035,560 @@ dr_client_template::emit(translator_output& o)
 void
 dr_client_template::emit_globals (translator_output& o)
 {
-  // TODOXXX
+  o.newline() << "// globals";
+  // The script mutex guards the list of live thread data and the default
+  // data, while handlers hold the mutexes of the globals they use (see
+  // find_locks()):
+  o.newline() << "static void *script_mutex;";
+  for (unsigned i = 0; i < globals.size(); i++)
+    {
+      ebt_global *g = globals[i];
+      if (g->is_thread_local) continue;
+      o.newline() << "static ";
+      if (g->array_type == d_array)
+        o.line() << c_unparser::array_prefix(g) + " " << unparser.global(g);
+      else
+        o.line() << c_unparser::c_type(g->value_type) << unparser.global(g)
+                 << " = " << c_unparser::default_value(g->value_type);
+      o.line() << "; /* " << g->name << " */";
+      if (locked_globals.count(g))
+        o.newline() << "static void *" << global_mutex(g) << ";";
+    }
+#ifdef PROBE_COUNTERS
+  set<unsigned> seen;
+  for (probe_map::iterator it = basic_probes.begin();
+       it != basic_probes.end(); it++)
+    for (unsigned i = 0; i < it->second.size(); i++)
+      {
+        handler *h = it->second[i]->body;
+        if (seen.count(h->id)) continue;
+        seen.insert(h->id);
+        o.newline() << "static unsigned long " << probecounter(h) << ";";
+      }
+#endif
+  o.newline();
+
+  if (wants_thread_data)
+    emit_thread_globals(o);
+}
+
+void
+dr_client_template::emit_functions (translator_output& o, bool forward)
+{
+  for (unsigned i = 0; i < functions.size(); i++)
+    {
+      ebt_function *fn = functions[i];
+
+      if (!forward)
+        o.newline() << "/* func " << fn->name << " */";
+      string type = c_unparser::c_type(fn->return_type);
+      if (!forward) // -- the return type goes on its own line
+        type = type.substr(0, type.find_last_not_of(' ') + 1) + "\n";
+      o.newline() << "static " << type << unparser.function(fn) << "(";
+      for (unsigned j = 0; j < fn->argument_names.size(); j++)
+        o.line() << (j > 0 ? ", " : "")
+                 << c_unparser::c_type(fn->argument_types[j])
+                 << unparser.local(fn->argument_names[j]);
+      if (fn->argument_names.empty())
+        o.line() << "void";
+      o.line() << ")";
+      if (forward)
+        {
+          o.line() << ";";
+          continue;
+        }
+
+      o.newline() << "{";
+      o.indent(1);
+      unparser.in_handler = false;
+      unparser.return_type = fn->return_type;
+      global_use_collector uses(module);
+      fn->body->visit(&uses);
+      if (uses.uses_thread)
+        o.newline() << "ebt_thread_data *thread_data = thread_data_get();";
+      unparser.emit_locals(o, fn->locals);
+      unparser.emit_stmt(o, fn->body);
+      o.newline() << "return " << c_unparser::default_value(fn->return_type)
+                  << ";";
+      o.newline(-1) << "}";
+      o.newline();
+    }
+}
+
+void
+dr_client_template::emit_probe_handlers (translator_output& o, bool forward)
+{
+  for (probe_map::iterator it = basic_probes.begin();
+       it != basic_probes.end(); it++)
+    for (unsigned i = 0; i < it->second.size(); i++)
+      emit_probe_handler(o, it->second[i], forward);
+  emit_dispatcher(o, forward);
+  if (!forward)
+    emit_batch_flush(o); // -- declared by runtime/batch.h
+}
+
+void
+dr_client_template::emit_basic_block_callback (translator_output& o, bool forward)
+{
+  if (!wants_bb_callback) return;
+
+  // The analysis phase of drmgr allocates the state of batching:
+  if (wants_batch)
+    {
+      o.newline() << "static dr_emit_flags_t";
+      o.line() << (forward ? " " : "\n") << "bb_analysis(void *drcontext, void *tag, instrlist_t *bb,";
+      o.line() << " bool for_trace, bool translating, void **user_data)";
+      if (forward)
+        o.line() << ";";
+      else
+        {
+          o.newline() << "{";
+          o.newline(1) << "*user_data = ebt_batch_block_begin(drcontext);";
+          o.newline() << "return DR_EMIT_DEFAULT;";
+          o.newline(-1) << "}";
+          o.newline();
+        }
+    }
+
+  // The insertion phase instruments a single instruction:
+  o.newline() << "static dr_emit_flags_t";
+  o.line() << (forward ? " " : "\n") << "bb_event(void *drcontext, void *tag, instrlist_t *bb,";
+  o.line() << " instr_t *instr, bool for_trace, bool translating, void *user_data)";
+  if (forward)
+    {
+      o.line() << ";";
+      return;
+    }
+
+  o.newline() << "{";
+  o.indent(1);
+
+  if (wants_sequence && wants_mechanism(EV_INSN))
+    o.newline() << "instr_t *seq_skip;";
+  if (!inline_checks.empty())
+    o.newline() << "ebt_inline il;";
+  if (!fused_probes.empty())
+    o.newline() << "ptr_uint_t probe_mask;";
+  if (wants_batch)
+    {
+      context_map passed, dynamic;
+      map<string, basic_probe *> owner;
+      collect_fused_context(passed, dynamic, owner);
+      o.newline() << "ebt_batch_block *batch = (ebt_batch_block *) user_data;";
+      o.newline() << "opnd_t batch_values["
+                  << 1 + passed.size() + dynamic.size() << "];";
+    }
+
+  // Declare the static context values which are used by any probe:
+  set<string> declared;
+  const vector<basic_probe *> &insn_probes = basic_probes[EV_INSN];
+  for (unsigned i = 0; i < insn_probes.size(); i++)
+    {
+      basic_probe *bp = insn_probes[i];
+      context_map used = static_context[bp];
+      for (unsigned j = 0; j < bp->conditions.size(); j++)
+        if (is_static(bp, bp->conditions[j]->e))
+          c_unparser::collect_context(bp->conditions[j]->e, used);
+      for (context_map::iterator it = used.begin(); it != used.end(); it++)
+        if (!declared.count(it->first))
+          {
+            declared.insert(it->first);
+            ebt_context *c = bp->find_context(it->second->tok->content);
+            o.newline() << (slot_globals.count(it->first) ? "int64 *"
+                            : c_unparser::c_type(c->value_type))
+                        << it->first << ";";
+          }
+    }
+  o.line() << "\n";
+
+  o.newline() << "if (!instr_is_app(instr) || !instr_opcode_valid(instr))";
+  o.newline(1) << "goto done;";
+  o.indent(-1);
+  // -- drreg may still hold registers used by instr (see runtime/inline.h)
+  o.newline() << "ebt_restore_operands(drcontext, bb, instr);";
+
+  emit_event_instrumentation (o, EV_INSN);
+  emit_event_instrumentation (o, EV_FENTRY);
+  emit_event_instrumentation (o, EV_FEXIT);
+
+  o.line() << "\n";
+  o.newline(-1) << "done:";
+  o.indent(1);
+  if (wants_batch)
+    {
+      o.newline() << "if (drmgr_is_last_instr(drcontext, instr))";
+      o.newline(1) << "ebt_batch_block_end(batch, drcontext, bb, instr);";
+      o.indent(-1);
+    }
+  o.newline() << "return DR_EMIT_DEFAULT;";
+
+  o.newline(-1) << "}";
+  o.newline();
+}
+
+void
+dr_client_template::emit_exit_callback (translator_output& o, bool forward)
+{
+  o.newline() << "static void";
+  o.line() << (forward ? " " : "\n") << "exit_event(void)";
+  if (forward)
+    {
+      o.line() << ";";
+      return;
+    }
+
+  o.newline() << "{";
+  o.indent(1);
+
+  /* Merge the private copies of threads which have not exited: */
+  if (!unparser.privatized.empty())
+    {
+      o.newline() << "ebt_thread_data *thread_data;";
+      o.newline() << "dr_mutex_lock(script_mutex);";
+      o.newline() << "for (thread_data = thread_data_live; thread_data != NULL;";
+      o.newline() << "     thread_data = thread_data->next)";
+      o.newline(1) << "thread_data_merge(thread_data);";
+      o.newline(-1) << "thread_data_merge(thread_data_default);";
+      o.newline() << "dr_mutex_unlock(script_mutex);";
+    }
+
+  /* Fire EV_END probes: */
+  emit_event_invocations(o, EV_END);
+
+  /* Report the elements which shared maps have dropped: */
+  for (unsigned i = 0; i < globals.size(); i++)
+    {
+      ebt_global *g = globals[i];
+      if (g->array_type == d_array && !g->is_dense && !g->is_thread_local)
+        o.newline() << c_unparser::array_prefix(g) << "_report(&"
+                    << unparser.global(g) << ", \""
+                    << c_stringify(g->name) << "\");";
+    }
+
+  /* Free the shared arrays, which nothing uses from here on: */
+  for (unsigned i = 0; i < globals.size(); i++)
+    {
+      ebt_global *g = globals[i];
+      if (g->array_type == d_array && !g->is_thread_local)
+        o.newline() << c_unparser::array_prefix(g) << "_destroy(&"
+                    << unparser.global(g) << ");";
+    }
+
+#ifdef PROBE_COUNTERS
+  /* Print a summary of probe counters: */
+  set<unsigned> seen;
+  for (probe_map::iterator it = basic_probes.begin();
+       it != basic_probes.end(); it++)
+    for (unsigned i = 0; i < it->second.size(); i++)
+      {
+        handler *h = it->second[i]->body;
+        if (seen.count(h->id)) continue;
+        seen.insert(h->id);
+        // -- the title is an argument, since it may contain '%'
+        o.newline() << "dr_fprintf(STDERR, \"%5lu :: %s\\n\", "
+                    << probecounter(h) << ", \""
+                    << c_stringify(h->title()) << "\");";
+      }
+#endif
+
+  if (wants_symbols)
+    o.newline() << "ebt_symbols_exit();";
+  if (wants_intern)
+    o.newline() << "ebt_intern_exit();";
+  if (wants_sequence)
+    o.newline() << "ebt_seq_exit(" << sequence_slots.size() << ");";
+  if (wants_batch)
+    o.newline() << "ebt_batch_exit();";
+  if (wants_thread_arena)
+    o.newline() << "ebt_alloc_exit();";
+  if (wants_thread_events)
+    {
+      o.newline() << "drmgr_unregister_thread_init_event(thread_init_event);";
+      o.newline() << "drmgr_unregister_thread_exit_event(thread_exit_event);";
+    }
+  if (wants_thread_data)
+    {
+      o.newline() << "thread_data_free(thread_data_default);";
+      o.newline() << "drmgr_unregister_tls_field(thread_data_idx);";
+    }
+  if (wants_batch)
+    o.newline() << "drmgr_unregister_bb_instrumentation_event(bb_analysis);";
+  else if (wants_bb_callback)
+    o.newline() << "drmgr_unregister_bb_insertion_event(bb_event);";
+  if (wants_inline)
+    o.newline() << "ebt_inline_exit();";
+  for (unsigned i = 0; i < globals.size(); i++)
+    if (locked_globals.count(globals[i]))
+      o.newline() << "dr_mutex_destroy(" << global_mutex(globals[i]) << ");";
+  o.newline() << "dr_mutex_destroy(script_mutex);";
+
+  o.newline(-1) << "}";
+  o.newline();
+}
+
+void
+dr_client_template::emit_thread_callbacks (translator_output& o)
+{
+  if (wants_thread_data)
+    {
+      o.newline() << "static ebt_thread_data *";
+      o.newline() << "thread_data_alloc(ebt_arena *arena)";
+      o.newline() << "{";
+      o.newline(1) << "ebt_thread_data *thread_data = (ebt_thread_data *)";
+      o.newline() << "  dr_global_alloc(sizeof(ebt_thread_data));";
+      for (unsigned i = 0; i < globals.size(); i++)
+        {
+          ebt_global *g = globals[i];
+          if (!g->is_thread_local) continue;
+          if (g->array_type == d_scalar && !g->initializer)
+            o.newline() << unparser.global(g) << " = "
+                        << c_unparser::default_value(g->value_type) << ";";
+          else
+            emit_global_initialization(o, g);
+        }
+      unparser.use_private = true;
+      for (unsigned i = 0; i < globals.size(); i++)
+        {
+          ebt_global *g = globals[i];
+          if (!unparser.privatized.count(g)) continue;
+          if (g->array_type == d_array)
+            emit_global_initialization(o, g);
+          else
+            o.newline() << unparser.global(g) << " = 0;";
+        }
+      unparser.use_private = false;
+      o.newline() << "return thread_data;";
+      o.newline(-1) << "}";
+      o.newline();
+
+      o.newline() << "static void";
+      o.newline() << "thread_data_free(ebt_thread_data *thread_data)";
+      o.newline() << "{";
+      o.indent(1);
+      for (unsigned i = 0; i < globals.size(); i++)
+        {
+          ebt_global *g = globals[i];
+          string prefix = c_unparser::array_prefix(g);
+          string destroy = prefix + "_destroy(&";
+          if (g->is_thread_local && g->array_type == d_array && !g->is_dense)
+            o.newline() << prefix << "_report(&" << unparser.global(g)
+                        << ", \"" << c_stringify(g->name) << "\");";
+          if (g->is_thread_local && g->array_type == d_array)
+            o.newline() << destroy << unparser.global(g) << ");";
+          else if (unparser.privatized.count(g) && g->array_type == d_array)
+            o.newline() << destroy << "thread_data->private_" << g->id
+                        << ");";
+        }
+      o.newline() << "dr_global_free(thread_data, sizeof(ebt_thread_data));";
+      o.newline(-1) << "}";
+      o.newline();
+
+      emit_thread_merge(o);
+    }
+
+  if (!wants_thread_events) return;
+
+  o.newline() << "static void";
+  o.newline() << "thread_init_event(void *drcontext)";
+  o.newline() << "{";
+  o.indent(1);
+  if (wants_thread_arena)
+    o.newline() << "ebt_alloc_thread_init(drcontext);";
+  if (wants_thread_data)
+    {
+      o.newline() << "ebt_thread_data *thread_data = thread_data_alloc("
+                  << (wants_thread_arena ? "ebt_thread_arena()" : "NULL") << ");";
+      o.newline() << "drmgr_set_tls_field(drcontext, thread_data_idx, "
+                  << "thread_data);";
+    }
+  if (!unparser.privatized.empty())
+    {
+      o.newline() << "dr_mutex_lock(script_mutex);";
+      o.newline() << "thread_data->next = thread_data_live;";
+      o.newline() << "thread_data_live = thread_data;";
+      o.newline() << "dr_mutex_unlock(script_mutex);";
+    }
+  if (wants_batch)
+    o.newline() << "ebt_batch_thread_init(drcontext);";
+  emit_event_invocations(o, EV_TBEGIN);
+  o.newline(-1) << "}";
+  o.newline();
+
+  o.newline() << "static void";
+  o.newline() << "thread_exit_event(void *drcontext)";
+  o.newline() << "{";
+  o.indent(1);
+  // -- the batched handlers of the thread run before thread.end, and
+  // both may still use (and update the private copies in) its data
+  if (wants_batch)
+    o.newline() << "ebt_batch_thread_exit(drcontext);";
+  emit_event_invocations(o, EV_TEND);
+  if (wants_thread_data)
+    {
+      o.newline() << "ebt_thread_data *thread_data = (ebt_thread_data *)";
+      o.newline() << "  drmgr_get_tls_field(drcontext, thread_data_idx);";
+      o.newline() << "dr_mutex_lock(script_mutex);";
+      if (!unparser.privatized.empty())
+        {
+          o.newline() << "ebt_thread_data **link = &thread_data_live;";
+          o.newline() << "while (*link != thread_data)";
+          o.newline(1) << "link = &(*link)->next;";
+          o.newline(-1) << "*link = thread_data->next;";
+          o.newline() << "thread_data_merge(thread_data);";
+          // -- in case a handler ran without thread data of its own
+          o.newline() << "thread_data_merge(thread_data_default);";
+        }
+      o.newline() << "drmgr_set_tls_field(drcontext, thread_data_idx, NULL);";
+      o.newline() << "dr_mutex_unlock(script_mutex);";
+      // -- its arrays are freed by the thread whose arena holds them
+      o.newline() << "thread_data_free(thread_data);";
+    }
+  if (wants_thread_arena)
+    o.newline() << "ebt_alloc_thread_exit(drcontext);";
+  o.newline(-1) << "}";
+  o.newline();
+}
+
+// --- helpers to emit specific boilerplate ---
+
+void
+dr_client_template::emit_global_initialization (translator_output& o, ebt_global *g)
+{
+  // -- the maps of a thread come from the arena of thread_data_alloc()
+  string arena = g->is_thread_local
+    || (unparser.use_private && unparser.privatized.count(g)) ? "arena" : "NULL";
+  if (g->is_dense)
+    o.newline() << "ebt_dense_init(&" << unparser.global(g) << ", "
+                << g->key_min << "LL, " << g->key_max << "LL);";
+  else if (g->array_type == d_array && g->capacity != 0)
+    o.newline() << c_unparser::array_prefix(g) << "_init_fixed(&"
+                << unparser.global(g) << ", " << g->capacity << ", "
+                << arena << ");";
+  // -- the elements of an array with slots must not move
+  else if (g->array_type == d_array && unparser.slotted.count(g))
+    o.newline() << c_unparser::array_prefix(g) << "_init_fixed(&"
+                << unparser.global(g) << ", MAXMAPENTRIES, " << arena << ");";
+  else if (g->array_type == d_array)
+    o.newline() << c_unparser::array_prefix(g) << "_init(&"
+                << unparser.global(g) << ", " << arena << ");";
+  else if (g->initializer)
+    {
+      o.newline() << unparser.global(g) << " = ";
+      unparser.emit_expr(o, g->initializer);
+      o.line() << ";";
+    }
 }
 
+// Thread-local globals are fields of a structure allocated for each
+// thread and kept in a drmgr TLS field; the arrays of a thread live in
+// its arena, and are freed when it exits. Code which runs outside of an
+// application thread (begin and end probes) gets default data in global
+// memory; such code never uses thread-local globals (see
+// thread_local_checker), only the private copies of privatized globals,
+// which are merged either way:
 void
-dr_client_template::emit_functions (translator_output& o, bool forward)
+dr_client_template::emit_thread_globals (translator_output& o)
 {
-  // TODOXXX
+  o.newline() << "// thread globals";
+  o.newline() << "typedef struct ebt_thread_data {";
+  o.indent(1);
+  for (unsigned i = 0; i < globals.size(); i++)
+    {
+      ebt_global *g = globals[i];
+      string field;
+      if (g->is_thread_local)
+        field = "global_";
+      else if (unparser.privatized.count(g))
+        field = "private_";
+      else
+        continue;
+      o.newline() << (g->array_type == d_array ? c_unparser::array_prefix(g) + " "
+                      : c_unparser::c_type(g->value_type))
+                  << field << g->id << "; /* " << g->name << " */";
+    }
+  if (!unparser.privatized.empty())
+    o.newline() << "struct ebt_thread_data *next; /* -- in thread_data_live */";
+  o.newline(-1) << "} ebt_thread_data;";
+  o.newline() << "static int thread_data_idx;";
+  o.newline() << "static ebt_thread_data *thread_data_default;";
+  if (!unparser.privatized.empty())
+    o.newline() << "static ebt_thread_data *thread_data_live;";
+  o.newline();
+
+  o.newline() << "static inline ebt_thread_data *";
+  o.newline() << "thread_data_get(void)";
+  o.newline() << "{";
+  o.newline(1) << "void *drcontext = dr_get_current_drcontext();";
+  o.newline() << "ebt_thread_data *thread_data = drcontext == NULL ? NULL";
+  o.newline() << "  : (ebt_thread_data *) drmgr_get_tls_field(drcontext, thread_data_idx);";
+  o.newline() << "return thread_data != NULL ? thread_data : thread_data_default;";
+  o.newline(-1) << "}";
+  o.newline();
 }
 
+// Adds the private copies of a thread into the shared globals and resets
+// them, with the script mutex held (see find_privatized()). The threads
+// which have not exited yet are kept in thread_data_live:
 void
-dr_client_template::emit_probe_handlers (translator_output& o, bool forward)
+dr_client_template::emit_thread_merge (translator_output& o)
 {
-  // TODOXXX
+  if (unparser.privatized.empty()) return;
+
+  o.newline() << "static void";
+  o.newline() << "thread_data_merge(ebt_thread_data *thread_data)";
+  o.newline() << "{";
+  o.indent(1);
+  for (unsigned i = 0; i < globals.size(); i++)
+    {
+      ebt_global *g = globals[i];
+      if (!unparser.privatized.count(g)) continue;
+      string copy = "thread_data->private_" + tostring(g->id);
+      if (g->array_type == d_array)
+        o.newline() << c_unparser::array_prefix(g) << "_merge(&"
+                    << unparser.global(g) << ", &" << copy << ");";
+      else
+        {
+          o.newline() << unparser.global(g) << " += " << copy << ";";
+          o.newline() << copy << " = 0;";
+        }
+    }
+  o.newline(-1) << "}";
+  o.newline();
 }
 
 void
-dr_client_template::emit_basic_block_callback (translator_output& o, bool forward)
+dr_client_template::emit_probe_handler (translator_output& o, basic_probe *bp,
+                                        bool forward)
 {
-  if (!wants_bb_callback) return;
+  context_map &passed = static_context[bp];
+  context_map &computed = dynamic_context[bp];
 
-  o.newline() << "static dr_emit_flags_t";
-  o.line() << " bb_event(void *drcontext, void *tag, instrlist_t *bb,";
-  o.line() << " bool for_trace, bool translating)";
+  if (!forward)
+    o.newline() << "/* " << c_comment(bp->body->title()) << " */";
+  o.newline() << "static void";
+  o.line() << (forward ? " " : "\n") << handlerfn(bp) << "(";
+  if (bp->mechanism == EV_FENTRY || bp->mechanism == EV_FEXIT)
+    // -- the signature expected by dr_insert_{call,mbr}_instrumentation()
+    o.line() << "app_pc instr_addr, app_pc target_addr";
+  else if (bp->mechanism == EV_INSN && !(passed.empty() && computed.empty()))
+    {
+      bool first = true;
+      for (context_map::iterator it = passed.begin(); it != passed.end(); it++)
+        {
+          o.line() << (first ? "" : ", ")
+                   << passed_type(bp, it->first, it->second) << it->first;
+          first = false;
+        }
+      for (context_map::iterator it = computed.begin(); it != computed.end(); it++)
+        {
+          o.line() << (first ? "" : ", ")
+                   << "reg_t arg_" << it->first.substr(strlen("ctx_"));
+          first = false;
+        }
+    }
+  else
+    o.line() << "void";
+  o.line() << ")";
   if (forward)
     {
       o.line() << ";";
@@ -208,92 +2598,552 @@ dr_client_template::emit_basic_block_callback (translator_output& o, bool forwar
   o.newline() << "{";
   o.indent(1);
 
-  o.newline() << "instr_t *instr, *next_instr;";
-  o.newline();
+  // The state of a sequence is checked inline for EV_INSN:
+  if (bp->num_stages > 1 && bp->mechanism != EV_INSN)
+    {
+      o.newline() << "if (" << sequence_state(bp) << " != "
+                  << bp->stage << ") return;";
+    }
+
+  // Compute the remaining context values (those passed from
+  // instrumentation time are already parameters):
+  for (context_map::iterator it = computed.begin(); it != computed.end(); it++)
+    {
+      ebt_context *c = bp->find_context(it->second->tok->content);
+      o.newline() << c_unparser::c_type(c->value_type) << it->first << " = ";
+      emit_context_value(o, bp, it->second, true);
+      o.line() << ";";
+    }
+  context_map &own = thread_context[bp];
+  for (context_map::iterator it = own.begin(); it != own.end(); it++)
+    {
+      o.newline() << "int64 " << it->first << " = ";
+      emit_context_value(o, bp, it->second, true);
+      o.line() << ";";
+    }
 
-  o.newline() << "for (instr = instrlist_first_app(bb); instr != NULL; instr = next_instr) {";
-  o.newline(1) << "next_instr = instr_get_next_app(instr);";
+  // A hot handler holds the mutexes of the locked globals it uses (an
+  // earlier stage of a sequence only touches thread-local state):
+  bool hot = bp->mechanism != EV_BEGIN && bp->mechanism != EV_END;
+  global_use_collector uses(module, hot ? &unparser.privatized : NULL);
+  if (bp->is_final())
+    bp->body->action->visit(&uses);
+  for (unsigned i = 0; i < bp->conditions.size(); i++)
+    if (!is_static(bp, bp->conditions[i]->e))
+      bp->conditions[i]->e->visit(&uses);
+  vector<ebt_global *> locks; // -- in the order of their ids
+  for (unsigned i = 0; i < globals.size(); i++)
+    if (hot && locked_globals.count(globals[i])
+        && (uses.reads.count(globals[i]) || uses.writes.count(globals[i])))
+      locks.push_back(globals[i]);
+  if (uses.uses_thread)
+    o.newline() << "ebt_thread_data *thread_data = thread_data_get();";
+  if (bp->is_final())
+    unparser.emit_locals(o, bp->body->locals);
 
-  emit_event_instrumentation (o, EV_INSN);
+  unparser.in_handler = true;
+  unparser.use_private = unparser.use_slots = hot;
+  unparser.exit_label = "handler_exit";
+  unparser.exit_label_used = false;
 
-  o.newline(-1) << "}";
+  for (unsigned i = 0; i < locks.size(); i++)
+    o.newline() << "dr_mutex_lock(" << global_mutex(locks[i]) << ");";
+  // Dynamic conditions are checked even if they were lowered into an
+  // inline check, which runtime/inline.h may fail to insert:
+  for (unsigned i = 0; i < bp->conditions.size(); i++)
+    {
+      expr *e = bp->conditions[i]->e;
+      if (is_static(bp, e)) continue; // -- already checked in bb_event
+      o.newline() << "if (!(";
+      unparser.emit_truth(o, e);
+      o.line() << ")) goto " << unparser.exit_label << ";";
+      unparser.exit_label_used = true;
+    }
+  if (bp->is_final())
+    {
+#ifdef PROBE_COUNTERS
+      // -- probes sharing a handler need not hold the same mutexes
+      o.newline() << "__sync_fetch_and_add(&" << probecounter(bp->body)
+                  << ", 1);";
+#endif
+      unparser.emit_stmt(o, bp->body->action);
+    }
+  else
+    // -- an earlier stage only advances the thread to the next one
+    o.newline() << sequence_state(bp) << " = " << bp->stage + 1 << ";";
+  if (unparser.exit_label_used)
+    {
+      o.newline(-1) << unparser.exit_label << ":";
+      o.indent(1);
+    }
+  for (unsigned i = locks.size(); i > 0; i--)
+    o.newline() << "dr_mutex_unlock(" << global_mutex(locks[i - 1]) << ");";
+  unparser.in_handler = false;
+  unparser.use_private = unparser.use_slots = false;
 
   o.newline(-1) << "}";
   o.newline();
 }
 
+// The context values passed to the dispatcher are those of every fused
+// probe, each defined by the first probe which uses it:
 void
-dr_client_template::emit_exit_callback (translator_output& o, bool forward)
+dr_client_template::collect_fused_context(context_map& passed,
+                                          context_map& dynamic,
+                                          map<string, basic_probe *>& owner)
+{
+  for (unsigned i = fused_probes.size(); i-- > 0; )
+    {
+      basic_probe *bp = fused_probes[i];
+      context_map &s = static_context[bp], &d = dynamic_context[bp];
+      for (context_map::iterator it = s.begin(); it != s.end(); it++)
+        passed[it->first] = it->second, owner[it->first] = bp;
+      for (context_map::iterator it = d.begin(); it != d.end(); it++)
+        dynamic[it->first] = it->second, owner[it->first] = bp;
+    }
+}
+
+void
+dr_client_template::emit_dispatcher (translator_output& o, bool forward)
 {
-  if (!wants_exit_callback) return;
+  if (fused_probes.empty()) return;
 
-  o.newline() << "static void exit_event(void)";
+  context_map passed, dynamic;
+  map<string, basic_probe *> owner;
+  collect_fused_context(passed, dynamic, owner);
+
+  if (!forward)
+    o.newline() << "/* fused probes */";
+  o.newline() << "static void";
+  o.line() << (forward ? " " : "\n") << "ebt_dispatch_insn(ptr_uint_t probe_mask";
+  for (context_map::iterator it = passed.begin(); it != passed.end(); it++)
+    o.line() << ", " << passed_type(owner[it->first], it->first, it->second)
+             << it->first;
+  for (context_map::iterator it = dynamic.begin(); it != dynamic.end(); it++)
+    o.line() << ", reg_t arg_" << it->first.substr(strlen("ctx_"));
+  o.line() << ")";
   if (forward)
     {
       o.line() << ";";
       return;
     }
 
+  // -- each handler checks its own dynamic conditions
   o.newline() << "{";
   o.indent(1);
-
-  /* Fire EV_END probes: */
-  emit_event_invocations(o, EV_END);
-
+  for (unsigned i = 0; i < fused_probes.size(); i++)
+    {
+      basic_probe *bp = fused_probes[i];
+      o.newline() << "if (probe_mask & " << fused_bit(bp) << ")";
+      o.newline(1) << handlerfn(bp) << "(";
+      bool first = true;
+      context_map &own_passed = static_context[bp];
+      context_map &own_dynamic = dynamic_context[bp];
+      for (context_map::iterator it = own_passed.begin();
+           it != own_passed.end(); it++)
+        {
+          o.line() << (first ? "" : ", ") << it->first;
+          first = false;
+        }
+      for (context_map::iterator it = own_dynamic.begin();
+           it != own_dynamic.end(); it++)
+        {
+          o.line() << (first ? "" : ", ") << "arg_"
+                   << it->first.substr(strlen("ctx_"));
+          first = false;
+        }
+      o.line() << ");";
+      o.indent(-1);
+    }
   o.newline(-1) << "}";
   o.newline();
 }
 
-// --- helpers to emit specific boilerplate ---
-
+// Calls the dispatcher for each entry recorded in the batch buffer of
+// the current thread. An entry holds the arguments of the dispatcher:
 void
-dr_client_template::emit_global_initialization (translator_output& o, ebt_global *g)
+dr_client_template::emit_batch_flush (translator_output& o)
 {
-  // TODOXXX
+  if (!wants_batch) return;
+
+  context_map passed, dynamic;
+  map<string, basic_probe *> owner;
+  collect_fused_context(passed, dynamic, owner);
+
+  o.newline() << "static void";
+  o.newline() << "ebt_batch_flush(void)";
+  o.newline() << "{";
+  o.indent(1);
+  o.newline() << "ptr_uint_t *slots = ebt_batch_slots();";
+  o.newline() << "ptr_uint_t *entry = (ptr_uint_t *) slots[0];";
+  o.newline() << "ptr_uint_t *end = (ptr_uint_t *) (slots[0] + slots[1]);";
+  o.newline() << "for (; entry < end; entry += "
+              << 1 + passed.size() + dynamic.size() << ")";
+  o.newline(1) << "ebt_dispatch_insn(entry[0]";
+  unsigned k = 1;
+  for (context_map::iterator it = passed.begin(); it != passed.end(); it++, k++)
+    {
+      string type = passed_type(owner[it->first], it->first, it->second);
+      // -- without the trailing space of "ptr_int_t "
+      o.line() << ", (" << type.substr(0, type.find_last_not_of(' ') + 1)
+               << ") entry[" << k << "]";
+    }
+  for (context_map::iterator it = dynamic.begin(); it != dynamic.end(); it++, k++)
+    o.line() << ", (reg_t) entry[" << k << "]";
+  o.line() << ");";
+  o.indent(-1);
+  o.newline() << "slots[1] = 0;";
+  o.newline(-1) << "}";
+  o.newline();
 }
 
 void
 dr_client_template::emit_event_invocations (translator_output& o, basic_probe_type bt)
 {
-  // TODOXXX
   if (!wants_mechanism(bt)) return;
 
-  o.newline() << "// TODOXXX invocations for " << bt << " go here";
+  const vector<basic_probe *> &group = basic_probes[bt];
+  for (unsigned i = 0; i < group.size(); i++)
+    o.newline() << handlerfn(group[i]) << "();";
 }
 
 void
 dr_client_template::emit_event_instrumentation (translator_output& o, basic_probe_type bt)
 {
-  // TODOXXX
   if (!wants_mechanism(bt)) return;
 
-  o.newline() << "// TODOXXX instrumentation for " << bt << " goes here";
+  if (bt == EV_INSN && !fused_probes.empty())
+    o.newline() << "probe_mask = 0;";
+
+  const vector<basic_probe *> &group = basic_probes[bt];
+  for (unsigned i = 0; i < group.size(); i++)
+    {
+      basic_probe *bp = group[i];
+      o.line() << "\n";
+      o.newline() << "/* " << c_comment(bp->body->title()) << " */";
+
+      // -- $name is looked up once here, where the address is known, so
+      // that the handler finds it in the cache (see runtime/symbols.h)
+      bool wants_name = dynamic_context[bp].count("ctx_name") != 0;
+      if (bt == EV_FENTRY)
+        {
+          // -- ignore far calls
+          o.newline() << "if (instr_is_call_direct(instr)) {";
+          o.indent(1);
+          if (wants_name)
+            o.newline() << "ebt_function_name(instr_get_branch_target_pc(instr));";
+          o.newline() << "dr_insert_call_instrumentation(drcontext, bb, instr, "
+                       << "(app_pc) " << handlerfn(bp) << ");";
+          o.newline(-1) << "}";
+          o.newline() << "else if (instr_is_call_indirect(instr))";
+          o.newline(1) << "dr_insert_mbr_instrumentation(drcontext, bb, instr, "
+                       << "(app_pc) " << handlerfn(bp) << ", SPILL_SLOT_1);";
+          o.indent(-1);
+          continue;
+        }
+      if (bt == EV_FEXIT)
+        {
+          o.newline() << "if (instr_is_return(instr)) {";
+          o.indent(1);
+          if (wants_name)
+            o.newline() << "ebt_function_name(instr_get_app_pc(instr));";
+          o.newline() << "dr_insert_mbr_instrumentation(drcontext, bb, instr, "
+                       << "(app_pc) " << handlerfn(bp) << ", SPILL_SLOT_1);";
+          o.newline(-1) << "}";
+          continue;
+        }
+
+      // EV_INSN: check the static conditions (computing the context values
+      // they need as late as possible), then insert a clean call:
+      set<string> &computed = static_computed[bp];
+      bool any_static = false;
+      for (unsigned j = 0; j < bp->conditions.size(); j++)
+        {
+          expr *e = bp->conditions[j]->e;
+          if (!is_static(bp, e)) continue;
+          any_static = true;
+
+          context_map used;
+          c_unparser::collect_context(e, used);
+          for (context_map::iterator it = used.begin(); it != used.end(); it++)
+            if (!computed.count(it->first))
+              {
+                computed.insert(it->first);
+                o.newline() << it->first << " = ";
+                emit_context_value(o, bp, it->second, false);
+                o.line() << ";";
+              }
+
+          o.newline() << "if (!(";
+          unparser.emit_truth(o, e);
+          o.line() << ")) goto " << chain_label(bp) << ";";
+        }
+
+      // -- a fused probe only marks that it applies to instr
+      if (fused_index.count(bp))
+        o.newline() << "probe_mask |= " << fused_bit(bp) << ";";
+      else
+        emit_clean_call(o, bp, computed);
+
+      if (any_static)
+        {
+          o.newline(-1) << chain_label(bp) << ": ;";
+          o.indent(1);
+        }
+    }
+
+  if (bt == EV_INSN && !fused_probes.empty())
+    emit_fused_call(o);
 }
 
-// TODOXXX old version of dr_client_template::emit()
-//   o.newline() << "#include \"dr_api.h\"";
-//   o.newline() << "#include \"runtime/opcode.h\""; // TODOXXX
-//   o.newline();
-//
-//   /* TODOXXX context data structure types for handlers */
-//
-//   o.newline() << "// forward declarations for callbacks";
-//   emit_function_decls(o, true);
-//
-//   o.newline() << "// global data -- probe counters, variables, mutexes";
-//   emit_global_data(o);
-//
-//   o.newline() << "// callbacks";
-//   emit_function_decls(o);
-// }
+// Inserts the clean call of an EV_INSN probe, given the static context
+// values already computed by its conditions:
+void
+dr_client_template::emit_clean_call (translator_output& o, basic_probe *bp,
+                                     const set<string> &computed)
+{
+  context_map &passed = static_context[bp];
+  context_map &dynamic = dynamic_context[bp];
+  for (context_map::iterator it = passed.begin(); it != passed.end(); it++)
+    if (!computed.count(it->first))
+      {
+        o.newline() << it->first << " = ";
+        emit_passed_value(o, bp, it->first, it->second);
+        o.line() << ";";
+      }
 
-// TODOXXX
+  // -- the clean call is skipped while the thread is in another stage
+  if (bp->num_stages > 1)
+    o.newline() << "seq_skip = ebt_seq_insert_check(drcontext, bb, instr, "
+                << sequence_slots[bp->body->id] << ", " << bp->stage << ");";
 
-// ------------------------------
-// --- methods for c_unparser ---
-// ------------------------------
+  // -- ... or if an inline check finds a dynamic condition false
+  inline_check *check = inline_checks.count(bp) ? &inline_checks[bp] : NULL;
+  if (check)
+    {
+      o.newline() << "ebt_inline_begin(&il, drcontext, bb, instr, "
+                  << check->num_regs << ");";
+      for (unsigned j = 0; j < check->loads.size(); j++)
+        {
+          o.newline() << "ebt_inline_load(&il, " << j << ", ";
+          emit_context_value(o, bp, check->loads[j], false);
+          o.line() << ");";
+        }
+      for (unsigned j = 0; j < check->code.size(); j++)
+        o.newline() << check->code[j];
+      o.newline() << "ebt_inline_insert(&il);";
+    }
+
+  o.newline() << "dr_insert_clean_call(drcontext, bb, instr, (void *) "
+              << handlerfn(bp) << ",";
+  o.newline() << "                     false /* no fp save */, "
+              << passed.size() + dynamic.size();
+  for (context_map::iterator it = passed.begin(); it != passed.end(); it++)
+    {
+      o.line() << ",";
+      o.newline() << "                     OPND_CREATE_INTPTR((ptr_int_t) "
+                  << it->first << ")";
+    }
+  for (context_map::iterator it = dynamic.begin(); it != dynamic.end(); it++)
+    {
+      o.line() << ",";
+      o.newline() << "                     ";
+      emit_context_value(o, bp, it->second, false);
+    }
+  o.line() << ");";
+  if (check)
+    o.newline() << "ebt_inline_end(&il);";
+  if (bp->num_stages > 1)
+    o.newline() << "ebt_seq_insert_skip(drcontext, bb, instr, seq_skip);";
+}
+
+// Inserts the clean calls of the fused probes which apply to instr. A
+// single probe is called directly (and may still be checked inline);
+// several are called through the dispatcher with a single clean call:
+void
+dr_client_template::emit_fused_call (translator_output& o)
+{
+  o.line() << "\n";
+  o.newline() << "/* fused probes */";
+  if (batch_handlers)
+    o.newline() << "if (probe_mask != 0) {";
+  else
+    {
+      for (unsigned i = 0; i < fused_probes.size(); i++)
+        {
+          basic_probe *bp = fused_probes[i];
+          o.newline() << (i > 0 ? "else " : "") << "if (probe_mask == "
+                      << fused_bit(bp) << ") {";
+          o.indent(1);
+          emit_clean_call(o, bp, static_computed[bp]);
+          o.newline(-1) << "}";
+        }
+      o.newline() << "else if (probe_mask != 0) {";
+    }
+  o.indent(1);
+
+  // A static context value is still valid if a probe in the mask computed
+  // it for its conditions. Otherwise, it is computed if a probe in the
+  // mask needs it:
+  context_map passed, dynamic;
+  map<string, basic_probe *> owner;
+  collect_fused_context(passed, dynamic, owner);
+  for (context_map::iterator it = passed.begin(); it != passed.end(); it++)
+    {
+      string computed_by, needed_by;
+      for (unsigned i = 0; i < fused_probes.size(); i++)
+        {
+          basic_probe *bp = fused_probes[i];
+          if (static_computed[bp].count(it->first))
+            computed_by += (computed_by.empty() ? "" : " | ") + fused_bit(bp);
+          if (static_context[bp].count(it->first))
+            needed_by += (needed_by.empty() ? "" : " | ") + fused_bit(bp);
+        }
+
+      basic_probe *bp = owner[it->first];
+      string type = passed_type(bp, it->first, it->second);
+      o.newline();
+      if (!computed_by.empty())
+        o.line() << "if (!(probe_mask & (" << computed_by << "))) ";
+      o.line() << it->first << " = (probe_mask & (" << needed_by << ")) ? ";
+      emit_passed_value(o, bp, it->first, it->second);
+      o.line() << " : " << (type == "ptr_int_t " ? "0" : "NULL") << ";";
+    }
+
+  if (batch_handlers)
+    {
+      emit_batch_record(o, passed, dynamic, owner);
+      o.newline(-1) << "}";
+      return;
+    }
+
+  o.newline() << "dr_insert_clean_call(drcontext, bb, instr, (void *) "
+              << "ebt_dispatch_insn,";
+  o.newline() << "                     false /* no fp save */, "
+              << 1 + passed.size() + dynamic.size() << ",";
+  o.newline() << "                     OPND_CREATE_INTPTR(probe_mask)";
+  for (context_map::iterator it = passed.begin(); it != passed.end(); it++)
+    {
+      o.line() << ",";
+      o.newline() << "                     OPND_CREATE_INTPTR((ptr_int_t) "
+                  << it->first << ")";
+    }
+  for (context_map::iterator it = dynamic.begin(); it != dynamic.end(); it++)
+    {
+      o.line() << ",";
+      o.newline() << "                     ";
+      emit_context_value(o, owner[it->first], it->second, false);
+    }
+  o.line() << ");";
+  o.newline(-1) << "}";
+}
+
+// Records the arguments of the dispatcher in the batch buffer, falling
+// back to a clean call if runtime/batch.h cannot insert the record:
+void
+dr_client_template::emit_batch_record (translator_output& o,
+                                       context_map& passed,
+                                       context_map& dynamic,
+                                       map<string, basic_probe *>& owner)
+{
+  unsigned k = 0;
+  o.newline() << "batch_values[" << k++ << "] = OPND_CREATE_INTPTR(probe_mask);";
+  for (context_map::iterator it = passed.begin(); it != passed.end(); it++)
+    o.newline() << "batch_values[" << k++ << "] = "
+                << "OPND_CREATE_INTPTR((ptr_int_t) " << it->first << ");";
+  for (context_map::iterator it = dynamic.begin(); it != dynamic.end(); it++)
+    {
+      o.newline() << "batch_values[" << k++ << "] = ";
+      emit_context_value(o, owner[it->first], it->second, false);
+      o.line() << ";";
+    }
+
+  o.newline() << "if (!ebt_batch_record(batch, drcontext, bb, instr, "
+              << k << ", batch_values))";
+  o.newline(1) << "dr_insert_clean_call(drcontext, bb, instr, (void *) "
+               << "ebt_dispatch_insn,";
+  o.newline() << "                     false /* no fp save */, " << k;
+  for (unsigned i = 0; i < k; i++)
+    {
+      o.line() << ",";
+      o.newline() << "                     batch_values[" << i << "]";
+    }
+  o.line() << ");";
+  o.indent(-1);
+}
+
+// The C type of a value passed from instrumentation time, i.e. of a
+// static context value or the slot of an element:
+string
+dr_client_template::passed_type(basic_probe *bp, const string& name,
+                                basic_expr *e)
+{
+  if (slot_globals.count(name))
+    return "int64 *";
+  ebt_context *c = bp->find_context(e->tok->content);
+  return c->value_type == t_str ? "const char *" : "ptr_int_t ";
+}
+
+// Emits the C expression computing a value passed from instrumentation
+// time. The slot of an element is resolved from its key:
+void
+dr_client_template::emit_passed_value (translator_output& o, basic_probe *bp,
+                                       const string& name, basic_expr *e)
+{
+  if (!slot_globals.count(name))
+    {
+      emit_context_value(o, bp, e, false);
+      return;
+    }
+
+  ebt_global *g = slot_globals[name];
+  o.line() << c_unparser::array_prefix(g) << "_slot(&" << unparser.global(g)
+           << ", ";
+  emit_context_value(o, bp, e, false);
+  o.line() << ", script_mutex)";
+}
+
+// Emits the C expression computing a context value. Static values are
+// computed at instrumentation time (from instr); dynamic values of
+// EV_INSN are clean call arguments, i.e. operands of instr:
+void
+dr_client_template::emit_context_value (translator_output& o, basic_probe *bp,
+                                        basic_expr *e, bool at_runtime)
+{
+  string name = e->tok->content;
 
-// TODOXXX
+  if (at_runtime)
+    {
+      if (name == "tid") // -- the handler runs in the thread
+        o.line() << "(int64) dr_get_thread_id(dr_get_current_drcontext())";
+      else if (bp->mechanism == EV_INSN) // -- a register or memory operand
+        o.line() << "(int64) (ptr_int_t) arg_" << unparser.context(e).substr(strlen("ctx_"));
+      else if (name == "name" && bp->mechanism == EV_FENTRY)
+        o.line() << "ebt_function_name(target_addr)";
+      else if (name == "name" && bp->mechanism == EV_FEXIT)
+        o.line() << "ebt_function_name(instr_addr)";
+      else
+        o.line() << "(BUG: unknown context value " << name << ")";
+      return;
+    }
+
+  if (name == "opcode" && wants_intern)
+    o.line() << "ebt_intern(opcode_string(instr_get_opcode(instr)))";
+  else if (name == "opcode")
+    o.line() << "opcode_string(instr_get_opcode(instr))";
+  else if (name == "name")
+    o.line() << "ebt_function_name(instr_get_app_pc(instr))";
+  else if (name == "op")
+    {
+      string index = e->chain[0].second->tok->content;
+      // XXX a missing operand is passed as 0
+      o.line() << "(instr_num_srcs(instr) > " << index
+               << " ? instr_get_src(instr, " << index << ")"
+               << " : OPND_CREATE_INTPTR(0))";
+    }
+  else
+    o.line() << "(BUG: unknown context value " << name << ")";
+}
 
 // ----------------------------------------
 // --- methods for fake_client_template ---
@@ -328,486 +3178,9 @@ fake_client_template::emit(translator_output& to)
   if (!globals.empty())
     {
       o << "RESULTING GLOBAL DATA" << endl;
-      for (unsigned i = 0; i < functions.size(); i++)
+      for (unsigned i = 0; i < globals.size(); i++)
         o << *(globals[i]) << endl;
       o << "===" << endl;
     }
 }
 
-// ==========================================================================
-// ==========================================================================
-// ==========================================================================
-// ==========================================================================
-// TODOXXX REWRITE BELOW
-
-// // === general functions for emitting C code ===
-//
-// /* a basic traversing visitor to emit the expression */
-// class unparsing_visitor : public visitor {
-//   translator_output *o;
-//   ebt_context *ctx;
-//
-// public:
-//   unparsing_visitor(translator_output *o, ebt_context *ctx) : o(o), ctx(ctx) {}
-//   void visit_basic_expr (basic_expr *s);
-//   void visit_unary_expr (unary_expr *s);
-//   void visit_binary_expr (binary_expr *s);
-//   void visit_conditional_expr (conditional_expr *s);
-// };
-//
-// void
-// unparsing_visitor::visit_basic_expr (basic_expr *s)
-// {
-//   // TODOXXX error handling, escaping intricacies
-//   if (s->tok->type == tok_ident)
-//     o->line() << "(" << (*ctx)[s->tok->content] << ")";
-//   else if (s->tok->type == tok_str)
-//     o->line() << "\"" << s->tok->content << "\"";
-//   else if (s->tok->type == tok_num)
-//     o->line() << s->tok->content;
-// }
-//
-// void
-// unparsing_visitor::visit_unary_expr (unary_expr *s)
-// {
-//   o->line() << s->op << "(";
-//   s->operand->visit(this);
-//   o->line() << ")";
-// }
-//
-// void
-// unparsing_visitor::visit_binary_expr (binary_expr *s)
-// {
-//   o->line() << "(";
-//   s->left->visit(this);
-//   o->line() << ")" << s->op << "(";
-//   s->right->visit(this);
-//   o->line() << ")";
-// }
-//
-// void
-// unparsing_visitor::visit_conditional_expr (conditional_expr *s)
-// {
-//   o->line() << "(";
-//   s->cond->visit(this);
-//   o->line() << ")" << "?" << "(";
-//   s->truevalue->visit(this);
-//   o->line() << ")" << ":" << "(";
-//   s->falsevalue->visit(this);
-//   o->line() << ")";
-// }
-//
-// /* we create instances of the c_unparser to make it possible for each
-//    client_template to (down the line) configure some of its own options */
-// c_unparser::c_unparser() {}
-//
-// void
-// c_unparser::emit_expr(translator_output &o, expr *e, ebt_context *ctx) const
-// {
-//   unparsing_visitor v(&o, ctx);
-//   e->visit(&v);
-// }
-//
-// // === DynamoRIO backend ===
-//
-// // TODOXXX class var_collector : public traversing visitor {
-// //   set<string> required_contextvars; // TODOXXX
-// //
-// // public:
-// //   void visit_basic_expr (basic_expr *s);
-// // };
-//
-// ebt_context dr_client_template::ctxvars;
-//
-// dr_client_template::dr_client_template(ebt_module *module)
-//   : client_template(module)
-// {
-//   if (ctxvars.empty())
-//     {
-//       // TODOXXX quick-and-dirty populate this with ctxvars
-//       // TODOXXX obviously we need a more sophisticated namespacing thing
-//       ctxvars["opcode"] = "opcode_string(opcode)"; // TODOXXX runtime
-//       ctxvars["fname"] = "TODOXXX_get_fname";
-//     }
-// }
-//
-// // --- registering data ---
-//
-// // HOW THE PIECES COME TOGETHER
-// //
-// // The client template is a set of boilerplate code where certain
-// // features are enabled and disabled depending on the
-// // presence of probes making use of a corresponding mechanism.
-// // For instance, EV_INSN requires a bb_event callback which
-// // iterates through the instructions in each basic block.
-//
-// // TODOXXX current batch of things to implement: EV_BEGIN, EV_END, EV_INSN
-//
-// // TODOXXX implement EV_FCALL
-// // TODOXXX implement EV_FRETURN
-// // TODOXXX implement EV_MALLOC
-// // TODOXXX implement EV_MACCESS
-//
-// // TODOXXX implement EV_END on interrupt
-//
-// void
-// dr_client_template::register_probe(basic_probe *bp)
-// {
-//   basic_probes[bp->mechanism].push_back(bp);
-//
-//   /* add handler to handlers */
-//   unsigned id = bp->body->id;
-//   if (seen_handlers.count(id) == 0)
-//     {
-//       seen_handlers.insert(id);
-//       all_handlers.push_back(bp->body);
-//     }
-// }
-//
-// // Check if there are probes needing a certain mechanism. This could
-// // be complicated as some mechanisms depend among each other,
-// // e.g. EV_FCALL builds on the per-instruction instrumentation
-// // provided by EV_INSN.
-// bool
-// dr_client_template::have(basic_probe_type m) const
-// {
-//   return basic_probes.count(m) != 0;
-// }
-//
-// // --- naming conventions ---
-//
-// // TODOXXX need c++0x to_string or such
-// string
-// tostring(unsigned id)
-// {
-//   ostringstream result; result << id; return result.str();
-// }
-//
-// string
-// dr_client_template::global(unsigned id) const
-// {
-//   return "global_" + tostring(id);
-// }
-//
-// string
-// dr_client_template::global_mutex(unsigned id) const
-// {
-//   return "global_" + tostring(id) + "_mutex";
-// }
-//
-// #ifdef PROBE_COUNTERS
-// string
-// dr_client_template::probecounter(unsigned id) const
-// {
-//   return "probecounter_" + tostring(id);
-// }
-//
-// string
-// dr_client_template::probecount_mutex(unsigned id) const
-// {
-//   return "probecounter_" + tostring(id) + "_mutex";
-// }
-// #endif
-//
-// string
-// dr_client_template::chain_label(unsigned id) const
-// {
-//   return "chain_label_" + tostring(id);
-// }
-//
-// string
-// dr_client_template::condvar(unsigned hid, int cid) const
-// {
-//   return "_handler_" + tostring(hid) + "_cond_" + tostring(cid);
-// }
-//
-// string
-// dr_client_template::handlerfn(unsigned id) const
-// {
-//   return "ebt_handler_" + tostring(id);
-// }
-//
-// // --- client template ---
-//
-// void
-// dr_client_template::emit_condition_chain(translator_output &o,
-//                                          vector<basic_probe *> chain,
-//                                          bool handle_inline)
-// {
-//   /* STEP 2 -- implement the condition chain thing */
-//
-//   /* TODOXXX initialize conditions/context */
-//   for (vector<basic_probe *>::const_iterator it = chain.begin();
-//        it != chain.end(); it++)
-//     {
-//       basic_probe *bp = *it;
-//
-//       /* obtain name of next label in the chain */
-//       string next_label = it+1 != chain.end() ?
-//         chain_label(bp->body->id) : "chain_finished";
-//
-//       for (vector<condition *>::const_iterator jt = bp->conditions.begin();
-//            jt != bp->conditions.end(); jt++)
-//         {
-//           condition *c = *jt;
-//
-//           /* TODOXXX ensure necessary context data for conditions */
-//
-//           // TODOXXX check actual conditions
-//
-//           o.newline() << "int " << condvar(bp->body->id, c->id)
-//                       << " = ";
-//           unparser.emit_expr(o, c->content, &ctxvars);
-//           o.line() << ";";
-//
-//           o.newline() << "if (!" << condvar(bp->body->id, c->id) << ") "
-//                       << "goto " << next_label << ";";
-//         }
-//
-//       /* TODOXXX enable handler for bp -- perhaps inline */
-//       if (handle_inline)
-//         o.newline() << handlerfn(bp->body->id) << "();";
-//       else
-//         /* TODOXXX need various hints at current instrumentation point ? */
-//         o.newline() << "dr_insert_clean_call(drcontext, bb, instr, (void *)"
-//                     << handlerfn(bp->body->id) << ", false /* no fp save */, 0);";
-//       /* TODOXXX need to attach context info -- use a struct for this */
-//
-//       o.newline();
-//       o.newline() << next_label << ":";
-//     }
-//
-//   o.newline() << ";";
-// }
-//
-// void
-// dr_client_template::emit_handler(translator_output &o, handler *h)
-// {
-//   /* TODOXXX mutex usage should be configurable by a command line option */
-//   /* TODOXXX OPTIONAL grab mutexes for required variables */
-// #ifdef PROBE_COUNTERS
-//   o.newline() << "dr_mutex_lock(" << probecount_mutex(h->id) << ");";
-//   o.newline() << probecounter(h->id) << "++;";
-// #endif
-//   /* TODOXXX handler contents */
-//   /* TODOXXX OPTIONAL release mutexes for required variables */
-// #ifdef PROBE_COUNTERS
-//   o.newline() << "dr_mutex_unlock(" << probecount_mutex(h->id) << ");";
-// #endif
-// }
-//
-// void
-// dr_client_template::emit_begin_callback(translator_output &o)
-// {
-//   /* initialize global data */
-// #ifdef PROBE_COUNTERS
-//   for (vector<handler *>::const_iterator it = all_handlers.begin();
-//        it != all_handlers.end(); it++)
-//     {
-//       handler *h = *it;
-//       unsigned id = h->id;
-//
-//       o.newline() << probecounter(id) << " = 0;";
-//       o.newline() << probecount_mutex(id) << " = dr_mutex_create();";
-//     }
-// #endif
-//   for (vector<global_data *>::const_iterator it = globals.begin();
-//        it != globals.end(); it++)
-//     {
-//       global_data *g = *it;
-//       unsigned id = g->id;
-//
-//       /* TODOXXX initialize global data content */
-//       o.newline() << "static void *" << global_mutex(id) << ";";
-//     }
-//
-//   /* handlers for EV_BEGIN */
-//   emit_condition_chain(o, basic_probes[EV_BEGIN], true);
-//
-//   /* register callbacks */
-// #ifdef PROBE_COUNTERS
-//   o.newline() << "dr_register_exit_event(event_exit);";
-// #else
-//   if (have(EV_END)) o.newline() << "dr_register_exit_event(event_exit);";
-// #endif
-//   if (have(EV_INSN)) o.newline() << "dr_register_bb_event(bb_event);";
-// }
-//
-// void
-// dr_client_template::emit_exit_callback(translator_output &o)
-// {
-//   /* handlers for EV_END */
-//   emit_condition_chain(o, basic_probes[EV_END], true);
-//
-// #ifdef PROBE_COUNTERS
-//   /* print a summary of probe counters */
-//   for (vector<handler *>::const_iterator it = all_handlers.begin();
-//        it != all_handlers.end(); it++)
-//     {
-//       handler *h = *it;
-//       unsigned id = h->id;
-//
-//       o.newline() << "dr_fprintf(STDERR, \"%5d :: "
-//                   << c_stringify(h->title())
-//                   << "\\n\", " << probecounter(id) << ");";
-//       // XXX <-- do we need to lock a mutex here?
-//     }
-// #endif
-// }
-//
-// void
-// dr_client_template::emit_bb_callback(translator_output &o)
-// {
-//   o.newline() << "instr_t *instr, *next_instr;";
-//   o.newline() << "int opcode;";
-//   o.newline();
-//
-//   o.newline() << "for (instr = instrlist_first(bb); instr != NULL; instr = next_instr) {";
-//   o.newline(1) << "/* handle per-instruction events */";
-//   o.newline() << "next_instr = instr_get_next(instr);";
-//   o.newline() << "opcode = instr_get_opcode(instr);"; // TODOXXX enable conditionally
-//
-//   /* handlers for EV_INSN */
-//   emit_condition_chain(o, basic_probes[EV_INSN]);
-//   /* TODOXXX will need to interleave EV_FCALL, EV_FRETURN events */
-//
-//   o.newline(-1) << "}";
-// }
-//
-// void
-// dr_client_template::emit_function_decls(translator_output &o, bool forward)
-// {
-//   if (!forward)
-//     {
-//       o.newline() << "DR_EXPORT void";
-//       o.newline() << "dr_init(client_id_t id)";
-//       o.newline() << "{";
-//       o.newline(1) << "/* initialize client */";
-//
-//       emit_begin_callback(o);
-//
-//       o.newline(-1) << "}";
-//       o.newline();
-//     }
-//
-//   for (vector<handler *>::const_iterator it = all_handlers.begin();
-//        it != all_handlers.end(); it++)
-//     {
-//       handler *h = *it;
-//       unsigned id = h->id;
-//
-//       o.newline() << "static void ";
-//       (forward ? o.line() : o.newline()) << handlerfn(id) << "()"; // TODOXXX context struct
-//       if (forward)
-//         o.line() << ";";
-//       else
-//         {
-//           o.newline() << "{";
-//           o.newline(1) << "/* " << c_comment(h->title()) << " */";
-//
-//           emit_handler(o, h);
-//
-//           o.newline(-1) << "}";
-//           o.newline();
-//         }
-//     }
-//
-// #ifdef PROBE_COUNTERS
-//   o.newline() << "static void ";
-//   (forward ? o.line() : o.newline()) << "event_exit(void)";
-//   if (forward)
-//     o.line() << ";";
-//   else
-//     {
-//       o.newline() << "{";
-//       o.newline(1) << "/* terminate client */";
-//
-//       emit_exit_callback(o);
-//
-//       o.newline(-1) << "}";
-//       o.newline();
-//     }
-// #else
-//   if (have(EV_END))
-//     {
-//       o.newline() << "static void ";
-//       (forward ? o.line() : o.newline()) << "event_exit(void)";
-//     }
-//   if (have(EV_END) && forward)
-//     o.line() << ";";
-//   else if (have(EV_END))
-//     {
-//       o.newline() << "{";
-//       o.newline(1) << "/* terminate client */";
-//
-//       emit_exit_callback(o);
-//
-//       o.newline(-1) << "}";
-//       o.newline();
-//     }
-// #endif
-//
-//   if (have(EV_INSN))
-//     {
-//       o.newline() << "static dr_emit_flags_t";
-//       o.newline() << "bb_event(void *drcontext, void *tag, instrlist_t *bb, "
-//                   << "bool for_trace, bool translating)";
-//     }
-//   if (have(EV_INSN) && forward)
-//     o.line() << ";";
-//   else if (have(EV_INSN))
-//     {
-//       o.newline() << "{";
-//       o.newline(1) << "/* instrument basic block */";
-//
-//       emit_bb_callback(o);
-//
-//       o.newline(-1) << "}";
-//       o.newline();
-//     }
-//
-//   o.newline();
-// }
-//
-// void
-// dr_client_template::emit_global_data(translator_output &o)
-// {
-// #ifdef PROBE_COUNTERS
-//   for (vector<handler *>::const_iterator it = all_handlers.begin();
-//        it != all_handlers.end(); it++)
-//     {
-//       handler *h = *it;
-//       unsigned id = h->id;
-//
-//       o.newline() << "unsigned " << probecounter(id) << ";";
-//       o.newline() << "static void *" << probecount_mutex(id) << ";";
-//     }
-// #endif
-//
-//   for (vector<global_data *>::const_iterator it = globals.begin();
-//        it != globals.end(); it++)
-//     {
-//       // TODOXXX iterate through global data; define variables & mutexes
-//     }
-//
-//   o.newline();
-// }
-//
-// void
-// dr_client_template::emit(translator_output& o)
-// {
-//   o.newline() << "#include \"dr_api.h\"";
-//   o.newline() << "#include \"runtime/opcode.h\""; // TODOXXX
-//   o.newline();
-//
-//   /* TODOXXX context data structure types for handlers */
-//
-//   o.newline() << "// forward declarations for callbacks";
-//   emit_function_decls(o, true);
-//
-//   o.newline() << "// global data -- probe counters, variables, mutexes";
-//   emit_global_data(o);
-//
-//   o.newline() << "// callbacks";
-//   emit_function_decls(o);
-// }
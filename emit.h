@@ -22,6 +22,89 @@ struct translator_output;
 
 #include "ir.h"
 
+// ---------------------------------------------------------------
+// --- generic C "unparser", used for any C/C++ output formats ---
+// ---------------------------------------------------------------
+
+// Context values used by a probe, named by their C variable (see
+// c_unparser::context()) -- e.g. ctx_opcode, ctx_op_0:
+typedef std::map<std::string, basic_expr *> context_map;
+
+// Code checking the dynamic conditions of an EV_INSN probe before its
+// clean call (see runtime/inline.h): operand values to load into the first
+// registers, followed by calls which compute the conditions:
+struct inline_check {
+  std::vector<basic_expr *> loads;
+  std::vector<std::string> code;
+  unsigned num_regs;
+
+  inline_check() : num_regs(0) {}
+};
+
+// Translates statements and expressions into C code. Values have the
+// native types inferred for them: int64 for integers and const char *
+// for strings (see runtime/value.h).
+class c_unparser {
+  ebt_module *module;
+  unsigned iter_ticket; // -- used to name foreach iterators
+
+public:
+  c_unparser(ebt_module *module)
+    : module(module), iter_ticket(0), in_handler(false),
+      exit_label_used(false), return_type(t_int), use_private(false),
+      use_slots(false) {}
+
+  // Within a probe handler, 'next' and 'return' jump to exit_label:
+  bool in_handler;
+  std::string exit_label;
+  bool exit_label_used;
+
+  // Outside a probe handler, 'return' leaves a function returning:
+  ebt_type return_type;
+
+  // Shared globals which each thread updates in a private copy, used
+  // instead of the global by handlers outside of begin and end probes
+  // (see dr_client_template::find_privatized()):
+  std::set<ebt_global *> privatized;
+  bool use_private;
+
+  // Shared globals which are updated atomically, without a lock (see
+  // dr_client_template::find_locks()):
+  std::set<ebt_global *> atomic;
+
+  // Shared arrays whose elements are resolved at instrumentation time,
+  // and updated by handlers through the slots passed to them (see
+  // dr_client_template::find_slots()):
+  std::set<ebt_global *> slotted;
+  bool use_slots;
+
+  // Standard names for the C counterparts of script elements:
+  std::string global(ebt_global *g) const;
+  std::string function(ebt_function *fn) const;
+  std::string local(const std::string& name) const;
+  std::string context(basic_expr *e) const;
+  std::string slot(ebt_global *g, basic_expr *key) const;
+
+  // The C type of a script value, and its value before assignment:
+  static std::string c_type(ebt_type t);
+  static std::string default_value(ebt_type t);
+  static std::string array_prefix(ebt_global *g);
+
+  void emit_expr(translator_output& o, expr *e,
+                 bool discard = false); // -- discard the value
+  void emit_truth(translator_output& o, expr *e); // -- as a C condition
+  void emit_stmt(translator_output& o, stmt *s);
+
+  // Declares the local variables of a function or handler body:
+  void emit_locals(translator_output& o,
+                   const std::map<std::string, ebt_type>& locals);
+
+  // Finds the context values an expression or statement uses:
+  static void collect_context(expr *e, context_map& ctx);
+  static void collect_context(stmt *s, context_map& ctx,
+                              const std::set<basic_expr *> *skip = NULL);
+};
+
 // ----------------------------
 // --- DBT client templates ---
 // ----------------------------
@@ -53,15 +136,78 @@ public:
 
 // Emits a client written in C for the DynamoRIO framework:
 class dr_client_template: public client_template {
+  c_unparser unparser;
+
   // Optional features enabled when a probe requires them:
-  bool wants_opcode;        // -- #include "runtime/opcodes.h"
+  bool wants_opcode;        // -- #include "runtime/opcode.h"
+  bool wants_symbols;       // -- #include "runtime/symbols.h"
+  bool wants_map;           // -- #include "runtime/map.h"
+  bool wants_dense;         // -- #include "runtime/dense.h"
+  bool wants_intern;        // -- #include "runtime/intern.h"
+  bool wants_sequence;      // -- #include "runtime/sequence.h"
+  bool wants_inline;        // -- #include "runtime/inline.h"
+  bool wants_batch;         // -- #include "runtime/batch.h"
+  bool wants_thread_arena;  // -- per-thread arenas of runtime/alloc.h
+  bool wants_thread_data;   // -- thread-local globals, in ebt_thread_data
+  bool wants_thread_events; // -- thread_init_event, thread_exit_event
   bool wants_forward;       // -- // forward declarations
-  bool wants_bb_callback;   // -- dr_register_exit_event(exit_event);
-  bool wants_exit_callback; // -- dr_register_bb_event(bb_event);
+  bool wants_bb_callback;   // -- bb_event, through drmgr and drreg
   bool wants_mechanism(basic_probe_type bt);
 
+  // Context values which each probe computes at instrumentation time
+  // (passed to its handler) and when the handler runs; an EV_INSN handler
+  // computes $tid itself, since its dynamic values are clean call arguments:
+  std::map<basic_probe *, context_map> static_context;
+  std::map<basic_probe *, context_map> dynamic_context;
+  std::map<basic_probe *, context_map> thread_context;
+  bool is_static(basic_probe *bp, expr *e);
+  void collect_context(basic_probe *bp);
+
+  // Dynamic conditions which are also checked before the clean call:
+  std::map<basic_probe *, inline_check> inline_checks;
+  void lower_conditions(basic_probe *bp);
+
+  // EV_INSN probes which share a single clean call at each instruction
+  // (through a dispatcher), and the bit of each in probe_mask:
+  std::vector<basic_probe *> fused_probes;
+  std::map<basic_probe *, unsigned> fused_index;
+  void collect_fused_context(context_map& passed, context_map& dynamic,
+                             std::map<std::string, basic_probe *>& owner);
+
+  // Slots of arrays, passed to handlers like static context values (by
+  // name, with their arrays and the keys which are used for them):
+  std::map<std::string, ebt_global *> slot_globals;
+  std::map<basic_probe *, std::set<basic_expr *> > slot_keys;
+  void find_slots();
+  std::string passed_type(basic_probe *bp, const std::string& name,
+                          basic_expr *e);
+  void emit_passed_value(translator_output& o, basic_probe *bp,
+                         const std::string& name, basic_expr *e);
+
+  // Static context values computed by the conditions of each probe:
+  std::map<basic_probe *, std::set<std::string> > static_computed;
+
+  // Shared globals only updated by commutative reductions outside of
+  // begin and end probes, which are privatized for each thread:
+  void find_privatized();
+
+  // Shared globals written by hot handlers, each guarded by its own mutex
+  // unless its updates can be atomic:
+  std::set<ebt_global *> locked_globals;
+  void find_locks();
+
+  // TLS slots holding the state of each sequence, by handler id:
+  std::map<unsigned, unsigned> sequence_slots;
+
   // Standard names for various generated variables:
-  // TODOXXX
+  std::string handlerfn(basic_probe *bp) const;
+  std::string global_mutex(ebt_global *g) const;
+  std::string chain_label(basic_probe *bp) const;
+  std::string fused_bit(basic_probe *bp);
+  std::string sequence_state(basic_probe *bp);
+#ifdef PROBE_COUNTERS
+  std::string probecounter(handler *h) const;
+#endif
 
   // Groups of declarations:
   void emit_globals (translator_output& o);
@@ -69,74 +215,39 @@ class dr_client_template: public client_template {
   void emit_probe_handlers (translator_output& o, bool forward = false);
   void emit_basic_block_callback (translator_output& o, bool forward = false);
   void emit_exit_callback (translator_output& o, bool forward = false);
+  void emit_thread_callbacks (translator_output& o);
   // -- some components have the option to emit forward declarations.
 
   // Helpers to emit specific boilerplate:
   void emit_global_initialization (translator_output& o, ebt_global *g);
+  void emit_thread_globals (translator_output& o);
+  void emit_thread_merge (translator_output& o);
+  void emit_probe_handler (translator_output& o, basic_probe *bp, bool forward);
+  void emit_dispatcher (translator_output& o, bool forward);
+  void emit_batch_flush (translator_output& o);
   void emit_event_invocations (translator_output& o, basic_probe_type bt);
   void emit_event_instrumentation (translator_output& o, basic_probe_type bt);
+  void emit_clean_call (translator_output& o, basic_probe *bp,
+                        const std::set<std::string>& computed);
+  void emit_fused_call (translator_output& o);
+  void emit_batch_record (translator_output& o, context_map& passed,
+                          context_map& dynamic,
+                          std::map<std::string, basic_probe *>& owner);
+  void emit_context_value (translator_output& o, basic_probe *bp,
+                           basic_expr *e, bool at_runtime);
   // Client code can either invoke a handler directly,
   // or ask DR to instrument target code with a clean call.
 
 public:
   dr_client_template(ebt_module *module);
   void emit(translator_output& o);
-};
 
-// TODOXXX REWRITE AND STUB OUT BELOW
+  // Record the values of fused probes at each instruction and call their
+  // handlers at the end of the basic block (see runtime/batch.h):
+  bool batch_handlers;
 
-// TODOXXX start stupidly simple with the context mapping
-//typedef std::map<std::string, std::string> ebt_context;
-
-// class dr_client_template: public client_template {
-//   std::vector<handler *> all_handlers; // -- used to iterate through handlers
-//   std::set<unsigned> seen_handlers; // -- used to avoid duplicates in all_handlers
-//
-//   c_unparser unparser;
-//   static ebt_context ctxvars; // TODOXXX initialize
-//
-//   bool have(basic_probe_type mechanism) const;
-//
-//   /* standard names for various generated variables */
-//   std::string global(unsigned id) const;
-//   std::string global_mutex(unsigned id) const;
-//
-// #ifdef PROBE_COUNTERS
-//   std::string probecounter(unsigned id) const;
-//   std::string probecount_mutex(unsigned id) const;
-// #endif
-//
-//   std::string chain_label(unsigned id) const;
-//   std::string condvar(unsigned hid, int cid) const;
-//   std::string handlerfn(unsigned id) const;
-//
-//   void emit_condition_chain(translator_output& o,
-//                             std::vector<basic_probe *> chain,
-//                             bool handle_inline = false);
-//   void emit_handler(translator_output& o, handler *h);
-//
-//   void emit_begin_callback(translator_output& o);
-//   void emit_exit_callback(translator_output& o);
-//   void emit_bb_callback(translator_output& o);
-//
-//   void emit_function_decls(translator_output& o, bool forward = false);
-//   void emit_global_data(translator_output &o);
-
-// public:
-//  dr_client_template(ebt_module *module) : client_template(module) {}
-//  void register_probe(basic_probe *bp);
-//  void emit(translator_output& o);
-// };
-
-// ---------------------------------------------------------------
-// --- generic C "unparser", used for any C/C++ output formats ---
-// ---------------------------------------------------------------
-
-// TODOXXX
-// class c_unparser {
-//  public:
-//   c_unparser();
-//   void emit_expr(translator_output& o, expr *e, ebt_context *ctx) const;
-// };
+  // Macros defined at the top of the client, as NAME or NAME=VALUE:
+  std::vector<std::string> defines;
+};
 
 #endif // EBT_EMIT_H
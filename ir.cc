@@ -10,14 +10,18 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <algorithm>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "util.h"
 #include "ir.h"
 #include "parse.h"
 #include "emit.h"
+#include "cache.h"
 
 using namespace std;
 
@@ -25,49 +29,2061 @@ using namespace std;
 // --- files and modules ---
 // -------------------------
 
-// --- TODOXXX NECESSARY/LOCATION?? visitor for event-resolution --
+// --- event resolution ---
 
-class resolving_visitor : public visitor {
-  probe *orig_probe;
+// Event resolution turns the event expression of a probe into disjunctive
+// normal form. Each disjunct (a resolved_event) is a conjunction of builtin
+// events, which together provide a mechanism and context values, and of
+// conditions on those context values.
+struct resolved_event {
+  ebt_event *head; // -- target of '.IDENTIFIER'; NULL after a compound event
+  vector<ebt_event *> events;
+  vector<expr *> conditions;
+
+  resolved_event() : head(NULL) {}
+
+  void add_event(ebt_event *e);
+  ebt_event *mechanism() const; // -- NULL if there is none
+};
+
+void
+resolved_event::add_event(ebt_event *e)
+{
+  for (unsigned i = 0; i < events.size(); i++)
+    if (events[i] == e) return;
+  events.push_back(e);
+}
+
+ebt_event *
+resolved_event::mechanism() const
+{
+  for (unsigned i = 0; i < events.size(); i++)
+    if (events[i]->mechanism != EV_NONE)
+      return events[i];
+  return NULL;
+}
+
+// Events without a mechanism (e.g. 'function') describe where in the
+// target an instruction belongs, so they need an instruction to refer to:
+static bool
+has_instruction(basic_probe_type bt)
+{
+  return bt == EV_INSN || bt == EV_FENTRY || bt == EV_FEXIT;
+}
+
+// Conditions which the resolver constructs are allocated from the file:
+static expr *
+make_binary(ebt_file *f, expr_op op, expr *left, expr *right)
+{
+  binary_expr *e = new (f->mem) binary_expr();
+  e->tok = left->tok;
+  e->op = op;
+  e->left = left;
+  e->right = right;
+  return e;
+}
+
+static expr *
+make_unary(ebt_file *f, expr_op op, expr *operand)
+{
+  unary_expr *e = new (f->mem) unary_expr();
+  e->tok = operand->tok;
+  e->op = op;
+  e->operand = operand;
+  return e;
+}
+
+static expr *
+make_number(ebt_file *f, token *at, const char *value)
+{
+  token *t = new (f->mem) token();
+  t->location = at->location;
+  t->type = tok_num;
+  t->content = value;
+
+  basic_expr *e = new (f->mem) basic_expr();
+  e->tok = t;
+  return e;
+}
+
+static expr *
+make_conjunction(ebt_file *f, const vector<expr *> &conditions)
+{
+  expr *result = conditions[0];
+  for (unsigned i = 1; i < conditions.size(); i++)
+    result = make_binary(f, op_land, result, conditions[i]);
+  return result;
+}
+
+// Comma-separated conditions must all hold:
+static void
+split_conditions(expr *e, vector<expr *> &conditions)
+{
+  binary_expr *be = dynamic_cast<binary_expr *>(e);
+  if (be && be->op == op_comma)
+    {
+      split_conditions(be->left, conditions);
+      split_conditions(be->right, conditions);
+    }
+  else
+    conditions.push_back(e);
+}
+
+class resolving_visitor : public traversing_visitor {
+  ebt_file *f;
+  vector<resolved_event> result;
+
+public:
+  resolving_visitor(ebt_file *f) : f(f) {}
+
+  vector<resolved_event> resolve(event_expr *e);
+
+  void visit_named_event (named_event *e);
+  void visit_conditional_event (conditional_event *e);
+  void visit_compound_event (compound_event *e);
+};
+
+vector<resolved_event>
+resolving_visitor::resolve(event_expr *e)
+{
+  result.clear();
+  e->visit(this);
+  vector<resolved_event> r;
+  r.swap(result);
+  return r;
+}
+
+void
+resolving_visitor::visit_named_event (named_event *e)
+{
+  if (!e->subevent)
+    {
+      ebt_event *ev = ebt_module::find_event(e->ident);
+      if (!ev)
+        throw semantic_error("unknown event '" + e->ident.str() + "'", e->tok);
+
+      resolved_event r;
+      r.head = ev;
+      r.add_event(ev);
+      result.assign(1, r);
+      return;
+    }
+
+  vector<resolved_event> sub = resolve(e->subevent);
+  for (unsigned i = 0; i < sub.size(); i++)
+    {
+      resolved_event &r = sub[i];
+      if (!r.head)
+        throw semantic_error("compound event has no subevent '"
+                             + e->ident.str() + "'", e->tok);
+
+      map<string, ebt_event *>::iterator it = r.head->subevents.find(e->ident);
+      if (it == r.head->subevents.end())
+        throw semantic_error("unknown event '" + r.head->name + "."
+                             + e->ident.str() + "'", e->tok);
+
+      // -- the parent event remains, since it provides context values
+      r.head = it->second;
+      r.add_event(it->second);
+    }
+  result = sub;
+}
+
+void
+resolving_visitor::visit_conditional_event (conditional_event *e)
+{
+  vector<expr *> conditions;
+  split_conditions(e->condition, conditions);
+
+  vector<resolved_event> sub = resolve(e->subevent);
+  for (unsigned i = 0; i < sub.size(); i++)
+    sub[i].conditions.insert(sub[i].conditions.end(),
+                             conditions.begin(), conditions.end());
+  result = sub;
+}
+
+void
+resolving_visitor::visit_compound_event (compound_event *e)
+{
+  switch (e->op) {
+  case e_not:
+    {
+      // not (A1 and A2 ...) or (B1 and B2 ...) or ... becomes a single
+      // condition, provided that none of the disjuncts has a mechanism:
+      vector<resolved_event> sub = resolve(e->subevents[0]);
+      resolved_event negated;
+      expr *disjunction = NULL;
+      bool always = false;
+      for (unsigned i = 0; i < sub.size(); i++)
+        {
+          ebt_event *mech = sub[i].mechanism();
+          if (mech)
+            throw semantic_error("cannot negate event '" + mech->name
+                                 + "', which determines when the probe fires",
+                                 e->tok);
+
+          for (unsigned j = 0; j < sub[i].events.size(); j++)
+            negated.add_event(sub[i].events[j]);
+
+          if (sub[i].conditions.empty())
+            always = true;
+          else
+            {
+              expr *c = make_conjunction(f, sub[i].conditions);
+              disjunction = disjunction ? make_binary(f, op_lor, disjunction, c) : c;
+            }
+        }
+
+      // -- an unconditional event always holds, so its negation never does
+      negated.conditions.push_back(always ? make_number(f, e->tok, "0")
+                                   : make_unary(f, op_lnot, disjunction));
+      result.assign(1, negated);
+      break;
+    }
+
+  case e_and:
+    {
+      vector<resolved_event> product = resolve(e->subevents[0]);
+      for (unsigned k = 1; k < e->subevents.size(); k++)
+        {
+          vector<resolved_event> right = resolve(e->subevents[k]);
+          vector<resolved_event> combined;
+          for (unsigned i = 0; i < product.size(); i++)
+            for (unsigned j = 0; j < right.size(); j++)
+              {
+                resolved_event r = product[i];
+                const resolved_event &s = right[j];
+                ebt_event *m1 = r.mechanism(), *m2 = s.mechanism();
+                if (m1 && m2 && m1 != m2)
+                  throw semantic_error("cannot combine events '" + m1->name
+                                       + "' and '" + m2->name + "'", e->tok);
+
+                r.head = NULL;
+                for (unsigned l = 0; l < s.events.size(); l++)
+                  r.add_event(s.events[l]);
+                r.conditions.insert(r.conditions.end(),
+                                    s.conditions.begin(), s.conditions.end());
+                combined.push_back(r);
+              }
+          product.swap(combined);
+        }
+      result = product;
+      break;
+    }
+
+  case e_or:
+    {
+      vector<resolved_event> sum;
+      for (unsigned k = 0; k < e->subevents.size(); k++)
+        {
+          vector<resolved_event> sub = resolve(e->subevents[k]);
+          sum.insert(sum.end(), sub.begin(), sub.end());
+        }
+      for (unsigned i = 0; i < sum.size(); i++)
+        sum[i].head = NULL;
+      result = sum;
+      break;
+    }
+
+  case e_seq:
+    // -- split off by resolve_probe(); the state cannot be conditional
+    throw semantic_error("event sequences ('::') cannot be combined with "
+                         "'and', 'or' or 'not'", e->tok);
+  }
+}
+
+// A sequence 'A :: B :: C' is split into its stages A, B and C, each
+// along with the token which errors about the stage should point to:
+static void
+split_stages(event_expr *e, token *tok,
+             vector<pair<event_expr *, token *> > &stages)
+{
+  compound_event *ce = dynamic_cast<compound_event *>(e);
+  if (ce && ce->op == e_seq)
+    for (unsigned i = 0; i < ce->subevents.size(); i++)
+      split_stages(ce->subevents[i], i == 0 ? tok : ce->tok, stages);
+  else
+    stages.push_back(make_pair(e, tok));
+}
+
+// Resolve one stage of a probe into the basic probes of f. Disjuncts which
+// share a mechanism are merged into a single basic probe (whose condition
+// is the disjunction of theirs), so that each instrumentation site is only
+// instrumented once and the handler runs at most once per event:
+static void
+resolve_stage(ebt_file *f, probe *pr, event_expr *e, token *tok,
+              unsigned stage, unsigned num_stages)
+{
+  resolving_visitor v(f);
+  vector<resolved_event> dnf = v.resolve(e);
+
+  vector<ebt_event *> mechanisms;
+  vector<vector<resolved_event *> > groups;
+  for (unsigned i = 0; i < dnf.size(); i++)
+    {
+      ebt_event *mech = dnf[i].mechanism();
+      if (!mech)
+        throw semantic_error("probe point does not specify when to fire "
+                             "(e.g. 'insn' or 'function.entry')", tok);
+      if (num_stages > 1
+          && (mech->mechanism == EV_BEGIN || mech->mechanism == EV_END))
+        throw semantic_error("event '" + mech->name + "' does not happen "
+                             "in a thread and cannot be part of a sequence",
+                             tok);
+
+      unsigned g = 0;
+      while (g < mechanisms.size() && mechanisms[g] != mech) g++;
+      if (g == mechanisms.size())
+        {
+          mechanisms.push_back(mech);
+          groups.push_back(vector<resolved_event *>());
+        }
+      groups[g].push_back(&dnf[i]);
+    }
+
+  for (unsigned g = 0; g < groups.size(); g++)
+    {
+      basic_probe *bp = f->keep(new basic_probe());
+      bp->tok = pr->tok;
+      bp->mechanism = mechanisms[g]->mechanism;
+      bp->body = pr->body;
+      bp->stage = stage;
+      bp->num_stages = num_stages;
+
+      bp->events.push_back(mechanisms[g]);
+      bool unconditional = false;
+      for (unsigned i = 0; i < groups[g].size(); i++)
+        {
+          resolved_event *r = groups[g][i];
+          for (unsigned j = 0; j < r->events.size(); j++)
+            {
+              ebt_event *ev = r->events[j];
+              if (ev->mechanism == EV_NONE && ev != mechanisms[g]->parent
+                  && !has_instruction(bp->mechanism))
+                throw semantic_error("cannot combine events '" + ev->name
+                                     + "' and '" + mechanisms[g]->name + "'",
+                                     pr->tok);
+              if (find(bp->events.begin(), bp->events.end(), ev)
+                  == bp->events.end())
+                bp->events.push_back(ev);
+            }
+          if (r->conditions.empty())
+            unconditional = true;
+        }
+
+      vector<expr *> conditions;
+      if (groups[g].size() == 1)
+        conditions = groups[g][0]->conditions;
+      else if (!unconditional)
+        {
+          expr *disjunction = NULL;
+          for (unsigned i = 0; i < groups[g].size(); i++)
+            {
+              expr *c = make_conjunction(f, groups[g][i]->conditions);
+              disjunction = disjunction ? make_binary(f, op_lor, disjunction, c) : c;
+            }
+          conditions.push_back(disjunction);
+        }
+
+      for (unsigned i = 0; i < conditions.size(); i++)
+        {
+          condition *c = new (f->mem) condition();
+          c->id = bp->get_variable_ticket();
+          c->e = conditions[i];
+          bp->conditions.push_back(c);
+        }
+
+      f->resolved_probes.push_back(bp);
+    }
+}
+
+// Resolve a probe into the basic probes of f, in order of stages:
+static void
+resolve_probe(ebt_file *f, probe *pr)
+{
+  vector<pair<event_expr *, token *> > stages;
+  split_stages(pr->probe_point, pr->tok, stages);
+  for (unsigned i = 0; i < stages.size(); i++)
+    resolve_stage(f, pr, stages[i].first, stages[i].second, i, stages.size());
+}
+
+// --- name resolution ---
+
+// Checks that the functions, globals and context values referred to by a
+// probe handler, function or global initializer exist and are used in a
+// way the emitter supports. Any other identifier is a local variable.
+class checking_visitor : public traversing_visitor {
+  ebt_module *m;
+  basic_probe *bp; // -- NULL outside of probe handlers
+  unsigned loop_depth;
+
+  void check_array_name(expr *e, const char *what);
+  void check_lvalue(expr *e);
+
+public:
+  checking_visitor(ebt_module *m, basic_probe *bp = NULL)
+    : m(m), bp(bp), loop_depth(0) {}
+
+  void visit_loop_stmt (loop_stmt *s);
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_jump_stmt (jump_stmt *s);
+
+  void visit_basic_expr (basic_expr *e);
+  void visit_unary_expr (unary_expr *e);
+  void visit_binary_expr (binary_expr *e);
+  void visit_call_expr (call_expr *e);
+};
+
+void
+checking_visitor::check_array_name(expr *e, const char *what)
+{
+  basic_expr *be = dynamic_cast<basic_expr *>(e);
+  ebt_global *g = NULL;
+  if (be && !be->sigil && be->tok->type == tok_ident && be->chain.empty())
+    g = m->find_global(be->tok->content);
+  if (!g || g->array_type != d_array)
+    throw semantic_error(string(what) + " must be an array", e->tok);
+}
+
+void
+checking_visitor::check_lvalue(expr *e)
+{
+  basic_expr *be = dynamic_cast<basic_expr *>(e);
+  if (!be || be->tok->type != tok_ident)
+    throw semantic_error("cannot assign to an expression", e->tok);
+  if (be->sigil)
+    throw semantic_error("cannot assign to context value '"
+                         + be->sigil->content.str() + be->tok->content.str()
+                         + "'", e->tok);
+}
+
+void
+checking_visitor::visit_loop_stmt (loop_stmt *s)
+{
+  loop_depth++;
+  traversing_visitor::visit_loop_stmt(s);
+  loop_depth--;
+}
+
+void
+checking_visitor::visit_foreach_stmt (foreach_stmt *s)
+{
+  ebt_global *g = m->find_global(s->identifier);
+  if (g && g->array_type == d_array)
+    throw semantic_error("cannot assign to array '" + s->identifier.str()
+                         + "'", s->tok);
+  check_array_name(s->array, "iterated value");
+
+  loop_depth++;
+  s->body->visit(this);
+  loop_depth--;
+}
+
+void
+checking_visitor::visit_jump_stmt (jump_stmt *s)
+{
+  if ((s->kind == j_break || s->kind == j_continue) && loop_depth == 0)
+    throw semantic_error("'" + s->tok->content.str()
+                         + "' outside of a loop", s->tok);
+  if (s->kind == j_next && !bp)
+    throw semantic_error("'next' outside of a probe handler", s->tok);
+  traversing_visitor::visit_jump_stmt(s);
+}
+
+void
+checking_visitor::visit_basic_expr (basic_expr *e)
+{
+  for (arena_list<chain_item>::iterator it = e->chain.begin();
+       it != e->chain.end(); it++)
+    if (it->first == chain_ident)
+      throw semantic_error("field access is not supported", e->tok);
+
+  string name = e->tok->content;
+  if (e->tok->type != tok_ident)
+    {
+      if (!e->chain.empty())
+        throw semantic_error("cannot index a literal", e->tok);
+    }
+  else if (e->sigil)
+    {
+      string full_name = e->sigil->content.str() + name;
+      if (!bp)
+        throw semantic_error("context value '" + full_name
+                             + "' used outside of a probe handler", e->tok);
+
+      ebt_context *c = bp->find_context(name);
+      if (!c)
+        throw semantic_error("context value '" + full_name
+                             + "' is not available here", e->tok);
+
+      string expected = c->lifetime == l_static ? "$" : "@";
+      if (e->sigil->content.str() != expected)
+        throw semantic_error("context value '" + name + "' must be written as '"
+                             + expected + name + "'", e->tok);
+
+      if (c->array_type == d_array)
+        {
+          basic_expr *index = e->chain.size() == 1
+            ? dynamic_cast<basic_expr *>(e->chain[0].second) : NULL;
+          if (!index || index->tok->type != tok_num)
+            throw semantic_error("context value '" + full_name
+                                 + "' requires a constant index", e->tok);
+        }
+      else if (!e->chain.empty())
+        throw semantic_error("cannot index context value '" + full_name
+                             + "'", e->tok);
+    }
+  else
+    {
+      ebt_global *g = m->find_global(name);
+      if (g && g->array_type == d_array)
+        {
+          if (e->chain.size() != 1)
+            throw semantic_error("array '" + name
+                                 + "' requires exactly one index", e->tok);
+        }
+      else if (!e->chain.empty())
+        throw semantic_error("cannot index scalar '" + name + "'", e->tok);
+    }
+
+  traversing_visitor::visit_basic_expr(e);
+}
+
+void
+checking_visitor::visit_unary_expr (unary_expr *e)
+{
+  if (e->op == op_preinc || e->op == op_predec
+      || e->op == op_postinc || e->op == op_postdec)
+    check_lvalue(e->operand);
+  traversing_visitor::visit_unary_expr(e);
+}
+
+void
+checking_visitor::visit_binary_expr (binary_expr *e)
+{
+  if (e->op == op_in)
+    {
+      check_array_name(e->right, "right operand of 'in'");
+      e->left->visit(this);
+      return;
+    }
+
+  if (e->op >= op_assign && e->op <= op_bor_assign)
+    check_lvalue(e->left);
+  traversing_visitor::visit_binary_expr(e);
+}
+
+void
+checking_visitor::visit_call_expr (call_expr *e)
+{
+  ebt_function *fn = ebt_module::find_builtin(e->func);
+  if (fn)
+    {
+      // -- printf() is variadic, but needs at least a format
+      if (e->args.empty())
+        throw semantic_error("'" + e->func.str()
+                             + "' requires at least one argument", e->tok);
+    }
+  else
+    {
+      fn = m->find_function(e->func);
+      if (!fn)
+        throw semantic_error("unknown function '" + e->func.str() + "'", e->tok);
+      if (fn->argument_names.size() != e->args.size())
+        throw semantic_error("wrong number of arguments to '"
+                             + e->func.str() + "'", e->tok);
+    }
+
+  traversing_visitor::visit_call_expr(e);
+}
+
+// Begin and end probes run outside of any application thread, so they have
+// no thread-local data to use. Rather than letting them see the values of
+// some arbitrary thread, any use of thread-local globals by their handlers,
+// or by the functions those call, is an error (thread.end probes see the
+// values of each thread):
+class thread_local_checker : public traversing_visitor {
+  ebt_module *m;
+  set<ebt_function *> seen;
+
+  void check_name(const string_ref& name, token *tok);
+
+public:
+  thread_local_checker(ebt_module *m) : m(m) {}
+
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_basic_expr (basic_expr *e);
+  void visit_call_expr (call_expr *e);
+};
+
+void
+thread_local_checker::check_name(const string_ref& name, token *tok)
+{
+  ebt_global *g = m->find_global(name);
+  if (g && g->is_thread_local)
+    throw semantic_error("thread-local '" + name.str()
+                         + "' cannot be used by a begin or end probe"
+                         " (use it in thread.end)", tok);
+}
+
+void
+thread_local_checker::visit_foreach_stmt (foreach_stmt *s)
+{
+  check_name(s->identifier, s->tok);
+  traversing_visitor::visit_foreach_stmt(s);
+}
+
+void
+thread_local_checker::visit_basic_expr (basic_expr *e)
+{
+  if (!e->sigil && e->tok->type == tok_ident)
+    check_name(e->tok->content, e->tok);
+  traversing_visitor::visit_basic_expr(e);
+}
+
+void
+thread_local_checker::visit_call_expr (call_expr *e)
+{
+  ebt_function *fn = m->find_function(e->func);
+  if (fn && !fn->is_builtin && seen.insert(fn).second)
+    fn->body->visit(this);
+  traversing_visitor::visit_call_expr(e);
+}
+
+// --- type inference ---
+
+// Infers the types of globals, array keys and elements, function arguments
+// and return values, and local variables by unification. One pass over the
+// script may leave types unknown (e.g. when a function is called before its
+// return statements are seen), so passes are repeated until nothing changes.
+class typing_visitor : public traversing_visitor {
+  ebt_module *m;
+  map<string, ebt_type> *locals;
+  ebt_function *fn; // -- NULL outside of functions
+  basic_probe *bp;  // -- NULL outside of probe handlers
+
+  ebt_type *slot(const string &name);
+  ebt_type type_of(expr *e) { e->visit(this); return e->type; }
+  void unify(ebt_type &slot, ebt_type t, const token *tok);
+  void unify(ebt_type &slot, expr *e);
+  void unify(expr *a, expr *b);
+  void constrain(expr *e, ebt_type t);
+
+public:
+  bool changed;
+
+  typing_visitor(ebt_module *m, map<string, ebt_type> *locals,
+                 ebt_function *fn = NULL, basic_probe *bp = NULL)
+    : m(m), locals(locals), fn(fn), bp(bp), changed(false) {}
+
+  void visit_initializer (ebt_global *g);
+
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_jump_stmt (jump_stmt *s);
+
+  void visit_basic_expr (basic_expr *e);
+  void visit_unary_expr (unary_expr *e);
+  void visit_binary_expr (binary_expr *e);
+  void visit_conditional_expr (conditional_expr *e);
+  void visit_call_expr (call_expr *e);
+};
+
+// The type of a variable, which is either a global (for an array, the
+// type of its elements), a function argument or a local:
+ebt_type *
+typing_visitor::slot(const string &name)
+{
+  ebt_global *g = m->find_global(name);
+  if (g)
+    return &g->value_type;
+
+  if (fn)
+    for (unsigned i = 0; i < fn->argument_names.size(); i++)
+      if (fn->argument_names[i] == name)
+        return &fn->argument_types[i];
+
+  return &(*locals)[name];
+}
+
+static semantic_error
+type_mismatch(ebt_type expected, ebt_type found, const token *tok)
+{
+  return semantic_error(string("type mismatch: expected ") + type_name(expected)
+                        + ", found " + type_name(found), tok);
+}
+
+void
+typing_visitor::unify(ebt_type &slot, ebt_type t, const token *tok)
+{
+  if (t == t_unknown || slot == t)
+    return;
+  if (slot != t_unknown)
+    throw type_mismatch(slot, t, tok);
+  slot = t;
+  changed = true;
+}
+
+void
+typing_visitor::unify(ebt_type &slot, expr *e)
+{
+  if (e->type != t_unknown)
+    unify(slot, e->type, e->tok);
+  else if (slot != t_unknown)
+    constrain(e, slot);
+}
+
+void
+typing_visitor::unify(expr *a, expr *b)
+{
+  if (a->type != t_unknown)
+    constrain(b, a->type);
+  else if (b->type != t_unknown)
+    constrain(a, b->type);
+}
+
+// Requires e to have type t, inferring the types of any variables
+// (or return values) whose value e is:
+void
+typing_visitor::constrain(expr *e, ebt_type t)
+{
+  if (e->type == t)
+    return;
+
+  basic_expr *be = dynamic_cast<basic_expr *>(e);
+  call_expr *ce = dynamic_cast<call_expr *>(e);
+  binary_expr *bine = dynamic_cast<binary_expr *>(e);
+  conditional_expr *cond = dynamic_cast<conditional_expr *>(e);
+
+  if (be && be->tok->type == tok_ident && !be->sigil)
+    {
+      ebt_type *s = slot(be->tok->content);
+      if (*s != t_unknown && *s != t)
+        throw type_mismatch(t, *s, e->tok);
+      unify(*s, t, e->tok);
+      e->type = *s;
+    }
+  else if (ce && !ebt_module::find_builtin(ce->func))
+    {
+      ebt_function *callee = m->find_function(ce->func);
+      if (callee->return_type != t_unknown && callee->return_type != t)
+        throw type_mismatch(t, callee->return_type, e->tok);
+      unify(callee->return_type, t, e->tok);
+      e->type = callee->return_type;
+    }
+  else if (cond)
+    {
+      constrain(cond->truevalue, t);
+      constrain(cond->falsevalue, t);
+      e->type = t;
+    }
+  else if (bine && (bine->op == op_assign || bine->op == op_comma))
+    {
+      if (bine->op == op_assign)
+        constrain(bine->left, t);
+      constrain(bine->right, t);
+      e->type = t;
+    }
+  else
+    throw type_mismatch(t, e->type, e->tok);
+}
+
+void
+typing_visitor::visit_initializer (ebt_global *g)
+{
+  if (!g->initializer)
+    return;
+  type_of(g->initializer);
+  unify(g->value_type, g->initializer);
+}
+
+void
+typing_visitor::visit_foreach_stmt (foreach_stmt *s)
+{
+  basic_expr *array = (basic_expr *) s->array; // -- checked by checking_visitor
+  ebt_global *g = m->find_global(array->tok->content);
+  ebt_type *var = slot(s->identifier);
+  unify(*var, g->key_type, s->tok);
+  unify(g->key_type, *var, s->tok);
+  s->body->visit(this);
+}
+
+void
+typing_visitor::visit_jump_stmt (jump_stmt *s)
+{
+  if (s->kind != j_return || !s->value)
+    return;
+  type_of(s->value);
+  // -- the value returned by a probe handler is ignored
+  if (fn)
+    unify(fn->return_type, s->value);
+}
+
+void
+typing_visitor::visit_basic_expr (basic_expr *e)
+{
+  if (e->tok->type == tok_num)
+    e->type = t_int;
+  else if (e->tok->type == tok_str)
+    e->type = t_str;
+  else if (e->sigil)
+    {
+      ebt_context *c = bp->find_context(e->tok->content);
+      e->type = c->value_type;
+      // -- the index is a constant
+    }
+  else
+    {
+      ebt_global *g = m->find_global(e->tok->content);
+      if (g && g->array_type == d_array)
+        {
+          expr *index = e->chain[0].second;
+          type_of(index);
+          unify(g->key_type, index);
+        }
+      e->type = *slot(e->tok->content);
+    }
+}
+
+void
+typing_visitor::visit_unary_expr (unary_expr *e)
+{
+  type_of(e->operand);
+  if (e->op != op_lnot) // -- any value can be tested for truth
+    constrain(e->operand, t_int);
+  e->type = t_int;
+}
+
+void
+typing_visitor::visit_binary_expr (binary_expr *e)
+{
+  if (e->op == op_in)
+    {
+      basic_expr *array = (basic_expr *) e->right;
+      ebt_global *g = m->find_global(array->tok->content);
+      type_of(e->left);
+      unify(g->key_type, e->left);
+      e->type = t_int;
+      return;
+    }
+
+  type_of(e->left);
+  type_of(e->right);
+  if (e->op >= op_lt && e->op <= op_ne)
+    {
+      unify(e->left, e->right);
+      e->type = t_int;
+    }
+  else if (e->op == op_land || e->op == op_lor)
+    e->type = t_int;
+  else if (e->op == op_assign)
+    {
+      unify(e->left, e->right);
+      e->type = e->left->type;
+    }
+  else if (e->op == op_comma)
+    e->type = e->right->type;
+  else // -- arithmetic, including compound assignment
+    {
+      constrain(e->left, t_int);
+      constrain(e->right, t_int);
+      e->type = t_int;
+    }
+}
+
+void
+typing_visitor::visit_conditional_expr (conditional_expr *e)
+{
+  type_of(e->cond);
+  type_of(e->truevalue);
+  type_of(e->falsevalue);
+  unify(e->truevalue, e->falsevalue);
+  e->type = e->truevalue->type;
+}
+
+void
+typing_visitor::visit_call_expr (call_expr *e)
+{
+  ebt_function *callee = ebt_module::find_builtin(e->func);
+  if (callee)
+    {
+      // TODOXXX printf is the only builtin function so far
+      for (unsigned i = 0; i < e->args.size(); i++)
+        type_of(e->args[i]);
+      constrain(e->args[0], t_str);
+      e->type = callee->return_type;
+      return;
+    }
+
+  callee = m->find_function(e->func);
+  for (unsigned i = 0; i < e->args.size(); i++)
+    {
+      type_of(e->args[i]);
+      unify(callee->argument_types[i], e->args[i]);
+    }
+  e->type = callee->return_type;
+}
+
+// Runs one pass of type inference over every file, returning true if any
+// types were inferred:
+static bool
+infer_types_pass(ebt_module *m)
+{
+  bool changed = false;
+  for (unsigned i = 0; i < m->script_files.size(); i++)
+    {
+      ebt_file *f = m->script_files[i];
+
+      for (map<string, ebt_global *>::iterator it = f->globals.begin();
+           it != f->globals.end(); it++)
+        {
+          map<string, ebt_type> no_locals;
+          typing_visitor v(m, &no_locals);
+          v.visit_initializer(it->second);
+          changed = changed || v.changed;
+        }
+
+      for (map<string, ebt_function *>::iterator it = f->functions.begin();
+           it != f->functions.end(); it++)
+        {
+          ebt_function *fn = it->second;
+          typing_visitor v(m, &fn->locals, fn);
+          fn->body->visit(&v);
+          changed = changed || v.changed;
+        }
+
+      for (unsigned j = 0; j < f->resolved_probes.size(); j++)
+        {
+          basic_probe *bp = f->resolved_probes[j];
+          typing_visitor v(m, &bp->body->locals, NULL, bp);
+          for (unsigned k = 0; k < bp->conditions.size(); k++)
+            bp->conditions[k]->e->visit(&v);
+          if (bp->is_final())
+            bp->body->action->visit(&v);
+          changed = changed || v.changed;
+        }
+    }
+  return changed;
+}
+
+static void
+default_type(ebt_type &t)
+{
+  if (t == t_unknown) t = t_int;
+}
+
+static void
+default_types(map<string, ebt_type> &types)
+{
+  for (map<string, ebt_type>::iterator it = types.begin();
+       it != types.end(); it++)
+    default_type(it->second);
+}
+
+int
+ebt_module::infer_types()
+{
+  try
+    {
+      for (unsigned i = 0; i < script_files.size(); i++)
+        for (map<string, ebt_function *>::iterator it
+               = script_files[i]->functions.begin();
+             it != script_files[i]->functions.end(); it++)
+          it->second->argument_types.resize(it->second->argument_names.size(),
+                                            t_unknown);
+
+      while (infer_types_pass(this)) ;
+
+      // Anything left unconstrained (e.g. an array which is only ever
+      // incremented) is an integer; a last pass then checks every use:
+      for (unsigned i = 0; i < script_files.size(); i++)
+        {
+          ebt_file *f = script_files[i];
+          for (map<string, ebt_global *>::iterator it = f->globals.begin();
+               it != f->globals.end(); it++)
+            {
+              default_type(it->second->value_type);
+              if (it->second->array_type == d_array)
+                default_type(it->second->key_type);
+            }
+          for (map<string, ebt_function *>::iterator it = f->functions.begin();
+               it != f->functions.end(); it++)
+            {
+              ebt_function *fn = it->second;
+              for (unsigned j = 0; j < fn->argument_types.size(); j++)
+                default_type(fn->argument_types[j]);
+              default_type(fn->return_type);
+              default_types(fn->locals);
+            }
+          for (unsigned j = 0; j < f->probes.size(); j++)
+            default_types(f->probes[j]->body->locals);
+        }
+
+      while (infer_types_pass(this)) ;
+    }
+  catch (const semantic_error& se)
+    {
+      print_error(cerr, se);
+      return 1;
+    }
+  return 0;
+}
+
+// --- optimization ---
+
+// Scripts built from templates often contain constant conditions, or
+// globals which are written but never read. Instrumentation is the most
+// expensive code a client contains, so before emitting anything the
+// module folds constants (including globals which are never assigned),
+// removes dead code, and drops the basic probes, globals and functions
+// whose effects cannot be observed.
+
+// Numbers are only folded if they are valid C integer literals:
+static bool
+number_value(expr *e, long long &value)
+{
+  basic_expr *be = dynamic_cast<basic_expr *>(e);
+  if (!be || be->sigil || be->tok->type != tok_num)
+    return false;
+
+  string s = be->tok->content.str();
+  char *end;
+  errno = 0;
+  value = strtoll(s.c_str(), &end, 0);
+  return *end == '\0' && errno == 0;
+}
+
+// Strings are only folded if they contain no escapes:
+static bool
+string_value(expr *e, string &value)
+{
+  basic_expr *be = dynamic_cast<basic_expr *>(e);
+  if (!be || be->sigil || be->tok->type != tok_str)
+    return false;
+
+  value = be->tok->content.str();
+  return value.find('\\') == string::npos;
+}
+
+static bool
+truth_value(expr *e, bool &truth)
+{
+  long long n; string s;
+  if (number_value(e, n))
+    truth = n != 0;
+  else if (string_value(e, s))
+    truth = !s.empty();
+  else
+    return false;
+  return true;
+}
+
+static expr *
+make_number(ebt_file *f, token *at, long long value)
+{
+  ostringstream s; s << value;
+  expr *e = make_number(f, at, f->mem.copy(s.str()).data);
+  e->type = t_int;
+  return e;
+}
+
+// A copy of a literal, e.g. the value of a constant global at its use:
+static expr *
+make_literal(ebt_file *f, token *at, basic_expr *value)
+{
+  token *t = new (f->mem) token(*value->tok);
+  t->location = at->location;
+
+  basic_expr *e = new (f->mem) basic_expr();
+  e->tok = t;
+  e->type = value->type;
+  return e;
+}
+
+static stmt *
+make_expr_stmt(ebt_file *f, expr *e)
+{
+  expr_stmt *s = new (f->mem) expr_stmt();
+  s->tok = e->tok;
+  s->e = e;
+  return s;
+}
+
+static stmt *
+make_empty_stmt(ebt_file *f, token *at)
+{
+  empty_stmt *s = new (f->mem) empty_stmt();
+  s->tok = at;
+  return s;
+}
+
+static compound_stmt *
+make_compound(ebt_file *f, token *at, const vector<stmt *> &stmts)
+{
+  compound_stmt *s = new (f->mem) compound_stmt();
+  s->tok = at;
+  s->stmts = arena_list<stmt *>(f->mem, stmts);
+  return s;
+}
+
+static bool
+is_empty_stmt(stmt *s)
+{
+  compound_stmt *cs = dynamic_cast<compound_stmt *>(s);
+  return dynamic_cast<empty_stmt *>(s) || (cs && cs->stmts.empty());
+}
+
+/* finds whether evaluating an expression can have side effects */
+class effect_checker : public traversing_visitor {
+public:
+  bool has_effects;
+  effect_checker() : has_effects(false) {}
+
+  void visit_unary_expr (unary_expr *e)
+  {
+    if (e->op >= op_preinc) has_effects = true;
+    traversing_visitor::visit_unary_expr(e);
+  }
+
+  void visit_binary_expr (binary_expr *e)
+  {
+    if (e->op >= op_assign && e->op <= op_bor_assign) has_effects = true;
+    traversing_visitor::visit_binary_expr(e);
+  }
+
+  // -- a function may modify globals or print output
+  void visit_call_expr (call_expr *) { has_effects = true; }
+};
+
+static bool
+has_effects(expr *e)
+{
+  effect_checker v;
+  e->visit(&v);
+  return v.has_effects;
+}
+
+// Returns the global which an expression such as 'g = e', 'g[i] += e'
+// or 'g++' updates, provided that it does nothing else:
+static ebt_global *
+update_target(ebt_module *m, expr *e)
+{
+  unary_expr *ue = dynamic_cast<unary_expr *>(e);
+  binary_expr *be = dynamic_cast<binary_expr *>(e);
+  expr *lhs = NULL, *rhs = NULL;
+  if (ue && ue->op >= op_preinc)
+    lhs = ue->operand;
+  else if (be && be->op >= op_assign && be->op <= op_bor_assign)
+    lhs = be->left, rhs = be->right;
+
+  basic_expr *target = dynamic_cast<basic_expr *>(lhs);
+  if (!target || (rhs && has_effects(rhs)))
+    return NULL;
+  if (!target->chain.empty() && has_effects(target->chain[0].second))
+    return NULL;
+  return m->find_global(target->tok->content);
+}
+
+// Small functions are inlined at their call sites, so that a condition
+// such as 'is_powerof2(@op[0])' becomes an expression which emit can
+// check without a call. Only functions whose body is a single 'return E'
+// are inlined, and only if E is no larger than max_inline_size nodes:
+static const unsigned max_inline_size = 24;
+
+/* checks whether a return expression can be substituted for a call */
+class inline_checker : public traversing_visitor {
+  ebt_module *m;
+  ebt_function *fn;
+
+  void check_write(expr *target)
+  {
+    if (!m->find_global(target->tok->content)) inlinable = false;
+  }
+
+public:
+  bool inlinable;
+  unsigned size;
+  map<string, unsigned> uses; // -- of each argument
+
+  inline_checker(ebt_module *m, ebt_function *fn)
+    : m(m), fn(fn), inlinable(true), size(0) {}
+
+  void visit_basic_expr (basic_expr *e)
+  {
+    size++;
+    if (e->sigil)
+      inlinable = false; // -- the context depends on the caller
+    else if (e->tok->type != tok_ident)
+      ;
+    else if (find(fn->argument_names.begin(), fn->argument_names.end(),
+                  e->tok->content) != fn->argument_names.end())
+      {
+        if (!e->chain.empty()) inlinable = false;
+        uses[e->tok->content]++;
+      }
+    else if (!m->find_global(e->tok->content))
+      inlinable = false; // -- a local of the function
+    traversing_visitor::visit_basic_expr(e);
+  }
+
+  void visit_unary_expr (unary_expr *e)
+  {
+    size++;
+    if (e->op >= op_preinc) check_write(e->operand);
+    traversing_visitor::visit_unary_expr(e);
+  }
+
+  void visit_binary_expr (binary_expr *e)
+  {
+    size++;
+    if (e->op >= op_assign && e->op <= op_bor_assign) check_write(e->left);
+    traversing_visitor::visit_binary_expr(e);
+  }
+
+  void visit_conditional_expr (conditional_expr *e)
+  {
+    size++;
+    traversing_visitor::visit_conditional_expr(e);
+  }
+
+  void visit_call_expr (call_expr *e)
+  {
+    size++;
+    if (e->func == fn->name) inlinable = false; // -- recursive
+    traversing_visitor::visit_call_expr(e);
+  }
+};
+
+// Returns the expression returned by fn, if fn can be inlined:
+static expr *
+inline_body(ebt_function *fn, inline_checker &c)
+{
+  if (fn->is_builtin) return NULL;
+
+  stmt *s = fn->body;
+  compound_stmt *cs = dynamic_cast<compound_stmt *>(s);
+  if (cs && cs->stmts.size() == 1) s = cs->stmts[0];
+  jump_stmt *js = dynamic_cast<jump_stmt *>(s);
+  if (!js || js->kind != j_return || !js->value)
+    return NULL;
+
+  js->value->visit(&c);
+  return c.inlinable && c.size <= max_inline_size ? js->value : NULL;
+}
+
+// An argument may be used more than once, or by a return expression which
+// updates globals, only if it is a literal, a context value or a local:
+static bool
+is_stable(ebt_module *m, expr *e)
+{
+  basic_expr *be = dynamic_cast<basic_expr *>(e);
+  if (!be) return false;
+  if (be->sigil)
+    {
+      long long index;
+      for (unsigned i = 0; i < be->chain.size(); i++)
+        if (be->chain[i].first == chain_index
+            && !number_value(be->chain[i].second, index))
+          return false;
+      return true;
+    }
+  return be->tok->type != tok_ident
+    || (be->chain.empty() && !m->find_global(be->tok->content));
+}
+
+// Copies e into f, replacing each argument by a copy of its value:
+static expr *
+copy_expr(ebt_file *f, expr *e, const map<string, expr *> &args)
+{
+  static const map<string, expr *> no_args;
+
+  if (basic_expr *be = dynamic_cast<basic_expr *>(e))
+    {
+      map<string, expr *>::const_iterator it = args.find(be->tok->content);
+      if (!be->sigil && be->tok->type == tok_ident && it != args.end())
+        return copy_expr(f, it->second, no_args);
+
+      basic_expr *c = new (f->mem) basic_expr(*be);
+      vector<chain_item> chain;
+      for (unsigned i = 0; i < be->chain.size(); i++)
+        chain.push_back(be->chain[i].first == chain_index
+                        ? chain_item(chain_index,
+                                     copy_expr(f, be->chain[i].second, args))
+                        : be->chain[i]);
+      c->chain = arena_list<chain_item>(f->mem, chain);
+      return c;
+    }
+  else if (unary_expr *ue = dynamic_cast<unary_expr *>(e))
+    {
+      unary_expr *c = new (f->mem) unary_expr(*ue);
+      c->operand = copy_expr(f, ue->operand, args);
+      return c;
+    }
+  else if (binary_expr *be = dynamic_cast<binary_expr *>(e))
+    {
+      binary_expr *c = new (f->mem) binary_expr(*be);
+      c->left = copy_expr(f, be->left, args);
+      c->right = copy_expr(f, be->right, args);
+      return c;
+    }
+  else if (conditional_expr *ce = dynamic_cast<conditional_expr *>(e))
+    {
+      conditional_expr *c = new (f->mem) conditional_expr(*ce);
+      c->cond = copy_expr(f, ce->cond, args);
+      c->truevalue = copy_expr(f, ce->truevalue, args);
+      c->falsevalue = copy_expr(f, ce->falsevalue, args);
+      return c;
+    }
+  else if (call_expr *ce = dynamic_cast<call_expr *>(e))
+    {
+      call_expr *c = new (f->mem) call_expr(*ce);
+      vector<expr *> call_args;
+      for (unsigned i = 0; i < ce->args.size(); i++)
+        call_args.push_back(copy_expr(f, ce->args[i], args));
+      c->args = arena_list<expr *>(f->mem, call_args);
+      return c;
+    }
+  return e; // -- no other kinds of expressions
+}
+
+/* finds the globals which are assigned anywhere */
+class write_collector : public traversing_visitor {
+  ebt_module *m;
+
+  void add_write(const string &name)
+  {
+    ebt_global *g = m->find_global(name);
+    if (g) written.insert(g);
+  }
 
 public:
-  resolving_visitor(probe *pr) : orig_probe(pr) {}
+  set<ebt_global *> written;
+  write_collector(ebt_module *m) : m(m) {}
+
+  void visit_foreach_stmt (foreach_stmt *s)
+  {
+    add_write(s->identifier);
+    traversing_visitor::visit_foreach_stmt(s);
+  }
+
+  void visit_unary_expr (unary_expr *e)
+  {
+    if (e->op >= op_preinc)
+      add_write(e->operand->tok->content); // -- checked by checking_visitor
+    traversing_visitor::visit_unary_expr(e);
+  }
+
+  void visit_binary_expr (binary_expr *e)
+  {
+    if (e->op >= op_assign && e->op <= op_bor_assign)
+      add_write(e->left->tok->content);
+    traversing_visitor::visit_binary_expr(e);
+  }
+};
+
+// Folds constant expressions, substitutes the values of constant globals
+// and removes statements without effect (including updates of globals in
+// dead), replacing each node by its simplified form:
+class simplifying_visitor : public traversing_visitor {
+  ebt_module *m;
+  ebt_file *f;
+  const map<ebt_global *, basic_expr *> &constants;
+  const set<ebt_global *> &dead;
 
-  vector<basic_probe *> resolved_probes;
+  expr *inline_call(call_expr *e);
 
-  void visit_named_event (named_event *c);
-  void visit_conditional_event (conditional_event *c);
-  void visit_compound_event (compound_event *c);
+  expr *e_result;
+  stmt *s_result; // -- NULL if the statement can be removed
+
+public:
+  set<ebt_function *> expanding; // -- not to be inlined again
+
+  simplifying_visitor(ebt_module *m, ebt_file *f,
+                      const map<ebt_global *, basic_expr *> &constants,
+                      const set<ebt_global *> &dead)
+    : m(m), f(f), constants(constants), dead(dead) {}
+
+  expr *simplify(expr *e) { e_result = e; e->visit(this); return e_result; }
+  stmt *simplify(stmt *s) { s_result = s; s->visit(this); return s_result; }
+
+  void visit_empty_stmt (empty_stmt *s);
+  void visit_expr_stmt (expr_stmt *s);
+  void visit_compound_stmt (compound_stmt *s);
+  void visit_ifthen_stmt (ifthen_stmt *s);
+  void visit_loop_stmt (loop_stmt *s);
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_jump_stmt (jump_stmt *s);
+
+  void visit_basic_expr (basic_expr *e);
+  void visit_unary_expr (unary_expr *e);
+  void visit_binary_expr (binary_expr *e);
+  void visit_conditional_expr (conditional_expr *e);
+  void visit_call_expr (call_expr *e);
 };
 
 void
-resolving_visitor::visit_named_event (named_event *c)
+simplifying_visitor::visit_empty_stmt (empty_stmt *)
 {
-  // TODOXXX
+  s_result = NULL;
+}
+
+void
+simplifying_visitor::visit_expr_stmt (expr_stmt *s)
+{
+  s->e = simplify(s->e);
+  ebt_global *target = update_target(m, s->e);
+  if ((target && dead.count(target)) || !has_effects(s->e))
+    s_result = NULL;
+  else
+    s_result = s;
+}
+
+void
+simplifying_visitor::visit_compound_stmt (compound_stmt *s)
+{
+  vector<stmt *> stmts;
+  for (unsigned i = 0; i < s->stmts.size(); i++)
+    {
+      stmt *result = simplify(s->stmts[i]);
+      if (result) stmts.push_back(result);
+      // -- anything after a jump is unreachable
+      if (dynamic_cast<jump_stmt *>(result)) break;
+    }
+
+  if (stmts.empty())
+    s_result = NULL;
+  else if (stmts.size() == s->stmts.size())
+    {
+      for (unsigned i = 0; i < stmts.size(); i++)
+        s->stmts[i] = stmts[i];
+      s_result = s;
+    }
+  else
+    s_result = make_compound(f, s->tok, stmts);
+}
+
+void
+simplifying_visitor::visit_ifthen_stmt (ifthen_stmt *s)
+{
+  s->condition = simplify(s->condition);
+
+  bool truth;
+  if (truth_value(s->condition, truth))
+    {
+      stmt *taken = truth ? s->then_stmt : s->else_stmt;
+      s_result = taken ? simplify(taken) : NULL;
+      return;
+    }
+
+  stmt *then_stmt = simplify(s->then_stmt);
+  stmt *else_stmt = s->else_stmt ? simplify(s->else_stmt) : NULL;
+  if (!then_stmt && !else_stmt)
+    {
+      s_result = has_effects(s->condition)
+        ? make_expr_stmt(f, s->condition) : NULL;
+      return;
+    }
+
+  if (!then_stmt)
+    {
+      // -- 'if (c) ; else S' is 'if (!c) S'
+      s->condition = make_unary(f, op_lnot, s->condition);
+      s->condition->type = t_int;
+      then_stmt = else_stmt; else_stmt = NULL;
+    }
+  s->then_stmt = then_stmt;
+  s->else_stmt = else_stmt;
+  s_result = s;
+}
+
+void
+simplifying_visitor::visit_loop_stmt (loop_stmt *s)
+{
+  if (s->initial) s->initial = simplify(s->initial);
+  if (s->condition) s->condition = simplify(s->condition);
+  if (s->update) s->update = simplify(s->update);
+
+  bool truth;
+  if (s->condition && truth_value(s->condition, truth))
+    {
+      if (!truth)
+        {
+          s_result = s->initial && has_effects(s->initial)
+            ? make_expr_stmt(f, s->initial) : NULL;
+          return;
+        }
+      s->condition = NULL;
+    }
+
+  stmt *body = simplify(s->body);
+  s->body = body ? body : make_empty_stmt(f, s->body->tok);
+  s_result = s;
+}
+
+void
+simplifying_visitor::visit_foreach_stmt (foreach_stmt *s)
+{
+  // -- the loop assigns the variable even if the body does nothing
+  stmt *body = simplify(s->body);
+  s->body = body ? body : make_empty_stmt(f, s->body->tok);
+  s_result = s;
+}
+
+void
+simplifying_visitor::visit_jump_stmt (jump_stmt *s)
+{
+  if (s->value) s->value = simplify(s->value);
+  s_result = s;
+}
+
+void
+simplifying_visitor::visit_basic_expr (basic_expr *e)
+{
+  e_result = e;
+  if (e->sigil || e->tok->type != tok_ident)
+    return; // -- the index of a context value is a constant
+
+  ebt_global *g = m->find_global(e->tok->content);
+  map<ebt_global *, basic_expr *>::const_iterator it = constants.find(g);
+  if (it != constants.end())
+    {
+      e_result = make_literal(f, e->tok, it->second);
+      return;
+    }
+
+  if (!e->chain.empty() && e->chain[0].first == chain_index)
+    e->chain[0].second = simplify(e->chain[0].second);
+  e_result = e;
+}
+
+void
+simplifying_visitor::visit_unary_expr (unary_expr *e)
+{
+  e->operand = simplify(e->operand);
+  e_result = e;
+
+  long long n, result; bool truth;
+  if (e->op == op_lnot && truth_value(e->operand, truth))
+    e_result = make_number(f, e->tok, !truth);
+  else if (e->op <= op_bnot && number_value(e->operand, n))
+    {
+      // -- n is never LLONG_MIN, which has no literal in C
+      result = e->op == op_plus ? n : e->op == op_neg ? -n : ~n;
+      if (result != LLONG_MIN)
+        e_result = make_number(f, e->tok, result);
+    }
+}
+
+// Folds an operator of the scripting language, returning false if the
+// result is not known at translation time:
+static bool
+fold_numbers(expr_op op, long long x, long long y, long long &result)
+{
+  typedef unsigned long long uint64;
+  switch (op) {
+  // -- arithmetic wraps around like the target's arithmetic
+  case op_mul: result = (long long) ((uint64) x * (uint64) y); return true;
+  case op_add: result = (long long) ((uint64) x + (uint64) y); return true;
+  case op_sub: result = (long long) ((uint64) x - (uint64) y); return true;
+  // -- division by zero yields 0, like ebt_div() and ebt_mod()
+  case op_div: case op_mod:
+    if (y == -1 && x == LLONG_MIN) return false;
+    result = y == 0 ? 0 : op == op_div ? x / y : x % y;
+    return true;
+  // -- the count is taken modulo 64, like the target's shifts
+  case op_shl: case op_shr:
+    y &= 63;
+    result = op == op_shl ? (long long) ((uint64) x << y) : x >> y;
+    return true;
+  case op_lt: result = x < y; return true;
+  case op_le: result = x <= y; return true;
+  case op_gt: result = x > y; return true;
+  case op_ge: result = x >= y; return true;
+  case op_eq: result = x == y; return true;
+  case op_ne: result = x != y; return true;
+  case op_band: result = x & y; return true;
+  case op_bxor: result = x ^ y; return true;
+  case op_bor: result = x | y; return true;
+  default: return false;
+  }
+}
+
+void
+simplifying_visitor::visit_binary_expr (binary_expr *e)
+{
+  e->left = simplify(e->left);
+  e->right = simplify(e->right);
+  e_result = e;
+
+  long long x, y, result; string s, t; bool truth;
+  if (e->op == op_land || e->op == op_lor)
+    {
+      // -- the right operand is not evaluated if the left decides
+      if (!truth_value(e->left, truth))
+        {
+          // -- ... but a pure left operand may be dropped if the right does
+          if (truth_value(e->right, truth) && truth == (e->op == op_lor)
+              && !has_effects(e->left))
+            e_result = make_number(f, e->tok, truth);
+          return;
+        }
+      if (truth == (e->op == op_lor))
+        e_result = make_number(f, e->tok, truth);
+      else if (truth_value(e->right, truth))
+        e_result = make_number(f, e->tok, truth);
+    }
+  else if (e->op == op_comma)
+    {
+      if (!has_effects(e->left))
+        e_result = e->right;
+    }
+  else if (e->op <= op_bor && number_value(e->left, x)
+           && number_value(e->right, y))
+    {
+      if (fold_numbers(e->op, x, y, result) && result != LLONG_MIN)
+        e_result = make_number(f, e->tok, result);
+    }
+  else if (e->op >= op_lt && e->op <= op_ne && string_value(e->left, s)
+           && string_value(e->right, t))
+    {
+      fold_numbers(e->op, s.compare(t), 0, result);
+      e_result = make_number(f, e->tok, result);
+    }
+}
+
+void
+simplifying_visitor::visit_conditional_expr (conditional_expr *e)
+{
+  e->cond = simplify(e->cond);
+  e->truevalue = simplify(e->truevalue);
+  e->falsevalue = simplify(e->falsevalue);
+
+  bool truth;
+  if (truth_value(e->cond, truth))
+    e_result = truth ? e->truevalue : e->falsevalue;
+  else
+    e_result = e;
+}
+
+void
+simplifying_visitor::visit_call_expr (call_expr *e)
+{
+  for (unsigned i = 0; i < e->args.size(); i++)
+    e->args[i] = simplify(e->args[i]);
+  expr *inlined = inline_call(e);
+  e_result = inlined ? inlined : e;
+}
+
+// Returns the simplified body of the function called by e, or NULL:
+expr *
+simplifying_visitor::inline_call (call_expr *e)
+{
+  ebt_function *fn = m->find_function(e->func);
+  if (!fn || expanding.count(fn)
+      || fn->argument_names.size() != e->args.size())
+    return NULL;
+
+  inline_checker c(m, fn);
+  expr *body = inline_body(fn, c);
+  if (!body)
+    return NULL;
+
+  bool updates = has_effects(body);
+  map<string, expr *> args;
+  for (unsigned i = 0; i < e->args.size(); i++)
+    {
+      expr *arg = e->args[i];
+      if (has_effects(arg)) return NULL; // -- would be reordered or dropped
+      if ((updates || c.uses[fn->argument_names[i]] > 1) && !is_stable(m, arg))
+        return NULL;
+      args[fn->argument_names[i]] = arg;
+    }
+
+  expanding.insert(fn);
+  expr *result = simplify(copy_expr(f, body, args));
+  expanding.erase(fn);
+  return result;
+}
+
+// Finds the globals and functions which can affect the output of the
+// script. Every use is attributed to an owner: the probe handlers and
+// conditions themselves (the roots), a function (for uses in its body),
+// or a global (for uses in its initializer and in statements which do
+// nothing but update it). Only the owners reachable from the roots are
+// live. Also finds every global which is still referred to at all.
+struct dependencies {
+  set<ebt_global *> globals;
+  set<ebt_function *> functions;
+};
+
+class liveness_visitor : public traversing_visitor {
+  ebt_module *m;
+  dependencies *owner;
+
+  dependencies roots;
+  map<ebt_global *, dependencies> global_deps;
+  map<ebt_function *, dependencies> function_deps;
+
+public:
+  set<ebt_global *> referenced;
+
+  liveness_visitor(ebt_module *m) : m(m), owner(&roots) {}
+
+  void collect(ebt_file *f);
+  void find_live(set<ebt_global *> &globals, set<ebt_function *> &functions);
+
+  void visit_expr_stmt (expr_stmt *s);
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_basic_expr (basic_expr *e);
+  void visit_call_expr (call_expr *e);
+};
+
+void
+liveness_visitor::collect(ebt_file *f)
+{
+  for (map<string, ebt_function *>::iterator it = f->functions.begin();
+       it != f->functions.end(); it++)
+    {
+      owner = &function_deps[it->second];
+      it->second->body->visit(this);
+    }
+
+  for (map<string, ebt_global *>::iterator it = f->globals.begin();
+       it != f->globals.end(); it++)
+    {
+      ebt_global *g = it->second;
+      if (!g->initializer) continue;
+      // -- the initializer runs even if the global is never used
+      owner = has_effects(g->initializer) ? &roots : &global_deps[g];
+      g->initializer->visit(this);
+    }
+
+  owner = &roots;
+  for (unsigned i = 0; i < f->resolved_probes.size(); i++)
+    {
+      basic_probe *bp = f->resolved_probes[i];
+      for (unsigned j = 0; j < bp->conditions.size(); j++)
+        bp->conditions[j]->e->visit(this);
+      if (bp->is_final())
+        bp->body->action->visit(this);
+    }
+}
+
+void
+liveness_visitor::find_live(set<ebt_global *> &globals,
+                            set<ebt_function *> &functions)
+{
+  vector<dependencies *> worklist(1, &roots);
+  while (!worklist.empty())
+    {
+      dependencies *d = worklist.back(); worklist.pop_back();
+      for (set<ebt_global *>::iterator it = d->globals.begin();
+           it != d->globals.end(); it++)
+        if (globals.insert(*it).second)
+          worklist.push_back(&global_deps[*it]);
+      for (set<ebt_function *>::iterator it = d->functions.begin();
+           it != d->functions.end(); it++)
+        if (functions.insert(*it).second)
+          worklist.push_back(&function_deps[*it]);
+    }
+}
+
+void
+liveness_visitor::visit_expr_stmt (expr_stmt *s)
+{
+  ebt_global *target = update_target(m, s->e);
+  if (!target)
+    {
+      s->e->visit(this);
+      return;
+    }
+
+  // -- the target is referenced, but not read by its own update
+  referenced.insert(target);
+  dependencies *saved = owner;
+  owner = &global_deps[target];
+  unary_expr *ue = dynamic_cast<unary_expr *>(s->e);
+  binary_expr *be = dynamic_cast<binary_expr *>(s->e);
+  basic_expr *lhs = (basic_expr *) (ue ? ue->operand : be->left);
+  if (!lhs->chain.empty())
+    lhs->chain[0].second->visit(this);
+  if (be)
+    be->right->visit(this);
+  owner = saved;
+}
+
+void
+liveness_visitor::visit_foreach_stmt (foreach_stmt *s)
+{
+  ebt_global *g = m->find_global(s->identifier);
+  if (g) referenced.insert(g);
+  traversing_visitor::visit_foreach_stmt(s);
+}
+
+void
+liveness_visitor::visit_basic_expr (basic_expr *e)
+{
+  if (!e->sigil && e->tok->type == tok_ident)
+    {
+      ebt_global *g = m->find_global(e->tok->content);
+      if (g)
+        {
+          owner->globals.insert(g);
+          referenced.insert(g);
+        }
+    }
+  traversing_visitor::visit_basic_expr(e);
+}
+
+void
+liveness_visitor::visit_call_expr (call_expr *e)
+{
+  if (!ebt_module::find_builtin(e->func))
+    owner->functions.insert(m->find_function(e->func));
+  traversing_visitor::visit_call_expr(e);
+}
+
+/* finds the local variables used in a statement */
+class local_collector : public traversing_visitor {
+public:
+  set<string> names;
+
+  void visit_foreach_stmt (foreach_stmt *s)
+  {
+    names.insert(s->identifier);
+    traversing_visitor::visit_foreach_stmt(s);
+  }
+
+  void visit_basic_expr (basic_expr *e)
+  {
+    if (!e->sigil && e->tok->type == tok_ident)
+      names.insert(e->tok->content);
+    traversing_visitor::visit_basic_expr(e);
+  }
+};
+
+static void
+prune_locals(stmt *body, map<string, ebt_type> &locals)
+{
+  local_collector v;
+  body->visit(&v);
+  for (map<string, ebt_type>::iterator it = locals.begin();
+       it != locals.end(); )
+    if (v.names.count(it->first))
+      it++;
+    else
+      locals.erase(it++);
+}
+
+// A condition 'a && b' is checked as two conditions, so that emit can
+// check a static part at instrumentation time even if the rest is dynamic:
+static void
+split_conjunction(expr *e, vector<expr *> &parts)
+{
+  binary_expr *be = dynamic_cast<binary_expr *>(e);
+  if (be && be->op == op_land && !has_effects(be->left)
+      && !has_effects(be->right))
+    {
+      split_conjunction(be->left, parts);
+      split_conjunction(be->right, parts);
+    }
+  else
+    parts.push_back(e);
 }
 
-void
-resolving_visitor::visit_conditional_event (conditional_event *c)
+// Simplifies the handlers and conditions of f's basic probes, then drops
+// the basic probes which can never fire or have no effect:
+static void
+simplify_probes(ebt_module *m, ebt_file *f,
+                const map<ebt_global *, basic_expr *> &constants,
+                const set<ebt_global *> &dead)
 {
-  // TODOXXX
+  simplifying_visitor v(m, f, constants, dead);
+
+  set<handler *> simplified, unobservable;
+  map<handler *, set<unsigned> > stages; // -- stages which can still fire
+  vector<basic_probe *> kept;
+  for (unsigned i = 0; i < f->resolved_probes.size(); i++)
+    {
+      basic_probe *bp = f->resolved_probes[i];
+      handler *h = bp->body;
+      if (bp->is_final() && !simplified.count(h))
+        {
+          simplified.insert(h);
+          stmt *action = v.simplify(h->action);
+          h->action = action ? action
+            : make_compound(f, h->action->tok, vector<stmt *>());
+          if (is_empty_stmt(h->action)) unobservable.insert(h);
+        }
+
+      bool fires = true;
+      vector<condition *> conditions;
+      for (unsigned j = 0; j < bp->conditions.size(); j++)
+        {
+          condition *c = bp->conditions[j];
+          vector<expr *> parts;
+          split_conjunction(v.simplify(c->e), parts);
+          for (unsigned k = 0; k < parts.size(); k++)
+            {
+              bool truth;
+              if (truth_value(parts[k], truth))
+                {
+                  if (!truth) fires = false;
+                  continue;
+                }
+              if (k > 0)
+                {
+                  c = new (f->mem) condition();
+                  c->id = bp->get_variable_ticket();
+                }
+              c->e = parts[k];
+              conditions.push_back(c);
+            }
+        }
+      bp->conditions = conditions;
+
+      if (fires)
+        {
+          kept.push_back(bp);
+          stages[h].insert(bp->stage);
+        }
+    }
+
+  // A sequence with a stage which can never fire never completes, and the
+  // earlier stages of a handler without effect need not be tracked:
+  f->resolved_probes.clear();
+  for (unsigned i = 0; i < kept.size(); i++)
+    {
+      handler *h = kept[i]->body;
+      if (!unobservable.count(h) && stages[h].size() == kept[i]->num_stages)
+        f->resolved_probes.push_back(kept[i]);
+    }
 }
 
 void
-resolving_visitor::visit_compound_event (compound_event *c)
+ebt_module::optimize()
 {
-  // TODOXXX
+  set<ebt_global *> dead;
+  for (;;)
+    {
+      // Globals which are never assigned keep the value they start with:
+      write_collector writes(this);
+      for (unsigned i = 0; i < script_files.size(); i++)
+        {
+          ebt_file *f = script_files[i];
+          for (unsigned j = 0; j < f->resolved_probes.size(); j++)
+            if (f->resolved_probes[j]->is_final())
+              f->resolved_probes[j]->body->action->visit(&writes);
+          for (map<string, ebt_function *>::iterator it = f->functions.begin();
+               it != f->functions.end(); it++)
+            it->second->body->visit(&writes);
+          for (map<string, ebt_global *>::iterator it = f->globals.begin();
+               it != f->globals.end(); it++)
+            if (it->second->initializer)
+              it->second->initializer->visit(&writes);
+        }
+
+      map<ebt_global *, basic_expr *> constants;
+      for (unsigned i = 0; i < script_files.size(); i++)
+        for (map<string, ebt_global *>::iterator it
+               = script_files[i]->globals.begin();
+             it != script_files[i]->globals.end(); it++)
+          {
+            ebt_global *g = it->second;
+            basic_expr *init = dynamic_cast<basic_expr *>(g->initializer);
+            if (g->array_type == d_scalar && !writes.written.count(g)
+                && init && !init->sigil
+                && (init->tok->type == tok_num || init->tok->type == tok_str))
+              constants[g] = init;
+          }
+
+      for (unsigned i = 0; i < script_files.size(); i++)
+        {
+          ebt_file *f = script_files[i];
+          simplify_probes(this, f, constants, dead);
+
+          simplifying_visitor v(this, f, constants, dead);
+          for (map<string, ebt_function *>::iterator it = f->functions.begin();
+               it != f->functions.end(); it++)
+            {
+              ebt_function *fn = it->second;
+              v.expanding.insert(fn);
+              stmt *body = v.simplify(fn->body);
+              v.expanding.erase(fn);
+              fn->body = body ? body
+                : make_compound(f, fn->body->tok, vector<stmt *>());
+            }
+        }
+
+      // Anything which the remaining probes cannot reach is dead:
+      liveness_visitor live(this);
+      for (unsigned i = 0; i < script_files.size(); i++)
+        live.collect(script_files[i]);
+      set<ebt_global *> live_globals;
+      set<ebt_function *> live_functions;
+      live.find_live(live_globals, live_functions);
+
+      bool changed = false;
+      for (unsigned i = 0; i < script_files.size(); i++)
+        {
+          ebt_file *f = script_files[i];
+          for (map<string, ebt_function *>::iterator it = f->functions.begin();
+               it != f->functions.end(); )
+            if (live_functions.count(it->second))
+              it++;
+            else
+              {
+                f->functions.erase(it++);
+                changed = true;
+              }
+
+          for (map<string, ebt_global *>::iterator it = f->globals.begin();
+               it != f->globals.end(); )
+            {
+              ebt_global *g = it->second;
+              if (live_globals.count(g))
+                it++;
+              else if (!live.referenced.count(g)
+                       && !(g->initializer && has_effects(g->initializer)))
+                {
+                  f->globals.erase(it++);
+                  changed = true;
+                }
+              else
+                {
+                  // -- its updates are removed by the next round
+                  if (dead.insert(g).second) changed = true;
+                  it++;
+                }
+            }
+        }
+
+      if (!changed)
+        break;
+    }
+
+  // Code which was removed may have used some of the locals:
+  for (unsigned i = 0; i < script_files.size(); i++)
+    {
+      ebt_file *f = script_files[i];
+      for (map<string, ebt_function *>::iterator it = f->functions.begin();
+           it != f->functions.end(); it++)
+        prune_locals(it->second->body, it->second->locals);
+      for (unsigned j = 0; j < f->resolved_probes.size(); j++)
+        prune_locals(f->resolved_probes[j]->body->action,
+                     f->resolved_probes[j]->body->locals);
+    }
 }
 
 // --- methods for ebt_module ---
 
 map<string, ebt_event *> ebt_module::builtin_events;
 map<string, ebt_function *> ebt_module::builtin_functions;
+pthread_once_t ebt_module::builtins_initialized = PTHREAD_ONCE_INIT;
 
-ebt_module::ebt_module()
-  : handler_ticket(0), global_ticket(0), last_pass(4)
+void
+ebt_module::init_builtins()
 {
   // Initialize builtin_events and corresponding context values:
-  if (builtin_events.empty())
   {
     ebt_event *e_begin = new ebt_event("begin"); // TODOXXX
     e_begin->mechanism = EV_BEGIN;
@@ -77,16 +2093,32 @@ ebt_module::ebt_module()
     e_end->mechanism = EV_END;
     builtin_events["end"] = e_end;
 
+    ebt_event *e_thread = new ebt_event("thread");
+    e_thread->mechanism = EV_NONE;
+    builtin_events["thread"] = e_thread;
+
+    ebt_event *e_tbegin = new ebt_event("begin", e_thread);
+    e_tbegin->mechanism = EV_TBEGIN;
+    e_tbegin->context["tid"] = new ebt_context(l_static, t_int);
+    e_thread->subevents["begin"] = e_tbegin;
+
+    ebt_event *e_tend = new ebt_event("end", e_thread);
+    e_tend->mechanism = EV_TEND;
+    e_tend->context["tid"] = new ebt_context(l_static, t_int);
+    e_thread->subevents["end"] = e_tend;
+
     ebt_event *e_insn = new ebt_event("insn");
     e_insn->mechanism = EV_INSN;
     e_insn->context["opcode"] = new ebt_context(l_static, t_str);
     e_insn->context["op"] = new ebt_context(l_dynamic, t_int, d_array);
     e_insn->context["op"]->key_type = t_int;
+    e_insn->context["tid"] = new ebt_context(l_static, t_int);
     builtin_events["insn"] = e_insn;
 
     ebt_event *e_function = new ebt_event("function");
     e_function->mechanism = EV_NONE;
     e_function->context["name"] = new ebt_context(l_static, t_str);
+    e_function->context["tid"] = new ebt_context(l_static, t_int);
     builtin_events["function"] = e_function;
 
     ebt_event *e_fentry = new ebt_event("entry", e_function);
@@ -101,53 +2133,270 @@ ebt_module::ebt_module()
   }
 
   // Initialize builtin_functions:
-  if (builtin_functions.empty())
   {
     ebt_function *f_printf = new ebt_function("printf");
     // printf() is variadic, so we can't hardcode argument_types
-    f_printf->return_type = t_void;
+    f_printf->return_type = t_int; // -- always 0
+
     f_printf->is_builtin = true;
     builtin_functions["printf"] = f_printf;
   }
 }
 
+ebt_module::ebt_module()
+  : handler_ticket(0), global_ticket(0), last_pass(4), optimize_ir(true)
+{
+  pthread_once(&builtins_initialized, init_builtins);
+  pthread_mutex_init(&sources_lock, NULL);
+}
+
+ebt_module::~ebt_module()
+{
+  for (unsigned i = 0; i < script_files.size(); i++)
+    delete script_files[i];
+  for (unsigned i = 0; i < sources.size(); i++)
+    delete sources[i];
+  for (unsigned i = 0; i < libraries.size(); i++)
+    delete libraries[i];
+  pthread_mutex_destroy(&sources_lock);
+}
+
+void
+ebt_module::keep_source(mapped_file *source)
+{
+  pthread_mutex_lock(&sources_lock);
+  sources.push_back(source);
+  pthread_mutex_unlock(&sources_lock);
+}
+
+ebt_event *
+ebt_module::find_event(const string& name)
+{
+  map<string, ebt_event *>::iterator it = builtin_events.find(name);
+  return it == builtin_events.end() ? NULL : it->second;
+}
+
+ebt_function *
+ebt_module::find_builtin(const string& name)
+{
+  map<string, ebt_function *>::iterator it = builtin_functions.find(name);
+  return it == builtin_functions.end() ? NULL : it->second;
+}
+
+ebt_function *
+ebt_module::find_function(const string& name) const
+{
+  for (unsigned i = 0; i < script_files.size(); i++)
+    {
+      map<string, ebt_function *>::const_iterator it
+        = script_files[i]->functions.find(name);
+      if (it != script_files[i]->functions.end()) return it->second;
+    }
+  return NULL;
+}
+
+ebt_global *
+ebt_module::find_global(const string& name) const
+{
+  for (unsigned i = 0; i < script_files.size(); i++)
+    {
+      map<string, ebt_global *>::const_iterator it
+        = script_files[i]->globals.find(name);
+      if (it != script_files[i]->globals.end()) return it->second;
+    }
+  return NULL;
+}
+
+mapped_file *
+ebt_module::map_source(const string& path)
+{
+  mapped_file *source = new mapped_file;
+  if (!source->open(path)) {
+    string mesg("cannot open script file '" + path + "'");
+    perror(mesg.c_str());
+    delete source;
+    return NULL;
+  }
+
+  keep_source(source);
+  return source;
+}
+
+string
+ebt_module::find_library(const string& name, vector<string> *declared)
+{
+  // Directories are only indexed once some name is actually looked up:
+  for (unsigned i = 0; i < library_dirs.size(); i++)
+    {
+      if (i == libraries.size())
+        libraries.push_back(new library_index(this, library_dirs[i]));
+
+      string path = libraries[i]->lookup(name, declared);
+      if (path != "") return path;
+    }
+  return "";
+}
+
+ebt_file *
+ebt_module::load_library(const string& path, ir_cache& cache)
+{
+  mapped_file *source = map_source(path);
+  if (source == NULL) return NULL;
+
+  // Unless the source has changed, use the IR from an earlier run:
+  string hash = ir_cache::content_hash(source->data, source->size);
+  ebt_file *lib = cache.load(this, path, hash);
+  if (lib == NULL)
+    {
+      lib = parse(this, source->data, source->size, path);
+      if (lib == NULL) return NULL;
+      cache.store(lib, hash);
+    }
+
+  return lib;
+}
+
+struct library_batch {
+  ebt_module *m;
+  ir_cache *cache;
+  vector<string> paths;
+  vector<ebt_file *> results;
+};
+
+static void
+load_library_task(void *arg, unsigned i)
+{
+  library_batch *b = (library_batch *) arg;
+  b->results[i] = b->m->load_library(b->paths[i], *b->cache);
+}
+
+int
+ebt_module::load_libraries(thread_pool& pool)
+{
+  reference_collector refs;
+  for (unsigned i = 0; i < script_files.size(); i++)
+    refs.collect(script_files[i]);
+
+  // Libraries are loaded in rounds: each round loads (in parallel) the
+  // files providing references found so far, whose own references are
+  // appended to refs.references for the next round.
+  ir_cache cache;
+  set<string> loaded;
+  unsigned next_ref = 0;
+  for (;;)
+    {
+      library_batch batch;
+      batch.m = this; batch.cache = &cache;
+
+      set<string> provided; // -- by the files in this round
+      for (; next_ref < refs.references.size(); next_ref++)
+        {
+          const string& name = refs.references[next_ref];
+          if (builtin_functions.count(name) || provided.count(name)) continue;
+
+          bool is_declared = false;
+          for (unsigned j = 0; j < script_files.size() && !is_declared; j++)
+            is_declared = script_files[j]->functions.count(name)
+              || script_files[j]->globals.count(name);
+          if (is_declared) continue;
+
+          // An unknown name need not be an error -- it may be a local variable:
+          vector<string> declared;
+          string path = find_library(name, &declared);
+          if (path == "" || loaded.count(path)) continue;
+          loaded.insert(path);
+
+          batch.paths.push_back(path);
+          provided.insert(declared.begin(), declared.end());
+        }
+
+      if (batch.paths.empty())
+        break;
+
+      batch.results.resize(batch.paths.size());
+      pool.run(batch.paths.size(), load_library_task, &batch);
+
+      // -- files are added in a fixed order, regardless of which finished first
+      for (unsigned i = 0; i < batch.results.size(); i++)
+        {
+          if (batch.results[i] == NULL) return 1;
+          script_files.push_back(batch.results[i]);
+          refs.collect(batch.results[i]);
+        }
+    }
+
+  return 0;
+}
+
+void
+ebt_module::number_files()
+{
+  for (unsigned i = 0; i < script_files.size(); i++)
+    {
+      ebt_file *f = script_files[i];
+      f->offset_ids(handler_ticket, global_ticket);
+      handler_ticket += f->handler_ticket;
+      global_ticket += f->global_ticket;
+    }
+}
+
+struct compile_batch {
+  ebt_module *m;
+  vector<string> errors;
+  vector<int> results;
+};
+
+static void
+compile_file_task(void *arg, unsigned i)
+{
+  compile_batch *b = (compile_batch *) arg;
+  ostringstream err;
+  b->results[i] = b->m->script_files[i]->compile(err);
+  b->errors[i] = err.str();
+}
+
 int
 ebt_module::compile()
 {
-  istream *input; string orig_path;
+  const char *input; unsigned input_size;
   if (has_contents)
     {
-      input = new istringstream(script_contents);
+      input = script_contents.data();
+      input_size = script_contents.size();
     }
   else
     {
-      ifstream *ifs = new ifstream(script_path.c_str());
-      input = ifs;
-
-      if (!ifs->is_open()) {
-        string mesg("cannot open script file '" + script_path + "'");
-        perror(mesg.c_str());
+      mapped_file *source = map_source(script_path);
+      if (source == NULL)
         return 1;
-      }
+
+      input = source->data;
+      input_size = source->size;
     }
 
   /* For testing the lexer pass: */
   if (last_pass < 1)
     {
-      test_lexer(this, *input);
+      test_lexer(this, input, input_size);
       return 0; // TODOXXX test_lexer should return an rc
     }
 
-  /* Parse the script file. (TODOXXX: Also parse and load any libraries.) */
-  ebt_file *result = parse(this, *input, script_name);
+  /* Parse the script file, then any libraries it refers to. */
+  ebt_file *result = parse(this, input, input_size, script_name);
 
   if (result == NULL)
     return 1;
 
   script_files.push_back(result);
 
+  thread_pool pool;
+  if (load_libraries(pool) != 0)
+    return 1;
+
+  number_files();
+
   /* For testing the parsing pass: */
-  if (last_pass < 3)
+  if (last_pass < 2)
     {
       cerr << "RESULTING SCRIPT FILES" << endl << endl;
       for (unsigned i = 0; i < script_files.size(); i++)
@@ -155,9 +2404,38 @@ ebt_module::compile()
       return 0;
     }
 
-  /* Only the first script_file is guaranteed to be needed.
-     For any other ones (i.e. libraries), compile() is invoked on demand. */
-  script_files[0]->compile();
+  /* Only libraries which the script refers to have been loaded,
+     so every script_file is needed. Files are compiled independently,
+     and their errors are reported in file order: */
+  compile_batch batch;
+  batch.m = this;
+  batch.errors.resize(script_files.size());
+  batch.results.resize(script_files.size());
+  pool.run(script_files.size(), compile_file_task, &batch);
+
+  int rc = 0;
+  for (unsigned i = 0; i < script_files.size(); i++)
+    {
+      cerr << batch.errors[i];
+      if (batch.results[i] != 0) rc = 1;
+    }
+  if (rc != 0)
+    return rc;
+
+  if (infer_types() != 0)
+    return 1;
+
+  if (optimize_ir)
+    optimize();
+
+  /* For testing the resolution pass: */
+  if (last_pass < 3)
+    {
+      cerr << "RESULTING SCRIPT FILES" << endl << endl;
+      for (unsigned i = 0; i < script_files.size(); i++)
+        cerr << script_files[i];
+    }
+
   return 0;
 }
 
@@ -165,43 +2443,111 @@ ebt_module::compile()
 
 // XXX ebt_file::ebt_file() : is_compiled(false) {}
 ebt_file::ebt_file(const string& name, ebt_module *parent)
-  : parent(parent), name(name), is_compiled(false) {}
+  : parent(parent), handler_ticket(0), global_ticket(0),
+    name(name), is_compiled(false) {}
 
-struct resolving_visitor;
+ebt_file::~ebt_file()
+{
+  for (unsigned i = 0; i < owned.size(); i++)
+    delete owned[i];
+}
 
 void
-ebt_file::compile()
+ebt_file::offset_ids(unsigned handler_base, unsigned global_base)
 {
-#ifndef ONLY_BASIC_PROBES
-  // TODOXXXX Perform event resolution on the current file.
+  // -- basic probes share their handlers with the original probes
+  for (unsigned i = 0; i < probes.size(); i++)
+    probes[i]->body->id += handler_base;
+
+  for (map<string, ebt_function *>::iterator it = functions.begin();
+       it != functions.end(); it++)
+    it->second->id += global_base;
+  for (map<string, ebt_global *>::iterator it = globals.begin();
+       it != globals.end(); it++)
+    it->second->id += global_base;
+}
 
-  // TODOXXX very approximate outline
-  //for (vector<ebt_file *>::iterator it = script_files.begin();
-  //     it != script_files.end(); it++) {
-  //  ebt_file * script = *it;
-  for (vector<probe *>::iterator it = probes.begin();
-       it != probes.end(); it++) {
-    probe * pr = *it;
+int
+ebt_file::compile(ostream &err)
+{
+  int rc = 0;
 
-    // Generate all of the basic_probes corresponding to this probe's event:
-    // resolving_visitor v(pr); // TODOXXX too virtual
-    // pr->probe_point->visit(v);
-    // resolved_probes.insert(resolved_probes.end(),
-    //                        resolved_probes.begin(), resolved_probes.end());
-  }
-  //}
-  // TODOXXX check if any events were unused and report back with an error
+  // Resolve each probe into basic probes, then check the names used by
+  // its handler in the context of every basic probe:
+  for (unsigned i = 0; i < probes.size(); i++)
+    {
+      probe *pr = probes[i];
+      unsigned first = resolved_probes.size();
+      try
+        {
+          resolve_probe(this, pr);
+          for (unsigned j = first; j < resolved_probes.size(); j++)
+            {
+              basic_probe *bp = resolved_probes[j];
+              checking_visitor v(parent, bp);
+              for (unsigned k = 0; k < bp->conditions.size(); k++)
+                bp->conditions[k]->e->visit(&v);
+              if (bp->is_final())
+                bp->body->action->visit(&v);
+              if (bp->is_final() && (bp->mechanism == EV_BEGIN
+                                     || bp->mechanism == EV_END))
+                {
+                  thread_local_checker tv(parent);
+                  bp->body->action->visit(&tv);
+                }
+            }
+        }
+      catch (const semantic_error& se)
+        {
+          print_error(err, se); rc = 1;
+          resolved_probes.resize(first);
+        }
+    }
+
+  for (map<string, ebt_function *>::iterator it = functions.begin();
+       it != functions.end(); it++)
+    try
+      {
+        checking_visitor v(parent);
+        it->second->body->visit(&v);
+      }
+    catch (const semantic_error& se)
+      {
+        print_error(err, se); rc = 1;
+      }
 
-#endif
+  for (map<string, ebt_global *>::iterator it = globals.begin();
+       it != globals.end(); it++)
+    try
+      {
+        checking_visitor v(parent);
+        if (it->second->initializer)
+          it->second->initializer->visit(&v);
+      }
+    catch (const semantic_error& se)
+      {
+        print_error(err, se); rc = 1;
+      }
 
   is_compiled = true;
+  return rc;
 }
 
 // ----------------------------
 // --- probe representation ---
 // ----------------------------
 
-// XXX
+ebt_context *
+basic_probe::find_context(const string& name) const
+{
+  for (unsigned i = 0; i < events.size(); i++)
+    {
+      map<string, ebt_context *>::const_iterator it
+        = events[i]->context.find(name);
+      if (it != events[i]->context.end()) return it->second;
+    }
+  return NULL;
+}
 
 // ---------------------------------------------------------------
 // --- declarations: globals, functions, and (built-in) events ---
@@ -263,7 +2609,70 @@ jump_stmt::visit (visitor *u)
 // --- scripting language: value expressions ---
 // ---------------------------------------------
 
-// XXX
+// --- operators ---
+
+static const char *const expr_op_names[] = {
+  "*", "/", "%",
+  "+", "-",
+  "<<", ">>",
+  "<", "<=", ">", ">=",
+  "==", "!=",
+  "&",
+  "^",
+  "|",
+  "in",
+  "&&",
+  "||",
+  "=", "+=", "-=", "*=", "/=",
+  "%=", "<<=", ">>=",
+  "&=", "^=", "|=",
+  ",",
+
+  "+", "-", "!", "~",
+  "++", "--", "++", "--",
+
+  "(BUG: not an operator)",
+};
+
+const char *
+op_name (expr_op op)
+{
+  return expr_op_names[op];
+}
+
+ostream&
+operator << (ostream &o, expr_op op)
+{
+  return o << op_name(op);
+}
+
+static const char *const type_names[] = { "unknown", "int", "string", "void" };
+
+const char *
+type_name (ebt_type t)
+{
+  return type_names[t];
+}
+
+ostream&
+operator << (ostream &o, ebt_type t)
+{
+  return o << type_name(t);
+}
+
+static const char *const event_op_names[] = { "not", "and", "or", "::" };
+
+const char *
+op_name (event_op op)
+{
+  return event_op_names[op];
+}
+
+ostream&
+operator << (ostream &o, event_op op)
+{
+  return o << op_name(op);
+}
 
 // --- expression visitors ---
 
@@ -325,14 +2734,68 @@ compound_event::visit (visitor *u)
 // --- AST visitors: used for various analyses ---
 // -----------------------------------------------
 
-// --- TODOXXX methods for traversing_visitor ---
+// --- methods for traversing_visitor ---
 
 void
-traversing_visitor::visit_basic_expr (basic_expr *s)
+traversing_visitor::visit_empty_stmt (empty_stmt *)
 {
   // nothing to do here
 }
 
+void
+traversing_visitor::visit_expr_stmt (expr_stmt *s)
+{
+  s->e->visit(this);
+}
+
+void
+traversing_visitor::visit_compound_stmt (compound_stmt *s)
+{
+  for (arena_list<stmt *>::iterator it = s->stmts.begin();
+       it != s->stmts.end(); it++)
+    (*it)->visit(this);
+}
+
+void
+traversing_visitor::visit_ifthen_stmt (ifthen_stmt *s)
+{
+  s->condition->visit(this);
+  s->then_stmt->visit(this);
+  if (s->else_stmt) s->else_stmt->visit(this);
+}
+
+void
+traversing_visitor::visit_loop_stmt (loop_stmt *s)
+{
+  if (s->initial) s->initial->visit(this);
+  if (s->condition) s->condition->visit(this);
+  if (s->update) s->update->visit(this);
+  s->body->visit(this);
+}
+
+void
+traversing_visitor::visit_foreach_stmt (foreach_stmt *s)
+{
+  s->array->visit(this);
+  s->body->visit(this);
+}
+
+void
+traversing_visitor::visit_jump_stmt (jump_stmt *s)
+{
+  if (s->value) s->value->visit(this);
+}
+
+void
+traversing_visitor::visit_basic_expr (basic_expr *s)
+{
+  // Only index expressions in the designator chain have subexpressions:
+  for (arena_list<chain_item>::iterator it = s->chain.begin();
+       it != s->chain.end(); it++)
+    if (it->first == chain_index)
+      it->second->visit(this);
+}
+
 void
 traversing_visitor::visit_unary_expr (unary_expr *s)
 {
@@ -357,17 +2820,105 @@ traversing_visitor::visit_conditional_expr (conditional_expr *s)
 void
 traversing_visitor::visit_call_expr (call_expr *e)
 {
-  for (vector<expr *>::iterator it = e->args.begin();
+  for (arena_list<expr *>::iterator it = e->args.begin();
        it != e->args.end(); it++)
   {
     (*it)->visit(this);
   }
 }
 
+void
+traversing_visitor::visit_named_event (named_event *e)
+{
+  if (e->subevent) e->subevent->visit(this);
+}
+
+void
+traversing_visitor::visit_conditional_event (conditional_event *e)
+{
+  e->subevent->visit(this);
+  e->condition->visit(this);
+}
+
+void
+traversing_visitor::visit_compound_event (compound_event *e)
+{
+  for (arena_list<event_expr *>::iterator it = e->subevents.begin();
+       it != e->subevents.end(); it++)
+    (*it)->visit(this);
+}
+
+// --- methods for reference_collector ---
+
+void
+reference_collector::add_reference (const string &name)
+{
+  if (locals.count(name) || seen.count(name)) return;
+  seen.insert(name);
+  references.push_back(name);
+}
+
+void
+reference_collector::collect (ebt_file *f)
+{
+  for (unsigned i = 0; i < f->probes.size(); i++)
+    {
+      f->probes[i]->probe_point->visit(this);
+      f->probes[i]->body->action->visit(this);
+    }
+
+  for (map<string, ebt_function *>::iterator it = f->functions.begin();
+       it != f->functions.end(); it++)
+    {
+      ebt_function *fn = it->second;
+      locals.insert(fn->argument_names.begin(), fn->argument_names.end());
+      fn->body->visit(this);
+      locals.clear();
+    }
+
+  for (map<string, ebt_global *>::iterator it = f->globals.begin();
+       it != f->globals.end(); it++)
+    if (it->second->initializer)
+      it->second->initializer->visit(this);
+}
+
+void
+reference_collector::visit_foreach_stmt (foreach_stmt *s)
+{
+  // XXX The variable stays 'local' past the end of the loop:
+  locals.insert(s->identifier);
+  traversing_visitor::visit_foreach_stmt(s);
+}
+
+void
+reference_collector::visit_basic_expr (basic_expr *e)
+{
+  // -- skip context values and literals
+  if (e->sigil == NULL && e->tok->type == tok_ident)
+    add_reference(e->tok->content);
+  traversing_visitor::visit_basic_expr(e);
+}
+
+void
+reference_collector::visit_call_expr (call_expr *e)
+{
+  add_reference(e->func);
+  traversing_visitor::visit_call_expr(e);
+}
+
 // --------------------------------
 // --- diagnostic functionality ---
 // --------------------------------
 
+void
+print_error (ostream &o, const semantic_error& se)
+{
+  o << "semantic error:" << ' ' << se.what() << endl;
+  if (se.tok)
+    o << "             " << *se.tok << endl;
+  o << endl;
+}
+
 // TODOXXX The pretty-printing sorely needs precedence (removal of unnecessary
 // parentheses) as well as a linebreaking feature of some sort.
 
@@ -445,6 +2996,14 @@ basic_expr::print (ostream &o) const
 void
 unary_expr::print (ostream &o) const
 {
+  if (op == op_postinc || op == op_postdec)
+    {
+      o << "(";
+      operand->print(o);
+      o << ") " << op;
+      return;
+    }
+
   o << op << " (";
   operand->print(o);
   o << ")";
@@ -476,7 +3035,7 @@ void
 call_expr::print (ostream &o) const
 {
   o << func << "(";
-  for (vector<expr *>::const_iterator it = args.begin();
+  for (arena_list<expr *>::const_iterator it = args.begin();
        it != args.end(); it++)
     {
       if (it != args.begin()) o << ", ";
@@ -518,7 +3077,7 @@ conditional_event::print (ostream &o) const
 void
 compound_event::print (ostream &o) const
 {
-  if (op == "not")
+  if (op == e_not)
     {
       o << op << " ";
       subevents[0]->print(o);
@@ -554,14 +3113,30 @@ operator << (ostream &o, const ebt_printable *pr)
 void
 ebt_global::print (ostream &o) const
 {
-  o << "global{" << id << "}";
-  // TODOXXX
+  o << (is_thread_local ? "thread " : "") << "global{" << id << "} " << name;
+  if (is_dense)
+    o << "[" << key_min << ".." << key_max << "]";
+  else if (array_type == d_array && key_type != t_unknown)
+    o << "[" << key_type << "]";
+  if (value_type != t_unknown)
+    o << " : " << value_type;
+  if (capacity != 0)
+    o << " (capacity " << capacity << ")";
 }
 
 void
 ebt_function::print (ostream &o) const
 {
-  // TODOXXX
+  o << "func{" << id << "} " << name << "(";
+  for (unsigned i = 0; i < argument_names.size(); i++)
+    {
+      o << (i > 0 ? ", " : "") << argument_names[i];
+      if (i < argument_types.size() && argument_types[i] != t_unknown)
+        o << " : " << argument_types[i];
+    }
+  o << ")";
+  if (return_type != t_unknown)
+    o << " : " << return_type;
 }
 
 void
@@ -603,6 +3178,8 @@ operator << (ostream &o, basic_probe_type bt)
   case EV_NONE: o << "(unknown)"; break;
   case EV_BEGIN: o << "EV_BEGIN"; break;
   case EV_END: o << "EV_END"; break;
+  case EV_TBEGIN: o << "EV_TBEGIN"; break;
+  case EV_TEND: o << "EV_TEND"; break;
   case EV_INSN: o << "EV_INSN"; break;
   case EV_FENTRY: o << "EV_FENTRY"; break;
   case EV_FEXIT: o << "EV_FEXIT"; break;
@@ -616,7 +3193,16 @@ basic_probe::print (ostream &o) const
 {
   o << "probe{" << body->id << "} ";
   o << mechanism;
+  if (num_stages > 1) o << "::" << stage;
   o << " ";
+  // -- list the events providing context, other than the mechanism:
+  if (events.size() > 1)
+    {
+      o << "[";
+      for (unsigned i = 1; i < events.size(); i++)
+        o << (i > 1 ? " " : "") << events[i]->name;
+      o << "] ";
+    }
   if (!conditions.empty()) o << "(";
   if (!conditions.empty()) o << *(conditions[0]->e);
   for (unsigned i = 1; i < conditions.size(); i++)
@@ -633,19 +3219,13 @@ ebt_file::print (ostream &o) const
   o << endl;
   // XXX print the path where the script file originated from
 
-#ifndef ONLY_BASIC_PROBES
   if (!probes.empty())
     {
       o << "Original probes:" << endl; 
       for (unsigned i = 0; i < probes.size(); i++)
         o << "* " << *(probes[i]) << endl;
     }
-#endif
-#ifdef ONLY_BASIC_PROBES
-  if (!resolved_probes.empty())
-#else
   if (is_compiled && !resolved_probes.empty())
-#endif
     {
       o << "Basic probes:" << endl;
       for (unsigned i = 0; i < resolved_probes.size(); i++)
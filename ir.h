@@ -12,12 +12,13 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <utility>
+#include <stdexcept>
 
-/* from parse.h */
-struct token;
-
-#define ONLY_BASIC_PROBES
+#include "util.h"
+#include "parse.h"
+#include "library.h"
 
 // -------------------
 // --- type system ---
@@ -26,9 +27,50 @@ struct token;
 enum ebt_type {t_unknown, t_int, t_str, t_void};
 enum ebt_dimension {d_scalar, d_array}; // TODOXXX -- add t_shadow
 
+const char *type_name (ebt_type t);
+std::ostream& operator << (std::ostream &o, ebt_type t);
+
 // Used to distinguish static '$' and dynamic '@' context values.
 enum ebt_lifetime {l_none, l_static, l_dynamic};
 
+// -------------------------------------
+// --- scripting language: operators ---
+// -------------------------------------
+
+// Operators of unary_expr and binary_expr. The binary operators are
+// listed in order of precedence (see the precedence table in parse.cc):
+enum expr_op {
+  op_mul, op_div, op_mod,
+  op_add, op_sub,
+  op_shl, op_shr,
+  op_lt, op_le, op_gt, op_ge,
+  op_eq, op_ne,
+  op_band,
+  op_bxor,
+  op_bor,
+  op_in,
+  op_land,
+  op_lor,
+  op_assign, op_add_assign, op_sub_assign, op_mul_assign, op_div_assign,
+  op_mod_assign, op_shl_assign, op_shr_assign,
+  op_band_assign, op_bxor_assign, op_bor_assign,
+  op_comma,
+
+  op_plus, op_neg, op_lnot, op_bnot,
+  op_preinc, op_predec, op_postinc, op_postdec,
+
+  op_none // -- not an operator
+};
+
+const char *op_name (expr_op op);
+std::ostream& operator << (std::ostream &o, expr_op op);
+
+// Operators of compound_event:
+enum event_op { e_not, e_and, e_or, e_seq };
+
+const char *op_name (event_op op);
+std::ostream& operator << (std::ostream &o, event_op op);
+
 // --------------------------------------
 // --- scripting language: statements ---
 // --------------------------------------
@@ -45,6 +87,9 @@ enum ebt_lifetime {l_none, l_static, l_dynamic};
 
 // TODOXXX STUB OUT AND IMPLEMENT BELOW
 
+// All nodes are allocated from the arena of the enclosing ebt_file,
+// and lists of child nodes are stored as contiguous arena_lists.
+
 struct visitor;
 struct stmt {
   token *tok;
@@ -68,7 +113,7 @@ struct expr_stmt : public stmt {
 };
 
 struct compound_stmt : public stmt {
-  std::vector<stmt *> stmts;
+  arena_list<stmt *> stmts;
 
   void print (std::ostream &o) const;
   void visit (visitor *u);
@@ -94,7 +139,7 @@ struct loop_stmt : public stmt {
 };
 
 struct foreach_stmt : public stmt {
-  std::string identifier;
+  string_ref identifier;
   expr *array;
   stmt *body;
 
@@ -129,6 +174,10 @@ struct jump_stmt : public stmt {
 
 struct expr {
   token *tok;
+  ebt_type type; // -- filled in by type inference
+
+  expr() : type(t_unknown) {}
+
   virtual void print (std::ostream &o) const = 0;
   virtual void visit (visitor* u) = 0;
 };
@@ -136,10 +185,11 @@ struct expr {
 std::ostream& operator << (std::ostream &o, const expr &e);
 
 enum chain_type { chain_ident, chain_index };
+typedef std::pair<chain_type, expr *> chain_item;
 
 struct basic_expr: public expr {
   token *sigil; // -- must be either NULL or tok_op: "$", "@"
-  std::vector<std::pair<chain_type, expr *> > chain;
+  arena_list<chain_item> chain;
 
   basic_expr() : sigil(NULL) {}
 
@@ -148,7 +198,7 @@ struct basic_expr: public expr {
 };
 
 struct unary_expr: public expr {
-  std::string op;
+  expr_op op;
   expr *operand;
 
   void print (std::ostream &o) const;
@@ -156,8 +206,8 @@ struct unary_expr: public expr {
 };
 
 struct binary_expr: public expr {
+  expr_op op;
   expr *left;
-  std::string op;
   expr *right;
 
   void print (std::ostream &o) const;
@@ -174,8 +224,8 @@ struct conditional_expr: public expr {
 };
 
 struct call_expr: public expr {
-  std::string func;
-  std::vector<expr *> args;
+  string_ref func;
+  arena_list<expr *> args;
 
   void print (std::ostream &o) const;
   void visit (visitor *u);
@@ -193,12 +243,13 @@ struct call_expr: public expr {
 struct event_expr {
   token *tok;
   virtual void print (std::ostream &o) const = 0;
+  virtual void visit (visitor* u) = 0;
 };
 
 std::ostream& operator << (std::ostream &o, const event_expr &e);
 
 struct named_event: public event_expr {
-  std::string ident;
+  string_ref ident;
   event_expr *subevent; // possibly NULL
 
   void print (std::ostream &o) const;
@@ -214,8 +265,8 @@ struct conditional_event: public event_expr {
 };
 
 struct compound_event: public event_expr {
-  std::string op;
-  std::vector<event_expr *> subevents;
+  event_op op;
+  arena_list<event_expr *> subevents;
 
   void print (std::ostream &o) const;
   void visit (visitor *u);
@@ -245,13 +296,42 @@ struct visitor {
   virtual void visit_compound_event (compound_event *e) = 0; // TODOXXX distinguish kinds??
 };
 
-// TODOXXX basic traversing visitor -- iterates the leaves of an expression
+// Basic traversing visitor -- visits every node below the starting one.
+// Subclasses override the visit methods of interest and call back into
+// traversing_visitor to continue the traversal.
 struct traversing_visitor : public visitor {
+  void visit_empty_stmt (empty_stmt *s);
+  void visit_expr_stmt (expr_stmt *s);
+  void visit_compound_stmt (compound_stmt *s);
+  void visit_ifthen_stmt (ifthen_stmt *s);
+  void visit_loop_stmt (loop_stmt *s);
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_jump_stmt (jump_stmt *s);
+
   void visit_basic_expr (basic_expr *s);
   void visit_unary_expr (unary_expr *s);
   void visit_binary_expr (binary_expr *s);
   void visit_conditional_expr (conditional_expr *s);
   void visit_call_expr (call_expr *s);
+
+  void visit_named_event (named_event *e);
+  void visit_conditional_event (conditional_event *e);
+  void visit_compound_event (compound_event *e);
+};
+
+// Collects the names of functions and globals referred to by a file.
+// Used to find the library files a script depends on:
+struct reference_collector : public traversing_visitor {
+  std::vector<std::string> references; // -- in order of first use
+  std::set<std::string> seen;
+  std::set<std::string> locals; // -- function arguments, foreach variables
+
+  void add_reference(const std::string &name);
+  void collect(ebt_file *f);
+
+  void visit_foreach_stmt (foreach_stmt *s);
+  void visit_basic_expr (basic_expr *s);
+  void visit_call_expr (call_expr *s);
 };
 
 // TODOXXX variable collecting visitor -- finds used context values
@@ -260,8 +340,19 @@ struct traversing_visitor : public visitor {
 // --- diagnostic functionality ---
 // --------------------------------
 
+// Errors found after parsing, e.g. while resolving events or names:
+struct semantic_error : public std::runtime_error
+{
+  const token *tok;
+  semantic_error (const std::string& msg, const token *t = NULL)
+    : runtime_error (msg), tok(t) {}
+};
+
+void print_error (std::ostream &o, const semantic_error& se);
+
 struct ebt_printable {
   virtual void print (std::ostream &o) const = 0; // TODOXXX stub implementation
+  virtual ~ebt_printable() {}
 };
 
 std::ostream& operator << (std::ostream &o, const ebt_printable &pr);
@@ -276,6 +367,8 @@ struct ebt_value : ebt_printable {
   ebt_type value_type;
   ebt_dimension array_type;
   ebt_type key_type; // -- only used when array_type = d_array
+
+  ebt_value() : value_type(t_unknown), array_type(d_scalar), key_type(t_unknown) {}
 };
 
 struct ebt_global : ebt_value {
@@ -283,6 +376,19 @@ struct ebt_global : ebt_value {
   unsigned id;
 
   expr *initializer;
+  bool is_thread_local; // -- 'thread global', 'thread array'
+
+  // An array of integers with a declared range of integer keys
+  // ('array hist[0..255]') is dense, i.e. stored as a flat block:
+  bool is_dense;
+  long long key_min, key_max;
+
+  // Any other array is a map, which may declare a capacity to be
+  // preallocated ('array per_fn[4096]'); 0 for the default capacity:
+  long long capacity;
+
+  ebt_global() : initializer(NULL), is_thread_local(false), is_dense(false),
+                 key_min(0), key_max(0), capacity(0) {}
 
   token *tok;
   void print(std::ostream &o) const;
@@ -292,16 +398,19 @@ struct ebt_function : ebt_printable {
   // Used for codegen; set when this function is first added to an ebt_file.
   unsigned id;
 
-  ebt_function() : is_builtin(false) {}
-  ebt_function(std::string name) : name(name), is_builtin(false) {}
+  ebt_function() : is_builtin(false), return_type(t_unknown) {}
+  ebt_function(std::string name)
+    : name(name), is_builtin(false), return_type(t_unknown) {}
 
   std::string name;
   std::vector<std::string> argument_names;
   stmt *body;
   bool is_builtin; // -- might be handled specially in emit & typecheck phases
 
-  std::vector<ebt_type *> argument_types;
+  // Filled in by type inference:
+  std::vector<ebt_type> argument_types;
   ebt_type return_type;
+  std::map<std::string, ebt_type> locals;
 
   token *tok;
   void print(std::ostream &o) const;
@@ -325,6 +434,9 @@ enum basic_probe_type {
   EV_BEGIN,   // -- at the beginning of script execution
   EV_END,     // -- just before the script terminates
 
+  EV_TBEGIN,  // -- when a thread starts, in that thread
+  EV_TEND,    // -- when a thread exits, in that thread
+
   EV_INSN,    // -- at every insn of every basic block
 
   EV_FENTRY,  // -- TODOXXX at the entry point to a function
@@ -389,6 +501,7 @@ struct handler : ebt_printable {
   unsigned id;
 
   stmt *action;
+  std::map<std::string, ebt_type> locals; // -- filled in by type inference
 
   // XXX The handler may be identified by an explanatory string in some cases:
   std::string orig_source;
@@ -405,14 +518,24 @@ private:
   unsigned variable_ticket;
 
 public:
-  basic_probe() : variable_ticket(0) {}
+  basic_probe() : variable_ticket(0), stage(0), num_stages(1) {}
   unsigned get_variable_ticket() { return variable_ticket++; }
 
   // Information describing the probe:
   basic_probe_type mechanism;
+  std::vector<ebt_event *> events; // -- provide the mechanism and context values
   std::vector<condition *> conditions;
   handler *body;
 
+  // A probe on a sequence 'A :: B :: ...' has basic probes for each stage.
+  // Each thread keeps its own state; a basic probe only fires while its
+  // thread is in its stage, and all but the last stage just advance the
+  // state instead of running the handler:
+  unsigned stage, num_stages;
+  bool is_final() const { return stage + 1 == num_stages; }
+
+  ebt_context *find_context(const std::string& name) const;
+
   token *tok;
   void print(std::ostream &o) const;
 };
@@ -423,20 +546,53 @@ public:
 
 struct ebt_file;
 
+/* from cache.h */
+class ir_cache;
+
 struct ebt_module : ebt_printable {
 private:
-  // Information describing builtin EBT events, context data, and functions:
+  // Information describing builtin EBT events, context data, and functions.
+  // These are filled in once (by init_builtins()) and read-only afterwards,
+  // so that files can be compiled by several threads at once:
   static std::map<std::string, ebt_event *> builtin_events;
   static std::map<std::string, ebt_function *> builtin_functions;
+  static pthread_once_t builtins_initialized;
+  static void init_builtins();
 
-  // Used to name top-level elements with a simple numerical id:
+  // Used to name top-level elements with a simple numerical id. Files are
+  // numbered independently, then offset by number_files() in file order:
   unsigned handler_ticket; // -- for probe handlers
   unsigned global_ticket;  // -- for both globals and functions
+  void number_files();
+
+  // Indices of library_dirs, created when first needed:
+  std::vector<library_index *> libraries;
+
+  pthread_mutex_t sources_lock;
+
+  mapped_file *map_source(const std::string& path);
+  std::string find_library(const std::string& name,
+                           std::vector<std::string> *declared = NULL);
+  int load_libraries(thread_pool& pool);
+
+  // Types flow between files (e.g. through calls to library functions),
+  // so they are inferred once every file has been compiled:
+  int infer_types();
+
+  // Removes code and declarations whose effects cannot be observed:
+  void optimize();
 
 public:
   ebt_module ();
-  unsigned get_handler_ticket() { return handler_ticket++; }
-  unsigned get_global_ticket() { return global_ticket++; }
+  ~ebt_module ();
+
+  ebt_file *load_library(const std::string& path, ir_cache& cache);
+
+  // Lookup of declarations; only valid once every file has been loaded:
+  static ebt_event *find_event(const std::string& name);
+  static ebt_function *find_builtin(const std::string& name);
+  ebt_function *find_function(const std::string& name) const;
+  ebt_global *find_global(const std::string& name) const;
 
   // Information describing the script...
   std::vector<ebt_file *> script_files;
@@ -446,7 +602,18 @@ public:
   std::string script_path; // from 'FILENAME'
   std::string script_contents; // from '-e PROGRAM'
 
+  // Directories (from '-I DIR') searched in order for undefined names:
+  std::vector<std::string> library_dirs;
+
+  // Script sources are kept in memory (mapped, not copied) for the
+  // module lifetime, since tokens refer to them. Sources which are not
+  // files (e.g. '-e PROGRAM' read from a stream) are copied to the arena:
+  arena mem;
+  std::vector<mapped_file *> sources;
+  void keep_source(mapped_file *source); // -- safe to call from any thread
+
   int last_pass; // which pass to stop compilation after (default 4:run)
+  bool optimize_ir; // -- false with '-u'
 
   int compile();
   void print(std::ostream &o) const;
@@ -455,13 +622,30 @@ public:
 struct ebt_file : ebt_printable {
   // XXX ebt_file ();
   ebt_file (const std::string& name, ebt_module *parent);
+  ~ebt_file ();
 
   ebt_module *parent;
-  unsigned get_handler_ticket() { return parent->get_handler_ticket(); }
-  unsigned get_global_ticket() { return parent->get_global_ticket(); }
+
+  // Ids handed out while parsing are local to the file:
+  unsigned handler_ticket;
+  unsigned global_ticket;
+  unsigned get_handler_ticket() { return handler_ticket++; }
+  unsigned get_global_ticket() { return global_ticket++; }
+  void offset_ids(unsigned handler_base, unsigned global_base);
+
+  // Syntax trees of the file, along with token text which does not
+  // appear verbatim in the source, are allocated from here:
+  arena mem;
+
+  // Declarations, handlers and basic probes hold strings and containers,
+  // so they are allocated on the heap instead and deleted with the file
+  // (whether or not they are still declared by it):
+  std::vector<ebt_printable *> owned;
+  template <typename T> T *keep(T *p) { owned.push_back(p); return p; }
 
   // Information describing the file:
   std::string name;
+  std::vector<token> tokens; // -- filled once, then never resized
   std::vector<probe *> probes;
   std::map<std::string, ebt_function *> functions;
   std::map<std::string, ebt_global *> globals;
@@ -469,11 +653,11 @@ struct ebt_file : ebt_printable {
   // ... this gets translated by compile() into:
   std::vector<basic_probe *> resolved_probes;
 
-  // Libraries are always loaded but only compiled and emitted on demand.
-  // Thus we need to track whether a given ebt_file is actually used:
+  // Library files are only loaded when the script refers to something
+  // they declare; is_compiled tracks whether a loaded file is actually used:
   bool is_compiled;
 
-  void compile();
+  int compile(std::ostream &err); // -- errors are reported to err
   void print(std::ostream &o) const;
 };
 
@@ -0,0 +1,251 @@
+// library search path
+// Copyright (C) 2014-2015 Serguei Makarov
+//
+// This file is part of EBT, and is free software. You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+extern "C" {
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+}
+
+using namespace std;
+
+#include "util.h"
+#include "parse.h"
+#include "library.h"
+
+// --- paraphernalia for dealing with the system ---
+
+static bool
+older (const struct stat &a, const struct stat &b)
+{
+  if (a.st_mtim.tv_sec != b.st_mtim.tv_sec)
+    return a.st_mtim.tv_sec < b.st_mtim.tv_sec;
+  return a.st_mtim.tv_nsec < b.st_mtim.tv_nsec;
+}
+
+static bool
+has_suffix (const string &s, const string &suffix)
+{
+  return s.size() >= suffix.size()
+    && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// --- methods for library_index ---
+
+string
+library_index::lookup(const string &name, vector<string> *declared)
+{
+  if (!loaded) load();
+
+  map<string, unsigned>::iterator it = symbols.find(name);
+  if (it == symbols.end()) return "";
+
+  // The directory mtime does not change when a file is edited in place,
+  // so check the file itself before trusting what the index says:
+  library_file &lf = files[it->second];
+  struct stat st;
+  if (stat(file_path(lf).c_str(), &st) < 0
+      || st.st_mtime != lf.mtime || st.st_size != lf.size)
+    {
+      rebuild();
+      it = symbols.find(name);
+      if (it == symbols.end()) return "";
+    }
+
+  const library_file &found = files[it->second];
+  if (declared)
+    {
+      declared->insert(declared->end(),
+                       found.functions.begin(), found.functions.end());
+      declared->insert(declared->end(),
+                       found.globals.begin(), found.globals.end());
+    }
+  return file_path(found);
+}
+
+void
+library_index::load()
+{
+  loaded = true;
+
+  struct stat dir_st, index_st;
+  if (stat(dir.c_str(), &dir_st) < 0)
+    {
+      string mesg("cannot open library directory '" + dir + "'");
+      perror(mesg.c_str());
+      return;
+    }
+
+  // XXX Adding a file within the same clock tick as the index was
+  // written will not be noticed until the directory changes again.
+  if (stat(index_path().c_str(), &index_st) == 0
+      && !older(index_st, dir_st) && read_index())
+    return;
+
+  rebuild();
+}
+
+bool
+library_index::read_index()
+{
+  ifstream in(index_path().c_str());
+  if (!in.is_open()) return false;
+
+  files.clear(); symbols.clear();
+
+  string line;
+  while (getline(in, line))
+    {
+      if (line.empty() || line[0] == '#') continue;
+
+      istringstream fields(line);
+      string kind, name;
+      fields >> kind >> name;
+      if (name.empty()) goto corrupt;
+
+      if (kind == "file")
+        {
+          library_file lf;
+          lf.name = name;
+          if (!(fields >> lf.mtime >> lf.size)) goto corrupt;
+          files.push_back(lf);
+        }
+      else if (files.empty())
+        goto corrupt;
+      else if (kind == "func")
+        files.back().functions.push_back(name);
+      else if (kind == "global")
+        files.back().globals.push_back(name);
+      else
+        goto corrupt;
+    }
+
+  for (unsigned i = 0; i < files.size(); i++)
+    add_symbols(i);
+  return true;
+
+ corrupt:
+  files.clear(); symbols.clear();
+  return false;
+}
+
+void
+library_index::write_index()
+{
+  // Write to a temporary file first, so that a concurrent ebt never
+  // observes a partially written index:
+  ostringstream tmp_path;
+  tmp_path << index_path() << "." << getpid();
+
+  ofstream out(tmp_path.str().c_str());
+  if (!out.is_open())
+    return; // -- e.g. directory not writable; keep the index in memory
+
+  out << "# generated by ebt, do not edit" << endl;
+  for (unsigned i = 0; i < files.size(); i++)
+    {
+      const library_file &lf = files[i];
+      out << "file " << lf.name << " " << lf.mtime << " " << lf.size << endl;
+      for (unsigned j = 0; j < lf.functions.size(); j++)
+        out << "func " << lf.functions[j] << endl;
+      for (unsigned j = 0; j < lf.globals.size(); j++)
+        out << "global " << lf.globals[j] << endl;
+    }
+  out.close();
+
+  if (out.fail() || rename(tmp_path.str().c_str(), index_path().c_str()) < 0)
+    {
+      unlink(tmp_path.str().c_str());
+      return;
+    }
+
+  // Renaming the index into place updated the directory mtime; touch the
+  // index so that it is not considered stale on the next run:
+  utimes(index_path().c_str(), NULL);
+}
+
+void
+library_index::rebuild()
+{
+  files.clear(); symbols.clear();
+
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL) return;
+
+  vector<string> names;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL)
+    {
+      string name(ent->d_name);
+      // XXX names containing whitespace cannot be stored in the index
+      if (has_suffix(name, ".ebt") && name.find_first_of(" \t\n") == string::npos)
+        names.push_back(name);
+    }
+  closedir(d);
+
+  // Sort the names, so that the first declaration of a duplicate symbol
+  // does not depend on the order of directory entries:
+  sort(names.begin(), names.end());
+
+  for (unsigned i = 0; i < names.size(); i++)
+    {
+      library_file lf;
+      lf.name = names[i];
+      if (scan_file(lf))
+        files.push_back(lf);
+    }
+
+  for (unsigned i = 0; i < files.size(); i++)
+    add_symbols(i);
+
+  write_index();
+}
+
+bool
+library_index::scan_file(library_file &lf)
+{
+  string path = file_path(lf);
+
+  mapped_file source;
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0 || !source.open(path))
+    {
+      string mesg("cannot open library file '" + path + "'");
+      perror(mesg.c_str());
+      return false;
+    }
+
+  lf.mtime = st.st_mtime;
+  lf.size = st.st_size;
+  return scan_declarations(m, source.data, source.size, path,
+                           lf.functions, lf.globals);
+}
+
+void
+library_index::add_symbols(unsigned i)
+{
+  // -- the first file declaring a symbol takes precedence
+  const library_file &lf = files[i];
+  for (unsigned j = 0; j < lf.functions.size(); j++)
+    symbols.insert(make_pair(lf.functions[j], i));
+  for (unsigned j = 0; j < lf.globals.size(); j++)
+    symbols.insert(make_pair(lf.globals[j], i));
+}
@@ -0,0 +1,77 @@
+// library search path
+// Copyright (C) 2014-2015 Serguei Makarov
+//
+// This file is part of EBT, and is free software. You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#ifndef EBT_LIBRARY_H
+#define EBT_LIBRARY_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <sys/types.h>
+
+/* from ir.h */
+struct ebt_module;
+
+// Every library directory keeps an index (DIR/ebt.index) of the functions
+// and globals declared by each of its files, so that resolving a script
+// only requires reading the index and parsing the files actually used.
+//
+// The index is a text file consisting of lines of the form
+//
+//   file NAME MTIME SIZE
+//   func NAME
+//   global NAME
+//
+// where each 'func' and 'global' line belongs to the preceding 'file'.
+// It is regenerated when it is missing or older than the directory, or
+// when a file turns out to have changed since it was indexed. XXX A file
+// edited in place (rather than replaced) is only checked once the index
+// points to it, so new declarations in it are found after the directory
+// changes again or ebt.index is removed.
+
+#define LIBRARY_INDEX_NAME "ebt.index"
+
+struct library_file {
+  std::string name; // -- relative to the library directory
+  time_t mtime;
+  off_t size;
+  std::vector<std::string> functions;
+  std::vector<std::string> globals; // -- includes arrays
+};
+
+class library_index {
+  ebt_module *m;
+  std::string dir;
+  bool loaded;
+
+  std::vector<library_file> files;
+  std::map<std::string, unsigned> symbols; // -- name -> index into files
+
+  std::string index_path() const { return dir + "/" + LIBRARY_INDEX_NAME; }
+  std::string file_path(const library_file &lf) const
+    { return dir + "/" + lf.name; }
+
+  void load();
+  bool read_index();
+  void write_index();
+  void rebuild();
+  bool scan_file(library_file &lf);
+  void add_symbols(unsigned i);
+
+public:
+  library_index(ebt_module *m, const std::string &dir)
+    : m(m), dir(dir), loaded(false) {}
+
+  // Returns the path of the file declaring name, or "" if there is none.
+  // Optionally lists everything else which that file declares:
+  std::string lookup(const std::string &name,
+                     std::vector<std::string> *declared = NULL);
+};
+
+#endif // EBT_LIBRARY_H
@@ -140,8 +140,10 @@ system_command(vector<string> &args, string path = "", bool show_output = false)
 // --- command line parser and utility ---
 
 static struct option long_options[] = {
+  {"batch", no_argument, 0, 'b' },
   {"fake", no_argument, 0, 'f' },
   {"show-source", no_argument, 0, 'o' },
+  {"unoptimized", no_argument, 0, 'u' },
   {"verbose", no_argument, 0, 'v' },
   {0, 0, 0, 0}
 };
@@ -155,10 +157,14 @@ usage(const char *prog_name)
           "\n"
           "Options and arguments:\n"
           "  -e SCRIPT        : one-liner program\n"
+          "  -I DIR           : search DIR for library files (may be repeated)\n"
           "  -o --show-source : stop after pass-3 and show resulting client source\n"
           "  -g FILENAME      : output client source to file, instead of stdout\n"
           "  -t PATH          : create build folder in PATH (defaults to /tmp)\n"
           "  -f --fake        : (testing purposes only) output 'fake' client template\n"
+          "  -b --batch       : defer insn handlers to the end of each basic block\n"
+          "  -D NAME[=VALUE]  : define a macro in the client (e.g. MAXMAPENTRIES)\n"
+          "  -u --unoptimized : keep constant conditions, dead code and unused probes\n"
           "  -v --verbose     : show output of the compilation process\n"
           "  -p PASS          : stop after pass (0:lex, 1:parse, 2:resolve, 3:emit, 4:run)\n",
           // XXX may want additional options for launching the target program
@@ -182,12 +188,14 @@ main (int argc, char * const argv [])
   string outfile_path;
 
   bool emit_fake_client = false;
+  bool batch_handlers = false;
+  vector<string> defines;
 
   system_verbose = false;
 
   /* parse options */
   char c;
-  while ((c = getopt_long(argc, argv, "g:e:p:fvot:", long_options, NULL)) != -1)
+  while ((c = getopt_long(argc, argv, "g:e:I:p:D:bfvout:", long_options, NULL)) != -1)
     {
       switch (c)
         {
@@ -199,11 +207,23 @@ main (int argc, char * const argv [])
         case 'v':
           system_verbose = true;
           break;
+        case 'b':
+          batch_handlers = true;
+          break;
+        case 'D':
+          defines.push_back(string(optarg));
+          break;
+        case 'u':
+          script.optimize_ir = false;
+          break;
         case 'e':
           script.has_contents = true;
           script.script_contents = string(optarg);
           script.script_name = "<command line>";
           break;
+        case 'I':
+          script.library_dirs.push_back(string(optarg));
+          break;
         case 't':
           tmp_prefix = string(optarg);
           break;
@@ -327,6 +347,8 @@ main (int argc, char * const argv [])
   else
   {
     dr_client_template dr_template(&script);
+    dr_template.batch_handlers = batch_handlers;
+    dr_template.defines = defines;
     dr_template.emit(o);
   }
 
@@ -370,6 +392,13 @@ main (int argc, char * const argv [])
   co.newline() << "  message(FATAL_ERROR \"DynamoRIO package required to build\")";
   co.newline() << "endif(NOT DynamoRIO_FOUND)";
   co.newline() << "configure_DynamoRIO_client(ebt_client)";
+  // XXX drsyms is only needed by runtime/symbols.h
+  co.newline() << "use_DynamoRIO_extension(ebt_client drsyms)";
+  // XXX drmgr is only needed by runtime/alloc.h, runtime/inline.h and the
+  // thread events, thread data and bb_event of the client; drreg by
+  // runtime/inline.h, runtime/batch.h and runtime/sequence.h
+  co.newline() << "use_DynamoRIO_extension(ebt_client drmgr)";
+  co.newline() << "use_DynamoRIO_extension(ebt_client drreg)";
   co.newline();
 
   cmakefile.close();
@@ -7,8 +7,8 @@
 // later version.
 
 #include <string>
-#include <set>
 #include <stack>
+#include <algorithm>
 
 #include <iostream>
 #include <sstream>
@@ -17,6 +17,8 @@
 #include <stdexcept>
 
 #include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
 
 using namespace std;
 
@@ -87,7 +89,8 @@ private:
   ebt_module *m;
   ebt_file *f;
 
-  string input_contents;
+  // The lexer does not own its input; token contents point into it:
+  const char *input;
   unsigned input_size;
 
   unsigned cursor;
@@ -100,128 +103,85 @@ private:
   int input_peek(unsigned offset = 0);
 
 public:
-  lexer(ebt_module* m, ebt_file *f, istream& i);
+  lexer(ebt_module* m, ebt_file *f, const char *input, unsigned input_size);
 
-  static set<string> keywords;
-  static set<string> operators;
+  static bool is_keyword(const string_ref& s);
+  static unsigned match_operator(int c, int c2, int c3);
 
   // Used to extract a subrange of the source code (e.g. for diagnostics):
   unsigned get_pos();
   string source(unsigned start, unsigned end);
   string source_line(const token *tok);
 
-  token *scan();
+  // Scans the next token into t; returns false at the end of input:
+  bool scan(token &t);
 
-  // Clear unused last_tok and next_tok; skips any lookahead tokens:
-  void swallow();
-  // XXX check and re-check memory management for our tokens!
+  // Scans the entire input into a flat array. If a lexing error is
+  // thrown, the offending (partial) token is left at the end of toks:
+  void tokenize(std::vector<token> &toks);
 };
 
-set<string> lexer::keywords;
-set<string> lexer::operators;
-
-lexer::lexer(ebt_module* m, ebt_file *f, istream& input)
-  : m(m), f(f), cursor(0), curr_line(1), curr_col(1)
+lexer::lexer(ebt_module* m, ebt_file *f, const char *input, unsigned input_size)
+  : m(m), f(f), input(input), input_size(input_size),
+    cursor(0), curr_line(1), curr_col(1)
 {
-  getline(input, input_contents, '\0');
-  input_size = input_contents.size();
   line_coords.push_back(0); // start of first line
+}
 
-  if (keywords.empty())
-    {
-      keywords.insert("probe");
-      keywords.insert("global");
-      keywords.insert("array");
-      // XXX keywords.insert("shadow");
-      keywords.insert("func");
-
-      keywords.insert("not");
-      keywords.insert("and");
-      keywords.insert("or");
-
-#ifdef ONLY_BASIC_PROBES
-      // Not really keywords, thus should be checked with swallow_ident():
-      //keywords.insert("begin");
-      //keywords.insert("end");
-      //keywords.insert("insn");
-      //keywords.insert("function");
-      //keywords.insert("entry");
-      //keywords.insert("exit");
-#endif
-
-      keywords.insert("return");
-      keywords.insert("if");
-      keywords.insert("else");
-      keywords.insert("while");
-      keywords.insert("for");
-      keywords.insert("foreach");
-      keywords.insert("in");
-      keywords.insert("break");
-      keywords.insert("continue");
-      keywords.insert("next");
-    }
+// Keywords are recognized with a perfect hash over the first and last
+// characters and the length of the identifier. XXX When adding a keyword,
+// search for new multipliers that keep the table free of collisions.
+#define KEYWORD_HASH(s) \
+  (((unsigned char) (s)[0] + 5 * (unsigned char) (s)[(s).size()-1] \
+    + 4 * (s).size()) % 32)
+
+// XXX "shadow" is not yet a keyword. Event names (begin, end, insn,
+// function, entry, exit) are not really keywords, thus should be
+// checked with swallow_ident().
+static const char *const keyword_table[32] = {
+  NULL, "and", "next", NULL, "while", "func", NULL, NULL,
+  NULL, NULL, "foreach", NULL, "for", "break", "else", "if",
+  "return", "or", "array", NULL, NULL, NULL, NULL, "in",
+  NULL, NULL, NULL, "global", "continue", "probe", "not", NULL,
+};
 
-  if (operators.empty())
+bool
+lexer::is_keyword(const string_ref& s)
+{
+  if (s.empty()) return false;
+  const char *kw = keyword_table[KEYWORD_HASH(s)];
+  return kw != NULL && s == kw;
+}
+
+// Returns the length of the longest operator starting with c, c2, c3
+// (operators are at most three characters), or 0 for no operator:
+unsigned
+lexer::match_operator(int c, int c2, int c3)
+{
+  switch (c)
     {
-      // XXX: all operators currently at most 2 characters
-      operators.insert("{");
-      operators.insert("}");
-      operators.insert("(");
-      operators.insert(")");
-      operators.insert("[");
-      operators.insert("]");
-
-      operators.insert(",");
-      operators.insert(";");
-      
-      operators.insert(".");
-      operators.insert("::");
-
-      operators.insert("$");
-      operators.insert("@");
-
-      operators.insert("*");
-      operators.insert("/");
-      operators.insert("%");
-      operators.insert("+");
-      operators.insert("-");
-      operators.insert("!");
-      operators.insert("~");
-      operators.insert(">>");
-      operators.insert("<<");
-      operators.insert("<");
-      operators.insert(">");
-      operators.insert("<=");
-      operators.insert(">=");
-      operators.insert("==");
-      operators.insert("!=");
-      operators.insert("&");
-      operators.insert("^");
-      operators.insert("|");
-      operators.insert("&&");
-      operators.insert("||");
-
-      operators.insert("?");
-      operators.insert(":");
-
-      operators.insert("="); // -- imperative assignment operation
-      operators.insert("+=");
-      operators.insert("-=");
-      operators.insert("*=");
-      operators.insert("/=");
-      operators.insert("%=");
-      operators.insert("<<=");
-      operators.insert(">>=");
-      operators.insert("&=");
-      operators.insert("^=");
-      operators.insert("|=");
-
-      operators.insert("++");
-      operators.insert("--");
+    case '{': case '}': case '(': case ')': case '[': case ']':
+    case ',': case ';': case '$': case '@': case '~': case '?':
+      return 1;
+    case '.': // -- . ..
+      return c2 == '.' ? 2 : 1;
+    case ':': // -- : ::
+      return c2 == ':' ? 2 : 1;
+    case '*': case '/': case '%': case '!': case '=': case '^':
+      // -- * *= / /= % %= ! != = == ^ ^=
+      return c2 == '=' ? 2 : 1;
+    case '+': case '-': case '&': case '|':
+      // -- + ++ += - -- -= & && &= | || |=
+      return c2 == c || c2 == '=' ? 2 : 1;
+    case '<': case '>':
+      // -- < << <<= <= > >> >>= >=
+      if (c2 == c) return c3 == '=' ? 3 : 2;
+      return c2 == '=' ? 2 : 1;
+    default:
+      return 0;
     }
 }
 
-
 unsigned
 lexer::get_pos()
 {
@@ -232,7 +192,7 @@ string
 lexer::source(unsigned start, unsigned end)
 {
   assert (end >= start);
-  return input_contents.substr(start, end - start);
+  return string(input + start, end - start);
 }
 
 string
@@ -245,18 +205,18 @@ lexer::source_line(const token *tok)
   line_num = tok ? tok->location.line : line_coords.size();
  retry:
   line_start = line_coords[line_num-1];
-  line_next = line_start >= input_contents.size() ?
-    input_contents.size() : input_contents.find('\n', line_start);
+  line_next = line_start;
+  while (line_next < input_size && input[line_next] != '\n')
+    line_next++;
 
   // XXX When we are printing the last line:
-  if (tok == NULL
-      && (line_next == string::npos || line_next - line_start <= 0))
+  if (tok == NULL && line_next == line_start)
     {
       line_start = line_next;
-      if (line_num > 0) { line_num --; goto retry; }
+      if (line_num > 1) { line_num --; goto retry; }
     }
 
-  return input_contents.substr(line_start, line_next - line_start);
+  return string(input + line_start, line_next - line_start);
 }
 
 int
@@ -264,13 +224,13 @@ lexer::input_peek(unsigned offset)
 {
   if (cursor + offset >= input_size)
     return -1; // EOF or failed read
-  return input_contents[cursor + offset];
+  return (unsigned char) input[cursor + offset];
 }
 
 int
 lexer::input_get()
 {
-  char c = input_peek();
+  int c = input_peek();
   if (c < 0) return c; // EOF
 
   // advance cursor
@@ -288,21 +248,36 @@ lexer::input_get()
   return c;
 }
 
-token *
-lexer::scan()
+void
+lexer::tokenize(std::vector<token> &toks)
 {
-  token *t = new token;
+  // XXX A rough guess at token density, to avoid most reallocations:
+  toks.reserve(toks.size() + input_size / 4 + 1);
+
+  for (;;)
+    {
+      toks.push_back(token());
+      if (!scan(toks.back()))
+        break;
+    }
+  toks.pop_back(); // -- the slot where end of input was found
+}
+
+bool
+lexer::scan(token &tok)
+{
+  token *t = &tok;
   t->location.file = f;
 
  skip:
   t->location.line = curr_line;
   t->location.col = curr_col;
 
+  unsigned start = cursor;
   int c = input_get();
   if (c < 0)
     { // end of file
-      delete t;
-      return NULL;
+      return false;
     }
 
   if (isspace (c))
@@ -333,43 +308,55 @@ lexer::scan()
   if (isalpha(c) || c == '_') // found identifier
     {
       t->type = tok_ident;
-      t->content.push_back(c);
       while (isalnum (c2) || c2 == '_')
         {
           input_get ();
-          t->content.push_back(c2);
           c2 = input_peek ();
         }
-      if (keywords.count(t->content))
+      t->content = string_ref(input + start, cursor - start);
+      if (is_keyword(t->content))
         t->type = tok_op;
-      return t;
+      return true;
     }
   else if (isdigit(c)) // found integer literal
     {
       t->type = tok_num;
-      t->content.push_back(c);
       // XXX slurp alphanumeric chars first, figure out if it's a valid number later
       while (isalnum (c2))
         {
           input_get ();
-          t->content.push_back(c2);
           c2 = input_peek ();
         }
-      return t;
+      t->content = string_ref(input + start, cursor - start);
+      return true;
     }
   else if (c == '\"') // found string literal
     {
       t->type = tok_str;
+
+      // The literal is used in place unless some escape has to be
+      // rewritten, in which case we switch to building a copy:
+      start = cursor;
+      bool copied = false;
+      string buf;
+
       for (;;)
         {
+          unsigned pos = cursor;
           c = input_get();
           if (c < 0 || c == '\n')
             {
+              t->content = copied ? f->mem.copy(buf)
+                : string_ref(input + start, pos - start);
               throw parse_error("could not find matching closing quote", t);
             }
 
           if (c == '\"')
-            break;
+            {
+              t->content = copied ? f->mem.copy(buf)
+                : string_ref(input + start, pos - start);
+              break;
+            }
           else if (c == '\\')
             {
               c = input_get();
@@ -387,56 +374,45 @@ lexer::scan()
                 case '\\':
                   // XXX Maintain these escapes in the string as-is, in
                   // case we want to emit the string as a C literal.
-                  t->content.push_back('\\');
+                  if (copied) { buf.push_back('\\'); buf.push_back(c); }
+                  break;
 
                 default:
-                  t->content.push_back(c);
+                  // Drop the backslash, which requires a copy:
+                  if (!copied) { buf.assign(input + start, pos - start); copied = true; }
+                  buf.push_back(c);
                   break;
                 }
             }
-          else
-            t->content.push_back(c);
+          else if (copied)
+            buf.push_back(c);
         }
 
-      return t;
+      return true;
     }
   else if (ispunct (c)) // found at least a one-character operator
     {
       t->type = tok_op;
 
-      string s, s2, s3;
-      s.push_back(c); s2.push_back(c);
-      s2.push_back(c2);
-
-      if (operators.count(s3)) // valid three-character operator
-        {
-          input_get(); input_get(); // consume c2,c3
-          t->content = s3;
-        }
-      if (operators.count(s2)) // valid two-character operator
-        {
-          input_get(); // consume c2
-          t->content = s2;
-        }
-      else if (operators.count(s)) // valid single-character operator
+      unsigned n = match_operator(c, c2, c3);
+      if (n == 0)
         {
-          t->content = s;
-        }
-      else
-        {
-          t->content = ispunct(c2) && ispunct(c3) ? s3
-            : ispunct(c2) ? s2 : s;
+          n = ispunct(c2) && ispunct(c3) ? 3 : ispunct(c2) ? 2 : 1;
+          t->content = string_ref(input + start, min(n, input_size - start));
           throw parse_error("unrecognized operator", t);
         }
 
-      return t;
+      for (unsigned i = 1; i < n; i++)
+        input_get(); // consume c2, c3
+      t->content = string_ref(input + start, n);
+      return true;
     }
   else // found an unrecognized symbol
     {
       t->type = tok_op;
       ostringstream s;
       s << "\\x" << hex << setw(2) << setfill('0') << c;
-      t->content = s.str();
+      t->content = f->mem.copy(s.str());
       throw parse_error("unexpected junk symbol", t);
     }
 }
@@ -450,32 +426,19 @@ lexer::scan()
 // script ::= declaration script
 // script ::=
 //
-#ifndef ONLY_BASIC_PROBES
 // declaration ::= "probe" event_expr "{" smts "}"
-#else
-// declaration ::= "probe" probe_type ["(" [conditions] ")"] "{" stmts "}"
-#endif
-// declaration ::= "global" IDENTIFIER ["=" expr]
-// declaration ::= "array" IDENTIFIER
+// declaration ::= ["thread"] "global" IDENTIFIER ["=" expr]
+// declaration ::= ["thread"] "array" IDENTIFIER ["[" bound ".." bound "]"]
+// declaration ::= ["thread"] "array" IDENTIFIER "[" NUMBER "]"
 // declaration ::= "func" IDENTIFIER "(" [params_spec] ")" "{" stmts "}"
 // XXX declaration ::= "shadow" IDENTIFIER ":" NUMBER
 //
-#ifndef ONLY_BASIC_PROBES
 // event_expr ::= [event_expr "."] IDENTIFIER
 // event_expr ::= event_expr "(" expr ")"
 // event_expr ::= "not" event_expr
 // event_expr ::= event_expr "and" event_expr
 // event_expr ::= event_expr "or" event_expr
 // event_expr ::= event_expr "::" event_expr
-#else
-// probe_type ::= "begin"
-// probe_type ::= "end"
-// probe_type ::= "insn"
-// probe_type ::= "function" "." "entry"
-// probe_type ::= "function" "." "exit"
-// XXX probe_type ::= ...
-// conditions ::= expr ["," conditions]
-#endif
 //
 // stmts ::= stmt stmts
 // stmts ::=
@@ -507,6 +470,8 @@ lexer::scan()
 // designator ::= designator "." IDENTIFIER
 // designator ::= designator "." NUMBER
 // designator ::= designator "[" expr "]"
+//
+// bound ::= ["-"] NUMBER
 
 class parser
 {
@@ -518,36 +483,39 @@ private:
   void print_error(const parse_error& pe);
   void throw_expect_error(const string& expected_what, token *t = NULL);
 
-  // use to store lookahead:
-  token *last_tok;
-  token *next_tok;
+  // The whole file is tokenized up front (into f->tokens); the parser
+  // simply keeps an index of the next token:
+  unsigned pos;
+  void tokenize();
 
-  token *peek();  // -- preview the next token
+  token *peek(unsigned offset = 0); // -- preview an upcoming token
   token *next();  // -- get the next token and advance forward
-  void swallow(); // -- get the next token, delete it, and advance forward
+  void swallow(); // -- skip the next token and advance forward
 
   bool finished();
 
   // These return true iff the next token is op:
-  bool peek_op(const string& op, token* &t, bool throw_err = false);
-  bool next_op(const string& op, token* &t, bool throw_err = false);
-  bool swallow_op(const string& op, bool throw_err = true);
+  bool peek_op(const string_ref& op, token* &t, bool throw_err = false);
+  bool next_op(const string_ref& op, token* &t, bool throw_err = false);
+  bool swallow_op(const string_ref& op, bool throw_err = true);
 
   // These return true iff the next token is an identifier:
   bool peek_ident(token* &t, bool throw_err = false);
   bool next_ident(token* &t, bool throw_err = false);
   bool swallow_ident(bool throw_err = true);
-  bool swallow_ident(const string& text, bool throw_err = false);
+  bool swallow_ident(const string_ref& text, bool throw_err = false);
     // -- require exact text
 
 public:
-  parser(ebt_module* m, const string& name, istream& i)
-    : m(m), f(new ebt_file(name, m)), input(lexer(m, f, i)),
-      last_tok(NULL), next_tok(NULL) {}
+  parser(ebt_module* m, const string& name, const char *buf, unsigned size)
+    : m(m), f(new ebt_file(name, m)), input(lexer(m, f, buf, size)),
+      pos(0) {}
 
   void test_lexer();
 
   ebt_file *parse();
+  bool scan_declarations(std::vector<std::string> &functions,
+                         std::vector<std::string> &globals);
 
   // Precedence table for expressions:
   // 0        - IDENTIFIER, LITERAL
@@ -570,28 +538,36 @@ public:
   // 22 left  - ,
   // 1000     - (not an operator)
 #define PREC_NONE 1000
-  unsigned prec_expr(const string &op) {
+  unsigned prec_expr(expr_op op) {
     // For binary operations only:
-    if (op == "*" || op == "/" || op == "%") return 3;
-    else if (op == "+" || op == "-") return 4;
-    else if (op == "<<" || op == ">>") return 5;
-    else if (op == "<" || op == "<=" || op == ">" || op == ">=") return 6;
-    else if (op == "==" || op == "!=") return 7;
-    else if (op == "&") return 8;
-    else if (op == "^") return 9;
-    else if (op == "|") return 10;
-    else if (op == "in") return 11;
-    else if (op == "&&") return 12;
-    else if (op == "||") return 13;
-    else if (op == "="
-             || op == "+=" || op == "-=" || op == "*=" || op == "/="
-             || op == "%=" || op == "<<=" || op == ">>="
-             || op == "&=" || op == "^=" || op == "|=")
+    switch (op) {
+    case op_mul: case op_div: case op_mod: return 3;
+    case op_add: case op_sub: return 4;
+    case op_shl: case op_shr: return 5;
+    case op_lt: case op_le: case op_gt: case op_ge: return 6;
+    case op_eq: case op_ne: return 7;
+    case op_band: return 8;
+    case op_bxor: return 9;
+    case op_bor: return 10;
+    case op_in: return 11;
+    case op_land: return 12;
+    case op_lor: return 13;
+    case op_assign:
+    case op_add_assign: case op_sub_assign: case op_mul_assign:
+    case op_div_assign: case op_mod_assign:
+    case op_shl_assign: case op_shr_assign:
+    case op_band_assign: case op_bxor_assign: case op_bor_assign:
       return 21;
-    else if (op == ",") return 22;
-    else return PREC_NONE;
+    case op_comma: return 22;
+    default: return PREC_NONE;
+    }
   }
 
+  // Identify the operator denoted by a token:
+  expr_op binary_op(const token *t);
+  expr_op unary_op(const token *t, bool postfix = false);
+  event_op binary_event_op(const token *t);
+
   expr *parse_basic_expr();
   expr *parse_unary();
   expr *parse_binary(); // -- all binary operators except assignment
@@ -608,7 +584,7 @@ public:
   stmt *parse_compound_stmt();
   stmt *parse_stmt();
 
-  std::vector<stmt *> *parse_block(std::vector <stmt *> *stmts = NULL);
+  void parse_block(std::vector <stmt *> &stmts);
 
   // Precedence table for events:
   // 0       - IDENTIFIER
@@ -619,7 +595,7 @@ public:
   // 5 left  - EVENT or EVENT
   // 6 left  - EVENT :: EVENT
   // 1000    - (not an event operator)
-  unsigned prec_event(const string& op)
+  unsigned prec_event(const string_ref& op)
   {
     if (op == "and") return 4;
     else if (op == "or") return 5;
@@ -632,47 +608,68 @@ public:
   event_expr *parse_binary_event ();
   event_expr *parse_event_expr ();
 
-#ifdef ONLY_BASIC_PROBES
-  basic_probe *parse_basic_probe_decl ();
-#endif
   probe *parse_probe_decl ();
   ebt_function *parse_func_decl();
   ebt_global *parse_global_decl();
   ebt_global *parse_array_decl();
+  long long parse_bound();
 };
 
 ebt_file *
 parse (ebt_module* m, istream& i, const string source_name)
 {
-  const std::string& name = source_name == "" ? m->script_name : source_name;
-  parser p (m, name, i);
-  return p.parse();
+  string contents;
+  getline(i, contents, '\0');
+  string_ref buf = m->mem.copy(contents);
+  return parse(m, buf.data, buf.len, source_name);
 }
 
 ebt_file *
 parse (ebt_module* m, const string& n, const string source_name)
+{
+  string_ref buf = m->mem.copy(n);
+  return parse(m, buf.data, buf.len, source_name);
+}
+
+ebt_file *
+parse (ebt_module* m, const char *buf, unsigned size, const string source_name)
 {
   const std::string& name = source_name == "" ? m->script_name : source_name;
-  istringstream i (n);
-  parser p (m, name, i);
+  parser p (m, name, buf, size);
   return p.parse();
 }
 
+bool
+scan_declarations (ebt_module* m, const char *buf, unsigned size,
+                   const string source_name,
+                   vector<string> &functions, vector<string> &globals)
+{
+  parser p (m, source_name, buf, size);
+  return p.scan_declarations(functions, globals);
+}
+
 
 void
 test_lexer (ebt_module* m, istream& i, const string source_name)
 {
-  const std::string& name = source_name == "" ? m->script_name : source_name;
-  parser p (m, name, i);
-  p.test_lexer();
+  string contents;
+  getline(i, contents, '\0');
+  string_ref buf = m->mem.copy(contents);
+  test_lexer(m, buf.data, buf.len, source_name);
 }
 
 void
 test_lexer (ebt_module* m, const string& n, const string source_name)
+{
+  string_ref buf = m->mem.copy(n);
+  test_lexer(m, buf.data, buf.len, source_name);
+}
+
+void
+test_lexer (ebt_module* m, const char *buf, unsigned size, const string source_name)
 {
   const std::string& name = source_name == "" ? m->script_name : source_name;
-  istringstream i (n);
-  parser p (m, name, i);
+  parser p (m, name, buf, size);
   p.test_lexer();
 }
 
@@ -682,16 +679,19 @@ parser::test_lexer()
 {
   try
     {
-      token *t;
-      while (t = peek())
-        {
-          cerr << *t << endl; swallow();
-        }
+      tokenize();
     }
   catch (const parse_error& pe)
     {
+      // Print the tokens preceding the error, then the error itself:
+      for (unsigned i = 0; i + 1 < f->tokens.size(); i++)
+        cerr << f->tokens[i] << endl;
       print_error(pe);
+      return;
     }
+
+  for (unsigned i = 0; i < f->tokens.size(); i++)
+    cerr << f->tokens[i] << endl;
 }
 
 // --- parser error handling ---
@@ -699,33 +699,37 @@ parser::test_lexer()
 void
 parser::print_error(const parse_error& pe)
 {
-  cerr << "parse error:" << ' ' << pe.what() << endl;
+  // The message is assembled first, so that errors from files which are
+  // parsed in parallel do not get interleaved:
+  ostringstream o;
+  o << "parse error:" << ' ' << pe.what() << endl;
 
   if (pe.tok)
     {
       if (!pe.suppress_tok)
-        cerr << "             " << *pe.tok << endl;
-      cerr << input.source_line(pe.tok) << endl;
+        o << "             " << *pe.tok << endl;
+      o << input.source_line(pe.tok) << endl;
 
       // Point out the position of the token in the line:
       for (unsigned i = 0; i < pe.tok->location.col - 1; i++)
-        cerr << " ";
-      cerr << "^" << endl;
+        o << " ";
+      o << "^" << endl;
     }
   // If pe.tok is unavailable and we are at end of input, print the last line:
   else if (!pe.tok && peek() == NULL)
     {
       string last_line = input.source_line(NULL);
-      cerr << last_line << endl;
+      o << last_line << endl;
 
       // Point out the end of the line:
       for (unsigned i = 0; i < last_line.size(); i++)
-        cerr << " ";
-      cerr << "^" << endl;
+        o << " ";
+      o << "^" << endl;
     }
-  // XXX If pe.tok is unavailable, we may want to use parser.last_tok
+  // XXX If pe.tok is unavailable, we may want to use f->tokens[pos-1]
   // XXX Optionally this could benefit from some syntax coloring
-  cerr << endl;
+  o << endl;
+  cerr << o.str();
 }
 
 void
@@ -750,32 +754,39 @@ parser::throw_expect_error(const string& expected_what, token *t)
 
 // --- basic parser state management ---
 
+void
+parser::tokenize()
+{
+  try
+    {
+      input.tokenize(f->tokens);
+    }
+  catch (const parse_error& pe)
+    {
+      pos = f->tokens.size(); // -- nothing left to parse
+      throw;
+    }
+}
+
 token *
 parser::next()
 {
-  if (! next_tok) next_tok = input.scan();
-  if (! next_tok) throw parse_error("unexpected end of file");
-
-  last_tok = next_tok;
-  next_tok = NULL;
-  return last_tok;
+  if (pos >= f->tokens.size()) throw parse_error("unexpected end of file");
+  return &f->tokens[pos++];
 }
 
 token *
-parser::peek()
+parser::peek(unsigned offset)
 {
-  if (! next_tok) next_tok = input.scan();
-
-  last_tok = next_tok;
-  return last_tok;
+  if (pos + offset >= f->tokens.size()) return NULL;
+  return &f->tokens[pos + offset];
 }
 
 void
 parser::swallow()
 {
-  assert (last_tok != NULL);
-  delete last_tok;
-  last_tok = next_tok = NULL;
+  assert (pos < f->tokens.size());
+  pos++;
 }
 
 bool
@@ -787,7 +798,7 @@ parser::finished()
 // --- additional token handling utilities ---
 
 bool
-parser::peek_op(const string& op, token* &t, bool throw_err)
+parser::peek_op(const string_ref& op, token* &t, bool throw_err)
 {
   t = peek();
   bool valid = (t != NULL && t->type == tok_op && t->content == op);
@@ -800,7 +811,7 @@ parser::peek_op(const string& op, token* &t, bool throw_err)
 }
 
 bool
-parser::next_op(const string& op, token* &t, bool throw_err)
+parser::next_op(const string_ref& op, token* &t, bool throw_err)
 {
   bool valid = peek_op(op,t,throw_err);
   if (valid) next();
@@ -808,7 +819,7 @@ parser::next_op(const string& op, token* &t, bool throw_err)
 }
 
 bool
-parser::swallow_op(const string& op, bool throw_err)
+parser::swallow_op(const string_ref& op, bool throw_err)
 {
   token *t;
   bool valid = peek_op(op,t,throw_err);
@@ -836,7 +847,7 @@ parser::next_ident(token* &t, bool throw_err)
 
 // XXX We may eventually want an analogous peek_ident() variant:
 bool
-parser::swallow_ident(const string& text, bool throw_err)
+parser::swallow_ident(const string_ref& text, bool throw_err)
 {
   token *t;
   bool valid = peek_ident(t,false) && t->content == text;
@@ -858,6 +869,80 @@ parser::swallow_ident(bool throw_err)
   return valid;
 }
 
+expr_op
+parser::binary_op(const token *t)
+{
+  if (t == NULL || t->type != tok_op) return op_none;
+  for (unsigned op = op_mul; op <= op_comma; op++)
+    if (t->content == op_name((expr_op) op))
+      return (expr_op) op;
+  return op_none;
+}
+
+expr_op
+parser::unary_op(const token *t, bool postfix)
+{
+  if (t->content == "++") return postfix ? op_postinc : op_preinc;
+  if (t->content == "--") return postfix ? op_postdec : op_predec;
+  if (t->content == "+") return op_plus;
+  if (t->content == "-") return op_neg;
+  if (t->content == "!") return op_lnot;
+  if (t->content == "~") return op_bnot;
+  return op_none;
+}
+
+event_op
+parser::binary_event_op(const token *t)
+{
+  if (t->content == "and") return e_and;
+  if (t->content == "or") return e_or;
+  assert (t->content == "::");
+  return e_seq;
+}
+
+// --- scanning toplevel declarations ---
+
+// Used to index library files without the cost of a full parse. Anything
+// within braces is skipped, so only toplevel names are collected:
+bool
+parser::scan_declarations(vector<string> &functions, vector<string> &globals)
+{
+  try
+    {
+      tokenize();
+    }
+  catch (const parse_error& pe)
+    {
+      print_error(pe);
+      delete f; f = NULL;
+      return false;
+    }
+
+  unsigned depth = 0;
+  for (unsigned i = 0; i < f->tokens.size(); i++)
+    {
+      const token &t = f->tokens[i];
+      if (t.type != tok_op) continue;
+
+      if (t.content == "{")
+        depth++;
+      else if (t.content == "}" && depth > 0)
+        depth--;
+      else if (depth == 0 && i + 1 < f->tokens.size()
+               && f->tokens[i+1].type == tok_ident)
+        {
+          if (t.content == "func")
+            functions.push_back(f->tokens[i+1].content);
+          else if (t.content == "global" || t.content == "array")
+            globals.push_back(f->tokens[i+1].content);
+        }
+    }
+
+  // The file is not needed beyond this point (the names were copied):
+  delete f; f = NULL;
+  return true;
+}
+
 // --- parsing toplevel declarations ---
 
 ebt_file *
@@ -865,15 +950,13 @@ parser::parse()
 {
   try
     {
+      tokenize();
+
       for (;;)
         {
           token *t;
           if (peek_op("probe", t))
-#ifdef ONLY_BASIC_PROBES
-            f->resolved_probes.push_back(parse_basic_probe_decl());
-#else
             f->probes.push_back(parse_probe_decl());
-#endif
           else if (peek_op("func", t))
             {
               ebt_function *fn = parse_func_decl();
@@ -889,6 +972,20 @@ parser::parse()
               ebt_global *gl = parse_array_decl();
               f->globals[gl->name] = gl;
             }
+          else if (peek_ident(t) && t->content == "thread")
+            {
+              // -- not a keyword, since it also names thread.* events
+              swallow();
+              ebt_global *gl = NULL;
+              if (peek_op("global", t))
+                gl = parse_global_decl();
+              else if (peek_op("array", t))
+                gl = parse_array_decl();
+              else
+                throw_expect_error("'global' or 'array'");
+              gl->is_thread_local = true;
+              f->globals[gl->name] = gl;
+            }
           else if (finished())
             break;
           else
@@ -903,83 +1000,23 @@ parser::parse()
   return f;
 }
 
-#ifdef ONLY_BASIC_PROBES
-basic_probe *
-parser::parse_basic_probe_decl()
-{
-  // unsigned probe_start = input.get_pos();
-
-  basic_probe *p = new basic_probe;
-  next_op("probe", p->tok, true);
-
-  // Identify the probe point:
-  if (swallow_ident("begin",false))
-    p->mechanism = EV_BEGIN;
-  else if (swallow_ident("end",false))
-    p->mechanism = EV_END;
-  else if (swallow_ident("insn",false))
-    p->mechanism = EV_INSN;
-  else if (swallow_ident("function",false))
-    {
-      swallow_op(".");
-
-      if (swallow_ident("entry",false))
-        p->mechanism = EV_FENTRY;
-      else if (swallow_ident("exit",false))
-        p->mechanism = EV_FEXIT;
-      else
-        throw_expect_error("entry or exit");
-    }
-  else
-    throw_expect_error("basic probe type "
-                       "(begin, end, insn, function.entry, function.exit)");
-
-  // Parse condition chain:
-  if (swallow_op("(",false))
-    {
-      token *t;
-      if (!peek_op(")",t))
-        while (true)
-          {
-            condition *c = new condition;
-            c->id = p->get_variable_ticket();
-            c->e = parse_assignment(); // no comma operator allowed
-            p->conditions.push_back(c);
-            
-            if (!swallow_op(",",false)) break;
-          }
-      swallow_op(")");
-    }
-
-  // unsigned probe_end = input.get_pos();
-
-  p->body = new handler;
-  p->body->id = f->get_handler_ticket();
-  p->body->action = parse_compound_stmt();
-  // XXX Only works for oneliner probes: p->body->orig_source = "probe " + input.source(probe_start, probe_end) + " { ... }";
-  p->body->orig_source = "probe " + input.source_line(p->tok) + " ...";
-
-  return p;
-}
-#endif
-
 probe *
 parser::parse_probe_decl()
 {
   // unsigned probe_start = input.get_pos();
 
-  probe *p = new probe;
+  probe *p = new (f->mem) probe();
   next_op("probe", p->tok, true);
 
   p->probe_point = parse_event_expr();
 
   // unsigned probe_end = input.get_pos();
 
-  p->body = new handler;
+  p->body = f->keep(new handler());
   p->body->id = f->get_handler_ticket();
   p->body->action = parse_compound_stmt();
   // XXX Only works for oneliner probes: p->body->orig_source = "probe " + input.source(probe_start, probe_end) + " { ... }";
-  p->body->orig_source = "probe " + input.source_line(p->tok) + " ...";
+  p->body->orig_source = input.source_line(p->tok) + " ...";
 
   return p;
 }
@@ -987,7 +1024,7 @@ parser::parse_probe_decl()
 ebt_function *
 parser::parse_func_decl()
 {
-  ebt_function *fn = new ebt_function;
+  ebt_function *fn = f->keep(new ebt_function());
   next_op("func", fn->tok, true);
 
   fn->id = f->get_global_ticket();
@@ -1004,7 +1041,6 @@ parser::parse_func_decl()
       {
         next_ident(t,true);
         fn->argument_names.push_back(t->content);
-        delete t;
 
         if (!swallow_op(",",false)) break;
       }
@@ -1020,7 +1056,7 @@ parser::parse_global_decl()
 {
   swallow_op("global");
 
-  ebt_global *g = new ebt_global;
+  ebt_global *g = f->keep(new ebt_global());
   g->id = f->get_global_ticket();
   g->array_type = d_scalar;
 
@@ -1035,12 +1071,17 @@ parser::parse_global_decl()
   return g;
 }
 
+// -- the size of a dense array, in keys (and elements), and of the
+// preallocated elements of a map
+static const long long max_dense_keys = 1 << 20;
+static const long long max_capacity = 1 << 24;
+
 ebt_global *
 parser::parse_array_decl()
 {
   swallow_op("array");
 
-  ebt_global *g = new ebt_global;
+  ebt_global *g = f->keep(new ebt_global());
   g->id = f->get_global_ticket();
   g->array_type = d_array;
 
@@ -1048,9 +1089,47 @@ parser::parse_array_decl()
   next_ident(g->tok,true);
   g->name = g->tok->content;
 
+  // Parse the range of keys of a dense array, or the capacity of a map:
+  token *t;
+  if (!next_op("[", t))
+    return g;
+  long long bound = parse_bound();
+  if (swallow_op("]", false))
+    {
+      if (bound <= 0 || bound > max_capacity)
+        throw parse_error("capacity of an array out of range", t);
+      g->capacity = bound;
+      return g;
+    }
+  g->key_min = bound;
+  swallow_op("..");
+  g->key_max = parse_bound();
+  swallow_op("]");
+  if (g->key_max < g->key_min)
+    throw parse_error("empty range of keys", t);
+  // -- the difference may not fit in a long long
+  if ((unsigned long long) g->key_max - g->key_min >= max_dense_keys)
+    throw parse_error("range of keys too large for an array", t);
+  g->is_dense = true;
+  g->key_type = g->value_type = t_int;
+
   return g;
 }
 
+long long
+parser::parse_bound()
+{
+  bool negative = swallow_op("-", false);
+  token *t = next();
+  string s = t->content.str();
+  char *end;
+  errno = 0;
+  long long value = strtoll(s.c_str(), &end, 0);
+  if (t->type != tok_num || *end != '\0' || errno != 0)
+    throw_expect_error("integer", t);
+  return negative ? -value : value;
+}
+
 // --- parsing statements ---
 
 stmt *
@@ -1059,7 +1138,7 @@ parser::parse_stmt()
   token *t;
   if (peek_op(";",t))
     {
-      empty_stmt *s = new empty_stmt;
+      empty_stmt *s = new (f->mem) empty_stmt();
       s->tok = next();
       return s;
     }
@@ -1068,7 +1147,7 @@ parser::parse_stmt()
   else if (peek_op("return",t) || peek_op("break",t)
            || peek_op("continue",t) || peek_op("next",t))
     {
-      jump_stmt *s = new jump_stmt;
+      jump_stmt *s = new (f->mem) jump_stmt();
       s->tok = next();
       if (s->tok->content == "break")
         s->kind = j_break;
@@ -1104,7 +1183,7 @@ parser::parse_stmt()
 stmt *
 parser::parse_expr_stmt()
 {
-  expr_stmt *s = new expr_stmt;
+  expr_stmt *s = new (f->mem) expr_stmt();
   s->e = parse_expr();
   s->tok = s->e->tok;
   return s;
@@ -1113,7 +1192,7 @@ parser::parse_expr_stmt()
 stmt *
 parser::parse_ifthen_stmt()
 {
-  ifthen_stmt *s = new ifthen_stmt;
+  ifthen_stmt *s = new (f->mem) ifthen_stmt();
 
   next_op("if", s->tok, true);
 
@@ -1133,7 +1212,7 @@ parser::parse_ifthen_stmt()
 stmt *
 parser::parse_while_loop()
 {
-  loop_stmt *s = new loop_stmt;
+  loop_stmt *s = new (f->mem) loop_stmt();
 
   next_op("while", s->tok, true);
 
@@ -1149,7 +1228,7 @@ parser::parse_while_loop()
 stmt *
 parser::parse_for_loop()
 {
-  loop_stmt *s = new loop_stmt;
+  loop_stmt *s = new (f->mem) loop_stmt();
 
   next_op("for", s->tok, true);
 
@@ -1169,7 +1248,7 @@ parser::parse_for_loop()
 stmt *
 parser::parse_foreach_loop()
 {
-  foreach_stmt *s = new foreach_stmt;
+  foreach_stmt *s = new (f->mem) foreach_stmt();
 
   next_op("foreach", s->tok, true);
 
@@ -1178,7 +1257,6 @@ parser::parse_foreach_loop()
   token *t;
   next_ident(t, true);
   s->identifier = t->content;
-  delete t;
 
   swallow_op("in");
   s->array = parse_expr();
@@ -1191,23 +1269,21 @@ parser::parse_foreach_loop()
 }
 
 /* XXX Helper used only for parse_compound_stmt(). */
-std::vector<stmt *> *
-parser::parse_block(std::vector<stmt *> *stmts)
+void
+parser::parse_block(std::vector<stmt *> &stmts)
 {
-  if (!stmts) stmts = new vector<stmt *>;
-
   swallow_op("{");
   while (!swallow_op("}",false))
-    stmts->push_back(parse_stmt());
-
-  return stmts;
+    stmts.push_back(parse_stmt());
 }
 
 stmt *
 parser::parse_compound_stmt()
 {
-  compound_stmt *s = new compound_stmt;
-  parse_block(&s->stmts);
+  compound_stmt *s = new (f->mem) compound_stmt();
+  vector<stmt *> stmts;
+  parse_block(stmts);
+  s->stmts = arena_list<stmt *>(f->mem, stmts);
   return s;
 }
 
@@ -1227,7 +1303,7 @@ parser::parse_basic_event()
   token *t;
   next_ident(t,true);
 
-  named_event *start = new named_event;
+  named_event *start = new (f->mem) named_event();
   start->tok = t;
   start->ident = t->content;
   start->subevent = NULL;
@@ -1237,7 +1313,7 @@ parser::parse_basic_event()
     {
       if (t->content == ".")
         {
-          named_event *ne = new named_event;
+          named_event *ne = new (f->mem) named_event();
           next_ident(ne->tok,true);
           ne->ident = ne->tok->content;
           ne->subevent = e;
@@ -1245,7 +1321,7 @@ parser::parse_basic_event()
         }
       else // t->content == "("
         {
-          conditional_event *ce = new conditional_event;
+          conditional_event *ce = new (f->mem) conditional_event();
           ce->condition = parse_expr();
           ce->tok = ce->condition->tok;
           ce->subevent = e;
@@ -1253,7 +1329,6 @@ parser::parse_basic_event()
 
           swallow_op(")");
         }
-      delete t;
     }
 
   return e;
@@ -1265,10 +1340,11 @@ parser::parse_event_not()
   token* t;
   if (next_op("not", t))
     {
-      compound_event* e = new compound_event;
+      compound_event* e = new (f->mem) compound_event();
       e->tok = t;
-      e->op = t->content;
-      e->subevents.push_back(parse_event_not());
+      e->op = e_not;
+      vector<event_expr *> subevents(1, parse_event_not());
+      e->subevents = arena_list<event_expr *>(f->mem, subevents);
       // -- XXX Recursion may be unnecessary here.
       return e;
     }
@@ -1305,11 +1381,13 @@ parser::parse_binary_event()
             break;
 
           // Combine the left fragment:
-          compound_event *ev = new compound_event;
+          compound_event *ev = new (f->mem) compound_event();
           ev->tok = op_left;
-          ev->op = op_left->content;
-          ev->subevents.push_back(left_frag);
-          ev->subevents.push_back(right_frag);
+          ev->op = binary_event_op(op_left);
+          vector<event_expr *> subevents;
+          subevents.push_back(left_frag);
+          subevents.push_back(right_frag);
+          ev->subevents = arena_list<event_expr *>(f->mem, subevents);
           left_frags.pop();
           right_frag = ev;
         }
@@ -1342,7 +1420,7 @@ parser::parse_basic_expr()
     goto not_found;
   if (t != NULL && (t->type == tok_num || t->type == tok_str))
     {
-      basic_expr *e = new basic_expr;
+      basic_expr *e = new (f->mem) basic_expr();
       e->tok = next();
       return e;
     }
@@ -1357,7 +1435,7 @@ parser::parse_basic_expr()
   basic_expr *e;
   if (next_op("$",t) || next_op("@",t))
     {
-      e = new basic_expr;
+      e = new (f->mem) basic_expr();
       e->sigil = t;
       next_ident(e->tok,true);
       goto designator_chain;
@@ -1367,45 +1445,50 @@ parser::parse_basic_expr()
 
   if (swallow_op("(",false))
     {
-      call_expr *ce = new call_expr;
+      call_expr *ce = new (f->mem) call_expr();
       ce->tok = t;
       ce->func = t->content;
+      vector<expr *> args;
       if (!peek_op(")",t))
         while (true)
           {
-            ce->args.push_back(parse_assignment()); // no comma operator allowed
+            args.push_back(parse_assignment()); // no comma operator allowed
             if (!swallow_op(",",false)) break;
           }
       swallow_op(")");
+      ce->args = arena_list<expr *>(f->mem, args);
       return ce;
     }
 
   // Otherwise, parse a designator chain
-  e = new basic_expr;
+  e = new (f->mem) basic_expr();
   e->tok = t;
 
  designator_chain:
-  while (next_op(".",t) || next_op("[",t))
-    {
-      std::pair<chain_type, expr *> chain_item;
-      if (t->content == ".")
-        {
-          chain_item.first = chain_ident;
-          basic_expr *id = new basic_expr;
-          id->tok = next();
-          if (id->tok->type != tok_ident && id->tok->type != tok_num)
-            throw_expect_error("identifier or constant index");
-          chain_item.second = id;
-        }
-      else // t->content == "["
-        {
-          chain_item.first = chain_index;
-          chain_item.second = parse_expr();
-          swallow_op("]");
-        }
-      delete t;
-      e->chain.push_back(chain_item);
-    }
+  {
+    vector<chain_item> chain;
+    while (next_op(".",t) || next_op("[",t))
+      {
+        chain_item item;
+        if (t->content == ".")
+          {
+            item.first = chain_ident;
+            basic_expr *id = new (f->mem) basic_expr();
+            id->tok = next();
+            if (id->tok->type != tok_ident && id->tok->type != tok_num)
+              throw_expect_error("identifier or constant index");
+            item.second = id;
+          }
+        else // t->content == "["
+          {
+            item.first = chain_index;
+            item.second = parse_expr();
+            swallow_op("]");
+          }
+        chain.push_back(item);
+      }
+    e->chain = arena_list<chain_item>(f->mem, chain);
+  }
 
   return e;
 
@@ -1422,9 +1505,9 @@ parser::parse_unary()
       || next_op("!", t) || next_op("~", t)
       || next_op("++",t) || next_op("--", t))
     {
-      unary_expr* e = new unary_expr;
+      unary_expr* e = new (f->mem) unary_expr();
       e->tok = t;
-      e->op = t->content;
+      e->op = unary_op(t);
       e->operand = parse_unary();
       // -- XXX Recursion may be unnecessary here.
       return e;
@@ -1434,9 +1517,9 @@ parser::parse_unary()
       expr *e = parse_basic_expr();
       while (next_op("++",t) || next_op("--",t))
         {
-          unary_expr *ue = new unary_expr;
+          unary_expr *ue = new (f->mem) unary_expr();
           ue->tok = t;
-          ue->op = t->content;
+          ue->op = unary_op(t, true);
           ue->operand = e;
           e = ue;
         }
@@ -1455,8 +1538,7 @@ parser::parse_binary()
     {
       // Try to input a binary operator of suitable precedence:
       op_right = peek();
-      if (!op_right || op_right->type != tok_op
-          || prec_expr(op_right->content) >= 20)
+      if (prec_expr(binary_op(op_right)) >= 20)
         op_right = NULL;
       else
         next();
@@ -1469,14 +1551,14 @@ parser::parse_binary()
 
           // All operators are left associative:
           if (op_right
-              && prec_expr(op_left->content) > prec_expr(op_right->content))
+              && prec_expr(binary_op(op_left)) > prec_expr(binary_op(op_right)))
             break;
 
           // Combine the left fragment:
-          binary_expr *e = new binary_expr;
+          binary_expr *e = new (f->mem) binary_expr();
           e->tok = op_left;
           e->left = left_frag;
-          e->op = op_left->content;
+          e->op = binary_op(op_left);
           e->right = right_frag;
           left_frags.pop();
           right_frag = e;
@@ -1503,7 +1585,7 @@ parser::parse_ternary()
   token* t;
   if (next_op("?",t))
     {
-      conditional_expr *ce = new conditional_expr;
+      conditional_expr *ce = new (f->mem) conditional_expr();
       ce->tok = t;
       ce->cond = e;
       ce->truevalue = parse_ternary();
@@ -1529,10 +1611,10 @@ parser::parse_assignment()
          || next_op("<<=",t) || next_op(">>=",t)
          || next_op("&=",t) || next_op("^=",t) || next_op("|=",t))
     {
-      binary_expr *be = new binary_expr;
+      binary_expr *be = new (f->mem) binary_expr();
       be->tok = t;
       be->left = e;
-      be->op = t->content;
+      be->op = binary_op(t);
       be->right = parse_assignment();
       e = be;
     }
@@ -1549,10 +1631,10 @@ parser::parse_comma()
   token *t;
   while (next_op(",",t))
     {
-      binary_expr *be = new binary_expr();
+      binary_expr *be = new (f->mem) binary_expr();
       be->tok = t;
       be->left = e;
-      be->op = t->content;
+      be->op = op_comma;
       be->right = parse_assignment();
       e = be;
     }
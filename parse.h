@@ -10,8 +10,11 @@
 #define EBT_PARSE_H
 
 #include <string>
+#include <vector>
 #include <iostream>
 
+#include "util.h"
+
 /* from ir.h */
 struct ebt_module;
 struct ebt_file;
@@ -31,19 +34,32 @@ struct token
 {
   source_loc location;
   tok_type type;
-  std::string content;
+  string_ref content; // -- usually points into the source buffer
 };
 
 std::ostream& operator << (std::ostream& o, const token& tok);
 
+// The buffer variants do not copy the input; tokens of the resulting
+// file refer to it directly, so it must outlive the module.
 void test_lexer (ebt_module* m, std::istream& i,
                  const std::string source_name = "");
 void test_lexer (ebt_module* m, const std::string& n,
                  const std::string source_name = "");
+void test_lexer (ebt_module* m, const char *buf, unsigned size,
+                 const std::string source_name = "");
 
 ebt_file *parse (ebt_module* m, std::istream& i,
                 const std::string source_name = "");
 ebt_file *parse (ebt_module* m, const std::string& n,
                 const std::string source_name = "");
+ebt_file *parse (ebt_module* m, const char *buf, unsigned size,
+                const std::string source_name = "");
+
+// Collects the names of toplevel functions and globals (including arrays)
+// declared in a buffer, without parsing it. Returns false on a lexing error:
+bool scan_declarations (ebt_module* m, const char *buf, unsigned size,
+                        const std::string source_name,
+                        std::vector<std::string> &functions,
+                        std::vector<std::string> &globals);
 
 #endif // EBT_PARSE_H
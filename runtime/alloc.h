@@ -0,0 +1,181 @@
+/* XXX requires dr_api.h to have been included previously */
+
+/* Arenas for the data of the runtime. An arena hands out small blocks
+   from large chunks by bumping a pointer, keeps the blocks which are
+   freed on a free list for each size class, and releases all its chunks
+   at once when it is destroyed. A block larger than the largest class
+   bypasses the arena.
+
+   Arenas are not synchronized. Each application thread has an arena
+   over dr_thread_alloc() for data which does not outlive a handler (see
+   ebt_thread_arena()), so that handlers allocate without taking a lock.
+   Data shared between threads lives in arenas over global memory, which
+   are protected by their owner (e.g. the interned strings, see
+   runtime/intern.h); such an arena only takes the lock of DR's global heap
+   once per chunk. */
+
+#include "drmgr.h"
+
+#define EBT_ARENA_CHUNK (1 << 14) /* -- in bytes */
+#define EBT_ARENA_MIN_SHIFT 3     /* -- the smallest class holds 8 bytes */
+#define EBT_ARENA_CLASSES 6       /* -- and the largest 256 bytes */
+
+/* -- the header keeps the blocks of a chunk aligned for an int64 */
+typedef union ebt_arena_chunk {
+  union ebt_arena_chunk *next;
+  int64 align;
+} ebt_arena_chunk;
+
+typedef struct {
+  void *drcontext; /* -- NULL for an arena over global memory */
+  ebt_arena_chunk *chunks;
+  byte *next, *end; /* -- the unused part of the current chunk */
+  void *free_lists[EBT_ARENA_CLASSES];
+} ebt_arena;
+
+static inline void
+ebt_arena_init(ebt_arena *a, void *drcontext)
+{
+  uint c;
+  a->drcontext = drcontext;
+  a->chunks = NULL;
+  a->next = a->end = NULL;
+  for (c = 0; c < EBT_ARENA_CLASSES; c++)
+    a->free_lists[c] = NULL;
+}
+
+static inline void *
+ebt_arena_raw_alloc(ebt_arena *a, size_t size)
+{
+  return a->drcontext == NULL ? dr_global_alloc(size)
+    : dr_thread_alloc(a->drcontext, size);
+}
+
+static inline void
+ebt_arena_raw_free(ebt_arena *a, void *p, size_t size)
+{
+  if (a->drcontext == NULL)
+    dr_global_free(p, size);
+  else
+    dr_thread_free(a->drcontext, p, size);
+}
+
+/* Returns the size class of a block, or EBT_ARENA_CLASSES if the block is
+   too large for the arena: */
+static inline uint
+ebt_arena_class(size_t size)
+{
+  uint c = 0;
+  while (c < EBT_ARENA_CLASSES
+         && ((size_t) 1 << (c + EBT_ARENA_MIN_SHIFT)) < size)
+    c++;
+  return c;
+}
+
+static inline void *
+ebt_arena_alloc(ebt_arena *a, size_t size)
+{
+  uint c = ebt_arena_class(size);
+  size_t class_size = (size_t) 1 << (c + EBT_ARENA_MIN_SHIFT);
+  void *p;
+
+  if (c == EBT_ARENA_CLASSES)
+    return ebt_arena_raw_alloc(a, size);
+  if (a->free_lists[c] != NULL)
+    {
+      p = a->free_lists[c];
+      a->free_lists[c] = *(void **) p;
+      return p;
+    }
+  if (a->next == NULL || a->next + class_size > a->end)
+    {
+      /* -- the rest of the current chunk is left unused */
+      ebt_arena_chunk *chunk = (ebt_arena_chunk *)
+        ebt_arena_raw_alloc(a, EBT_ARENA_CHUNK);
+      chunk->next = a->chunks;
+      a->chunks = chunk;
+      a->next = (byte *) (chunk + 1);
+      a->end = (byte *) chunk + EBT_ARENA_CHUNK;
+    }
+  p = a->next;
+  a->next += class_size;
+  return p;
+}
+
+/* Frees a block of the given size, which must have been allocated from
+   the same arena: */
+static inline void
+ebt_arena_free(ebt_arena *a, void *p, size_t size)
+{
+  uint c = ebt_arena_class(size);
+  if (c == EBT_ARENA_CLASSES)
+    {
+      ebt_arena_raw_free(a, p, size);
+      return;
+    }
+  *(void **) p = a->free_lists[c];
+  a->free_lists[c] = p;
+}
+
+/* Releases every chunk of the arena at once; the large blocks which
+   bypassed it must have been freed already: */
+static inline void
+ebt_arena_destroy(ebt_arena *a)
+{
+  while (a->chunks != NULL)
+    {
+      ebt_arena_chunk *next = a->chunks->next;
+      ebt_arena_raw_free(a, a->chunks, EBT_ARENA_CHUNK);
+      a->chunks = next;
+    }
+  ebt_arena_init(a, a->drcontext);
+}
+
+/* The arena of each application thread is kept in a drmgr TLS field: */
+static int ebt_alloc_tls_idx = -1;
+
+static inline void
+ebt_alloc_init(void)
+{
+  ebt_alloc_tls_idx = drmgr_register_tls_field();
+  DR_ASSERT_MSG(ebt_alloc_tls_idx != -1, "unable to allocate a TLS field");
+}
+
+static inline void
+ebt_alloc_exit(void)
+{
+  drmgr_unregister_tls_field(ebt_alloc_tls_idx);
+  ebt_alloc_tls_idx = -1;
+}
+
+/* Called by the thread events of the client: */
+static void
+ebt_alloc_thread_init(void *drcontext)
+{
+  ebt_arena *a = (ebt_arena *) dr_thread_alloc(drcontext, sizeof(ebt_arena));
+  ebt_arena_init(a, drcontext);
+  drmgr_set_tls_field(drcontext, ebt_alloc_tls_idx, a);
+}
+
+static void
+ebt_alloc_thread_exit(void *drcontext)
+{
+  ebt_arena *a = (ebt_arena *) drmgr_get_tls_field(drcontext, ebt_alloc_tls_idx);
+  drmgr_set_tls_field(drcontext, ebt_alloc_tls_idx, NULL);
+  ebt_arena_destroy(a);
+  dr_thread_free(drcontext, a, sizeof(ebt_arena));
+}
+
+/* Returns the arena of the current thread, or NULL outside of an
+   application thread (e.g. in begin and end probes) or if the client has
+   no thread events: */
+static inline ebt_arena *
+ebt_thread_arena(void)
+{
+  void *drcontext;
+  if (ebt_alloc_tls_idx == -1)
+    return NULL;
+  drcontext = dr_get_current_drcontext();
+  return drcontext == NULL ? NULL
+    : (ebt_arena *) drmgr_get_tls_field(drcontext, ebt_alloc_tls_idx);
+}
@@ -0,0 +1,181 @@
+/* XXX requires dr_api.h and runtime/inline.h to have been included previously */
+
+/* Batched invocation of insn probe handlers ('-b'). Instead of a clean
+   call at each instruction, the values a handler needs are recorded
+   inline into a per-thread buffer, and the handlers of every recorded
+   entry run in a single clean call to ebt_batch_flush() at the end of the
+   block. The translator defines ebt_batch_flush(), since the layout of an
+   entry (the probe mask, then the context values) depends on the script.
+
+   The buffer is located through two raw TLS slots, holding its base and
+   the offset of the next entry, so that instrumentation can append to it
+   without a clean call. Before the first entry of a block, a check
+   flushes the buffer unless it has room for an entry at every remaining
+   instruction of the block. */
+
+#define EBT_BATCH_SIZE (1 << 16) /* -- in bytes, per thread */
+
+static void ebt_batch_flush(void);
+
+static reg_id_t ebt_batch_seg;
+static uint ebt_batch_offs;
+
+/* Returns the TLS slots of the current thread (base, then offset): */
+static inline ptr_uint_t *
+ebt_batch_slots(void)
+{
+  byte *base = (byte *) dr_get_dr_segment_base(ebt_batch_seg);
+  return (ptr_uint_t *) (base + ebt_batch_offs);
+}
+
+static inline opnd_t
+ebt_batch_slot(uint slot)
+{
+  return opnd_create_far_base_disp(ebt_batch_seg, DR_REG_NULL, DR_REG_NULL,
+                                   0, ebt_batch_offs + slot * sizeof(void *),
+                                   OPSZ_PTR);
+}
+
+/* Called by the thread events of the client: */
+static void
+ebt_batch_thread_init(void *drcontext)
+{
+  ptr_uint_t *slots = ebt_batch_slots();
+  slots[0] = (ptr_uint_t) dr_thread_alloc(drcontext, EBT_BATCH_SIZE);
+  slots[1] = 0;
+}
+
+static void
+ebt_batch_thread_exit(void *drcontext)
+{
+  ebt_batch_flush();
+  dr_thread_free(drcontext, (void *) ebt_batch_slots()[0], EBT_BATCH_SIZE);
+}
+
+static inline void
+ebt_batch_init(void)
+{
+  if (!dr_raw_tls_calloc(&ebt_batch_seg, &ebt_batch_offs, 2, 0))
+    DR_ASSERT_MSG(false, "unable to allocate TLS slots for batched handlers");
+}
+
+static inline void
+ebt_batch_exit(void)
+{
+  dr_raw_tls_cfree(ebt_batch_offs, 2);
+}
+
+/* Instrumentation of a single block, allocated in the analysis phase of
+   drmgr and passed to the insertion phase as user_data: */
+typedef struct {
+  bool checked; /* -- whether the capacity check has been inserted */
+} ebt_batch_block;
+
+static inline void *
+ebt_batch_block_begin(void *drcontext)
+{
+  ebt_batch_block *b = dr_thread_alloc(drcontext, sizeof(ebt_batch_block));
+  b->checked = false;
+  return b;
+}
+
+/* Inserts a check before where which flushes the buffer unless it has
+   room for the given number of bytes. */
+static inline void
+ebt_batch_insert_check(void *drcontext, instrlist_t *bb, instr_t *where,
+                       uint size)
+{
+  instr_t *skip = INSTR_CREATE_label(drcontext);
+
+  if (drreg_reserve_aflags(drcontext, bb, where) != DRREG_SUCCESS)
+    DR_ASSERT_MSG(false, "unable to reserve the arithmetic flags");
+  instrlist_meta_preinsert(bb, where, INSTR_CREATE_cmp
+                           (drcontext, ebt_batch_slot(1),
+                            OPND_CREATE_INT32(EBT_BATCH_SIZE - size)));
+  instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc
+                           (drcontext, OP_jbe, opnd_create_instr(skip)));
+  dr_insert_clean_call(drcontext, bb, where, (void *) ebt_batch_flush,
+                       false /* no fp save */, 0);
+  /* -- drreg restores the flags after the skip, on both paths */
+  instrlist_meta_preinsert(bb, where, skip);
+  drreg_unreserve_aflags(drcontext, bb, where);
+}
+
+/* Inserts code before where appending an entry with the given values to
+   the buffer. Returns false (inserting nothing) if there are not enough
+   scratch registers or the block is too long for the buffer, in which
+   case the caller should use a clean call instead. XXX x86 only. */
+static inline bool
+ebt_batch_record(ebt_batch_block *b, void *drcontext, instrlist_t *bb,
+                 instr_t *where, uint num_values, opnd_t *values)
+{
+  reg_id_t regs[3]; /* -- buffer base, offset of the entry, value */
+  uint i, n = 0, entry_size = num_values * sizeof(void *);
+
+  for (i = 0; n < 3
+         && i < sizeof(ebt_inline_candidates) / sizeof(reg_id_t); i++)
+    if (!instr_uses_reg(where, ebt_inline_candidates[i]))
+      regs[n++] = ebt_inline_candidates[i];
+  if (n < 3)
+    return false;
+
+  if (!b->checked)
+    {
+      instr_t *in;
+      uint remaining = 0;
+      for (in = where; in != NULL; in = instr_get_next_app(in))
+        remaining++;
+      if (remaining * entry_size > EBT_BATCH_SIZE)
+        return false;
+      ebt_batch_insert_check(drcontext, bb, where, remaining * entry_size);
+      b->checked = true;
+    }
+
+  for (i = 0; i < 3; i++)
+    if (!ebt_reserve_register(drcontext, bb, where, regs[i]))
+      DR_ASSERT_MSG(false, "unable to reserve a scratch register");
+  instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld
+                           (drcontext, opnd_create_reg(regs[0]),
+                            ebt_batch_slot(0)));
+  instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_ld
+                           (drcontext, opnd_create_reg(regs[1]),
+                            ebt_batch_slot(1)));
+  for (i = 0; i < num_values; i++)
+    {
+      /* XXX an operand which cannot be loaded is recorded as 0 */
+      if (!ebt_insert_load(drcontext, bb, where, regs[2], values[i]))
+        instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_imm
+                                 (drcontext, opnd_create_reg(regs[2]),
+                                  OPND_CREATE_INTPTR(0)));
+      instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st
+                               (drcontext,
+                                opnd_create_base_disp(regs[0], regs[1], 1,
+                                                      i * sizeof(void *),
+                                                      OPSZ_PTR),
+                                opnd_create_reg(regs[2])));
+    }
+  /* -- lea advances the offset without touching the flags */
+  instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea
+                           (drcontext, opnd_create_reg(regs[1]),
+                            opnd_create_base_disp(regs[1], DR_REG_NULL, 0,
+                                                  entry_size, OPSZ_lea)));
+  instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st
+                           (drcontext, ebt_batch_slot(1),
+                            opnd_create_reg(regs[1])));
+  for (i = 0; i < 3; i++)
+    drreg_unreserve_register(drcontext, bb, where, regs[i]);
+  return true;
+}
+
+/* Completes the instrumentation of a block at its last instruction (after
+   any entry recorded there), flushing the buffer if any entries were
+   recorded: */
+static inline void
+ebt_batch_block_end(ebt_batch_block *b, void *drcontext, instrlist_t *bb,
+                    instr_t *where)
+{
+  if (b->checked)
+    dr_insert_clean_call(drcontext, bb, where, (void *) ebt_batch_flush,
+                         false /* no fp save */, 0);
+  dr_thread_free(drcontext, b, sizeof(ebt_batch_block));
+}
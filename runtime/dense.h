@@ -0,0 +1,109 @@
+/* XXX requires dr_api.h and runtime/value.h to have been included previously */
+
+/* Dense arrays, for the arrays of integers whose keys the script bounds
+   by a range ('array hist[0..255]'). The elements are a flat block with
+   one int64 for each key in the range, aligned to a cache line, so that
+   an access is an index computation rather than a hash lookup.
+
+   An element exists while it is non-zero: membership tests and
+   iteration skip the zero elements. Reading a key outside of the range
+   yields 0, and an update of such a key is dropped (it goes to a scratch
+   element which is never read).
+
+   Like the maps of runtime/map.h, dense arrays are not synchronized. */
+
+#define EBT_DENSE_ALIGN 64 /* -- in bytes, a cache line */
+
+typedef struct {
+  int64 lo, hi;   /* -- the range of keys, inclusive */
+  int64 *elts;    /* -- aligned within block */
+  void *block;
+  size_t block_size;
+  int64 scratch;  /* -- the target of updates outside of the range */
+} ebt_dense;
+
+static inline void
+ebt_dense_init(ebt_dense *d, int64 lo, int64 hi)
+{
+  size_t size = (size_t) (hi - lo + 1) * sizeof(int64);
+  d->lo = lo;
+  d->hi = hi;
+  d->block_size = size + EBT_DENSE_ALIGN;
+  d->block = dr_global_alloc(d->block_size);
+  d->elts = (int64 *) ALIGN_FORWARD(d->block, EBT_DENSE_ALIGN);
+  memset(d->elts, 0, size);
+  d->scratch = 0;
+}
+
+static inline void
+ebt_dense_destroy(ebt_dense *d)
+{
+  dr_global_free(d->block, d->block_size);
+  d->block = NULL;
+  d->elts = NULL;
+}
+
+static inline int64
+ebt_dense_get(ebt_dense *d, int64 key)
+{
+  return key < d->lo || key > d->hi ? 0 : d->elts[key - d->lo];
+}
+
+static inline int
+ebt_dense_contains(ebt_dense *d, int64 key)
+{
+  return ebt_dense_get(d, key) != 0;
+}
+
+static inline int64 *
+ebt_dense_ref(ebt_dense *d, int64 key)
+{
+  if (key < d->lo || key > d->hi)
+    {
+      d->scratch = 0;
+      return &d->scratch;
+    }
+  return &d->elts[key - d->lo];
+}
+
+/* Adds every element of src into the same key of dst and resets it to 0,
+   as the merge of a map does. The arrays must have the same range: */
+static inline void
+ebt_dense_merge(ebt_dense *dst, ebt_dense *src)
+{
+  int64 i, n = src->hi - src->lo + 1;
+  for (i = 0; i < n; i++)
+    {
+      dst->elts[i] += src->elts[i];
+      src->elts[i] = 0;
+    }
+}
+
+/* Iteration goes over the elements in the order of their keys, skipping
+   the zero elements. Unlike the iteration of a map, it sees the elements
+   which the loop body adds at greater keys. */
+typedef struct {
+  ebt_dense *d;
+  int64 key; /* -- the current key */
+} ebt_dense_iter;
+
+static inline void
+ebt_dense_iter_init(ebt_dense_iter *it, ebt_dense *d)
+{
+  it->d = d;
+  it->key = d->lo - 1;
+}
+
+static inline bool
+ebt_dense_iter_next(ebt_dense_iter *it)
+{
+  while (it->key < it->d->hi)
+    if (it->d->elts[++it->key - it->d->lo] != 0)
+      return true;
+  return false;
+}
+
+static inline void
+ebt_dense_iter_done(ebt_dense_iter *it)
+{
+}
@@ -0,0 +1,376 @@
+/* XXX requires dr_api.h to have been included previously */
+
+/* Inline instrumentation, built on the insertion phase of drmgr. Scratch
+   registers and the arithmetic flags are reserved through drreg, which
+   spills them only if they are live, and restores them lazily: adjacent
+   instrumentation points in a block share a single spill and restore.
+
+   Inline checks of dynamic ('@') conditions: the translator lowers a
+   simple condition on operand values into a sequence of calls to the
+   functions below, which build the corresponding IR before a clean call:
+
+     ebt_inline_begin(&il, drcontext, bb, instr, 2);
+     ebt_inline_load(&il, 0, instr_get_src(instr, 0));
+     ...
+     ebt_inline_cmp_imm(&il, 1, 0);
+     ebt_inline_skip(&il, OP_jnz); -- skip the call unless r1 == 0
+     ebt_inline_insert(&il);
+     dr_insert_clean_call(...);
+     ebt_inline_end(&il);
+
+   Registers are numbered from 0; each is a scratch register which instr
+   does not use. The code is built in a separate list, and the registers
+   are only reserved once it is complete. Operand values are loaded before
+   the arithmetic flags are reserved, since drreg may keep them in xax.
+
+   drreg does not follow control flow within instrumentation, so every
+   reservation is made before the first branch, and released after the
+   paths join (in ebt_inline_end).
+
+   If an operand cannot be loaded or there are not enough scratch
+   registers, nothing is inserted and the handler is left to check the
+   condition by itself. XXX x86 only; on 32-bit platforms the arithmetic
+   wraps at the pointer size rather than at 64 bits. */
+
+#include "drmgr.h"
+#include "drreg.h"
+
+#define EBT_INLINE_REGS 4
+
+static inline void
+ebt_inline_init(void)
+{
+  /* -- the scratch registers of a check, and the arithmetic flags */
+  drreg_options_t ops = { sizeof(ops), EBT_INLINE_REGS + 1, false };
+  if (!drmgr_init() || drreg_init(&ops) != DRREG_SUCCESS)
+    DR_ASSERT_MSG(false, "unable to initialize drmgr and drreg");
+}
+
+static inline void
+ebt_inline_exit(void)
+{
+  drreg_exit();
+  drmgr_exit();
+}
+
+typedef struct {
+  void *drcontext;
+  instrlist_t *bb;
+  instr_t *where;
+
+  instrlist_t *ilist; /* -- code is built here until ebt_inline_insert() */
+  instr_t *loaded;    /* -- ... the operand values are loaded before this */
+  instr_t *end;       /* -- ... and inserted before this label */
+  instr_t *skip;      /* -- the target of ebt_inline_skip() */
+
+  reg_id_t regs[EBT_INLINE_REGS];
+  uint num_regs;
+  bool uses_flags;
+  bool failed;
+} ebt_inline;
+
+static const reg_id_t ebt_inline_candidates[] = {
+  DR_REG_XCX, DR_REG_XDX, DR_REG_XBX, DR_REG_XSI, DR_REG_XDI,
+#ifdef X86_64
+  DR_REG_R8, DR_REG_R9, DR_REG_R10, DR_REG_R11,
+  DR_REG_R12, DR_REG_R13, DR_REG_R14, DR_REG_R15,
+#endif
+};
+
+/* Restores the application values of the registers used by the operands
+   of instr, which drreg may still hold from earlier instrumentation. This
+   precedes any instrumentation which reads them, such as the arguments of
+   a clean call; drreg would restore them before instr in any case. */
+static inline void
+ebt_restore_operands(void *drcontext, instrlist_t *bb, instr_t *instr)
+{
+  int i;
+  reg_id_t swap = DR_REG_NULL; /* -- unused, as nothing is reserved */
+
+  for (i = 0; i < instr_num_srcs(instr); i++)
+    drreg_restore_app_values(drcontext, bb, instr, instr_get_src(instr, i),
+                             &swap);
+  for (i = 0; i < instr_num_dsts(instr); i++)
+    drreg_restore_app_values(drcontext, bb, instr, instr_get_dst(instr, i),
+                             &swap);
+}
+
+/* Reserves the given register through drreg: */
+static inline bool
+ebt_reserve_register(void *drcontext, instrlist_t *bb, instr_t *where,
+                     reg_id_t reg)
+{
+  drvector_t allowed;
+  reg_id_t reserved;
+  drreg_status_t res;
+
+  drreg_init_and_fill_vector(&allowed, false);
+  drreg_set_vector_entry(&allowed, reg, true);
+  res = drreg_reserve_register(drcontext, bb, where, &allowed, &reserved);
+  drvector_delete(&allowed);
+  return res == DRREG_SUCCESS;
+}
+
+static inline void
+ebt_inline_append(ebt_inline *il, instr_t *in)
+{
+  instrlist_meta_preinsert(il->ilist, il->end, in);
+}
+
+static inline opnd_t
+ebt_inline_reg(ebt_inline *il, uint r)
+{
+  return opnd_create_reg(il->regs[r]);
+}
+
+static inline void
+ebt_inline_begin(ebt_inline *il, void *drcontext, instrlist_t *bb,
+                 instr_t *where, uint num_regs)
+{
+  uint i, n = 0;
+
+  il->drcontext = drcontext;
+  il->bb = bb;
+  il->where = where;
+  il->ilist = instrlist_create(drcontext);
+  il->end = INSTR_CREATE_label(drcontext);
+  instrlist_meta_append(il->ilist, il->end);
+  il->loaded = il->end;
+  il->skip = INSTR_CREATE_label(drcontext);
+  il->num_regs = 0;
+  il->uses_flags = false;
+  il->failed = num_regs > EBT_INLINE_REGS;
+
+  for (i = 0; !il->failed && n < num_regs
+         && i < sizeof(ebt_inline_candidates) / sizeof(reg_id_t); i++)
+    if (!instr_uses_reg(where, ebt_inline_candidates[i]))
+      il->regs[n++] = ebt_inline_candidates[i];
+  if (n < num_regs)
+    il->failed = true;
+  if (!il->failed)
+    il->num_regs = n;
+}
+
+/* Inserts code loading the value of an operand of an instruction into
+   dst before where, the same way as a clean call argument. Returns false
+   (inserting nothing) if the operand is not supported: */
+static inline bool
+ebt_insert_load(void *drcontext, instrlist_t *ilist, instr_t *where,
+                reg_id_t dst, opnd_t src)
+{
+  opnd_size_t size;
+  instr_t *load;
+
+  if (opnd_is_immed_int(src))
+    {
+      instrlist_meta_preinsert(ilist, where, INSTR_CREATE_mov_imm
+                               (drcontext, opnd_create_reg(dst),
+                                OPND_CREATE_INTPTR(opnd_get_immed_int(src))));
+      return true;
+    }
+
+  if (opnd_is_reg(src) && !reg_is_gpr(opnd_get_reg(src)))
+    return false;
+  if (!opnd_is_reg(src) && !opnd_is_base_disp(src))
+    return false; /* XXX e.g. absolute and pc-relative addresses */
+
+  /* -- narrower values are zero-extended */
+  size = opnd_get_size(src);
+  if (size == OPSZ_PTR)
+    load = INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(dst), src);
+#ifdef X86_64
+  else if (size == OPSZ_4)
+    load = INSTR_CREATE_mov_ld(drcontext,
+                               opnd_create_reg(reg_64_to_32(dst)), src);
+#endif
+  else if (size == OPSZ_1 || size == OPSZ_2)
+    load = INSTR_CREATE_movzx(drcontext, opnd_create_reg(dst), src);
+  else
+    return false;
+  instrlist_meta_preinsert(ilist, where, load);
+  return true;
+}
+
+/* Loads the value of an operand of instr into register r: */
+static inline void
+ebt_inline_load(ebt_inline *il, uint r, opnd_t src)
+{
+  if (il->failed)
+    return;
+  if (il->uses_flags)
+    {
+      /* -- xax may hold the flags by now */
+      il->failed = true;
+      return;
+    }
+
+  if (!ebt_insert_load(il->drcontext, il->ilist, il->end, il->regs[r], src))
+    il->failed = true;
+}
+
+/* Every other instruction clobbers the flags, which are reserved at this
+   point in the code: */
+static inline bool
+ebt_inline_prepare(ebt_inline *il)
+{
+  if (il->failed)
+    return false;
+  if (!il->uses_flags)
+    {
+      il->loaded = INSTR_CREATE_label(il->drcontext);
+      ebt_inline_append(il, il->loaded);
+      il->uses_flags = true;
+    }
+  return true;
+}
+
+static inline void
+ebt_inline_mov(ebt_inline *il, uint dst, uint src)
+{
+  if (!ebt_inline_prepare(il)) return;
+  ebt_inline_append(il, INSTR_CREATE_mov_ld(il->drcontext,
+                                            ebt_inline_reg(il, dst),
+                                            ebt_inline_reg(il, src)));
+}
+
+static inline void
+ebt_inline_mov_imm(ebt_inline *il, uint dst, ptr_int_t value)
+{
+  if (!ebt_inline_prepare(il)) return;
+  ebt_inline_append(il, INSTR_CREATE_mov_imm(il->drcontext,
+                                             ebt_inline_reg(il, dst),
+                                             OPND_CREATE_INTPTR(value)));
+}
+
+/* Computes dst = dst OP src, for OP_add, OP_sub, OP_and, OP_or, OP_xor
+   and OP_imul: */
+static inline void
+ebt_inline_op(ebt_inline *il, int opcode, uint dst, uint src)
+{
+  if (!ebt_inline_prepare(il)) return;
+  ebt_inline_append(il, instr_create_1dst_2src(il->drcontext, opcode,
+                                               ebt_inline_reg(il, dst),
+                                               ebt_inline_reg(il, src),
+                                               ebt_inline_reg(il, dst)));
+}
+
+/* ... and dst = dst OP value, also for OP_shl and OP_sar; the translator
+   only passes values which fit in 32 bits: */
+static inline void
+ebt_inline_op_imm(ebt_inline *il, int opcode, uint dst, int value)
+{
+  opnd_t imm = (opcode == OP_shl || opcode == OP_sar)
+    ? OPND_CREATE_INT8(value) : OPND_CREATE_INT32(value);
+  if (!ebt_inline_prepare(il)) return;
+  ebt_inline_append(il, instr_create_1dst_2src(il->drcontext, opcode,
+                                               ebt_inline_reg(il, dst),
+                                               imm, ebt_inline_reg(il, dst)));
+}
+
+/* Computes dst = OP dst, for OP_neg and OP_not: */
+static inline void
+ebt_inline_unary(ebt_inline *il, int opcode, uint dst)
+{
+  if (!ebt_inline_prepare(il)) return;
+  ebt_inline_append(il, instr_create_1dst_1src(il->drcontext, opcode,
+                                               ebt_inline_reg(il, dst),
+                                               ebt_inline_reg(il, dst)));
+}
+
+static inline void
+ebt_inline_cmp(ebt_inline *il, uint a, uint b)
+{
+  if (!ebt_inline_prepare(il)) return;
+  ebt_inline_append(il, INSTR_CREATE_cmp(il->drcontext,
+                                         ebt_inline_reg(il, a),
+                                         ebt_inline_reg(il, b)));
+}
+
+static inline void
+ebt_inline_cmp_imm(ebt_inline *il, uint a, int value)
+{
+  if (!ebt_inline_prepare(il)) return;
+  ebt_inline_append(il, INSTR_CREATE_cmp(il->drcontext,
+                                         ebt_inline_reg(il, a),
+                                         OPND_CREATE_INT32(value)));
+}
+
+static inline void
+ebt_inline_test(ebt_inline *il, uint a)
+{
+  if (!ebt_inline_prepare(il)) return;
+  ebt_inline_append(il, INSTR_CREATE_test(il->drcontext,
+                                          ebt_inline_reg(il, a),
+                                          ebt_inline_reg(il, a)));
+}
+
+/* Skips the clean call if the flags satisfy the jcc opcode: */
+static inline void
+ebt_inline_skip(ebt_inline *il, int jcc_opcode)
+{
+  if (!ebt_inline_prepare(il)) return;
+  ebt_inline_append(il, INSTR_CREATE_jcc(il->drcontext, jcc_opcode,
+                                         opnd_create_instr(il->skip)));
+}
+
+/* Moves the code built up to the given label before where: */
+static inline void
+ebt_inline_splice(ebt_inline *il, instr_t *upto)
+{
+  instr_t *in, *next;
+  for (in = instrlist_first(il->ilist); in != upto; in = next)
+    {
+      next = instr_get_next(in);
+      instrlist_remove(il->ilist, in);
+      instrlist_meta_preinsert(il->bb, il->where, in);
+    }
+}
+
+/* Inserts the check before where, or discards it if it failed: */
+static inline void
+ebt_inline_insert(ebt_inline *il)
+{
+  uint i;
+
+  for (i = 0; !il->failed && i < il->num_regs; i++)
+    if (!ebt_reserve_register(il->drcontext, il->bb, il->where, il->regs[i]))
+      {
+        /* -- e.g. the register is reserved by another component */
+        while (i-- > 0)
+          drreg_unreserve_register(il->drcontext, il->bb, il->where,
+                                   il->regs[i]);
+        il->failed = true;
+      }
+
+  if (!il->failed)
+    {
+      ebt_inline_splice(il, il->loaded);
+      if (il->uses_flags
+          && drreg_reserve_aflags(il->drcontext, il->bb, il->where)
+             != DRREG_SUCCESS)
+        DR_ASSERT_MSG(false, "unable to reserve the arithmetic flags");
+      ebt_inline_splice(il, il->end);
+    }
+  instrlist_clear_and_destroy(il->drcontext, il->ilist);
+  il->ilist = NULL;
+
+  if (il->failed)
+    instr_destroy(il->drcontext, il->skip);
+}
+
+/* ... and joins the skipped path after the clean call. The registers and
+   flags are restored by drreg after this point, on both paths: */
+static inline void
+ebt_inline_end(ebt_inline *il)
+{
+  uint i;
+
+  if (il->failed)
+    return;
+
+  instrlist_meta_preinsert(il->bb, il->where, il->skip);
+  if (il->uses_flags)
+    drreg_unreserve_aflags(il->drcontext, il->bb, il->where);
+  for (i = 0; i < il->num_regs; i++)
+    drreg_unreserve_register(il->drcontext, il->bb, il->where, il->regs[i]);
+}
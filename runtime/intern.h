@@ -0,0 +1,105 @@
+/* XXX requires dr_api.h and runtime/alloc.h to have been included previously */
+
+/* Interned strings. Each string which the client uses as a key of an
+   array is replaced by a canonical copy with the same contents, so that
+   maps hash and compare string keys by pointer (see runtime/map.h).
+   Static context values ($opcode, $name) are interned when they are
+   computed, typically at instrumentation time, so that handlers never
+   touch the bytes of a key; any other string is interned where it is
+   used as a key. Interned strings live as long as the client.
+
+   The canonical copies are chained from a fixed table of buckets. A
+   string which has been interned already is found without a lock, since
+   handlers intern the keys they compute; only adding a copy takes the
+   mutex. A copy is complete before it is linked into its chain, and is
+   never changed or unlinked afterwards. XXX x86 only, which keeps the
+   stores of the copy ahead of the store linking it. */
+
+#define EBT_INTERN_BITS 14
+
+typedef struct ebt_intern_entry {
+  struct ebt_intern_entry *next;
+  uint hash;
+  char str[]; /* -- the canonical copy */
+} ebt_intern_entry;
+
+static ebt_intern_entry *volatile ebt_intern_table[1 << EBT_INTERN_BITS];
+static ebt_arena ebt_intern_strs; /* -- the entries */
+static void *ebt_intern_mutex;
+
+static inline void
+ebt_intern_init(void)
+{
+  ebt_arena_init(&ebt_intern_strs, NULL);
+  ebt_intern_mutex = dr_mutex_create();
+}
+
+static inline void
+ebt_intern_exit(void)
+{
+  /* -- the long entries bypassed the arena */
+  uint i;
+  for (i = 0; i < (1 << EBT_INTERN_BITS); i++)
+    {
+      ebt_intern_entry *e = ebt_intern_table[i], *next;
+      for (; e != NULL; e = next)
+        {
+          next = e->next;
+          ebt_arena_free(&ebt_intern_strs, e,
+                         sizeof(ebt_intern_entry) + strlen(e->str) + 1);
+        }
+      ebt_intern_table[i] = NULL;
+    }
+  ebt_arena_destroy(&ebt_intern_strs);
+  dr_mutex_destroy(ebt_intern_mutex);
+}
+
+/* Returns the FNV-1a hash of s: */
+static inline uint
+ebt_intern_hash(const char *s)
+{
+  uint h = 2166136261u;
+  for (; *s != '\0'; s++)
+    h = (h ^ (unsigned char) *s) * 16777619u;
+  return h;
+}
+
+static inline const char *
+ebt_intern_find(ebt_intern_entry *e, const char *s, uint hash)
+{
+  for (; e != NULL; e = e->next)
+    if (e->hash == hash && strcmp(e->str, s) == 0)
+      return e->str;
+  return NULL;
+}
+
+/* Returns the canonical copy of s, adding one if necessary: */
+static inline const char *
+ebt_intern(const char *s)
+{
+  uint hash = ebt_intern_hash(s);
+  ebt_intern_entry *volatile *bucket =
+    &ebt_intern_table[hash >> (32 - EBT_INTERN_BITS)];
+  const char *result = ebt_intern_find(*bucket, s, hash);
+  size_t size;
+  ebt_intern_entry *e;
+
+  if (result != NULL) /* -- without the mutex */
+    return result;
+
+  dr_mutex_lock(ebt_intern_mutex);
+  result = ebt_intern_find(*bucket, s, hash);
+  if (result == NULL)
+    {
+      size = strlen(s) + 1;
+      e = (ebt_intern_entry *)
+        ebt_arena_alloc(&ebt_intern_strs, sizeof(ebt_intern_entry) + size);
+      e->next = *bucket;
+      e->hash = hash;
+      memcpy(e->str, s, size);
+      *bucket = e; /* -- publishes the copy */
+      result = e->str;
+    }
+  dr_mutex_unlock(ebt_intern_mutex);
+  return result;
+}
@@ -0,0 +1,131 @@
+/* XXX requires dr_api.h, runtime/value.h and runtime/alloc.h to have
+   been included previously */
+
+/* Script arrays are open-addressing hash maps, instantiated from
+   runtime/map_impl.h for each pair of key and element types:
+   ebt_map_ii (int64 keys and elements), ebt_map_is (int64 keys, string
+   elements), ebt_map_si and ebt_map_ss. String keys are interned strings
+   (see runtime/intern.h), which are hashed and compared by pointer.
+
+   A map keeps its buckets as three parallel arrays: the hash of each key
+   (0 for an empty bucket), the keys and the elements. A lookup probes
+   linearly through the hashes, touching a key only when its hash
+   matches, and iteration scans the hashes alone; the table is kept at
+   most half full. Elements are never removed, so an element exists once
+   stored even if its value is 0 or "".
+
+   A map holds at most a fixed number of elements: the capacity which its
+   array declares ('array per_fn[4096]'), whose buckets are preallocated
+   when the client starts and never resized, or else MAXMAPENTRIES.
+   Storing a new element into a full map is dropped (the store goes to a
+   scratch element which is never read) and counted, and the counts are
+   reported when the client exits.
+
+   Since a map which grows moves its elements, the accessors take keys
+   and values rather than handing out pointers to elements, except for
+   the slots of ebt_map_ii_slot() and ebt_map_si_slot(), whose maps are
+   preallocated (with MAXMAPENTRIES elements if the array has no capacity).
+
+   The buckets of a map which belongs to a single thread (a thread-local
+   array or a private copy) come from the arena of that thread, so that
+   growing it in a handler does not take the lock of DR's global heap;
+   the buckets of a shared map come from global memory.
+
+   The maps are not synchronized, since a probe handler holds the mutex of
+   every array which is written while application threads run (and each
+   thread-local or private array belongs to a single thread). An array
+   which handlers only update through slots is only modified at
+   instrumentation time, under the script mutex. */
+
+#define EBT_MAP_BITS 8 /* -- the initial size of a map which may grow */
+
+/* -- may be overridden with 'ebt -D MAXMAPENTRIES=N' */
+#ifndef MAXMAPENTRIES
+#define MAXMAPENTRIES 65536
+#endif
+
+#define EBT_MAP_CAT2(a, b) a##_##b
+#define EBT_MAP_CAT(a, b) EBT_MAP_CAT2(a, b)
+
+/* Returns the hash of a key (an integer or an interned string), which is
+   never 0. Multiplying by 2^64 / phi spreads nearby integers and aligned
+   pointers over the high bits: */
+static inline uint
+ebt_map_hash(ptr_uint_t key)
+{
+  uint h = (uint) (((uint64) key * 0x9e3779b97f4a7c15ULL) >> 32);
+  return h == 0 ? 1 : h;
+}
+
+/* Returns the number of buckets for a map holding up to count elements: */
+static inline uint
+ebt_map_size(uint count)
+{
+  uint size = 1 << EBT_MAP_BITS;
+  while (size < 2 * count)
+    size *= 2;
+  return size;
+}
+
+static inline void *
+ebt_map_alloc(ebt_arena *arena, size_t size)
+{
+  return arena != NULL ? ebt_arena_alloc(arena, size) : dr_global_alloc(size);
+}
+
+static inline void
+ebt_map_free(ebt_arena *arena, void *p, size_t size)
+{
+  if (arena != NULL)
+    ebt_arena_free(arena, p, size);
+  else
+    dr_global_free(p, size);
+}
+
+/* Applies an update to an integer element, where op is the character
+   of a C assignment operator ('<' and '>' for the shifts); division by
+   zero yields 0, as for ebt_div(), and shift counts are taken modulo 64: */
+static inline int64
+ebt_map_apply(int64 *elt, char op, int64 value)
+{
+  switch (op) {
+  case '=': *elt = value; break;
+  case '+': *elt += value; break;
+  case '-': *elt -= value; break;
+  case '*': *elt *= value; break;
+  case '/': *elt = ebt_div(*elt, value); break;
+  case '%': *elt = ebt_mod(*elt, value); break;
+  case '<': *elt <<= value & 63; break;
+  case '>': *elt >>= value & 63; break;
+  case '&': *elt &= value; break;
+  case '^': *elt ^= value; break;
+  case '|': *elt |= value; break;
+  }
+  return *elt;
+}
+
+#define EBT_MAP_NAME ebt_map_ii
+#define EBT_MAP_KEY int64
+#define EBT_MAP_VALUE int64
+#define EBT_MAP_DEFAULT 0
+#define EBT_MAP_INT_VALUES
+#include "map_impl.h"
+
+#define EBT_MAP_NAME ebt_map_is
+#define EBT_MAP_KEY int64
+#define EBT_MAP_VALUE const char *
+#define EBT_MAP_DEFAULT ""
+#include "map_impl.h"
+
+#define EBT_MAP_NAME ebt_map_si
+#define EBT_MAP_KEY const char *
+#define EBT_MAP_VALUE int64
+#define EBT_MAP_DEFAULT 0
+#define EBT_MAP_INT_VALUES
+#include "map_impl.h"
+
+#define EBT_MAP_NAME ebt_map_ss
+#define EBT_MAP_KEY const char *
+#define EBT_MAP_VALUE const char *
+#define EBT_MAP_DEFAULT ""
+#include "map_impl.h"
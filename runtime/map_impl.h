@@ -0,0 +1,280 @@
+/* XXX included by runtime/map.h, once for each type of map, with
+   EBT_MAP_NAME, EBT_MAP_KEY, EBT_MAP_VALUE and EBT_MAP_DEFAULT defined
+   (and EBT_MAP_INT_VALUES for int64 elements); they are undefined at the
+   end, so that the next instance can define them again */
+
+/* The functions of a map type are prefixed with its name, e.g.
+   ebt_map_si_get(): */
+#define EBT_MAP_FN(f) EBT_MAP_CAT(EBT_MAP_NAME, f)
+
+typedef struct {
+  uint *hashes;          /* -- 0 for an empty bucket */
+  EBT_MAP_KEY *keys;
+  EBT_MAP_VALUE *values;
+  uint size;             /* -- the number of buckets, a power of 2 */
+  uint entries;
+  uint max_entries;
+  bool fixed;            /* -- preallocated and never resized */
+  uint64 dropped;        /* -- the number of new elements dropped when full */
+  EBT_MAP_VALUE scratch; /* -- stands in for a dropped element */
+  ebt_arena *arena;      /* -- NULL for a map in global memory */
+} EBT_MAP_NAME;
+
+static inline void
+EBT_MAP_FN(alloc)(EBT_MAP_NAME *m, uint size)
+{
+  m->size = size;
+  m->hashes = (uint *) ebt_map_alloc(m->arena, size * sizeof(uint));
+  m->keys = (EBT_MAP_KEY *) ebt_map_alloc(m->arena, size * sizeof(EBT_MAP_KEY));
+  m->values = (EBT_MAP_VALUE *)
+    ebt_map_alloc(m->arena, size * sizeof(EBT_MAP_VALUE));
+  memset(m->hashes, 0, size * sizeof(uint));
+}
+
+static inline void
+EBT_MAP_FN(free)(EBT_MAP_NAME *m)
+{
+  ebt_map_free(m->arena, m->hashes, m->size * sizeof(uint));
+  ebt_map_free(m->arena, m->keys, m->size * sizeof(EBT_MAP_KEY));
+  ebt_map_free(m->arena, m->values, m->size * sizeof(EBT_MAP_VALUE));
+}
+
+/* Initializes a map whose buckets come from arena, i.e. the arena of
+   the thread which owns the map, or global memory for NULL: */
+static inline void
+EBT_MAP_FN(init)(EBT_MAP_NAME *m, ebt_arena *arena)
+{
+  m->arena = arena;
+  EBT_MAP_FN(alloc)(m, 1 << EBT_MAP_BITS);
+  m->entries = 0;
+  m->max_entries = MAXMAPENTRIES;
+  m->fixed = false;
+  m->dropped = 0;
+}
+
+/* Initializes a map with a capacity, preallocating enough buckets for that
+   many elements; the map is not resized. */
+static inline void
+EBT_MAP_FN(init_fixed)(EBT_MAP_NAME *m, uint capacity, ebt_arena *arena)
+{
+  m->arena = arena;
+  EBT_MAP_FN(alloc)(m, ebt_map_size(capacity));
+  m->entries = 0;
+  m->max_entries = capacity;
+  m->fixed = true;
+  m->dropped = 0;
+}
+
+/* Frees the buckets of the map, e.g. for the thread-local arrays of an
+   exiting thread: */
+static inline void
+EBT_MAP_FN(destroy)(EBT_MAP_NAME *m)
+{
+  EBT_MAP_FN(free)(m);
+  m->hashes = NULL;
+  m->keys = NULL;
+  m->values = NULL;
+}
+
+/* Returns the bucket holding key, or the empty bucket where key belongs
+   (there is one, since the map is at most half full): */
+static inline uint
+EBT_MAP_FN(find)(EBT_MAP_NAME *m, EBT_MAP_KEY key, uint hash)
+{
+  uint mask = m->size - 1, i = hash & mask;
+  while (m->hashes[i] != 0 && (m->hashes[i] != hash || m->keys[i] != key))
+    i = (i + 1) & mask;
+  return i;
+}
+
+/* Doubles the buckets of the map, moving every element: */
+static inline void
+EBT_MAP_FN(grow)(EBT_MAP_NAME *m)
+{
+  EBT_MAP_NAME old = *m;
+  uint i, j, mask;
+  EBT_MAP_FN(alloc)(m, old.size * 2);
+  mask = m->size - 1;
+  for (i = 0; i < old.size; i++)
+    {
+      if (old.hashes[i] == 0)
+        continue;
+      for (j = old.hashes[i] & mask; m->hashes[j] != 0; j = (j + 1) & mask)
+        ;
+      m->hashes[j] = old.hashes[i];
+      m->keys[j] = old.keys[i];
+      m->values[j] = old.values[i];
+    }
+  EBT_MAP_FN(free)(&old);
+}
+
+/* Returns the bucket holding key, adding it with the default element if
+   necessary, or -1 if the map is full (counting the dropped element): */
+static inline int
+EBT_MAP_FN(insert)(EBT_MAP_NAME *m, EBT_MAP_KEY key)
+{
+  uint hash = ebt_map_hash((ptr_uint_t) key);
+  uint i = EBT_MAP_FN(find)(m, key, hash);
+  if (m->hashes[i] != 0)
+    return i;
+  if (m->entries >= m->max_entries)
+    {
+      m->dropped++;
+      return -1;
+    }
+  if (!m->fixed && 2 * (m->entries + 1) > m->size)
+    {
+      EBT_MAP_FN(grow)(m);
+      i = EBT_MAP_FN(find)(m, key, hash);
+    }
+  m->hashes[i] = hash;
+  m->keys[i] = key;
+  m->values[i] = EBT_MAP_DEFAULT;
+  m->entries++;
+  return i;
+}
+
+static inline int
+EBT_MAP_FN(contains)(EBT_MAP_NAME *m, EBT_MAP_KEY key)
+{
+  uint i = EBT_MAP_FN(find)(m, key, ebt_map_hash((ptr_uint_t) key));
+  return m->hashes[i] != 0;
+}
+
+static inline EBT_MAP_VALUE
+EBT_MAP_FN(get)(EBT_MAP_NAME *m, EBT_MAP_KEY key)
+{
+  uint i = EBT_MAP_FN(find)(m, key, ebt_map_hash((ptr_uint_t) key));
+  return m->hashes[i] != 0 ? m->values[i] : EBT_MAP_DEFAULT;
+}
+
+/* Stores value as the element for key, returning value: */
+static inline EBT_MAP_VALUE
+EBT_MAP_FN(set)(EBT_MAP_NAME *m, EBT_MAP_KEY key, EBT_MAP_VALUE value)
+{
+  int i = EBT_MAP_FN(insert)(m, key);
+  if (i >= 0)
+    m->values[i] = value;
+  return value;
+}
+
+#ifdef EBT_MAP_INT_VALUES
+/* Returns the element for key, adding it if necessary, for an update
+   which does not add elements to the map before it is done: */
+static inline int64 *
+EBT_MAP_FN(ref)(EBT_MAP_NAME *m, EBT_MAP_KEY key)
+{
+  int i = EBT_MAP_FN(insert)(m, key);
+  if (i < 0)
+    {
+      m->scratch = 0;
+      return &m->scratch;
+    }
+  return &m->values[i];
+}
+
+/* Updates the element for key as ebt_map_apply() does, returning the
+   new value: */
+static inline int64
+EBT_MAP_FN(update)(EBT_MAP_NAME *m, EBT_MAP_KEY key, char op, int64 value)
+{
+  return ebt_map_apply(EBT_MAP_FN(ref)(m, key), op, value);
+}
+
+/* Returns the element for key like ref, holding the given mutex while
+   doing so. This resolves the slot of an element once, at
+   instrumentation time, so that handlers update the element through its
+   address without hashing the key; since the map must be preallocated,
+   its elements never move (a full map gives its scratch element): */
+static inline int64 *
+EBT_MAP_FN(slot)(EBT_MAP_NAME *m, EBT_MAP_KEY key, void *mutex)
+{
+  int64 *elt;
+  DR_ASSERT_MSG(m->fixed, "a slot of a map which may grow");
+  dr_mutex_lock(mutex);
+  elt = EBT_MAP_FN(ref)(m, key);
+  dr_mutex_unlock(mutex);
+  return elt;
+}
+
+/* Adds every element of src into the same key of dst and resets it to 0,
+   e.g. for the private copy of an array updated by a single thread: */
+static inline void
+EBT_MAP_FN(merge)(EBT_MAP_NAME *dst, EBT_MAP_NAME *src)
+{
+  uint i;
+  for (i = 0; i < src->size; i++)
+    if (src->hashes[i] != 0)
+      {
+        *EBT_MAP_FN(ref)(dst, src->keys[i]) += src->values[i];
+        src->values[i] = 0;
+      }
+  dst->dropped += src->dropped;
+  src->dropped = 0;
+}
+#endif
+
+/* Reports the elements which a map has dropped, if any: */
+static inline void
+EBT_MAP_FN(report)(EBT_MAP_NAME *m, const char *name)
+{
+  if (m->dropped > 0)
+    dr_fprintf(STDERR, "ebt: array %s dropped %" INT64_FORMAT "u new elements"
+               " (capacity %u)\n", name, m->dropped, m->max_entries);
+}
+
+/* Iteration goes over a copy of the keys, so that the loop body may
+   add elements to the map (which may move the elements). The copy comes
+   from the arena of the current thread, if any, and is released by
+   iter_done(), which must also be called before a jump out of the loop. */
+typedef struct {
+  ebt_arena *arena; /* -- NULL for a copy in global memory */
+  EBT_MAP_KEY *keys;
+  uint num_keys;
+  uint pos;
+  EBT_MAP_KEY key; /* -- the current key */
+} EBT_MAP_FN(iter);
+
+static inline void
+EBT_MAP_FN(iter_init)(EBT_MAP_FN(iter) *it, EBT_MAP_NAME *m)
+{
+  uint i, n = 0;
+  size_t size = m->entries * sizeof(EBT_MAP_KEY);
+  it->arena = ebt_thread_arena();
+  it->num_keys = m->entries;
+  it->keys = it->num_keys == 0 ? NULL : (EBT_MAP_KEY *)
+    (it->arena != NULL ? ebt_arena_alloc(it->arena, size)
+     : dr_global_alloc(size));
+  for (i = 0; i < m->size; i++)
+    if (m->hashes[i] != 0)
+      it->keys[n++] = m->keys[i];
+  it->pos = 0;
+}
+
+static inline bool
+EBT_MAP_FN(iter_next)(EBT_MAP_FN(iter) *it)
+{
+  if (it->pos >= it->num_keys)
+    return false;
+  it->key = it->keys[it->pos++];
+  return true;
+}
+
+static inline void
+EBT_MAP_FN(iter_done)(EBT_MAP_FN(iter) *it)
+{
+  size_t size = it->num_keys * sizeof(EBT_MAP_KEY);
+  if (it->keys == NULL)
+    return;
+  if (it->arena != NULL)
+    ebt_arena_free(it->arena, it->keys, size);
+  else
+    dr_global_free(it->keys, size);
+}
+
+#undef EBT_MAP_FN
+#undef EBT_MAP_NAME
+#undef EBT_MAP_KEY
+#undef EBT_MAP_VALUE
+#undef EBT_MAP_DEFAULT
+#undef EBT_MAP_INT_VALUES
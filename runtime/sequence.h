@@ -0,0 +1,65 @@
+/* XXX requires dr_api.h and runtime/inline.h to have been included previously */
+
+/* Per-thread state of sequence events ('A :: B'). Each sequence is a
+   finite automaton whose state is the index of the stage it waits for,
+   kept in a raw TLS slot so that instrumentation can check it inline
+   without a clean call. A new thread starts in stage 0. */
+
+static reg_id_t ebt_seq_seg;
+static uint ebt_seq_offs;
+
+static inline void
+ebt_seq_init(uint num_sequences)
+{
+  if (!dr_raw_tls_calloc(&ebt_seq_seg, &ebt_seq_offs, num_sequences, 0))
+    DR_ASSERT_MSG(false, "unable to allocate TLS slots for sequence events");
+}
+
+static inline void
+ebt_seq_exit(uint num_sequences)
+{
+  dr_raw_tls_cfree(ebt_seq_offs, num_sequences);
+}
+
+/* Returns the state of seq for the current thread: */
+static inline ptr_uint_t *
+ebt_seq_state(uint seq)
+{
+  byte *base = (byte *) dr_get_dr_segment_base(ebt_seq_seg);
+  return (ptr_uint_t *) (base + ebt_seq_offs) + seq;
+}
+
+/* Inserts a check before where, which skips the instrumentation inserted
+   up to the matching ebt_seq_insert_skip() unless the current thread is
+   in the given stage of seq. XXX x86 only; the arithmetic flags are
+   reserved through drreg (see runtime/inline.h) until the skip, so the
+   instrumentation in between cannot reserve anything by itself. */
+static inline instr_t *
+ebt_seq_insert_check(void *drcontext, instrlist_t *bb, instr_t *where,
+                     uint seq, uint stage)
+{
+  instr_t *skip = INSTR_CREATE_label(drcontext);
+  opnd_t state = opnd_create_far_base_disp(ebt_seq_seg, DR_REG_NULL,
+                                           DR_REG_NULL, 0,
+                                           ebt_seq_offs + seq * sizeof(void *),
+                                           OPSZ_PTR);
+
+  if (drreg_reserve_aflags(drcontext, bb, where) != DRREG_SUCCESS)
+    DR_ASSERT_MSG(false, "unable to reserve the arithmetic flags");
+  instrlist_meta_preinsert(bb, where,
+                           INSTR_CREATE_cmp(drcontext, state,
+                                            OPND_CREATE_INT32(stage)));
+  instrlist_meta_preinsert(bb, where,
+                           INSTR_CREATE_jcc(drcontext, OP_jnz,
+                                            opnd_create_instr(skip)));
+  return skip;
+}
+
+/* -- drreg restores the flags after the skip, on both paths */
+static inline void
+ebt_seq_insert_skip(void *drcontext, instrlist_t *bb, instr_t *where,
+                    instr_t *skip)
+{
+  instrlist_meta_preinsert(bb, where, skip);
+  drreg_unreserve_aflags(drcontext, bb, where);
+}
@@ -0,0 +1,117 @@
+/* XXX requires dr_api.h and runtime/intern.h to have been included previously */
+
+/* Lookup of function names ($name) through drsyms.
+
+   The name for each address is cached, so that a handler looking up the
+   name of a function (for function.entry and function.exit) only pays
+   for drsyms and ebt_intern() the first time. The addresses which are
+   known when a block is instrumented (returns and direct calls) are
+   looked up there, so that their handlers find them in the cache.
+
+   The cache is a fixed table of (addr, name) pairs, filled under a mutex
+   and read without it: an entry is never changed once its addr is set,
+   and its name is stored first. XXX x86 only, which keeps stores in
+   order. An address is not cached once the table is half full. */
+
+#include "drsyms.h"
+
+#define EBT_MAX_SYM_RESULT 256
+#define EBT_SYMBOL_CACHE_BITS 12
+
+typedef struct {
+  app_pc volatile addr; /* -- NULL for an empty entry */
+  const char *volatile name;
+} ebt_symbol_entry;
+
+static ebt_symbol_entry ebt_symbol_cache[1 << EBT_SYMBOL_CACHE_BITS];
+static uint ebt_symbol_entries;
+static void *ebt_symbol_mutex;
+
+static inline void
+ebt_symbols_init(void)
+{
+  if (drsym_init(0) != DRSYM_SUCCESS)
+    dr_log(NULL, LOG_ALL, 1, "WARNING: unable to initialize symbol translation\n");
+  ebt_symbol_mutex = dr_mutex_create();
+}
+
+static inline void
+ebt_symbols_exit(void)
+{
+  if (drsym_exit() != DRSYM_SUCCESS)
+    dr_log(NULL, LOG_ALL, 1, "WARNING: error cleaning up symbol library\n");
+  dr_mutex_destroy(ebt_symbol_mutex);
+}
+
+/* Returns the cache entry holding addr, or the empty entry where addr
+   belongs (there is one, since the table is at most half full): */
+static inline ebt_symbol_entry *
+ebt_symbol_find(app_pc addr)
+{
+  uint mask = (1 << EBT_SYMBOL_CACHE_BITS) - 1;
+  uint i = (uint) (((uint64) (ptr_uint_t) addr * 0x9e3779b97f4a7c15ULL)
+                   >> (64 - EBT_SYMBOL_CACHE_BITS));
+  while (ebt_symbol_cache[i].addr != NULL && ebt_symbol_cache[i].addr != addr)
+    i = (i + 1) & mask;
+  return &ebt_symbol_cache[i];
+}
+
+/* Looks up the name of the function containing addr through drsyms: */
+static inline const char *
+ebt_symbol_lookup(app_pc addr)
+{
+  char name[EBT_MAX_SYM_RESULT];
+  char file[MAXIMUM_PATH];
+  module_data_t *data;
+  drsym_error_t symres;
+  drsym_info_t sym;
+
+  data = dr_lookup_module(addr);
+  if (data == NULL)
+    return ebt_intern("(function in unknown module)");
+
+  sym.struct_size = sizeof(sym);
+  sym.name = name;
+  sym.name_size = EBT_MAX_SYM_RESULT;
+  sym.file = file;
+  sym.file_size = MAXIMUM_PATH;
+  symres = drsym_lookup_address(data->full_path, addr - data->start,
+                                &sym, DRSYM_DEFAULT_FLAGS);
+  dr_free_module_data(data);
+  if (symres != DRSYM_SUCCESS && symres != DRSYM_ERROR_LINE_NOT_AVAILABLE)
+    return ebt_intern("(unknown function)");
+  return ebt_intern(name);
+}
+
+/* Returns the name of the function containing addr. The result is
+   interned, since it may be passed to clean calls, stored in script
+   variables or used as a key. */
+static inline const char *
+ebt_function_name(app_pc addr)
+{
+  ebt_symbol_entry *e;
+  const char *name;
+
+  if (addr == NULL) /* -- marks an empty entry */
+    return ebt_symbol_lookup(addr);
+  e = ebt_symbol_find(addr);
+  if (e->addr == addr) /* -- without the mutex */
+    return e->name;
+
+  dr_mutex_lock(ebt_symbol_mutex);
+  e = ebt_symbol_find(addr);
+  if (e->addr == addr)
+    name = e->name;
+  else
+    {
+      name = ebt_symbol_lookup(addr);
+      if (2 * (ebt_symbol_entries + 1) <= (1 << EBT_SYMBOL_CACHE_BITS))
+        {
+          e->name = name;
+          e->addr = addr;
+          ebt_symbol_entries++;
+        }
+    }
+  dr_mutex_unlock(ebt_symbol_mutex);
+  return name;
+}
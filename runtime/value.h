@@ -0,0 +1,138 @@
+/* XXX requires dr_api.h to have been included previously */
+
+/* Script values have the types inferred for them by the translator:
+   integers are int64 and strings are const char *. Strings are never
+   freed, so they may be shared between variables without copying. */
+
+#include <string.h>
+
+/* A string is true unless it is empty: */
+static inline int
+ebt_str_truth(const char *s)
+{
+  return s != NULL && s[0] != '\0';
+}
+
+/* XXX division by zero yields 0 rather than crashing the target */
+static inline int64
+ebt_div(int64 x, int64 y)
+{
+  return y == 0 ? 0 : x / y;
+}
+
+static inline int64
+ebt_mod(int64 x, int64 y)
+{
+  return y == 0 ? 0 : x % y;
+}
+
+/* Implement x /= y and x %= y: */
+static inline int64
+ebt_div_assign(int64 *lv, int64 y)
+{
+  return *lv = ebt_div(*lv, y);
+}
+
+static inline int64
+ebt_mod_assign(int64 *lv, int64 y)
+{
+  return *lv = ebt_mod(*lv, y);
+}
+
+/* The translator turns a printf() with a literal format into a call to
+   dr_fprintf(); any other format is interpreted at runtime, with the
+   arguments boxed as tagged values. */
+
+#define EBT_INT 0
+#define EBT_STR 1
+
+typedef struct {
+  int type;
+  int64 i;
+  const char *s;
+} ebt_value;
+
+static inline ebt_value
+ebt_int(int64 i)
+{
+  ebt_value v;
+  v.type = EBT_INT; v.i = i; v.s = NULL;
+  return v;
+}
+
+static inline ebt_value
+ebt_str(const char *s)
+{
+  ebt_value v;
+  v.type = EBT_STR; v.i = 0; v.s = s;
+  return v;
+}
+
+/* printf() for tagged values. The conversion of each argument is picked
+   according to its tag, so e.g. '%d' prints a string argument as-is and
+   any length modifiers in the format are ignored. */
+static inline int64
+ebt_printf(const char *fmt, int nargs, const ebt_value *args)
+{
+  const char *p = fmt;
+  char spec[32];
+  int arg = 0;
+
+  while (*p != '\0')
+    {
+      const char *start = p;
+      unsigned len;
+
+      if (*p != '%')
+        {
+          while (*p != '\0' && *p != '%') p++;
+          dr_fprintf(STDERR, "%.*s", (int) (p - start), start);
+          continue;
+        }
+
+      p++;
+      if (*p == '%')
+        {
+          dr_fprintf(STDERR, "%%");
+          p++;
+          continue;
+        }
+
+      /* Copy flags, width and precision; skip length modifiers: */
+      while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL) p++;
+      len = p - start;
+      if (len > sizeof(spec) - 8) len = sizeof(spec) - 8;
+      memcpy(spec, start, len);
+      while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) p++;
+      if (*p == '\0')
+        break;
+
+      if (arg >= nargs)
+        {
+          /* XXX missing arguments are printed as the conversion itself */
+          dr_fprintf(STDERR, "%.*s", (int) (p + 1 - start), start);
+        }
+      else if (args[arg].type == EBT_STR)
+        {
+          strcpy(spec + len, "s");
+          dr_fprintf(STDERR, spec, args[arg].s);
+        }
+      else if (*p == 'c')
+        {
+          strcpy(spec + len, "c");
+          dr_fprintf(STDERR, spec, (int) args[arg].i);
+        }
+      else
+        {
+          /* -- %u, %x, %X and %o keep their conversion, others print as %d */
+          const char *conv = strchr("uxXo", *p) != NULL ? p : "d";
+          dr_snprintf(spec + len, sizeof(spec) - len,
+                      INT64_FORMAT "%c", *conv);
+          dr_fprintf(STDERR, spec, args[arg].i);
+        }
+      arg++;
+      p++;
+    }
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+# Be sure to run using bash -x.
+
+# GOOD INPUT
+./ebt -p3 -u -e 'probe insn {}'
+./ebt -p3 -u -e 'probe insn ($opcode == "div") and function ($name == "foo") {}'
+./ebt -p3 -u -e 'probe insn ($opcode == "div") or insn ($opcode == "idiv") {}' # -- one handler
+./ebt -p3 -u -e 'probe insn ($opcode == "div") or function.entry {}' # -- two handlers
+./ebt -p3 -u ./test/emit.good/basic1.ebt
+./ebt -p3 ./test/emit.good/1.ebt
+./ebt -p3 ./test/emit.good/seq1.ebt
+./ebt -p3 -e 'probe insn ($opcode == "mul") :: insn ($opcode == "div") { printf("div after mul\n") }'
+./ebt -p3 -u -e 'probe insn (($name == "extra" && $opcode == "mul") || $opcode == "div") and function {}'
+./ebt -p3 -u -e 'probe insn ($opcode == "div" ? @op[0] == 0 : $opcode == "mul") {}'
+./ebt -p3 -I test/lib ./test/parse.good/lib1.ebt
+./ebt -p3 -I test/lib -I test/cache -e 'probe insn ($opcode == "div") { count_p2(@op[0]); if (is_even(@op[1])) calls++ } probe end { printf("%d %d\n", p2_count, calls) }' # -- three library files parsed in one round
+./ebt -p3 -e 'array a func f(s) { return s ? s : "none" } probe end { a[1] = f(""); foreach (k in a) printf("%d: %s %x\n", k, a[k]) }'
+./ebt -p3 -e 'probe end { fmt = "%d\n"; printf(fmt, 1 / 0) }' # -- format interpreted at runtime
+./ebt -p3 -e 'probe insn { if (0) printf("never\n") }' # -- no probes remain
+./ebt -p3 -e 'global DEBUG = 0 probe insn ($opcode == "div") { if (DEBUG) printf("div\n") } probe end { printf("%d\n", 2 * 3 + 1) }'
+./ebt -p3 -e 'global unused func f(x) { return x + 1 } probe insn { unused++; f(1) } probe end { printf("done\n") }'
+./ebt -p2 -e 'global n = 2 probe insn ($opcode == "div" && n > 3) { printf("%d\n", n) } probe end { printf("%d\n", n * 2) }'
+./ebt -p2 -u -e 'global n = 2 probe insn ($opcode == "div" && n > 3) { printf("%d\n", n) } probe end { printf("%d\n", n * 2) }'
+./ebt -p3 -e 'global k = 70 global x probe insn { x = 1 << 70; x <<= @op[0]; printf("%d\n", x >> k) }' # -- shift counts are taken modulo 64
+./ebt -p3 -e 'func is_powerof2(n) { return (n & (n - 1)) == 0 } probe insn ($opcode == "div" && is_powerof2(@op[0])) { printf("%d\n", is_powerof2(4)) }' # -- inlined
+./ebt -p3 -e 'global g func fact(n) { return n <= 1 ? 1 : n * fact(n - 1) } func twice(x) { return x + x } probe end { printf("%d %d\n", fact(5), twice(g++)) }' # -- not inlined
+./ebt -p3 -e 'global n probe insn ($opcode == "div" && @op[0] > 2 && !(@op[1] & 3)) { n++ } probe insn (@op[0] * 3 + @op[1] != -5 && 4 < @op[0] << 2) { n++ } probe end { printf("%d\n", n) }' # -- checked inline
+./ebt -p3 -e 'probe insn { printf("%s\n", $opcode) } probe insn ($opcode == "mul") and function { printf("%s\n", $name) } probe insn and function ($name == "f") { printf("%d\n", @op[0]) }' # -- one dispatcher
+./ebt -p3 -b -e 'global n probe insn { n++ } probe insn ($opcode == "mul") and function { printf("%s %d\n", $name, @op[0]) } probe insn :: insn ($opcode == "div") { n-- } probe end { printf("%d\n", n) }' # -- batched
+./ebt -p3 -e 'thread global depth thread array calls global total probe function.entry { depth++; calls[$name]++ } probe function.exit { depth--; total++ } probe thread.end { foreach (k in calls) printf("%s %d\n", k, calls[k]); printf("%d\n", depth) } probe end { printf("%d\n", total) }' # -- thread-local
+./ebt -p3 -e 'global n global m array a probe insn { n++; a[$opcode] += 2 } probe insn ($opcode == "div") { m -= 1; printf("%d\n", n) } probe end { foreach (k in a) printf("%s %d\n", k, a[k]); printf("%d %d\n", n, m) }' # -- privatized reduction of m, not n (a has slots)
+./ebt -p3 -e 'global mode global last global hits array seen probe begin { mode = 2 } probe insn ($opcode == "add") { hits += mode; last = $opcode } probe insn ($opcode == "div") { seen[last]++; printf("%d\n", hits) } probe end { printf("%d %s %d\n", hits, last, seen["add"]) }' # -- hits is atomic, mode is read-only, last is locked
+./ebt -p3 -e 'global n global m probe insn { n = 5; m = m * 2 } probe end { printf("%d %d\n", n, m) }' # -- the store into n is atomic, m is locked, end takes no lock
+./ebt -p3 -e 'thread global n global threads probe thread.begin { threads++; printf("start %d\n", $tid) } probe insn ($opcode == "div") { n++ } probe thread.end { printf("thread %d: %d divs\n", $tid, n) } probe end { printf("%d threads\n", threads) }' # -- thread events
+./ebt -p3 -e 'array divs probe insn ($opcode == "div" && $tid != 0) { divs[$tid]++ } probe function.entry { printf("%d %s\n", $tid, $name) } probe end { foreach (t in divs) printf("%d: %d\n", t, divs[t]) }' # -- $tid in every probe
+./ebt -p3 -e 'array calls probe function.entry { calls[$name]++ } probe insn ($opcode == "ret") { op = $opcode; calls[op]++ } probe end { printf("%d %d\n", calls["main"], calls["ret"]) }' # -- interned keys
+./ebt -p3 -e 'array ops array divs probe insn { ops[$opcode]++ } probe insn ($opcode == "div") and function { divs[$name] += 2; if (@op[0] == 0) divs[$opcode]-- } probe end { foreach (k in ops) printf("%s %d %d\n", k, ops[k], divs[k]) }' # -- slots of ops, not divs (a conditional update)
+./ebt -p3 -e 'array hist[0..255] thread array low[-4..4] func bucket(x) { return hist[x & 255] } probe insn { hist[@op[0] & 255]++; low[@op[1] & 3] += 1 } probe insn ($opcode == "div") { printf("%d %d\n", bucket(@op[0]), 2 in low) } probe end { foreach (k in hist) printf("%d %d\n", k, hist[k]) }' # -- dense arrays, hist is atomic
+./ebt -p3 -D MAXMAPENTRIES=1024 -e 'array per_fn[4096] thread array seen probe function.entry { per_fn[$name]++; seen[$name] = 1 } probe end { foreach (k in per_fn) printf("%s %d\n", k, per_fn[k]) }' # -- preallocated capacity, default capacity
+./ebt -p3 -e 'array hits array names probe insn ($opcode == "div") { hits[@op[0]] *= 2; x = hits[@op[1]]++; names[x] = $opcode } probe end { foreach (k in names) printf("%d %s %d\n", k, names[k], hits[k]) }' # -- maps for int and string elements, updated through their accessors
+./ebt -p3 -e 'array a func first() { foreach (k in a) { foreach (j in a) return j } return -1 } probe insn { a[@op[0]]++ } probe end { foreach (k in a) { if (k > 5) next; printf("%d\n", first()) } }' # -- jumps out of foreach loops release their iterators
+# ALSO THE REAL TEST PROGRAMS
+./ebt -p3 ./dr-demo/empty.ebt
+./ebt -p3 ./dr-demo/fcalls.ebt
+./ebt -p3 ./dr-demo/hello.ebt
+./ebt -p3 ./dr-demo/insn_div_array.ebt
+./ebt -p3 ./dr-demo/insn_div.ebt
+./ebt -p3 ./dr-demo/insn_div_fn.ebt
+
+# IR CACHE (the second run of each library reads it from the cache)
+rm -rf /tmp/ebt-test-cache; mkdir /tmp/ebt-test-cache
+XDG_CACHE_HOME=/tmp/ebt-test-cache ./ebt -p3 -I test/cache ./test/emit.good/cached.ebt > /tmp/ebt-test-cache/cold.c
+XDG_CACHE_HOME=/tmp/ebt-test-cache ./ebt -p3 -I test/cache ./test/emit.good/cached.ebt | diff /tmp/ebt-test-cache/cold.c - # -- the same client
+ls /tmp/ebt-test-cache/ebt | wc -l # -- one entry per library file
+rm -rf /tmp/ebt-test-cache
+
+# BAD INPUT
+./ebt -p2 -e 'probe function {}' # -- no mechanism
+./ebt -p2 -e 'probe not insn {}'
+./ebt -p2 -e 'probe insn and function.entry {}'
+./ebt -p2 -e 'probe end and function {}'
+./ebt -p2 -e 'probe insn ($name == "foo") {}' # -- needs 'and function'
+./ebt -p2 -e 'probe insn { x = @op[$opcode] }'
+./ebt -p2 -e 'probe insn { break }'
+./ebt -p2 -e 'func f(a) { return a } probe end { f(1, 2) }'
+./ebt -p2 -e 'probe end { printf() }'
+./ebt -p2 -e 'array a probe end { a = 1 }'
+./ebt -p2 -e 'array a[0..-1] probe end { a[0] = "b" }' # -- empty range
+./ebt -p2 -e 'array a[-9000000000000000000..9000000000000000000] probe end { a[0]++ }' # -- range too large
+./ebt -p2 -e 'array a[0..3] probe end { a["x"]++ }' # -- integer keys
+./ebt -p2 -e 'array a[0] probe end { a[1]++ }' # -- no capacity
+./ebt -p2 -e 'thread probe end {}'
+./ebt -p2 -e 'thread global n func get() { return n } probe insn { n++ } probe end { printf("%d\n", get()) }' # -- end probes have no thread-local data
+./ebt -p2 -e 'probe thread.begin and function {}'
+./ebt -p2 -e 'probe begin :: insn {}'
+./ebt -p2 -e 'probe insn and function :: function.exit { $opcode }' # -- only the last stage provides context
+./ebt -p2 ./test/parse.good/2.ebt # -- each stage needs a mechanism
+./ebt -p2 -e 'global s probe end { s = "a"; s = s + 1 }'
+./ebt -p2 -e 'func f(x) { return x } probe end { f(1); f("a") }'
+./ebt -p2 -e 'array a probe insn { a[$opcode] = 1; a[0] = "b" }'
@@ -5,6 +5,7 @@
 ./ebt -p0 -e 'probe insn {}'
 ./ebt -p0 ./test/lex.good/1.ebt
 ./ebt -p0 ./test/lex.good/2.ebt
+./ebt -p0 ./test/lex.good/3.ebt
 
 # BAD INPUT
 ./ebt -p0 ./test/lex.bad/1.ebt
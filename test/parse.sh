@@ -7,6 +7,7 @@
 ./ebt -p1 -e 'probe insn and not function ($name == "boring") {}'
 ./ebt -p1 ./test/parse.good/1.ebt
 ./ebt -p1 ./test/parse.good/2.ebt # -- test the '::' restriction operator
+./ebt -p1 ./test/parse.good/basic1.ebt
 # ALSO THE REAL TEST PROGRAMS
 ./ebt -p1 ./dr-demo/empty.ebt
 ./ebt -p1 ./dr-demo/fcalls.ebt
@@ -22,3 +23,7 @@
 ./ebt -p1 ./test/parse.bad/2.ebt
 ./ebt -p1 ./test/parse.bad/3.ebt
 ./ebt -p1 ./test/parse.bad/4.ebt
+
+# LIBRARIES
+./ebt -p1 -I test/lib ./test/parse.good/lib1.ebt
+./ebt -p1 -I test/lib -e 'probe end { printf("%d\n", is_even(2)) }'
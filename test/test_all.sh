@@ -1,4 +1,3 @@
 bash -x test/lex.sh
-# bash -x test/parse.sh
-bash -x test/parse_basic.sh # -- temporary measure for basic events
-bash -x test/emit_basic.sh # -- temporary measure for basic events
+bash -x test/parse.sh
+bash -x test/emit.sh
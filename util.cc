@@ -10,6 +10,19 @@
 // later version.
 
 #include <iostream>
+#include <algorithm>
+#include <new>
+
+extern "C" {
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+}
 
 #include "util.h"
 
@@ -77,3 +90,196 @@ c_comment(const std::string &unescaped)
     }
   return result;
 }
+
+// --- string references ---
+
+bool
+operator == (const string_ref &a, const string_ref &b)
+{
+  return a.len == b.len && memcmp(a.data, b.data, a.len) == 0;
+}
+
+bool
+operator != (const string_ref &a, const string_ref &b)
+{
+  return !(a == b);
+}
+
+bool
+operator < (const string_ref &a, const string_ref &b)
+{
+  int cmp = memcmp(a.data, b.data, std::min(a.len, b.len));
+  return cmp < 0 || (cmp == 0 && a.len < b.len);
+}
+
+ostream&
+operator << (ostream &o, const string_ref &s)
+{
+  return o.write(s.data, s.len);
+}
+
+// --- arena allocation ---
+
+arena::arena (size_t chunk_size)
+  : cursor(NULL), limit(NULL), chunk_size(chunk_size) {}
+
+arena::~arena ()
+{
+  for (unsigned i = 0; i < chunks.size(); i++)
+    free(chunks[i]);
+}
+
+void *
+arena::allocate (size_t size, size_t align)
+{
+  size_t pad = (align - (size_t) cursor % align) % align;
+  if (cursor == NULL || size + pad > (size_t) (limit - cursor))
+    {
+      // Oversized requests get a chunk to themselves:
+      size_t n = std::max(chunk_size, size + align);
+      char *chunk = (char *) malloc(n);
+      if (chunk == NULL) throw std::bad_alloc();
+      chunks.push_back(chunk);
+      cursor = chunk; limit = chunk + n;
+      pad = (align - (size_t) cursor % align) % align;
+    }
+
+  void *result = cursor + pad;
+  cursor += pad + size;
+  return result;
+}
+
+string_ref
+arena::copy (const char *data, unsigned len)
+{
+  char *buf = (char *) allocate(len + 1, 1);
+  memcpy(buf, data, len);
+  buf[len] = '\0';
+  return string_ref(buf, len);
+}
+
+// --- memory-mapped files ---
+
+mapped_file::~mapped_file ()
+{
+  if (size > 0)
+    munmap((void *) data, size);
+}
+
+bool
+mapped_file::open (const string &path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) < 0) { close(fd); return false; }
+
+  // XXX mmap() refuses empty mappings, so empty files need a special case:
+  size = statbuf.st_size;
+  if (size == 0) { data = ""; close(fd); return true; }
+
+  void *buf = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int saved_errno = errno;
+  close(fd);
+  if (buf == MAP_FAILED) { size = 0; errno = saved_errno; return false; }
+
+  data = (const char *) buf;
+  return true;
+}
+
+// --- thread pool ---
+
+thread_pool::thread_pool (unsigned num_threads)
+  : shutting_down(false), task(NULL), task_arg(NULL),
+    next_item(0), num_items(0), items_done(0)
+{
+  if (num_threads == 0)
+    {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      num_threads = cpus > 0 ? cpus : 1;
+    }
+
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&work_ready, NULL);
+  pthread_cond_init(&work_done, NULL);
+
+  // -- the thread calling run() counts as one of the num_threads
+  for (unsigned i = 1; i < num_threads; i++)
+    {
+      pthread_t worker;
+      if (pthread_create(&worker, NULL, worker_main, this) != 0)
+        break; // -- make do with fewer threads
+      workers.push_back(worker);
+    }
+}
+
+thread_pool::~thread_pool ()
+{
+  pthread_mutex_lock(&lock);
+  shutting_down = true;
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&lock);
+
+  for (unsigned i = 0; i < workers.size(); i++)
+    pthread_join(workers[i], NULL);
+
+  pthread_cond_destroy(&work_done);
+  pthread_cond_destroy(&work_ready);
+  pthread_mutex_destroy(&lock);
+}
+
+void *
+thread_pool::worker_main (void *pool)
+{
+  thread_pool *p = (thread_pool *) pool;
+
+  pthread_mutex_lock(&p->lock);
+  for (;;)
+    {
+      while (!p->shutting_down && p->next_item >= p->num_items)
+        pthread_cond_wait(&p->work_ready, &p->lock);
+      if (p->shutting_down) break;
+      p->work();
+    }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+void
+thread_pool::work ()
+{
+  while (next_item < num_items)
+    {
+      unsigned i = next_item++;
+      pthread_mutex_unlock(&lock);
+      task(task_arg, i);
+      pthread_mutex_lock(&lock);
+
+      if (++items_done == num_items)
+        pthread_cond_broadcast(&work_done);
+    }
+}
+
+void
+thread_pool::run (unsigned n, void (*task)(void *arg, unsigned i), void *arg)
+{
+  if (n <= 1 || workers.empty())
+    {
+      for (unsigned i = 0; i < n; i++)
+        task(arg, i);
+      return;
+    }
+
+  pthread_mutex_lock(&lock);
+  this->task = task; task_arg = arg;
+  next_item = 0; num_items = n; items_done = 0;
+  pthread_cond_broadcast(&work_ready);
+
+  work();
+  while (items_done < num_items)
+    pthread_cond_wait(&work_done, &lock);
+
+  next_item = num_items = items_done = 0;
+  pthread_mutex_unlock(&lock);
+}
@@ -13,6 +13,12 @@
 #define EBT_UTIL_H
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <new>
+
+#include <string.h>
+#include <pthread.h>
 
 /* XXX this is a primitive version of translator-output.cxx from systemtap */
 class translator_output {
@@ -31,6 +37,128 @@ public:
 std::string c_stringify(const std::string &unescaped);
 std::string c_comment(const std::string &unescaped);
 
+// A non-owning reference to a range of characters, e.g. the text of a
+// token inside a source buffer. The referenced memory must outlive it.
+struct string_ref {
+  const char *data;
+  unsigned len;
+
+  string_ref() : data(""), len(0) {}
+  string_ref(const char *data, unsigned len) : data(data), len(len) {}
+  string_ref(const char *s) : data(s), len(strlen(s)) {}
+  string_ref(const std::string &s) : data(s.data()), len(s.size()) {}
+
+  unsigned size() const { return len; }
+  unsigned length() const { return len; }
+  bool empty() const { return len == 0; }
+  char operator[] (unsigned i) const { return data[i]; }
+
+  std::string str() const { return std::string(data, len); }
+  operator std::string() const { return str(); }
+};
+
+bool operator == (const string_ref &a, const string_ref &b);
+bool operator != (const string_ref &a, const string_ref &b);
+bool operator < (const string_ref &a, const string_ref &b);
+std::ostream& operator << (std::ostream &o, const string_ref &s);
+
+// Bump allocator for data that lives as long as the arena itself
+// (e.g. tokens of a script file). Destructors are never invoked for
+// objects placed in an arena, so only use it for trivial contents.
+class arena {
+  std::vector<char *> chunks;
+  char *cursor;
+  char *limit;
+  size_t chunk_size;
+
+  arena(const arena&);           // -- not copyable
+  void operator= (const arena&);
+
+public:
+  arena(size_t chunk_size = 64 * 1024);
+  ~arena();
+
+  void *allocate(size_t size, size_t align = sizeof(void *));
+  string_ref copy(const char *data, unsigned len); // -- NUL-terminated
+  string_ref copy(const std::string &s) { return copy(s.data(), s.size()); }
+};
+
+inline void *operator new (size_t size, arena &a) { return a.allocate(size); }
+
+// A fixed-size array stored contiguously in an arena, e.g. the children
+// of a syntax tree node. Elements can be replaced but not appended.
+template <typename T>
+struct arena_list {
+  T *items;
+  unsigned count;
+
+  typedef T *iterator;
+  typedef const T *const_iterator;
+
+  arena_list() : items(NULL), count(0) {}
+  arena_list(arena &a, const std::vector<T> &v) : items(NULL), count(v.size())
+  {
+    if (count == 0) return;
+    items = (T *) a.allocate(count * sizeof(T), __alignof__(T));
+    for (unsigned i = 0; i < count; i++)
+      new (&items[i]) T(v[i]);
+  }
+
+  unsigned size() const { return count; }
+  bool empty() const { return count == 0; }
+  T& operator[] (unsigned i) { return items[i]; }
+  const T& operator[] (unsigned i) const { return items[i]; }
+
+  iterator begin() { return items; }
+  iterator end() { return items + count; }
+  const_iterator begin() const { return items; }
+  const_iterator end() const { return items + count; }
+};
+
+// Read-only contents of a file, mapped into memory rather than copied:
+class mapped_file {
+  mapped_file(const mapped_file&); // -- not copyable
+  void operator= (const mapped_file&);
+
+public:
+  const char *data;
+  size_t size;
+
+  mapped_file() : data(NULL), size(0) {}
+  ~mapped_file();
+
+  bool open(const std::string &path); // -- sets errno on failure
+};
+
+// A fixed set of worker threads, used to process independent items
+// (e.g. script files) in parallel:
+class thread_pool {
+  thread_pool(const thread_pool&); // -- not copyable
+  void operator= (const thread_pool&);
+
+  std::vector<pthread_t> workers;
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  bool shutting_down;
+
+  // The batch currently being processed:
+  void (*task)(void *arg, unsigned i);
+  void *task_arg;
+  unsigned next_item, num_items, items_done;
+
+  static void *worker_main(void *pool);
+  void work(); // -- called with lock held
+
+public:
+  thread_pool(unsigned num_threads = 0); // -- 0 means one per online CPU
+  ~thread_pool();
+
+  // Runs task(arg, i) for every i < n and waits for all of them to finish.
+  // The calling thread takes part; a single item is simply run in place:
+  void run(unsigned n, void (*task)(void *arg, unsigned i), void *arg);
+};
+
 // Miscellaneous debugging utilities:
 
 #ifdef NO_TRACE